@@ -0,0 +1,55 @@
+#ifndef ARGON2PROFILE_H
+#define ARGON2PROFILE_H
+
+#include <stdint.h>
+#include <string>
+
+// The file the server and my_adduser read the profile for new hashes from
+const char profilefilename[] = "argon2profile";
+
+/****************************************************************************************
+ * Argon2Profile - The Argon2 variant and cost parameters a password hash was made with.
+ *                 Profiles are written in the PHC string style, for example
+ *                    $argon2id$v=19$m=65536,t=2,p=1
+ *                 both at the end of each passwd record and in the server's profile file.
+ *                 A default-constructed profile matches the parameters every record was
+ *                 hashed with before profiles were stored (argon2i, t=2, 64 MiB, p=1).
+ *
+ ****************************************************************************************/
+
+class Argon2Profile {
+public:
+   enum variant { argon2i, argon2id };
+
+   Argon2Profile();
+   Argon2Profile(variant type, uint32_t t_cost, uint32_t m_cost, uint32_t parallelism);
+   ~Argon2Profile();
+
+   bool operator==(const Argon2Profile &other) const;
+   bool operator!=(const Argon2Profile &other) const { return !(*this == other); };
+
+   std::string toString() const;
+   bool fromString(const std::string &str);
+
+   // Reads/writes a profile file holding a single profile string
+   bool load(const char *filename);
+   void save(const char *filename) const;
+
+   // Hashes pwd with salt into hash using these parameters, returns false on failure
+   bool hash(const char *pwd, size_t pwdlen, const uint8_t *salt, size_t saltlen,
+             uint8_t *hash, size_t hashlen) const;
+
+   // Memory one hash with this profile needs, in KiB
+   uint32_t memoryKiB() const { return m_cost; };
+
+   // Picks the most expensive argon2id profile that stays within the latency target and
+   // memory budget on this machine
+   static Argon2Profile calibrate(double target_ms, uint32_t max_mem_kib, bool verbose = false);
+
+   variant type;
+   uint32_t t_cost;           // Passes over memory
+   uint32_t m_cost;           // Memory in KiB
+   uint32_t parallelism;      // Lanes
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef BENCHRUNNER_H
+#define BENCHRUNNER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <utility>
+
+// A benchmark body runs the operation being measured the given number of times
+typedef std::function<void(uint64_t iterations)> BenchFunc;
+
+struct BenchResult {
+   std::string name;
+   uint64_t iterations = 0;
+   double real_ns = 0.0;        // Wall time per iteration
+   double cpu_ns = 0.0;         // Process CPU time per iteration
+   uint64_t bytes_per_iter = 0; // If non-zero, bytes_per_second is reported too
+
+   // Extra named values reported alongside the timings (user counters)
+   std::vector<std::pair<std::string, double>> counters;
+};
+
+/****************************************************************************************
+ * BenchRunner - Small self-contained benchmark harness in the style of Google Benchmark.
+ *               Each benchmark body is called with a growing iteration count until it has
+ *               run for at least min_time seconds, then the per-iteration wall and CPU
+ *               time is recorded. Results print to stderr as they finish and can be
+ *               written as Google Benchmark compatible JSON so existing comparison tools
+ *               can track them.
+ *
+ ****************************************************************************************/
+
+class BenchRunner {
+public:
+   BenchRunner(double min_time = 0.5);
+   ~BenchRunner();
+
+   // Only benchmarks whose name contains filter are run (empty runs everything)
+   void setFilter(const char *filter) { _filter = filter; };
+
+   bool matches(const std::string &name) const;
+
+   void run(const std::string &name, BenchFunc fn, uint64_t bytes_per_iter = 0);
+
+   // Records a result measured elsewhere (e.g. by an end-to-end harness)
+   void addResult(BenchResult &result);
+
+   void writeJSON(FILE *out, const char *executable);
+
+   const std::vector<BenchResult> &getResults() const { return _results; };
+
+   static uint64_t nowNS();
+   static uint64_t cpuNS();
+
+private:
+   void printResult(BenchResult &result);
+
+   double _min_time;
+   std::string _filter;
+
+   std::vector<BenchResult> _results;
+};
+
+#endif
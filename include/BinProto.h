@@ -0,0 +1,85 @@
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <stdint.h>
+#include <string>
+
+/****************************************************************************************
+ * BinProto - The framed binary protocol automated clients can use instead of the line-based
+ *            text one. A client picks it by making 0xB1 the first byte it sends, followed by
+ *            the protocol version:
+ *
+ *               client -> server    B1 01
+ *               server -> client    B1 01       (after the text banner, which has no 0xB1)
+ *
+ *            Everything after that is frames: a fixed 12 byte header in network byte order
+ *            followed by length bytes of payload.
+ *
+ *               0      1      2      4           8          12
+ *               +------+------+------+-----------+----------+------------
+ *               |opcode|status| rsvd | requestid |  length  | payload ...
+ *               +------+------+------+-----------+----------+------------
+ *
+ *            Every request gets exactly one reply with the same opcode and request ID, so a
+ *            client may have any number of requests outstanding. Replies to commands may
+ *            overtake a password change that is still hashing; everything else is answered
+ *            in order. Request ID 0 is the server's own: an op_exit with ID 0 means the
+ *            server is closing the connection (shutting down, or the login timed out) and
+ *            its payload says why; op_broadcast and op_message frames, also ID 0, carry
+ *            messages from other users ("broadcast" and "msg" commands) and need no reply.
+ *
+ ****************************************************************************************/
+
+namespace binproto {
+
+const unsigned char magic = 0xB1;
+const unsigned char version = 1;
+
+const size_t header_size = 12;
+const uint32_t max_payload = 65536;
+
+enum opcode {
+   op_login = 1,        // payload: username '\0' password
+   op_command = 2,      // payload: a menu command, e.g. "hello" or "2"
+   op_passwd = 3,       // payload: the new password
+   op_exit = 4,         // payload: none
+
+   // Server to client only, request ID 0: a message from another user
+   op_broadcast = 5,    // payload: sender '\0' text
+   op_message = 6       // payload: sender '\0' text
+};
+
+enum status {
+   st_ok = 0,
+   st_denied = 1,       // bad credentials, or a command before logging in
+   st_busy = 2,         // the server is overloaded, retry the request
+   st_badreq = 3,       // malformed request or unknown opcode
+   st_unknown = 4,      // unrecognized menu command
+   st_limited = 5       // too many failed logins from this IP; the server disconnects
+};
+
+struct FrameHeader {
+   uint8_t opcode;
+   uint8_t status;
+   uint32_t reqid;
+   uint32_t length;
+};
+
+// Decodes the header at data if at least header_size bytes are there
+bool parseHeader(const char *data, size_t len, FrameHeader &hdr);
+
+// Encodes a header into header_size bytes at out
+void writeHeader(char *out, uint8_t opcode, uint8_t status, uint32_t reqid, uint32_t length);
+
+// Appends a complete frame to out
+void appendFrame(std::string &out, uint8_t opcode, uint8_t status, uint32_t reqid,
+                 const char *payload, uint32_t length);
+
+inline void appendFrame(std::string &out, uint8_t opcode, uint8_t status, uint32_t reqid,
+                        const std::string &payload) {
+   appendFrame(out, opcode, status, reqid, payload.data(), (uint32_t) payload.size());
+}
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+class TCPConn;
+
+/****************************************************************************************
+ * ConnHot - The part of a connection's state the server loop looks at on every pass, packed
+ *           into one cache line. Everything else (username, address, buffers, pending hashes)
+ *           stays in the TCPConn, which is only touched when the connection has work to do.
+ *
+ ****************************************************************************************/
+
+struct alignas(64) ConnHot {
+   // flags
+   static const uint8_t f_negotiated = 0x01;    // first bytes seen, protocol decided
+   static const uint8_t f_binary = 0x02;        // speaks binproto frames
+   static const uint8_t f_hashing = 0x04;       // a login, password or rehash job is in flight
+   static const uint8_t f_request = 0x08;       // a complete line/frame is buffered
+
+   int32_t fd = -1;           // -1 once closed
+   uint8_t status = 0;        // TCPConn::statustype
+   uint8_t attempts = 0;      // failed passwords so far
+   uint8_t flags = 0;
+   uint8_t pad0 = 0;
+
+   uint32_t in_head = 0;      // consumed bytes at the front of the input buffer
+   uint32_t in_tail = 0;      // bytes in the input buffer
+   uint32_t out_len = 0;      // unsent bytes in the output buffer
+   uint32_t hash_reqid = 0;   // binproto request the hash in flight answers
+
+   uint64_t deadline = 0;     // monotonic ms by which the login must finish, 0 for none
+
+   TCPConn *conn = NULL;      // the cold state, NULL if the slot is free
+
+   uint32_t user = 0;         // CredIndex ID + 1 once logged in, 0 before
+
+   uint8_t pad1[64 - 44] = {0};
+};
+
+static_assert(sizeof(ConnHot) == 64, "ConnHot must fill exactly one cache line");
+
+/****************************************************************************************
+ * ConnTable - A fixed array of ConnHot slots, one per open connection. Slots never move, so a
+ *             TCPConn can keep a pointer to its own, and the server loop walks the array in
+ *             order up to the highest slot ever used. Freed slots are reused lowest first to
+ *             keep the walk short.
+ *
+ ****************************************************************************************/
+
+class ConnTable {
+public:
+   ConnTable(size_t capacity);
+   ~ConnTable();
+
+   // Takes a free slot for conn, NULL if the table is full
+   ConnHot *claim(TCPConn *conn);
+   void release(ConnHot *slot);
+
+   // Slots [0, limit()) include every slot in use; free ones have conn == NULL
+   ConnHot &operator[](size_t i) { return _slots[i]; };
+   size_t limit() const { return _limit; };
+
+   size_t size() const { return _used; };
+   size_t capacity() const { return _capacity; };
+
+   // Milliseconds on the monotonic clock, for deadlines
+   static uint64_t nowMS();
+
+private:
+   std::unique_ptr<ConnHot[]> _slots;
+   size_t _capacity;
+   size_t _used = 0;
+   size_t _limit = 0;
+
+   // Free slot indexes below _limit
+   std::vector<uint32_t> _free;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef COROPOOL_H
+#define COROPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/****************************************************************************************
+ * CoroPool - Recycles coroutine frames for one event loop. Frames are rounded up to a
+ *            multiple of 64 bytes; freed ones go on a free list for their size, so once the
+ *            loop has seen its peak number of sessions, starting one does no malloc. Frames
+ *            over max_pooled bytes come from the heap. Not thread safe: each reactor has its
+ *            own pool and frames are created and destroyed on its thread.
+ *
+ ****************************************************************************************/
+
+class CoroPool {
+public:
+   CoroPool();
+   ~CoroPool();
+
+   void *allocate(size_t size);
+   void deallocate(void *ptr, size_t size);
+
+   // The pool of the calling thread, for coroutines that aren't given one
+   static CoroPool &local();
+
+   // Counters for reporting
+   uint64_t getAllocs() const { return _allocs; };
+   uint64_t getReuses() const { return _reuses; };
+
+   static const size_t granule = 64;
+   static const size_t max_pooled = 4096;
+
+private:
+   // Free frames, indexed by size / granule - 1
+   std::vector<void *> _free[max_pooled / granule];
+
+   uint64_t _allocs = 0;
+   uint64_t _reuses = 0;
+};
+
+#endif
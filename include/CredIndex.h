@@ -0,0 +1,138 @@
+#ifndef CREDINDEX_H
+#define CREDINDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "PasswdMgr.h"
+
+// Connections refer to their user by this ID once the username has been recognized
+typedef uint32_t userid;
+const userid no_user = UINT32_MAX;
+
+class Replicator;
+
+/****************************************************************************************
+ * CredIndex - The password file held in memory and shared by all connections. Each username
+ *             is interned once and gets a userid that stays valid for the life of the
+ *             process, even if the file is reloaded or the user is removed from it, so
+ *             connections can keep the ID instead of a copy of the name.
+ *
+ *             Lookups stat the file and reload it when it has changed (e.g. my_adduser
+ *             appended a user). Changes are written through PasswdMgr::replaceUser.
+ *
+ *             Thread safe, with lookups that never lock. The credentials are an immutable
+ *             Snapshot behind an atomic pointer; a reader loads it inside an Epoch read
+ *             section and reads it as is. Writers (a password change, or a reload after the
+ *             file changed) serialize on a mutex, build a new Snapshot that shares whatever
+ *             didn't change with the old one, publish it, and retire the old one to the
+ *             Epoch. Interned names never change, so they live outside the snapshots.
+ *
+ *             With a Replicator attached, every change is reported to it, in order, with
+ *             the write lock held.
+ *
+ ****************************************************************************************/
+
+class CredIndex {
+public:
+   CredIndex(const char *pwd_file);
+   ~CredIndex();
+
+   // The profile new hashes are made with
+   void setProfile(const Argon2Profile &profile) { _mgr.setProfile(profile); };
+   const Argon2Profile &getProfile() const { return _mgr.getProfile(); };
+   void makeSalt(std::vector<uint8_t> &salt) { _mgr.makeSalt(salt); };
+
+   // The ID of a user in the password file, or no_user
+   userid find(std::string_view name);
+
+   // The ID of any interned name, whether or not it is in the password file, or no_user
+   userid lookup(std::string_view name);
+
+   // Interns a user kept by another server (see ShardNode), so connections can refer to
+   // them by ID too. They get no credential here.
+   userid internRemote(std::string_view name);
+
+   // The interned name; empty for no_user
+   const std::string &getName(userid id) const;
+
+   // Copies out the user's credential, false if they are no longer in the password file
+   bool getCred(userid id, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt, Argon2Profile &profile);
+
+   // Replaces the user's credential in the file and the index, false if they are gone
+   bool replace(userid id, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt, const Argon2Profile &profile);
+
+   // Applies changes received through replication to the file and the index
+   void apply(const std::vector<PasswdChange> &changes);
+
+   // Starts (or with NULL, stops) reporting changes to repl, which first gets the current
+   // credentials through Replicator::attached
+   void setReplicator(Replicator *repl);
+
+   size_t size() const { return _name_count.load(std::memory_order_acquire); };
+
+   // Names are interned in chunks that are never moved or freed while the index lives
+   static const size_t name_chunk = 1024;
+   static const size_t max_chunks = 4096;
+
+private:
+   struct Cred {
+      std::vector<uint8_t> hash;
+      std::vector<uint8_t> salt;
+      Argon2Profile profile;
+   };
+
+   typedef std::unordered_map<std::string_view, userid> IdMap;
+
+   // One published version of the index; never changed once published
+   struct Snapshot {
+      std::shared_ptr<const IdMap> ids;
+
+      // Indexed by userid, null for users no longer in the file
+      std::vector<std::shared_ptr<const Cred>> creds;
+
+      // Identity of the file loaded, to notice changes
+      bool loaded = false;
+      ino_t ino = 0;
+      off_t size = 0;
+      timespec mtime = {0, 0};
+
+      bool sameFile(const struct stat &st) const;
+      void setFile(const struct stat &st);
+   };
+
+   // The current snapshot; only valid inside an Epoch::Reader
+   const Snapshot *current() const { return _snap.load(std::memory_order_seq_cst); };
+
+   const Snapshot *refresh();
+   void reload(const struct stat &st);
+   void load(const struct stat &st);
+   void publish(Snapshot *snap);
+   void reportReload(const Snapshot &was, const Snapshot &now);
+   userid idOf(const std::string &name, const IdMap *&ids, std::shared_ptr<IdMap> &newids);
+   userid intern(const std::string &name);
+   const std::string &nameAt(userid id) const { return _names[id / name_chunk][id % name_chunk]; };
+
+   PasswdMgr _mgr;
+
+   // Held by writers only
+   std::mutex _write_lock;
+
+   // Told about every change; only touched with the write lock held
+   Replicator *_repl = nullptr;
+
+   std::atomic<const Snapshot *> _snap;
+
+   // Interned names, indexed by userid. A chunk is allocated before the count covering it
+   // is published, and a name is written before its ID is.
+   std::unique_ptr<std::string[]> _names[max_chunks];
+   std::atomic<size_t> _name_count{0};
+};
+
+#endif
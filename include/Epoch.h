@@ -0,0 +1,104 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/****************************************************************************************
+ * Epoch - Epoch-based reclamation for data published behind an atomic pointer. Readers
+ *         wrap each access in a Reader; writers publish a new version, then retire the old
+ *         one, which is freed once every thread that was reading when it was retired has
+ *         left its read section.
+ *
+ *         Each reading thread owns one slot, a cache line of its own, and entering or
+ *         leaving only writes that slot, so readers never lock and never write a line
+ *         another thread writes. Writers (rare) take a mutex and scan the slots. A thread
+ *         gets its slot on its first read and gives it back when it exits.
+ *
+ ****************************************************************************************/
+
+class Epoch {
+private:
+   struct alignas(64) Slot {
+      // Epoch the owner entered its read section in, 0 while it is outside one
+      std::atomic<uint64_t> epoch{0};
+      std::atomic<bool> used{false};
+
+      // Nesting of Readers on the owner thread, only touched by the owner
+      unsigned int depth = 0;
+   };
+
+public:
+   /*************************************************************************************
+    * Reader - A read section; anything loaded from a published pointer while one is in
+    *          scope stays allocated until it goes out of scope. Sections may nest.
+    *
+    *************************************************************************************/
+
+   class Reader {
+   public:
+      Reader():_slot(Epoch::global().enter()) { };
+      ~Reader() {
+         if (--_slot->depth == 0)
+            _slot->epoch.store(0, std::memory_order_release);
+      };
+
+      Reader(const Reader &) = delete;
+      Reader &operator=(const Reader &) = delete;
+
+   private:
+      Slot *_slot;
+   };
+
+   // The one domain all readers and writers in the process share
+   static Epoch &global();
+
+   // Frees obj with delete once no reader can still be looking at it. The caller must have
+   // already published whatever replaces it.
+   template <typename T>
+   void retire(const T *obj) {
+      retire(const_cast<T *>(obj), [](void *p) { delete static_cast<T *>(p); }); };
+   void retire(void *obj, void (*deleter)(void *));
+
+   // Frees whatever no reader can still see. Returns how many objects were freed.
+   size_t reclaim();
+
+   // Counters for reporting
+   uint64_t getRetired() const { return _retired_count; };
+   uint64_t getFreed() const { return _freed_count; };
+
+   static const size_t max_readers = 256;
+
+   Epoch(const Epoch &) = delete;
+   Epoch &operator=(const Epoch &) = delete;
+
+private:
+   Epoch();
+   ~Epoch();
+
+   Slot *enter();
+   Slot *attach();
+
+   struct Retired {
+      void *obj;
+      void (*deleter)(void *);
+      uint64_t epoch;
+   };
+
+   void collect(std::vector<Retired> &freeing);
+
+   // Advanced by every retire; readers only load it
+   alignas(64) std::atomic<uint64_t> _epoch{1};
+
+   Slot _slots[max_readers];
+
+   std::mutex _lock;
+   std::vector<Retired> _retired;
+   uint64_t _retired_count = 0;
+   uint64_t _freed_count = 0;
+};
+
+#endif
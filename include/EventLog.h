@@ -0,0 +1,113 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+/****************************************************************************************
+ * EventLog - The binary format of the server's event log, shared by the writer (LogMgr)
+ *            and the offline renderer (logview).
+ *
+ *            The file starts with an 8 byte header, "EVLG", the format version and three
+ *            zero bytes. After that everything is records with a fixed 2 byte header, the
+ *            record type and the length of its body, so a reader can skip any record:
+ *
+ *               0      1      2
+ *               +------+------+--------------------
+ *               | type | len  | body (len bytes)
+ *               +------+------+--------------------
+ *
+ *            Integers in bodies are LEB128 varints (7 bits a byte, low bits first).
+ *
+ *               rec_batch   pid, monotonic ns, wall clock ns since the epoch. Starts every
+ *                           write, so batches from two processes appending to the same
+ *                           file (a hot upgrade) never depend on each other.
+ *               rec_user    user ID, then the name. Defines an ID for the rest of this
+ *                           process's batches; written before the ID is first used.
+ *               events      the event type values below: monotonic ns since the batch,
+ *                           zigzag wall clock ns since the batch, IPv4 address (host byte
+ *                           order), port, user ID + 1 (0 for none), then for a name that has
+ *                           no ID (an unrecognized username) the name itself.
+ *
+ ****************************************************************************************/
+
+namespace evlog {
+
+const char magic[4] = {'E', 'V', 'L', 'G'};
+const uint8_t version = 1;
+const size_t file_header_size = 8;
+
+const size_t record_header_size = 2;
+const size_t max_body = 255;
+
+// Longest name stored in a record, longer ones are cut
+const size_t max_name = 128;
+
+// Record types; the events are the ones the server logs
+enum event {serverStart, newConn_NOT_WL, newConn_ON_WL, usrName_NOT_recog, paswd_failed_twice, succ_login,
+            discon, paswd_rate_limited, serverStop, num_events};
+
+const uint8_t rec_batch = 0xF0;
+const uint8_t rec_user = 0xF1;
+
+// The enum names, as logview prints and filters them
+const char *eventName(uint8_t ev);
+bool eventFromName(const std::string &name, uint8_t &ev);
+
+// Writes v at out (at most 10 bytes), returns the bytes written
+size_t putVarint(char *out, uint64_t v);
+
+// Reads a varint at p, advancing p; false if it runs past end
+bool getVarint(const char *&p, const char *end, uint64_t &v);
+
+inline uint64_t zigzag(int64_t v) { return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63); };
+inline int64_t unzigzag(uint64_t v) { return (int64_t) (v >> 1) ^ -(int64_t) (v & 1); };
+
+void appendFileHeader(std::string &out);
+bool checkFileHeader(const char *data, size_t len);
+
+// One decoded event with its batch's times applied and its user ID resolved
+struct Event {
+   uint8_t type;
+   uint32_t pid;
+   uint64_t mono_ns;
+   uint64_t wall_ns;
+   uint32_t ipaddr;        // network byte order
+   uint16_t port;
+   bool has_user;
+   std::string user;
+};
+
+/****************************************************************************************
+ * Decoder - walks the records after the file header, keeping the batch times and user
+ *           IDs needed to turn event records into Events
+ *
+ ****************************************************************************************/
+
+class Decoder {
+public:
+   enum result { d_event, d_meta, d_more, d_bad };
+
+   // Decodes the record at p, advancing p past it unless more data is needed
+   result next(const char *&p, const char *end, Event &ev);
+
+private:
+   bool _in_batch = false;
+   uint32_t _pid = 0;
+   uint64_t _mono_base = 0;
+   uint64_t _wall_base = 0;
+
+   // (pid << 32 | user ID) -> name
+   std::unordered_map<uint64_t, std::string> _names;
+};
+
+// The server's old server.log line for the event
+void renderText(const Event &ev, std::string &out);
+
+// One JSON object per line
+void renderJSON(const Event &ev, std::string &out);
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "CredIndex.h"
+
+class TCPConn;
+class ConnTable;
+struct ConnHot;
+
+/****************************************************************************************
+ * MsgBuf - An immutable block of bytes with a reference count, header and bytes in a single
+ *          allocation. Every recipient's output queue points into the same block and the
+ *          last reference frees it. The count is not atomic: blocks are only touched on the
+ *          server loop's thread.
+ *
+ ****************************************************************************************/
+
+class MsgBuf {
+public:
+   // A block of len bytes with one reference; the creator fills it before sharing it
+   static MsgBuf *create(size_t len);
+   static MsgBuf *copyOf(const char *data, size_t len);
+
+   char *data() { return reinterpret_cast<char *>(this + 1); };
+   size_t size() const { return _len; };
+
+   void ref() { _refs++; };
+   void unref() {
+      if (--_refs == 0)
+         ::operator delete(this);
+   };
+
+   MsgBuf(const MsgBuf &) = delete;
+   MsgBuf &operator=(const MsgBuf &) = delete;
+
+private:
+   MsgBuf(size_t len):_len(len) { };
+
+   uint32_t _refs = 1;
+   size_t _len;
+};
+
+/****************************************************************************************
+ * MsgRef - Holds one reference to a MsgBuf
+ *
+ ****************************************************************************************/
+
+class MsgRef {
+public:
+   MsgRef() { };
+
+   // Takes over the reference the caller holds (as create() returns it)
+   explicit MsgRef(MsgBuf *buf):_buf(buf) { };
+
+   MsgRef(const MsgRef &other):_buf(other._buf) { if (_buf) _buf->ref(); };
+   MsgRef(MsgRef &&other) noexcept:_buf(std::exchange(other._buf, nullptr)) { };
+   MsgRef &operator=(MsgRef other) noexcept { std::swap(_buf, other._buf); return *this; };
+   ~MsgRef() { if (_buf) _buf->unref(); };
+
+   MsgBuf *get() const { return _buf; };
+   MsgBuf *operator->() const { return _buf; };
+
+private:
+   MsgBuf *_buf = nullptr;
+};
+
+/****************************************************************************************
+ * FanOut - Delivers broadcasts and direct messages between logged-in sessions. A message is
+ *          built once, in one MsgBuf holding both the text line and the binary frame, and a
+ *          reference to the right part is queued on each recipient; nothing is copied per
+ *          recipient. Recipients are found from the hot connection table alone. The queues
+ *          are sent by flush, which the server calls once per pass of its loop, with one
+ *          writev per connection.
+ *
+ ****************************************************************************************/
+
+class FanOut {
+public:
+   FanOut();
+   ~FanOut();
+
+   // Queues text from sender to every other logged-in session. Returns the recipient count.
+   size_t broadcast(ConnTable &table, TCPConn &sender, std::string_view text);
+
+   // Queues text from sender to every session logged in as to (but the sender's own)
+   size_t message(ConnTable &table, TCPConn &sender, userid to, std::string_view text);
+
+   // Sends what was queued since the last call
+   void flush();
+
+   // Counters for reporting
+   uint64_t getMessages() const { return _messages; };
+   uint64_t getDeliveries() const { return _deliveries; };
+
+private:
+   MsgRef build(uint8_t opcode, const char *label, std::string_view from, std::string_view text,
+                size_t &textlen);
+   void deliver(ConnHot &hot, const MsgRef &msg, size_t textlen);
+
+   // Slots with something queued this pass; slots never move, so these stay valid
+   std::vector<ConnHot *> _pending;
+
+   uint64_t _messages = 0;
+   uint64_t _deliveries = 0;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <vector>
+#include <initializer_list>
 #include <unistd.h>
 #include "exceptions.h"
 
@@ -15,6 +16,7 @@
 // SocketFD - Network socket FD with stored IP/port information in sockaddr_in
 // TermFD - Stdin terminal
 // FileFD - non-buffered file FD with ability to write/read binary data
+// SignalFD - delivers signals as readable data so an event loop can handle them
 
 class FileDesc
 {
@@ -22,8 +24,8 @@ public:
    FileDesc();
    virtual ~FileDesc();
 
-   // Ensures certain functions do not block
-   void setNonBlocking();
+   // Ensures certain functions do not block (or, with false, that they do again)
+   void setNonBlocking(bool nonblocking = true);
 
    // Basic write function to write data to the FD
    ssize_t writeFD(std::string &str);
@@ -33,6 +35,9 @@ public:
    // Basic read function to read all string data off the FD
    ssize_t readFD(std::string &buf);
 
+   // Reads up to len raw bytes into data (binary safe, no allocation)
+   ssize_t readFD(char *data, unsigned int len);
+
    // Reads one character from the buffer at a time until it finds a newline
    ssize_t readStr(std::string &buf);
 
@@ -140,13 +145,29 @@ protected:
 
 class SocketFD : public FileDesc {
 public:
-   SocketFD();
+   // Accepted connections don't need a socket of their own, pass false for those
+   SocketFD(bool create = true);
    ~SocketFD();
 
    void bindFD(const char *ip_addr, unsigned short int port);
    bool connectTo(const char *ip_addr, unsigned short port);
+
+   // Starts a nonblocking connect: false if it failed right away. Once the socket polls
+   // writable, finishConnect says whether it succeeded.
+   bool startConnect(const char *ip_addr, unsigned short port);
+   bool finishConnect();
+
+   // Sends small writes as they come instead of holding them back (TCP_NODELAY)
+   void setNoDelay();
+
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
+   void takeFD(SocketFD &other);
+   void adoptFD(int fd);
+
+   // Reads whatever has arrived without blocking, even on a blocking socket: returns the
+   // bytes read, 0 if the peer closed, -1 on error or -2 if nothing was waiting
+   ssize_t recvFD(char *data, unsigned int len);
 
    unsigned long getIPAddr();
    void getIPAddrStr(std::string &buf);
@@ -185,7 +206,7 @@ public:
    FileFD(const char *filename);
    ~FileFD();
 
-   enum fd_file_type {readfd, writefd, appendfd};
+   enum fd_file_type {readfd, writefd, appendfd, createfd};
 
    bool openFile(fd_file_type ftype);
 
@@ -193,5 +214,22 @@ private:
    std::string _filename; 
 };
 
+/********************************************************************************************
+ * SignalFD class - blocks the given signals for the process and delivers them through a
+ *                  signalfd instead, so they are handled by whoever polls it rather than by
+ *                  an asynchronous handler. Create it before starting any threads so they
+ *                  inherit the blocked mask.
+ *
+ ********************************************************************************************/
+
+class SignalFD : public FileDesc {
+public:
+   SignalFD(std::initializer_list<int> signals);
+   ~SignalFD();
+
+   // Returns the number of the next pending signal, or -1 if none is waiting
+   int readSignal();
+};
+
 
 #endif
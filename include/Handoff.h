@@ -0,0 +1,47 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+
+/****************************************************************************************
+ * Handoff - The Unix socket a running tcpserver hands its sockets to its replacement over.
+ *           The running server listens on the path; a newly started server connects to it
+ *           and receives, in order:
+ *              'L'  the listening socket
+ *              'C'  one message per handed-over connection: its socket and TCPConn state
+ *              'E'  end, sent after the old server has released the path
+ *           Sockets travel as SCM_RIGHTS ancillary data, so the kernel keeps the listening
+ *           socket (and its backlog) open throughout and no client sees a refused connect.
+ *
+ *           Each message is a 4-byte length (network order), a type byte and the payload,
+ *           with at most one descriptor attached to the first byte.
+ *
+ ****************************************************************************************/
+
+class Handoff {
+public:
+   Handoff(const char *path);
+   ~Handoff();
+
+   // Old side: listen on the path for a successor, and accept one if it is waiting
+   void listen();
+   int acceptSuccessor();
+
+   // Releases the path so the successor can listen on it in turn
+   void closeListener();
+
+   // New side: connects to a server already listening on the path, -1 if there is none
+   int connectPredecessor();
+
+   // Message IO over a connected handoff socket. fd is -1 for none.
+   static bool sendMsg(int sock, char type, const std::string &payload, int fd = -1);
+   static char recvMsg(int sock, std::string &payload, int &fd);
+
+   const std::string &getPath() const { return _path; };
+
+private:
+   std::string _path;
+   int _listenfd = -1;
+};
+
+#endif
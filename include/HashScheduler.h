@@ -0,0 +1,128 @@
+#ifndef HASHSCHEDULER_H
+#define HASHSCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "Argon2Profile.h"
+
+/****************************************************************************************
+ * HashJob - One password hash handed to the HashScheduler. The connection that submitted
+ *           it polls isFinished() from the event loop and then reads status and hash.
+ *           The plaintext copy is wiped when the job is destroyed.
+ *
+ ****************************************************************************************/
+
+class HashJob {
+public:
+   enum jobstatus { queued, running, done, busy, failed };
+
+   HashJob(const char *passwd, const std::vector<uint8_t> &salt, const Argon2Profile &profile);
+   ~HashJob();
+
+   // Computes the hash (normally on a worker thread)
+   void run();
+
+   bool isFinished() const { return getStatus() >= done; };
+   jobstatus getStatus() const { return (jobstatus) _status.load(std::memory_order_acquire); };
+   void setStatus(jobstatus status) { _status.store(status, std::memory_order_release); };
+
+   std::string passwd;
+   std::vector<uint8_t> salt;
+   Argon2Profile profile;
+   std::vector<uint8_t> hash;    // Valid once the status is done
+
+   // Position in the scheduler's queue, so a queued job can be cancelled
+   int priority = 0;
+   uint64_t seq = 0;
+
+private:
+   std::atomic<int> _status{queued};
+};
+
+/****************************************************************************************
+ * HashScheduler - Runs password hashes on a pool of worker threads under a memory budget.
+ *                 Every Argon2 hash allocates its full m_cost, so a worker only starts the
+ *                 next job once its memory fits in what is left of the budget. Waiting jobs
+ *                 are served in priority order:
+ *                    1. logins from IPs that already have a logged-in session
+ *                    2. logins from new IPs
+ *                    3. password changes (and rehash upgrades)
+ *                 The queue is bounded; once it is full a new request either displaces the
+ *                 lowest priority queued job (if it outranks it) or is refused. Refused and
+ *                 displaced requests are reported as busy so the client can retry, instead of
+ *                 the server allocating its way into the OOM killer under a login flood.
+ *
+ ****************************************************************************************/
+
+class HashScheduler {
+public:
+   enum jobtype { login, changepwd };
+
+   HashScheduler(unsigned int threads, uint32_t mem_budget_kib, unsigned int max_queue);
+   ~HashScheduler();
+
+   // Queues a hash. Returns NULL if the scheduler is too busy to accept it.
+   std::shared_ptr<HashJob> submit(jobtype type, unsigned long ipaddr, const char *passwd,
+                                   const std::vector<uint8_t> &salt, const Argon2Profile &profile);
+
+   // Drops a job that has not started yet (e.g. its client disconnected)
+   void cancel(std::shared_ptr<HashJob> &job);
+
+   // Records an IP with a successful login, so its next logins get priority
+   void markKnown(unsigned long ipaddr);
+
+   // Stops accepting work, marks queued jobs busy and joins the workers once the running
+   // hashes are finished
+   void stop();
+
+   // Counters for reporting
+   uint64_t getCompleted() const { return _completed; };
+   uint64_t getRejected() const { return _rejected; };
+   uint64_t getDisplaced() const { return _displaced; };
+   uint32_t getPeakMemKiB() const { return _peak_mem_kib; };
+   size_t getQueued();
+
+private:
+   struct QueueEntry {
+      int priority;
+      uint64_t seq;
+      std::shared_ptr<HashJob> job;
+
+      bool operator<(const QueueEntry &other) const {
+         return (priority < other.priority) || ((priority == other.priority) && (seq < other.seq));
+      };
+   };
+
+   void worker();
+   bool canStart();
+
+   std::mutex _mutex;
+   std::condition_variable _cv;
+
+   // Ordered highest priority first, lowest priority last
+   std::set<QueueEntry> _queue;
+
+   std::vector<std::thread> _workers;
+   std::unordered_set<unsigned long> _known_ips;
+
+   uint32_t _mem_budget_kib;
+   uint32_t _mem_inuse_kib = 0;
+   unsigned int _max_queue;
+   uint64_t _seq = 0;
+   bool _stopping = false;
+
+   std::atomic<uint64_t> _completed{0};
+   std::atomic<uint64_t> _rejected{0};
+   std::atomic<uint64_t> _displaced{0};
+   uint32_t _peak_mem_kib = 0;
+};
+
+#endif
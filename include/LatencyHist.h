@@ -0,0 +1,49 @@
+#ifndef LATENCYHIST_H
+#define LATENCYHIST_H
+
+#include <stdint.h>
+#include <vector>
+
+/****************************************************************************************
+ * LatencyHist - Log-linear latency histogram. Values are stored in nanoseconds in buckets
+ *               that split every power of two into 32 slices, so any percentile is within
+ *               about 3% of the true value no matter how wide the range of samples is.
+ *               Recording is a couple of shifts and an increment, so it is cheap enough
+ *               to call on every request.
+ *
+ ****************************************************************************************/
+
+class LatencyHist {
+public:
+   LatencyHist();
+   ~LatencyHist();
+
+   // Adds a single sample (in nanoseconds)
+   void record(uint64_t ns);
+
+   // Folds the samples from another histogram into this one
+   void merge(const LatencyHist &other);
+
+   void clear();
+
+   // Returns the approximate value at the given percentile (0-100) in nanoseconds
+   uint64_t percentile(double pct) const;
+
+   uint64_t count() const { return _count; };
+   uint64_t min() const { return (_count > 0) ? _min : 0; };
+   uint64_t max() const { return _max; };
+   double mean() const { return (_count > 0) ? (_sum / _count) : 0.0; };
+
+private:
+   static unsigned int bucketOf(uint64_t ns);
+   static uint64_t bucketValue(unsigned int idx);
+
+   std::vector<uint64_t> _buckets;
+
+   uint64_t _count = 0;
+   uint64_t _min = 0;
+   uint64_t _max = 0;
+   double _sum = 0.0;
+};
+
+#endif
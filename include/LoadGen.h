@@ -0,0 +1,137 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include "LatencyHist.h"
+
+// A login the simulated clients can use
+struct LoadGenCred {
+   std::string username;
+   std::string passwd;
+};
+
+// One kind of scripted session. The commands are sent one at a time after logging in and
+// each must produce a reply (a newline-terminated line or a ": " prompt). A command of
+// "%p" sends the session's own password, so "passwd,%p" exercises a password change
+// without invalidating the login for later sessions.
+struct LoadGenScript {
+   std::string name;
+   unsigned int weight = 1;
+   std::vector<std::string> commands;
+};
+
+// Describes the load to generate
+struct LoadGenParams {
+   unsigned int conns = 10;          // Maximum number of concurrent connections
+   unsigned int sessions = 100;      // Total number of sessions to run before stopping
+   double rate = 0.0;                // New sessions started per second (0 = as fast as possible)
+   long timeout_ms = 30000;          // How long a single phase may take before it counts as failed
+   bool binary = false;              // Speak the framed binary protocol, pipelining each session
+
+   // Sessions cycle through these logins
+   std::vector<LoadGenCred> creds;
+
+   // Each session runs one of these, picked in proportion to its weight
+   std::vector<LoadGenScript> scripts;
+};
+
+/****************************************************************************************
+ * LoadGen - Load generator for the tcpserver. Opens up to conns non-blocking connections
+ *           driven from a single epoll loop, runs the scripted login-and-command scenario
+ *           on each at the target rate and records the latency of every phase. A mix of
+ *           scripts and logins can be given to approximate real traffic.
+ *
+ *           Phases are measured from the moment the request is sent until the server's
+ *           reply (or prompt) for it has arrived:
+ *              connect  - connect() until the "Username: " prompt
+ *              username - username sent until the "Password: " prompt
+ *              password - password sent until the login result
+ *              command  - menu command sent until its newline-terminated reply
+ *
+ *           In binary mode a session sends its login, all its commands and exit in one go
+ *           as soon as the protocol is negotiated, and each reply is timed from then.
+ *           There is no separate username phase.
+ *
+ *    Throws: socket_error if the epoll instance cannot be created
+ ****************************************************************************************/
+
+class LoadGen {
+public:
+   LoadGen(const char *ip_addr, unsigned short port, LoadGenParams &params);
+   ~LoadGen();
+
+   enum phase { p_connect, p_username, p_passwd, p_command, p_numphases };
+
+   void run();
+
+   // Prints the throughput and per-phase percentiles
+   void report(FILE *out);
+
+   const LatencyHist &getHist(phase p) const { return _hist[p]; };
+   uint64_t getCompleted() const { return _completed; };
+   uint64_t getFailed() const { return _failed; };
+   uint64_t getRequests() const { return _requests; };
+   uint64_t getScriptCompleted(unsigned int script) const { return _script_done[script]; };
+   double getElapsed() const { return _elapsed; };
+
+private:
+   enum sesstatus { s_connecting, s_username, s_passwd, s_command, s_exit };
+
+   // One simulated client
+   struct Session {
+      int fd = -1;
+      size_t slot = 0;               // Index in _active, for O(1) removal
+      bool connected = false;
+      bool want_write = true;        // EPOLLOUT currently requested
+      sesstatus status = s_connecting;
+      unsigned int cred = 0;
+      unsigned int script = 0;
+      unsigned int cmd_idx = 0;
+      uint64_t phase_start = 0;
+      uint32_t last_reqid = 0;       // Binary mode: the exit request, answered last
+      std::string inbuf;
+      std::string outbuf;
+   };
+
+   void startSession();
+   void handleEvent(Session *sess, uint32_t events);
+   bool readSession(Session *sess);
+   bool advance(Session *sess);
+   bool advanceBinary(Session *sess);
+   void sendFrames(Session *sess);
+   void nextCommand(Session *sess);
+   void sendLine(Session *sess, const std::string &line);
+   bool flushSession(Session *sess);
+   void finishPhase(Session *sess, phase p);
+   void endSession(Session *sess, bool success);
+   void checkTimeouts(uint64_t now);
+
+   static phase phaseOf(sesstatus status);
+   static uint64_t nowNS();
+
+   sockaddr_in _srvaddr;
+   LoadGenParams _params;
+
+   int _epfd = -1;
+
+   std::vector<Session *> _active;
+
+   // Script indexes repeated by weight and shuffled, sessions take them in turn
+   std::vector<unsigned int> _schedule;
+   std::vector<uint64_t> _script_done;
+
+   LatencyHist _hist[p_numphases];
+   uint64_t _phase_failed[p_numphases] = {0};
+
+   uint64_t _started = 0;
+   uint64_t _completed = 0;
+   uint64_t _failed = 0;
+   uint64_t _requests = 0;
+   double _elapsed = 0.0;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef LOGCOMPRESSOR_H
+#define LOGCOMPRESSOR_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/****************************************************************************************
+ * LogCompressor - Gzips closed log segments on one low priority background thread, so the
+ *                 server loop only ever pays for the rename that closed them. Each segment
+ *                 is compressed to a temporary file that is renamed to <segment>.gz when
+ *                 complete; the plain segment is removed after that. Then a line
+ *
+ *                    <first wall ns> <last wall ns> <segment file name>
+ *
+ *                 is appended to the index, so readers can find the segments covering a
+ *                 time range without opening them. The thread is started by the first
+ *                 segment queued, and runs until every queued segment is done.
+ *
+ ****************************************************************************************/
+
+class LogCompressor {
+public:
+   LogCompressor(const std::string &index_file);
+   ~LogCompressor();
+
+   // Queues a closed segment for compression and indexing
+   void submit(const std::string &segment, uint64_t first_ns, uint64_t last_ns);
+
+   // Finishes the queued segments and joins the thread
+   void stop();
+
+private:
+   struct Segment {
+      std::string path;
+      uint64_t first_ns;
+      uint64_t last_ns;
+   };
+
+   void worker();
+   bool compress(const std::string &path, const std::string &gzpath);
+   void addToIndex(const Segment &seg, const std::string &path);
+
+   std::string _index_file;
+
+   std::mutex _mutex;
+   std::condition_variable _cv;
+   std::deque<Segment> _queue;
+   std::thread _thread;
+   bool _stopping = false;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef LOGMGR_H
+#define LOGMGR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "CredIndex.h"
+#include "EventLog.h"
+#include "LogCompressor.h"
+
+// The server's event log, in the EventLog format; logview renders it
+const char logfilename[] = "server.evlog";
+
+// Bytes buffered before a flush is forced
+const size_t log_flush_bytes = 65536;
+
+// Segment size the server rotates the log at by default
+const unsigned long default_log_rotate_mib = 64;
+
+/****************************************************************************************
+ * LogMgr - The server log writer. Each event is encoded straight into a buffer as a binary
+ *          EventLog record (a few varints and, at most, a name copy); nothing is formatted.
+ *          flush appends the buffer to the log with a single write, and the server flushes
+ *          once per pass of its loop. Every flushed batch starts with its own pid and clock
+ *          readings, so two processes may append to the same log.
+ *
+ *          A user's name is written once per process, in a rec_user record before the first
+ *          event that uses their ID. CredIndex IDs never change, so that stays valid.
+ *
+ *          With rotation set, the first batch after the log has reached the size limit, or
+ *          after the interval has run out, first renames the log to
+ *             <log>.<UTC start time>.<pid>.<seq>
+ *          and starts a new one. rename is atomic, so readers and the other writer during
+ *          a hot upgrade always find a whole file under each name; a writer that sees the
+ *          log was renamed under it reopens it. The LogCompressor then gzips and indexes
+ *          the closed segment in the background.
+ *
+ ****************************************************************************************/
+
+class LogMgr {
+public:
+   LogMgr(const char *filename = logfilename, const CredIndex *creds = NULL);
+   ~LogMgr();
+
+   // Names for records with a user ID come from here
+   void setCredIndex(const CredIndex *creds) { _creds = creds; };
+
+   // ipaddr is in network byte order as from SocketFD::getIPAddr, port in host order
+   void record(evlog::event ev, uint32_t ipaddr = 0, uint16_t port = 0, userid user = no_user);
+
+   // For names that never got an ID (unrecognized usernames)
+   void record(evlog::event ev, uint32_t ipaddr, uint16_t port, std::string_view name);
+
+   // Rotate at max_bytes and/or every interval_secs; 0 turns either off
+   void setRotation(uint64_t max_bytes, unsigned int interval_secs);
+
+   // Writes the buffered records
+   void flush();
+
+   size_t pending() const { return _buf.size(); };
+
+private:
+   void append(evlog::event ev, uint32_t ipaddr, uint16_t port, uint64_t user, std::string_view name);
+   void startBatch();
+   void defineUser(userid user);
+   void openLog();
+   bool rotationDue(uint64_t now_ns);
+   void rotate(uint64_t now_ns);
+
+   std::string _filename;
+   const CredIndex *_creds;
+   int _fd = -1;
+   pid_t _pid;
+
+   // Encoded records waiting for the next flush
+   std::string _buf;
+
+   // Clock readings the current batch's events are relative to
+   uint64_t _mono_base = 0;
+   uint64_t _wall_base = 0;
+
+   // IDs whose rec_user has been written, indexed by userid
+   std::vector<bool> _defined;
+
+   // The open segment: identity, size and wall clock span (first batch to last flush)
+   ino_t _ino = 0;
+   uint64_t _seg_bytes = 0;
+   uint64_t _seg_opened_ns = 0;
+   uint64_t _seg_first_ns = 0;
+   uint64_t _seg_last_ns = 0;
+
+   uint64_t _rotate_bytes = 0;
+   uint64_t _rotate_interval_ns = 0;
+   unsigned int _rotations = 0;
+   std::unique_ptr<LogCompressor> _compressor;
+};
+
+#endif
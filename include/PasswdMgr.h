@@ -4,9 +4,27 @@
 #include <string>
 #include <stdexcept>
 #include "FileDesc.h"
+#include "Argon2Profile.h"
+
+// One record of the password file
+struct PasswdRecord {
+   std::string name;
+   std::vector<uint8_t> hash;
+   std::vector<uint8_t> salt;
+   Argon2Profile profile;
+};
+
+// A change to one user's record: a new credential, or the user removed (only the name is used)
+struct PasswdChange {
+   PasswdRecord rec;
+   bool removed = false;
+};
 
 /****************************************************************************************
- * PasswdMgr - Manages user authentication through a file
+ * PasswdMgr - Manages user authentication through a file. Each record carries the Argon2
+ *             profile its hash was made with, so the cost parameters can be raised without
+ *             invalidating existing passwords: records with an outdated profile are rehashed
+ *             with the current one the next time that user logs in.
  *
  ****************************************************************************************/
 
@@ -15,6 +33,10 @@ class PasswdMgr {
       PasswdMgr(const char *pwd_file);
       ~PasswdMgr();
 
+      // The profile new hashes are made with
+      void setProfile(const Argon2Profile &profile) { _profile = profile; };
+      const Argon2Profile &getProfile() const { return _profile; };
+
       bool checkUser(const char *name);
       bool checkPasswd(const char *name, const char *passwd);
       bool changePasswd(const char *name, const char *newpassd);
@@ -22,15 +44,34 @@ class PasswdMgr {
       void addUser(const char *name, const char *passwd);
 
       void hashArgon2(std::vector<uint8_t> &ret_hash, std::vector<uint8_t> &ret_salt, const char *passwd, 
-                                                                                 std::vector<uint8_t> *in_salt = NULL);
+                      std::vector<uint8_t> *in_salt = NULL, const Argon2Profile *profile = NULL);
+      void makeSalt(std::vector<uint8_t> &salt);
+
+      // Record lookup and replacement for callers that hash asynchronously (see HashScheduler)
+      bool findUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                    Argon2Profile &profile);
+      bool replaceUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                       const Argon2Profile &profile);
+
+      // Applies a batch of changes in one rewrite, adding users that are not in the file.
+      // Returns the number of records written or removed.
+      size_t updateUsers(const std::vector<PasswdChange> &changes);
+
+      // Reads every record in one pass (see CredIndex)
+      void readAll(std::vector<PasswdRecord> &records);
+
+      const std::string &getFilename() const { return _pwd_file; };
 
    private:
-      bool findUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
-      bool readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
-      int writeUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
-      int writeHash(FileFD &pwfile, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
+      bool readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                    Argon2Profile &profile);
+      int writeUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                    const Argon2Profile &profile);
+      size_t rewrite(const std::vector<PasswdChange> &changes, bool add_missing);
 
       std::string _pwd_file;
+
+      Argon2Profile _profile;
 };
 
 #endif
@@ -0,0 +1,62 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+// Default number of IPs tracked by a limiter (16 bytes each)
+const size_t default_limiter_capacity = 65536;
+
+/****************************************************************************************
+ * RateLimiter - Per-IP token buckets in a fixed-size table, so memory stays bounded no
+ *               matter how many addresses show up. Each IP hashes to a small set of slots
+ *               (the table is sharded by IP, one cache line or two per set); a new IP takes
+ *               over the least recently used slot of its set, so quiet addresses age out
+ *               first while the ones hammering us keep their (empty) buckets.
+ *
+ *               A bucket is a single 64-bit word holding the last refill time and the token
+ *               count, updated with compare-and-swap, so checks never take a lock.
+ *
+ ****************************************************************************************/
+
+class RateLimiter {
+public:
+   // rate - tokens added per second, burst - bucket size (and the tokens a new IP starts with)
+   RateLimiter(double rate, double burst, size_t capacity = default_limiter_capacity);
+   ~RateLimiter();
+
+   // Takes cost tokens from the IP's bucket. Returns false (taking nothing) if there are
+   // not enough.
+   bool allow(unsigned long ipaddr, double cost = 1.0);
+
+   // True if the IP currently has at least cost tokens, without taking any
+   bool check(unsigned long ipaddr, double cost = 1.0);
+
+   uint64_t getDenied() const { return _denied; };
+   uint64_t getEvictions() const { return _evictions; };
+
+private:
+   struct Slot {
+      std::atomic<uint64_t> key{0};       // IP + 1, 0 for an empty slot
+      std::atomic<uint64_t> state{0};     // refill time in ms << token_bits | tokens
+   };
+
+   bool take(unsigned long ipaddr, double cost, bool consume);
+   Slot &findSlot(unsigned long ipaddr, uint64_t now);
+   uint64_t refill(uint64_t state, uint64_t now) const;
+   uint64_t nowMS() const;
+
+   std::unique_ptr<Slot[]> _slots;
+   size_t _set_mask;
+
+   double _rate_per_ms;       // In token fractions (see token_scale)
+   uint64_t _burst;           // In token fractions
+
+   uint64_t _epoch_ns;
+
+   std::atomic<uint64_t> _denied{0};
+   std::atomic<uint64_t> _evictions{0};
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef REPLLOG_H
+#define REPLLOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "PasswdMgr.h"
+
+const char repllogfilename[] = "passwd.replog";
+
+/****************************************************************************************
+ * repl - The credential replication protocol between a primary tcpserver and its
+ *        followers (see Replicator). Everything is frames: a 4 byte length (network
+ *        order) of what follows, a type byte and the body.
+ *
+ *           f_subscribe   follower -> primary, first frame: the sequence number it wants
+ *                         next (8 bytes). 1 is the start of the log.
+ *           f_record      primary -> follower: a change with its sequence number, 8 bytes,
+ *                         then the change
+ *           f_write       follower -> primary: a change made on the follower, for the
+ *                         primary to order and send back out as a record
+ *           f_refused     primary -> follower: text saying why it is closing, e.g. the
+ *                         follower asked for records the primary never wrote
+ *
+ *        A change is an op byte (op_put or op_delete), then the name, hash, salt and
+ *        profile string, each preceded by its length in one byte.
+ *
+ *        The replication log file is nothing but f_record frames back to back, so
+ *        catching a follower up is a sendfile of a byte range of it.
+ *
+ ****************************************************************************************/
+
+namespace repl {
+
+const char f_subscribe = 'S';
+const char f_record = 'R';
+const char f_write = 'W';
+const char f_refused = 'X';
+
+const char op_put = 'P';
+const char op_delete = 'D';
+
+const size_t frame_header_size = 5;
+const uint32_t max_frame = 4096;
+
+// Decodes the header at data if a whole frame is there; len is set to the body length
+bool parseFrame(const char *data, size_t avail, char &type, uint32_t &len);
+
+// Appends whole frames to out
+void appendSubscribe(std::string &out, uint64_t next);
+void appendChange(std::string &out, char type, uint64_t seq, const PasswdChange &change);
+void appendRefused(std::string &out, const std::string &why);
+
+// Decodes a change body (after the sequence number, for a record)
+bool parseChange(const char *body, size_t len, PasswdChange &change);
+
+uint64_t get64(const char *data);
+
+}
+
+/****************************************************************************************
+ * ReplLog - The ordered log of credential changes, kept in a local file. On the primary
+ *           every change to the credential index is appended here and numbered; followers
+ *           append the records they receive, with the primary's numbers, so the last
+ *           sequence number in their log is where they resume after a restart or a lost
+ *           connection.
+ *
+ *           Records are synced to disk before append returns. The file offset of every
+ *           record is kept in memory (8 bytes each) to find where a catch-up starts.
+ *           Thread safe.
+ *
+ ****************************************************************************************/
+
+class ReplLog {
+public:
+   ReplLog(const char *filename = repllogfilename);
+   ~ReplLog();
+
+   // Opens (or creates) the log and indexes it, cutting off a record torn by a crash
+   void open();
+
+   // Numbers a change and appends it. Returns its sequence number.
+   uint64_t append(const PasswdChange &change);
+
+   // Appends a record received from the primary, frame and all. Returns false if seq is
+   // not the next one.
+   bool appendRecord(uint64_t seq, const char *frame, size_t len);
+
+   uint64_t lastSeq();
+
+   // The file offset seq's record starts at (the end of the log for lastSeq() + 1).
+   // False if seq is past that.
+   bool offsetOf(uint64_t seq, off_t &offset);
+
+   // Where the last complete record ends
+   off_t end();
+
+   // Every user's latest credential according to the log
+   void readState(std::unordered_map<std::string, PasswdRecord> &state);
+
+   int getFD() const { return _fd; };
+
+private:
+   void writeAll(const std::string &data);
+
+   std::string _filename;
+   int _fd = -1;
+
+   std::mutex _mutex;
+
+   // Offset of each record, indexed by sequence number - 1
+   std::vector<off_t> _offsets;
+   off_t _end = 0;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "PasswdMgr.h"
+#include "ReplLog.h"
+
+class CredIndex;
+
+// How long a follower waits between attempts to reach its primary, in ms
+const int repl_retry_ms = 1000;
+
+/****************************************************************************************
+ * Replicator - Keeps the credentials of several tcpserver processes (each with its own
+ *              passwd file) the same. One is the primary: every change to its credential
+ *              index--a password change or rehash, an edit to its passwd file such as
+ *              my_adduser, or a change sent by a follower--is appended to its ReplLog and
+ *              streamed, in log order, to every follower over TCP (see repl). A follower
+ *              applies the records to its own index and passwd file in batches and appends
+ *              them to its own log; when it connects it subscribes from the record after the
+ *              last one in its log, so it catches up from wherever it left off. Changes made
+ *              on a follower are sent to the primary, which orders them with everything
+ *              else; the follower applies its own change right away, and again when it comes
+ *              back as a record, so every node ends up with the primary's order. A change
+ *              is sent again after a reconnect until it has come back.
+ *
+ *              The first time a primary runs, its whole passwd file goes into the log; after
+ *              that, whatever changed in the file while it was down is logged when it
+ *              starts. The log is never compacted.
+ *
+ *              All replication runs on one thread of its own, apart from the server loop,
+ *              which only pays for appending to the log. The index is thread safe for this.
+ *
+ ****************************************************************************************/
+
+class Replicator {
+public:
+   // Where a change to the credential index came from
+   enum source {
+      s_local,       // a password change or rehash on this server
+      s_file,        // the passwd file was edited outside the server
+      s_remote       // received from the primary, or on the primary from a follower
+   };
+
+   Replicator(CredIndex &creds, ReplLog &log);
+   ~Replicator();
+
+   // Which role to take; the address is ours to listen on as the primary, or the primary's
+   void setPrimary(const char *ip_addr, unsigned short port);
+   void setFollower(const char *ip_addr, unsigned short port);
+
+   // Opens the log, hooks into the index and starts the thread
+   void start();
+
+   // Stops the thread and unhooks from the index; followers are disconnected
+   void stop();
+
+   // Called by the index with its write lock held
+   void attached(const std::vector<PasswdRecord> &current);
+   void changed(const PasswdChange &change, source src);
+
+   bool isPrimary() const { return _primary; };
+
+   // Counter for reporting: changes applied from followers (primary) or the primary (follower)
+   uint64_t getApplied() const { return _applied; };
+
+private:
+   struct Follower {
+      int fd;
+      std::string ipaddr;
+      std::string in;
+      bool subscribed = false;
+      off_t pos = 0;
+   };
+
+   void run();
+   void runPrimary();
+   void runFollower();
+
+   bool readFollower(Follower &f);
+   bool sendLog(Follower &f);
+   void dropFollower(size_t idx, const char *why);
+
+   int connectPrimary();
+   bool readPrimary(int sock, std::string &in);
+   bool sendUpstream(int sock);
+   void waitWake(int ms);
+   void wake();
+   void clearWake();
+
+   CredIndex &_creds;
+   ReplLog &_log;
+
+   bool _primary = false;
+   std::string _ip_addr;
+   unsigned short _port = 0;
+
+   std::thread _thread;
+   std::atomic<bool> _stopping{false};
+
+   // Written to wake the thread: the log grew, a change is waiting to go upstream, or stop
+   int _wakefd = -1;
+
+   // Primary: the listening socket and the followers
+   int _listenfd = -1;
+   std::vector<Follower> _followers;
+
+   // Follower: changes made here that haven't come back from the primary as records
+   // (sent again on every connect), and the bytes waiting to go out on this connection
+   std::mutex _upstream_mutex;
+   std::vector<PasswdChange> _pending;
+   std::string _upstream;
+   bool _connected = false;
+
+   std::atomic<uint64_t> _applied{0};
+};
+
+#endif
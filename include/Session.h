@@ -0,0 +1,94 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include "CoroPool.h"
+
+/****************************************************************************************
+ * Session - A coroutine running one client's conversation with the server. It starts
+ *           suspended; the owner calls resume() to run it to its first co_await and again
+ *           each time the event loop has what it was waiting for. Exceptions thrown inside
+ *           come back out of resume(). Destroying the Session destroys the frame wherever
+ *           it is suspended.
+ *
+ *           The frame comes from the CoroPool of the object the coroutine is a member of
+ *           (its coroPool()), so sessions on one event loop recycle each other's frames.
+ *           The pool is remembered in front of the frame for when it is freed.
+ *
+ ****************************************************************************************/
+
+class Session {
+public:
+   struct promise_type {
+      std::exception_ptr error;
+
+      Session get_return_object() {
+         return Session(std::coroutine_handle<promise_type>::from_promise(*this)); };
+      std::suspend_always initial_suspend() noexcept { return {}; };
+      std::suspend_always final_suspend() noexcept { return {}; };
+      void return_void() { };
+      void unhandled_exception() { error = std::current_exception(); };
+
+      // Owner is the object a member coroutine is called on
+      template <typename Owner, typename... Args>
+      static void *operator new(size_t size, Owner &owner, Args &&...) {
+         return allocate(owner.coroPool(), size); };
+      static void *operator new(size_t size) { return allocate(CoroPool::local(), size); };
+
+      static void operator delete(void *frame, size_t size) {
+         char *block = static_cast<char *>(frame) - header_size;
+         CoroPool *pool = *reinterpret_cast<CoroPool **>(block);
+         pool->deallocate(block, size + header_size);
+      };
+
+   private:
+      // Keeps the frame at the alignment operator new would give it
+      static const size_t header_size = alignof(std::max_align_t);
+
+      static void *allocate(CoroPool &pool, size_t size) {
+         char *block = static_cast<char *>(pool.allocate(size + header_size));
+         *reinterpret_cast<CoroPool **>(block) = &pool;
+         return block + header_size;
+      };
+   };
+
+   Session() { };
+   Session(Session &&other) noexcept:_handle(std::exchange(other._handle, nullptr)) { };
+   Session &operator=(Session &&other) noexcept {
+      if (this != &other) {
+         reset();
+         _handle = std::exchange(other._handle, nullptr);
+      }
+      return *this;
+   };
+   Session(const Session &) = delete;
+   Session &operator=(const Session &) = delete;
+   ~Session() { reset(); };
+
+   // Runs the coroutine to its next suspension point, rethrowing anything it threw
+   void resume() {
+      if (!_handle || _handle.done())
+         return;
+      _handle.resume();
+      if (_handle.promise().error)
+         std::rethrow_exception(std::exchange(_handle.promise().error, nullptr));
+   };
+
+   bool active() const { return _handle && !_handle.done(); };
+
+   void reset() {
+      if (_handle)
+         _handle.destroy();
+      _handle = nullptr;
+   };
+
+private:
+   explicit Session(std::coroutine_handle<promise_type> handle):_handle(handle) { };
+
+   std::coroutine_handle<promise_type> _handle = nullptr;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef SHARDNODE_H
+#define SHARDNODE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "BinProto.h"
+#include "CredIndex.h"
+#include "HashScheduler.h"
+#include "ShardRing.h"
+
+// How long calls to a node that could not be reached fail right away before it is tried
+// again, in ms
+const int shard_retry_ms = 1000;
+
+// How often the RPC thread looks for finished hashes while any are in flight, in ms
+const int shard_poll_ms = 5;
+
+/****************************************************************************************
+ * shard - The RPC between the nodes of a partitioned cluster (see ShardNode). It uses the
+ *         binproto frame header, without the magic bytes, over a TCP connection each node
+ *         keeps to every other one:
+ *
+ *            op_lookup    is the user in your passwd file?
+ *            op_verify    does this password match the user's hash?
+ *            op_change    hash this new password and store it
+ *
+ *         A request's payload is the client's IPv4 address (4 bytes, network order, for
+ *         the owner's hash priorities), the username, '\0', and the password (empty for a
+ *         lookup). The reply has the same opcode and request ID, no payload, and one of
+ *         st_ok, st_denied (wrong password), st_unknown (no such user), st_busy (the
+ *         owner's hash scheduler is full) or st_badreq.
+ *
+ *         Passwords cross in the clear, like they do from clients, so the port must only
+ *         be reachable from the cluster. Connections from IPs that aren't nodes are closed.
+ *
+ ****************************************************************************************/
+
+namespace shard {
+
+enum opcode {
+   op_lookup = 1,
+   op_verify = 2,
+   op_change = 3
+};
+
+}
+
+/****************************************************************************************
+ * ShardCall - One request to the node owning a user. Like a HashJob, the connection that
+ *             made it polls isFinished() from the event loop and then reads status and
+ *             result. The plaintext is wiped once it has been sent, or when the call is
+ *             destroyed.
+ *
+ ****************************************************************************************/
+
+class ShardCall {
+public:
+   // failed: the owner could not be reached or went away before answering
+   enum callstatus { pending, done, failed };
+
+   ShardCall(uint8_t op, std::string_view name, const char *passwd, uint32_t ipaddr);
+   ~ShardCall();
+
+   bool isFinished() const { return getStatus() != pending; };
+   callstatus getStatus() const { return (callstatus) _status.load(std::memory_order_acquire); };
+   void setStatus(callstatus status) { _status.store(status, std::memory_order_release); };
+
+   uint8_t op;
+   std::string name;
+   std::string passwd;
+   uint32_t ipaddr;
+
+   // The owner's binproto status, valid once the status is done
+   uint8_t result = binproto::st_busy;
+
+private:
+   std::atomic<int> _status{pending};
+};
+
+/****************************************************************************************
+ * ShardNode - One node of a partitioned cluster. Usernames are spread over the nodes by a
+ *             ShardRing, and each node's passwd file only holds the users it owns, so
+ *             both the number of users and the Argon2 hashing capacity grow with the
+ *             number of nodes. A client may log in on any node: for a user owned by
+ *             another node, the connection makes a ShardCall and the owner looks the user
+ *             up, verifies the password or stores a new one with its own CredIndex and
+ *             HashScheduler (rehashing outdated records as a local login does), and sends
+ *             back the result.
+ *
+ *             Both sides of the RPC run on one thread of its own: the requests other nodes
+ *             send here, and the calls this node's connections make, which go out over one
+ *             connection per node, opened when it is first needed. Calls to a node that
+ *             can't be reached fail, which the connection reports as busy.
+ *
+ *             Every node must be given the same set of nodes.
+ *
+ ****************************************************************************************/
+
+class ShardNode {
+public:
+   // self is this node's "ip:port", which the RPC listens on
+   ShardNode(CredIndex &creds, const std::string &self, unsigned int vnodes = default_shard_vnodes);
+   ~ShardNode();
+
+   // Adds another node by its "ip:port". Only call this before start.
+   void addPeer(const std::string &addr);
+
+   // Hashes for the other nodes' requests are queued here. Set before start.
+   void setHashScheduler(HashScheduler *hasher) { _hasher = hasher; };
+
+   // Listens for the other nodes and starts the thread
+   void start();
+
+   // Stops the thread and closes every connection; calls still in flight fail
+   void stop();
+
+   // True if this node owns name, so it is in our passwd file (if it is anywhere)
+   bool isLocal(std::string_view name) const { return _ring.owner(name) == _self; };
+   const std::string &ownerOf(std::string_view name) const { return _ring.node(_ring.owner(name)); };
+
+   // Sends a request to the node owning name. The call is always returned, already failed
+   // if the owner is known to be unreachable.
+   std::shared_ptr<ShardCall> call(uint8_t op, std::string_view name, const char *passwd, uint32_t ipaddr);
+
+   size_t nodes() const { return _ring.size(); };
+
+   // Counters for reporting: requests answered for other nodes, calls made to them
+   uint64_t getServed() const { return _served; };
+   uint64_t getForwarded() const { return _forwarded; };
+
+private:
+   // A request from another node waiting on its hash
+   struct Request {
+      uint32_t reqid;
+      uint8_t op;
+      userid id;
+      uint32_t ipaddr;
+      std::vector<uint8_t> hash;
+      Argon2Profile profile;
+      std::shared_ptr<HashJob> job;
+   };
+
+   // A connection another node opened to us
+   struct Inbound {
+      int fd;
+      std::string ipstr;
+      std::string in;
+      std::string out;
+      std::vector<Request> requests;
+   };
+
+   // Our connection to another node, and the calls on it waiting for an answer
+   struct Peer {
+      int fd = -1;
+      bool connecting = false;
+      uint64_t retry_at = 0;
+      std::string in;
+      std::string out;
+      size_t sent = 0;
+      std::unordered_map<uint32_t, std::shared_ptr<ShardCall>> calls;
+   };
+
+   // Rehash of an outdated record after a verify, stored when it finishes
+   struct Upgrade {
+      userid id;
+      std::vector<uint8_t> oldhash;
+      std::shared_ptr<HashJob> job;
+   };
+
+   void run();
+   void loop();
+   void sendCalls();
+   void connectPeer(size_t idx);
+   bool readPeer(Peer &p);
+   bool writePeer(Peer &p);
+   void failPeer(size_t idx, const char *why);
+   void failAll();
+
+   void acceptNodes();
+   bool readInbound(Inbound &c);
+   void handleRequest(Inbound &c, const binproto::FrameHeader &hdr, const char *payload);
+   void finishRequests(Inbound &c);
+   void finishUpgrades();
+   bool writeInbound(Inbound &c);
+   void dropInbound(size_t idx, const char *why);
+   bool hashing() const;
+
+   void wake();
+   void clearWake();
+
+   CredIndex &_creds;
+   HashScheduler *_hasher = NULL;
+
+   ShardRing _ring;
+   size_t _self;
+
+   // Every node's IPv4 address (network order); only these may connect
+   std::vector<uint32_t> _node_ips;
+
+   std::thread _thread;
+   std::atomic<bool> _stopping{false};
+
+   // Written to wake the thread: a call was queued, or stop
+   int _wakefd = -1;
+   int _listenfd = -1;
+
+   std::vector<Inbound> _inbound;
+   std::vector<Upgrade> _upgrades;
+
+   // Indexed like the ring's nodes; ours stays unused
+   std::vector<Peer> _peers;
+   uint32_t _next_reqid = 1;
+
+   // Calls made by the server loop, with the peer they go to, not yet handed over. Once
+   // the thread is not running (under the same mutex) calls fail right away.
+   std::mutex _queue_mutex;
+   std::vector<std::pair<size_t, std::shared_ptr<ShardCall>>> _queued;
+   bool _running = false;
+
+   std::atomic<uint64_t> _served{0};
+   std::atomic<uint64_t> _forwarded{0};
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef SHARDRING_H
+#define SHARDRING_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Points each node gets on the ring unless the ring is built with another count
+const unsigned int default_shard_vnodes = 64;
+
+/****************************************************************************************
+ * ShardRing - Consistent hashing of usernames onto the nodes of a partitioned cluster.
+ *             Every node is hashed onto a 64 bit ring at vnodes points; a name belongs to
+ *             the node owning the first point at or after the name's own hash. Adding or
+ *             removing a node only moves the names between its points and the ones before
+ *             them, about 1/N of all users, and the points even out each node's share.
+ *
+ *             Nodes are named by their "ip:port" address. Every node must be built with
+ *             the same addresses and vnodes to agree on owners; the order they are added
+ *             in doesn't matter. Not thread safe while nodes are being added; lookups
+ *             after that may run on any thread.
+ *
+ ****************************************************************************************/
+
+class ShardRing {
+public:
+   ShardRing(unsigned int vnodes = default_shard_vnodes);
+   ~ShardRing();
+
+   // Adds a node; adding an address that is already there does nothing. Returns its index.
+   size_t addNode(const std::string &addr);
+
+   // The index of the node that owns name. The ring must have at least one node.
+   size_t owner(std::string_view name) const;
+
+   const std::string &node(size_t idx) const { return _nodes[idx]; };
+   size_t size() const { return _nodes.size(); };
+
+   // The hash names and points are placed by
+   static uint64_t hash(std::string_view data);
+
+private:
+   struct Point {
+      uint64_t pos;
+      uint32_t node;
+   };
+
+   unsigned int _vnodes;
+   std::vector<std::string> _nodes;
+
+   // Sorted by position
+   std::vector<Point> _points;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef STREAMCOMPRESSOR_H
+#define STREAMCOMPRESSOR_H
+
+#include <stdint.h>
+#include <string>
+#include <zlib.h>
+
+// zlib level compressed connections use unless the server is given another
+const int default_compress_level = 6;
+
+// Batches smaller than this go out as stored blocks; a flushed deflate block of a few words
+// saves a handful of bytes at best. Longer canned replies shrink to a few bytes against the
+// dictionary, so this stays low.
+const size_t compress_threshold = 64;
+
+// History each stream keeps. An 8 KiB window and 16 KiB of hash chains hold every canned
+// reply and the dictionary, for about 48 KiB of zlib state per connection instead of 256.
+const int compress_window_bits = 13;
+const int compress_mem_level = 6;
+
+// The reply to "compress", the last thing the server sends uncompressed
+const char compress_reply[] = "Compression on\n";
+
+// Totals over every compressed connection, for the server's report
+struct CompressStats {
+   uint64_t streams = 0;
+   uint64_t bytes_in = 0;
+   uint64_t bytes_out = 0;
+   uint64_t cpu_ns = 0;
+};
+
+// The preset dictionary both ends of a stream load: the server's canned replies
+const std::string &compressDictionary();
+
+/****************************************************************************************
+ * StreamCompressor - One connection's deflate stream. Everything the connection sends
+ *                    after it is set up goes through compress, in order, so each batch
+ *                    builds on the history of the ones before it; the stream starts with
+ *                    compressDictionary() preset, so even the first menu compresses well.
+ *                    Each batch ends with a sync flush, letting the client decode all of it
+ *                    without waiting for more. Batches under compress_threshold are stored
+ *                    rather than deflated.
+ *
+ *                    The CPU time spent in zlib is added to the stats, if given, apart from
+ *                    everything else the server does.
+ *
+ ****************************************************************************************/
+
+class StreamCompressor {
+public:
+   // Throws std::runtime_error if zlib can't set up the stream
+   StreamCompressor(int level = default_compress_level, CompressStats *stats = NULL);
+   ~StreamCompressor();
+
+   // Compresses len bytes at data onto the end of out
+   void compress(const char *data, size_t len, std::string &out);
+
+private:
+   void setLevel(int level, std::string &out);
+
+   z_stream _zs;
+   int _level;
+   int _cur_level;
+   CompressStats *_stats;
+};
+
+/****************************************************************************************
+ * StreamDecompressor - The client's end of a StreamCompressor stream
+ *
+ ****************************************************************************************/
+
+class StreamDecompressor {
+public:
+   // Throws std::runtime_error if zlib can't set up the stream
+   StreamDecompressor();
+   ~StreamDecompressor();
+
+   // Appends what the next len bytes of the stream decode to onto out. Returns false if the
+   // stream is corrupt.
+   bool decompress(const char *data, size_t len, std::string &out);
+
+private:
+   z_stream _zs;
+};
+
+#endif
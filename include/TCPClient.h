@@ -2,12 +2,22 @@
 #define TCPCLIENT_H
 
 #include <string>
+#include <memory>
 #include "Client.h"
 #include "FileDesc.h"
+#include "StreamCompressor.h"
 
-// The amount to read in before we send a packet
+// A partial line this long is sent without waiting for its newline
 const unsigned int stdin_bufsize = 50;
-const unsigned int socket_bufsize = 100;
+
+// Reads from stdin and the socket take up to this much at a time
+const unsigned int client_readbuf = 65536;
+
+// Server output is written to stdout once this much has built up, or before the loop waits
+const size_t stdout_flush_bytes = 65536;
+
+// Stdin is not read while this much is still waiting to go to the server
+const size_t max_pending_send = 1 << 20;
 
 class TCPClient : public Client
 {
@@ -20,12 +30,31 @@ public:
 
    virtual void closeConn();
 
+   // Ask for compression once logged in, and inflate what the server sends after it agrees
+   void setCompression(bool on) { _compress = on; };
+
 private:
-   int readStdin();
+   bool readStdin();
+   bool readSocket();
+   void takeOutput(const char *data, size_t len);
+   void sendPending();
+   void flushStdout();
 
-   // Stores the user's typing
+   // Stores the user's typing until a line is complete
    std::string _in_buf;
 
+   // Complete lines not yet taken by the socket
+   std::string _out_buf;
+
+   // Server output not yet written to stdout
+   std::string _stdout_buf;
+
+   // With compression asked for, the server's lines are watched in _zline until it replies
+   // to "compress"; then _inflate decodes the rest of the stream
+   bool _compress = false;
+   std::string _zline;
+   std::unique_ptr<StreamDecompressor> _inflate;
+
    // Class to manage our client's network connection
    SocketFD _sockfd;
  
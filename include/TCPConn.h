@@ -3,71 +3,368 @@
 
 #include "FileDesc.h"
 #include "PasswdMgr.h"
+#include "CredIndex.h"
+#include "HashScheduler.h"
+#include "RateLimiter.h"
+#include "BinProto.h"
+#include "ConnTable.h"
+#include "LogMgr.h"
+#include "Session.h"
+#include "FanOut.h"
+#include "ShardNode.h"
+#include "StreamCompressor.h"
 
 
+// The filename/path of the password file
+const char pwdfilename[] = "passwd";
+
+// Where the files "get" serves come from, unless the server is given another directory
+const char default_contentdir[] = "content";
+
+// Where "put" stores files, in a directory per user, unless the server is given another
+const char default_uploaddir[] = "uploads";
+
+// Largest file one "put" may send
+const uint64_t max_upload_bytes = 4ULL << 30;
+
+// Bytes moved off the socket per splice, the default pipe capacity
+const size_t upload_chunk = 65536;
+
+// When uploads are flushed to disk: never (left to the kernel's writeback), once when they
+// are complete, before they are renamed into place, or also every so many bytes on the way
+enum uploadsync { sync_none, sync_end, sync_every };
+
 const int max_attempts = 2;
 
+// Seconds a client has from connecting to finishing its login
+const unsigned int login_timeout_secs = 60;
+
+// Longest text a "broadcast" or "msg" command may carry
+const size_t max_message_len = 1024;
+
+// Queued messages handed to the socket per sendmsg
+const size_t max_send_iov = 64;
+
+// Most queued bytes a compressed connection deflates at once, and flushes after
+const size_t compress_batch = 65536;
+
 // Methods and attributes to manage a network connection, including tracking the username
-// and a buffer for user input. Status tracks what "phase" of login the user is currently in
+// and a buffer for user input. A text client's whole conversation runs as one coroutine,
+// textSession, that co_awaits input lines and password hashes; handleConnection resumes it
+// when the event loop has what it is waiting for. Status tracks what "phase" of login the
+// user is currently in, for handoff, the login timeout and the binary protocol.
+//
+// The fields the server loop checks every pass live in a ConnHot slot (see ConnTable.h); the
+// TCPConn itself holds the rest and is only touched when the connection has work to do.
 class TCPConn 
 {
 public:
-   TCPConn(/* LogMgr &server_log*/);
+   // A standalone connection with its own hot state, credential index and log
+   TCPConn(const Argon2Profile &profile = Argon2Profile());
+
+   // A server connection: hot state in a ConnTable slot, sharing the server's CredIndex and log
+   TCPConn(ConnTable &table, CredIndex &creds, LogMgr &log);
    ~TCPConn();
 
-   enum logMessage {serverStart, newConn_NOT_WL, newConn_ON_WL, usrName_NOT_recog, paswd_failed_twice, succ_login, discon};
+   ConnHot *getHot() { return _hot; };
 
    bool accept(SocketFD &server);
+   void adoptSocket(SocketFD &client);
+   int getFD() { return _connfd.getFD(); };
+
+   // Failed password attempts are charged here per IP; without one only max_attempts applies
+   void setLoginLimiter(RateLimiter *limiter) { _login_limiter = limiter; };
+
+   // Password hashes are queued here; without one they are computed inline
+   void setHashScheduler(HashScheduler *hasher) { _hasher = hasher; };
+
+   // The event loop's pool the session coroutine's frame comes from; set before the session
+   // starts (startAuthentication or restoreState). Defaults to the thread's pool.
+   void setCoroPool(CoroPool *pool) { _coropool = pool; };
+   CoroPool &coroPool() { return *_coropool; };
+
+   // Broadcasts and direct messages go through this; without one the commands are refused
+   void setFanOut(FanOut *fanout) { _fanout = fanout; };
 
+   // Users another node owns are looked up and verified there; without one all are local
+   void setShardNode(ShardNode *shards) { _shards = shards; };
+
+   // The directory "get" serves files from; without one the command is refused
+   void setContentDir(const char *dir) { _contentdir = dir; };
+
+   // The directory "put" stores files under; without one the command is refused
+   void setUploadDir(const char *dir, uploadsync sync, uint64_t sync_bytes) {
+      _uploaddir = dir; _upload_sync = sync; _upload_sync_bytes = sync_bytes; };
+
+   // The zlib level "compress" turns on, and where its totals go; level 0 refuses the command
+   void setCompression(int level, CompressStats *stats) { _zlevel = level; _zstats = stats; };
+
+   // Text replies; they go behind any queued messages rather than into the middle of one
    int sendText(const char *msg);
    int sendText(const char *msg, int size);
+   int sendText(const std::string &msg) { return sendText(msg.data(), (int) msg.size()); };
+
+   // Queues len bytes at data, which buf keeps alive, without copying them. Returns true if
+   // the queue was empty, so the caller knows to have sendQueued called.
+   bool queueMessage(const MsgRef &buf, const char *data, size_t len);
+
+   // Writes as much of the queue as the socket takes without blocking
+   void sendQueued();
+
+   // Queues len bytes of file from offset, sent with sendfile once the queue gets to them
+   void queueFile(const std::shared_ptr<FileFD> &file, off_t offset, size_t len);
 
    void handleConnection();
    void startAuthentication();
-   void getUsername();
-   void getPasswd();
    void sendMenu();
-   void getMenuChoice();
-   void setPassword();
-   void changePassword();
+   void handleBinary();
    
-   bool getUserInput(std::string &cmd);
+   bool getUserInput(std::string &cmd, bool lowercase = false);
 
    void disconnect();
    bool isConnected();
 
-   unsigned long getIPAddr() { return _connfd.getIPAddr(); };
-   void getIPAddrStr(std::string &buf);
-   const char *getUsernameStr() { return _username.c_str(); };
+   // For draining on shutdown: idle means nothing is in flight, buffered or unsent
+   bool isIdle();
+   void closeForShutdown();
+
+   // Closes a client still not logged in once its ConnHot::deadline has passed
+   void loginTimedOut();
 
-   bool isNewIPAllowed(std::string inputIP);
+   // Hot upgrade: an idle connection at a prompt can move to a new server process
+   bool canHandOff();
+   void saveState(std::string &state);
+   bool restoreState(int fd, const std::string &state);
+   void releaseFD();
 
-   void log(std::string logString);
-   void log(enum logMessage inputLogOption);
-   void log(std::string logString, enum logMessage inputLogOption);
+   // The peer's address, cached when the socket was attached
+   unsigned long getIPAddr() { return _ipaddr; };
+   unsigned short getPort() { return _port; };
+   void getIPAddrStr(std::string &buf) { buf = _ipstr; };
+   const char *getIPAddrCStr() const { return _ipstr; };
+   const char *getUsernameStr() { return _creds->getName(_userid).c_str(); };
+
+   bool isNewIPAllowed(std::string_view inputIP);
+
+   void log(evlog::event ev);
+   void logUnknownUser(std::string_view name);
 
 
 
 private:
 
 
-   enum statustype { s_username, s_changepwd, s_confirmpwd, s_passwd, s_menu };
+   enum statustype { s_username, s_changepwd, s_confirmpwd, s_passwd, s_menu,
+                     s_passwd_wait, s_changepwd_wait, s_upload };
+
+   // Outcomes of the login and password change steps both protocols share
+   enum authresult { a_started, a_ok, a_busy, a_denied, a_locked, a_unknown, a_limited, a_error };
+
+   // What the session coroutine is suspended on
+   enum waitkind { w_none, w_line, w_hash, w_upload };
+
+   // co_await readLine(line): the next input line, without its newline
+   struct LineAwaiter {
+      TCPConn &conn;
+      std::string &line;
+      bool lowercase;
+
+      bool await_ready() { return conn.getUserInput(line, lowercase); };
+      void await_suspend(std::coroutine_handle<>) {
+         conn._wait = w_line;
+         conn._wait_line = &line;
+         conn._wait_lower = lowercase;
+      };
+      void await_resume() { };
+   };
+
+   // co_await hashDone(): the hash in _hashjob, or the call to the user's node in _shardcall,
+   // has finished (or was dropped)
+   struct HashAwaiter {
+      TCPConn &conn;
 
-   //enum logMessage {serverStart, newConn_NOT_WL, newConn_ON_WL, usrName_NOT_recog, paswd_failed_twice, succ_login, discon};
+      bool await_ready() { return conn.hashFinished(); };
+      void await_suspend(std::coroutine_handle<>) { conn._wait = w_hash; };
+      void await_resume() { };
+   };
 
-   statustype _status = s_username;
+   // co_await uploadDone(): every byte of the upload in _upload has been written to its file
+   // (or the client went away)
+   struct UploadAwaiter {
+      TCPConn &conn;
 
-   SocketFD _connfd{};
+      bool await_ready() { return conn.pumpUpload(); };
+      void await_suspend(std::coroutine_handle<>) { conn._wait = w_upload; };
+      void await_resume() { };
+   };
+
+   LineAwaiter readLine(std::string &line, bool lowercase = false) { return {*this, line, lowercase}; };
+   HashAwaiter hashDone() { return {*this}; };
+   UploadAwaiter uploadDone() { return {*this}; };
+
+   Session textSession(statustype start);
+   void startSession(statustype start);
+   void resumeSession();
+
+   bool hashFinished() const;
+   bool isRemoteUser(std::string_view name) const { return (_shards != NULL) && !_shards->isLocal(name); };
+   authresult finishLookup();
+
+   authresult startLogin(const char *passwd);
+   authresult finishLogin();
+   authresult startChangePasswd(const char *passwd);
+   authresult finishChangePasswd();
+
+   bool readInput();
+   bool hasRequest();
+   void consumeInput(size_t len);
+   void updateFlags();
+   void cacheAddress();
+
+   // Hot state accessors
+   statustype status() const { return (statustype) _hot->status; };
+   void setStatus(statustype status) { _hot->status = (uint8_t) status; };
+   bool isBinary() const { return (_hot->flags & ConnHot::f_binary) != 0; };
+
+   // The unconsumed part of the input buffer
+   const char *inputData() const { return _inputbuf.data() + _hot->in_head; };
+   size_t inputLen() const { return _hot->in_tail - _hot->in_head; };
+   bool menuReply(const std::string &cmd, std::string &msg);
+
+   enum msgresult { m_none, m_sent, m_error };
+   msgresult messageCommand(const std::string &cmd, std::string &msg);
+   msgresult getCommand(const std::string &cmd, std::string &msg);
+   bool sendFileChunk(size_t idx);
+   void updateBlocking();
+
+   msgresult putCommand(const std::string &cmd, std::string &msg);
+   bool pumpUpload();
+   void finishUpload(std::string &msg);
+   void abortUpload();
+
+   msgresult compressCommand(const std::string &cmd, std::string &msg);
+   void startCompression();
+   void sendCompressed();
+   void queueReplies();
+   void buildMenu(std::string &menustr);
+
+   bool dispatchFrame(const binproto::FrameHeader &hdr, const char *payload);
+   void finishBinaryHash();
+   void flushOutput();
+   void updateOutLen();
+
+   std::shared_ptr<HashJob> startHash(HashScheduler::jobtype type, const char *passwd,
+                                      const std::vector<uint8_t> &salt, const Argon2Profile &profile);
+   void checkUpgrade();
+
+   // Status, attempts, protocol flags and buffer cursors
+   ConnHot *_hot;
+   std::unique_ptr<ConnHot> _own_hot;
+   ConnTable *_table = NULL;
+
+   SocketFD _connfd{false};
+
+   // Peer address (network byte order), port and the address as text, filled in once
+   uint32_t _ipaddr = 0;
+   uint16_t _port = 0;
+   char _ipstr[INET_ADDRSTRLEN] = "";
  
-   std::string _username = ""; // The username this connection is associated with
+   userid _userid = no_user; // The user this connection is associated with, in _creds
 
+   // Received bytes; ConnHot::in_head marks how much has been consumed
    std::string _inputbuf = "";
 
-   std::string _newpwd = ""; // Used to store user input for changing passwords
+   // Binary replies waiting to be written, sent once per pass
+   std::string _outbuf;
+
+   // Messages (and replies that came after them) waiting to be written; each chunk points
+   // into a shared MsgBuf, or for a download, at len bytes of file from offset. Sent chunks
+   // before _msgq_head are dropped once all are sent.
+   struct OutChunk {
+      MsgRef buf;
+      const char *data;
+      size_t len;
+      std::shared_ptr<FileFD> file;
+      off_t offset;
+   };
+   std::vector<OutChunk> _msgq;
+   size_t _msgq_head = 0;
+   size_t _msgq_bytes = 0;
+
+   // The socket is switched to nonblocking while a file is queued or an upload is coming
+   // in, for sendfile and splice
+   bool _nonblocking = false;
+   const char *_contentdir = NULL;
+
+   // A "put" in progress: its bytes go from the socket through the pipe into the file, which
+   // is written under a hidden name and renamed into place once complete
+   struct Upload {
+      std::string name;
+      std::string path;
+      std::string partpath;
+      std::unique_ptr<FileFD> file;
+      int pipefd[2] = {-1, -1};
+      uint64_t total = 0;
+      uint64_t remaining = 0;    // still to come off the socket
+      size_t in_pipe = 0;
+      uint64_t unsynced = 0;
+   };
+   std::unique_ptr<Upload> _upload;
+
+   const char *_uploaddir = NULL;
+   uploadsync _upload_sync = sync_end;
+   uint64_t _upload_sync_bytes = 0;
+
+   // Once "compress" is on, everything queued after the reply goes through _zstream: up to
+   // compress_batch bytes of it are gathered in _zin and deflated onto _zout, which is sent
+   // from _zsent. The first _zraw chunks in the queue predate it and still go out as they are.
+   std::unique_ptr<StreamCompressor> _zstream;
+   size_t _zraw = 0;
+   std::string _zin;
+   std::string _zout;
+   size_t _zsent = 0;
+   int _zlevel = 0;
+   CompressStats *_zstats = NULL;
+
+   FanOut *_fanout = NULL;
+
+   CredIndex *_creds;
+   std::unique_ptr<CredIndex> _own_creds;
+
+   LogMgr *_log;
+   std::unique_ptr<LogMgr> _own_log;
+
+   HashScheduler *_hasher = NULL;
+   RateLimiter *_login_limiter = NULL;
+
+   // Hash in flight for the current login or password change
+   std::shared_ptr<HashJob> _hashjob;
+
+   // Rehash of an outdated record after a login, stored when it finishes
+   std::shared_ptr<HashJob> _upgradejob;
+
+   // The users' node, and the request to it in flight for the current lookup, login or
+   // password change
+   ShardNode *_shards = NULL;
+   std::shared_ptr<ShardCall> _shardcall;
+
+   // Set while the user is one another node owns. They only get an ID here once that node
+   // knows them.
+   std::string _remote_name;
+
+   // The record the pending hashes were checked against
+   std::vector<uint8_t> _userhash;
+   Argon2Profile _userprofile;
+
+   CoroPool *_coropool = &CoroPool::local();
 
-   int _pwd_attempts = 0;
+   // What the suspended session needs before handleConnection resumes it
+   waitkind _wait = w_none;
+   std::string *_wait_line = NULL;
+   bool _wait_lower = false;
 
-   std::unique_ptr<PasswdMgr> PWMgr;
+   // Last, so the frame is destroyed before anything it refers to
+   Session _session;
 };
 
 
@@ -0,0 +1,166 @@
+#ifndef TCPPROXY_H
+#define TCPPROXY_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include "Server.h"
+#include "FileDesc.h"
+
+// How often each backend is health checked, and how long a check may take, in ms
+const int default_health_ms = 1000;
+
+// Failed checks or connects in a row before a backend is taken out of the rotation
+const unsigned int default_health_fails = 2;
+
+// Client connections relayed at once, more are closed at accept
+const unsigned long default_proxy_conns = 1000;
+
+// On SIGTERM/SIGINT, seconds the sessions in progress get to finish
+const double default_proxy_drain_secs = 10.0;
+
+// Bytes moved per splice call, the default pipe capacity
+const size_t relay_chunk = 65536;
+
+// Emptied pipes kept for the next sessions instead of closed
+const size_t max_pooled_pipes = 256;
+
+/******************************************************************************************
+ * TCPProxy - A layer 4 front end for a pool of tcpserver backends. Each client connection
+ *            is paired with a connection to the healthy backend relaying the fewest sessions
+ *            (ties go round robin), and the bytes are moved between the two sockets with
+ *            splice() through a pipe per direction, so they never get copied into the
+ *            proxy. It knows nothing about the protocol; a session ends when both sides
+ *            have closed their half, with each FIN passed on as it arrives.
+ *
+ *            Backends are health checked with a TCP connect every health_ms. A backend
+ *            failing health_fails checks (or client connects) in a row gets no new
+ *            sessions until a check passes again; a client whose backend refuses is tried
+ *            on the next one.
+ *
+ *            With a backends file, it is read again on SIGHUP: new lines add backends, a
+ *            line ending in "drain" or a removed line stops new sessions going there, and
+ *            a removed backend is forgotten once its last session ends. SIGTERM/SIGINT stop
+ *            accepting and give the sessions in progress the drain timeout to finish.
+ *
+ *            Single threaded: one poll loop covers the listener, every session's two
+ *            sockets and the health checks.
+ *
+ *****************************************************************************************/
+
+class TCPProxy : public Server
+{
+public:
+   TCPProxy();
+   ~TCPProxy();
+
+   void bindSvr(const char *ip_addr, unsigned short port) override;
+   void listenSvr() override;
+   void shutdown() override;
+
+   // Adds a backend by its "ip:port"
+   void addBackend(const std::string &addr, bool drain = false);
+
+   // Reads the backends from a file, one "ip:port [drain]" per line, now and on SIGHUP
+   void setBackendFile(const char *path);
+
+   void setHealthCheck(int interval_ms, unsigned int fails);
+   void setDrainTimeout(double secs) { _drain_secs = secs; };
+   void setMaxConns(unsigned long max_conns) { _max_conns = max_conns; };
+
+   size_t backends() const { return _backends.size(); };
+
+private:
+   struct Backend {
+      std::string addr;
+      std::string ip;
+      unsigned short port = 0;
+
+      bool healthy = true;
+      bool draining = false;
+      bool removed = false;
+      unsigned int fails = 0;
+
+      // Sessions relayed now and since the start
+      size_t conns = 0;
+      uint64_t total = 0;
+
+      // The health check in flight, if its socket is open
+      SocketFD check{false};
+      uint64_t check_started = 0;
+      uint64_t next_check = 0;
+      short revents = 0;
+   };
+
+   // A pipe and the bytes in it, spliced in from one socket and out to the other
+   struct Pipe {
+      int rd = -1;
+      int wr = -1;
+      size_t len = 0;
+   };
+
+   struct Direction {
+      Pipe pipe;
+      bool eof = false;
+      bool shut = false;
+   };
+
+   struct Session {
+      SocketFD client{false};
+      SocketFD server{false};
+      Backend *backend = NULL;
+      bool connecting = true;
+      bool failed = false;
+
+      // up: client to backend, down: backend to client
+      Direction up;
+      Direction down;
+
+      short client_rev = 0;
+      short server_rev = 0;
+   };
+
+   void loadBackends();
+   bool parseAddr(const std::string &addr, std::string &ip, unsigned short &port);
+
+   int pollTimeout(uint64_t now);
+   void acceptClients();
+   Backend *pickBackend(const Backend *skip);
+   bool connectBackend(Session &s, const Backend *skip);
+   void serveSession(Session &s);
+   bool pump(int src, int dst, Direction &d);
+   void endSession(size_t idx);
+
+   void checkHealth(uint64_t now);
+   void noteFailure(Backend &b, const char *what);
+   void noteSuccess(Backend &b);
+   void reapBackends();
+
+   bool getPipe(Pipe &p);
+   void putPipe(Pipe &p);
+
+   SocketFD _sockfd;
+   // SIGTERM/SIGINT/SIGHUP arrive here and are handled by the proxy loop
+   std::unique_ptr<SignalFD> _sigfd;
+
+   std::vector<std::unique_ptr<Backend>> _backends;
+   std::vector<std::unique_ptr<Session>> _sessions;
+   std::vector<Pipe> _pipes;
+   std::vector<pollfd> _pollfds;
+
+   // Where the round robin among equally loaded backends starts next
+   size_t _next = 0;
+
+   std::string _backend_file;
+   int _health_ms = default_health_ms;
+   unsigned int _health_fails = default_health_fails;
+   double _drain_secs = default_proxy_drain_secs;
+   unsigned long _max_conns = default_proxy_conns;
+
+   uint64_t _accepted = 0;
+   uint64_t _refused = 0;
+};
+
+#endif
@@ -1,11 +1,43 @@
 #ifndef TCPSERVER_H
 #define TCPSERVER_H
 
-#include <list>
 #include <memory>
+#include <vector>
+#include <poll.h>
 #include "Server.h"
 #include "FileDesc.h"
 #include "TCPConn.h"
+#include "HashScheduler.h"
+#include "RateLimiter.h"
+#include "Handoff.h"
+#include "ConnTable.h"
+#include "ReplLog.h"
+#include "Replicator.h"
+#include "ShardNode.h"
+
+// Per-IP limits unless overridden with setRateLimits: connects per second and failed
+// password attempts per minute. Either may burst to twice its rate.
+const double default_conn_rate = 10.0;
+const double default_login_fail_rate = 6.0;
+
+// Most connections accepted (or shed) per pass of the server loop
+const unsigned int max_accepts_per_loop = 64;
+
+// Seconds a shutdown waits for busy connections (and their hashes) before closing them anyway
+const double default_drain_secs = 10.0;
+
+// Connections served at once unless overridden with setMaxConns. Past this, new ones are
+// closed at accept. Kept under FD_SETSIZE since FileDesc::hasData still uses select.
+const size_t default_max_conns = 1000;
+
+// How often the loop looks for finished hashes while any are in flight, in ms (a hash
+// finishing is not an event on any descriptor)
+const int hash_poll_ms = 5;
+
+// Password hashing limits unless overridden with setHashLimits
+const unsigned int default_hash_threads = 0;       // 0 = one per CPU
+const uint32_t default_hash_mem_mib = 256;
+const unsigned int default_hash_queue = 64;
 
 class TCPServer : public Server 
 {
@@ -17,14 +49,114 @@ public:
    void listenSvr();
    void shutdown();
 
+   // Bounds concurrent password hashing: worker threads, total Argon2 memory and waiting jobs
+   void setHashLimits(unsigned int threads, uint32_t mem_budget_mib, unsigned int max_queue);
+
+   // Token bucket rates per client IP: connects per second and failed logins per minute
+   void setRateLimits(double conn_rate, double login_fail_rate);
+
+   // Size of the connection table. Only call this before listenSvr or takeOver.
+   void setMaxConns(size_t max_conns);
+
+   // Rotate the event log at this size and/or interval; 0 turns either off
+   void setLogRotation(unsigned long max_mib, unsigned int interval_secs) {
+      _log.setRotation((uint64_t) max_mib << 20, interval_secs); };
+
+   // How long a SIGTERM/SIGINT shutdown lets busy connections finish
+   void setDrainTimeout(double secs) { _drain_secs = secs; };
+
+   // The directory logged in users download files from with "get"
+   void setContentDir(const char *dir) { _contentdir = dir; };
+
+   // The directory "put" stores each user's files under, and when they are synced to disk
+   void setUploadDir(const char *dir) { _uploaddir = dir; };
+   void setUploadSync(uploadsync sync, uint64_t sync_bytes) {
+      _upload_sync = sync; _upload_sync_bytes = sync_bytes; };
+
+   // The zlib level clients get when they send "compress"; 0 turns the command off
+   void setCompressLevel(int level) { _zlevel = level; };
+
+   // Hot upgrade: listen on this Unix socket path for a replacement server to hand off to
+   void setHandoffPath(const char *path);
+
+   // Takes the listening socket and idle connections from a server already running on the
+   // handoff path. Returns false if there is none (bind normally then).
+   bool takeOver();
+
+   // Credential replication (see Replicator): as the primary, followers connect to us at
+   // ip_addr:port; as a follower, ip_addr:port is the primary. Started by listenSvr.
+   void setReplication(bool primary, const char *ip_addr, unsigned short port);
+
+   // Partitioned mode (see ShardNode): users are spread over this node, which answers the
+   // others at self ("ip:port"), and the peers. Started by listenSvr.
+   void setSharding(const std::string &self, const std::vector<std::string> &peers);
+
 private:
+   void acceptConnections();
+   void beginShutdown(int sig);
+   void closeAll();
+   void handOff(int sock);
+   int pollTimeout(uint64_t now);
+   void serveConns(bool draining, uint64_t now);
+   void removeConn(ConnHot &hot);
+
+   // SIGTERM/SIGINT arrive here and are handled by the server loop
+   std::unique_ptr<SignalFD> _sigfd;
+
    // Class to manage the server socket
    SocketFD _sockfd;
  
-   // List of TCPConn objects to manage connections
-   std::list<std::unique_ptr<TCPConn>> _connlist;
+   // Session coroutine frames, recycled between this loop's connections
+   CoroPool _coropool;
+
+   // Broadcasts and direct messages queued this pass, sent after serveConns
+   FanOut _fanout;
+
+   // Hot state of every connection; each slot points at (and owns) its TCPConn
+   std::unique_ptr<ConnTable> _conntable;
+
+   // One entry per server descriptor, then one per ConnTable slot, rebuilt each pass
+   std::vector<pollfd> _pollfds;
+
+   // Argon2 parameters new and upgraded password hashes are made with
+   Argon2Profile _profile;
+
+   // The password file in memory, shared by every connection
+   std::unique_ptr<CredIndex> _creds;
+
+   // Keeps _creds the same as on the other servers; before _log and after _creds, so it is
+   // stopped before the index goes
+   std::unique_ptr<ReplLog> _repllog;
+   std::unique_ptr<Replicator> _replicator;
+
+   // Events are queued here and written once per pass of the loop; after _creds so it is
+   // destroyed (and does its last flush) while the names are still there
+   LogMgr _log;
+
+   // Runs login and password change hashes off the event loop, within a memory budget
+   std::unique_ptr<HashScheduler> _hasher;
+
+   // Looks up and verifies users other nodes own; after _hasher, so it is stopped first
+   std::unique_ptr<ShardNode> _shards;
+
+   // Served by "get", and written by "put"
+   std::string _contentdir = default_contentdir;
+   std::string _uploaddir = default_uploaddir;
+   uploadsync _upload_sync = sync_end;
+   uint64_t _upload_sync_bytes = 0;
+
+   // Level "compress" turns on, and the totals over every compressed connection
+   int _zlevel = default_compress_level;
+   CompressStats _zstats;
+
+   // Shed abusive IPs at accept, before any per-connection work is done
+   std::unique_ptr<RateLimiter> _conn_limiter;
+   std::unique_ptr<RateLimiter> _login_limiter;
+   uint64_t _shed = 0;
+
+   double _drain_secs = default_drain_secs;
 
-   std::unique_ptr<TCPConn> _serverLog;
+   std::unique_ptr<Handoff> _handoff;
 
 };
 
@@ -0,0 +1,37 @@
+#ifndef TEXTKERNELS_H
+#define TEXTKERNELS_H
+
+#include <stddef.h>
+
+/****************************************************************************************
+ * TextKernels - The byte scanning loops behind strfuncts and the text protocol's input
+ *               path, with SSE2 and AVX2 versions picked at runtime by what the CPU
+ *               supports. Other CPUs (and builds for other architectures) get the scalar
+ *               versions. The choice is made on the first call; no compiler flags are
+ *               needed since each version is compiled for its own target.
+ *
+ ****************************************************************************************/
+
+namespace textk {
+
+enum impl { scalar, sse2, avx2 };
+
+// The first '\n' in data, or NULL
+const char *findNewline(const char *data, size_t len);
+
+// Removes every '\r' and '\n' in place, lowercasing ASCII letters as well if lower is set.
+// Returns the new length.
+size_t cleanLine(char *data, size_t len, bool lower);
+
+// Lowercases ASCII letters in place; other bytes are left alone
+void lowerASCII(char *data, size_t len);
+
+// The implementation in use, and a way to force one (for benchmarks). select returns false
+// if the CPU can't run it.
+impl active();
+bool select(impl which);
+const char *implName(impl which);
+
+}
+
+#endif
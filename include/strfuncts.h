@@ -9,6 +9,9 @@ bool split(std::string &orig, std::string &left, std::string &right, const char
 // Turns a string into lowercase
 void lower(std::string &str);
 
+// clrNewlines and lower in one pass
+void clrNewlinesLower(std::string &str);
+
 // Turns off local echo from a user's terminal
 int hideInput(int fd, bool hide);
 
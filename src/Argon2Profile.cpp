@@ -0,0 +1,194 @@
+#include <argon2.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fstream>
+#include <stdexcept>
+#include "Argon2Profile.h"
+#include "exceptions.h"
+
+// Never calibrate below these, whatever the hardware
+const uint32_t min_calib_mem_kib = 8192;
+const uint32_t max_calib_t_cost = 64;
+
+// Argon2 version 1.3, the only one we write
+const uint32_t argon2_version = 0x13;
+
+Argon2Profile::Argon2Profile():type(argon2i), t_cost(2), m_cost(1 << 16), parallelism(1) {
+
+}
+
+Argon2Profile::Argon2Profile(variant type, uint32_t t_cost, uint32_t m_cost, uint32_t parallelism):
+                     type(type), t_cost(t_cost), m_cost(m_cost), parallelism(parallelism) {
+
+}
+
+
+Argon2Profile::~Argon2Profile() {
+
+}
+
+bool Argon2Profile::operator==(const Argon2Profile &other) const {
+   return ((type == other.type) && (t_cost == other.t_cost) && (m_cost == other.m_cost) &&
+           (parallelism == other.parallelism));
+}
+
+/*****************************************************************************************
+ * toString - formats the profile as a PHC-style string, e.g. $argon2id$v=19$m=65536,t=2,p=1
+ *
+ *****************************************************************************************/
+
+std::string Argon2Profile::toString() const {
+   char buf[80];
+   snprintf(buf, sizeof(buf), "$%s$v=%u$m=%u,t=%u,p=%u", (type == argon2id) ? "argon2id" : "argon2i",
+            argon2_version, m_cost, t_cost, parallelism);
+   return std::string(buf);
+}
+
+/*****************************************************************************************
+ * fromString - parses a string written by toString
+ *
+ *    Returns: true if the string was a valid profile, false otherwise (profile unchanged)
+ *****************************************************************************************/
+
+bool Argon2Profile::fromString(const std::string &str) {
+   char name[16];
+   unsigned int version, m, t, p;
+
+   if (sscanf(str.c_str(), "$%15[a-z0-9]$v=%u$m=%u,t=%u,p=%u", name, &version, &m, &t, &p) != 5)
+      return false;
+
+   variant v;
+   if (strcmp(name, "argon2i") == 0)
+      v = argon2i;
+   else if (strcmp(name, "argon2id") == 0)
+      v = argon2id;
+   else
+      return false;
+
+   if ((version != argon2_version) || (t < 1) || (p < 1) || (m < 8 * p))
+      return false;
+
+   type = v;
+   m_cost = m;
+   t_cost = t;
+   parallelism = p;
+   return true;
+}
+
+/*****************************************************************************************
+ * load - reads the profile from the first line of filename
+ *
+ *    Returns: true if the file existed and held a valid profile, false otherwise
+ *****************************************************************************************/
+
+bool Argon2Profile::load(const char *filename) {
+   std::ifstream file(filename);
+   std::string line;
+   if (!file || !std::getline(file, line))
+      return false;
+   return fromString(line);
+}
+
+/*****************************************************************************************
+ * save - writes the profile to filename, replacing what was there
+ *
+ *    Throws: pwfile_error if the file could not be written
+ *****************************************************************************************/
+
+void Argon2Profile::save(const char *filename) const {
+   std::ofstream file(filename, std::ios::trunc);
+   if (!file)
+      throw pwfile_error("Could not open Argon2 profile file for writing");
+   file << toString() << "\n";
+   if (!file)
+      throw pwfile_error("Could not write Argon2 profile file");
+}
+
+/*****************************************************************************************
+ * hash - runs the Argon2 variant with these parameters
+ *
+ *    Returns: true if the hash was computed, false if Argon2 failed (normally because the
+ *             memory could not be allocated)
+ *****************************************************************************************/
+
+bool Argon2Profile::hash(const char *pwd, size_t pwdlen, const uint8_t *salt, size_t saltlen,
+                         uint8_t *hash, size_t hashlen) const {
+   int results;
+   if (type == argon2id)
+      results = argon2id_hash_raw(t_cost, m_cost, parallelism, pwd, pwdlen, salt, saltlen, hash, hashlen);
+   else
+      results = argon2i_hash_raw(t_cost, m_cost, parallelism, pwd, pwdlen, salt, saltlen, hash, hashlen);
+
+   return (results == ARGON2_OK);
+}
+
+/*****************************************************************************************
+ * timeHash - wall time in milliseconds of one hash with the given profile, or a huge value
+ *            if it could not be computed
+ *****************************************************************************************/
+
+static double timeHash(const Argon2Profile &profile) {
+   const char pwd[] = "calibration password";
+   uint8_t salt[16] = {0};
+   uint8_t out[32];
+   timespec start, end;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   bool ok = profile.hash(pwd, strlen(pwd), salt, sizeof(salt), out, sizeof(out));
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   if (!ok)
+      return 1e12;
+   return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/*****************************************************************************************
+ * calibrate - finds the strongest argon2id profile that meets the latency target. Memory is
+ *             the main cost, so it starts at the budget with a single pass and halves the
+ *             memory until one pass fits. Any time left over goes to extra passes (hash
+ *             time is linear in t_cost).
+ *
+ *    Params:  target_ms - the longest a single hash may take
+ *             max_mem_kib - memory budget per hash in KiB
+ *             verbose - print each measurement to stdout
+ *
+ *    Returns: the chosen profile
+ *****************************************************************************************/
+
+Argon2Profile Argon2Profile::calibrate(double target_ms, uint32_t max_mem_kib, bool verbose) {
+   Argon2Profile profile(argon2id, 1, max_mem_kib, 1);
+   if (profile.m_cost < min_calib_mem_kib)
+      profile.m_cost = min_calib_mem_kib;
+
+   double ms = timeHash(profile);
+   if (verbose)
+      printf("  %-40s %10.1f ms\n", profile.toString().c_str(), ms);
+
+   while ((ms > target_ms) && (profile.m_cost / 2 >= min_calib_mem_kib)) {
+      profile.m_cost /= 2;
+      ms = timeHash(profile);
+      if (verbose)
+         printf("  %-40s %10.1f ms\n", profile.toString().c_str(), ms);
+   }
+
+   if (ms >= target_ms)
+      return profile;
+
+   // Spend the remaining budget on passes, stepping back if the estimate was optimistic
+   uint32_t passes = (uint32_t) (target_ms / ms);
+   if (passes > max_calib_t_cost)
+      passes = max_calib_t_cost;
+
+   while (passes > 1) {
+      Argon2Profile candidate = profile;
+      candidate.t_cost = passes;
+      double cand_ms = timeHash(candidate);
+      if (verbose)
+         printf("  %-40s %10.1f ms\n", candidate.toString().c_str(), cand_ms);
+      if (cand_ms <= target_ms)
+         return candidate;
+      passes--;
+   }
+   return profile;
+}
@@ -0,0 +1,137 @@
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "BenchRunner.h"
+
+// Never run a single benchmark more times than this, no matter how fast it is
+const uint64_t max_iterations = 1000000000ULL;
+
+BenchRunner::BenchRunner(double min_time):_min_time(min_time) {
+
+}
+
+
+BenchRunner::~BenchRunner() {
+
+}
+
+uint64_t BenchRunner::nowNS() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t BenchRunner::cpuNS() {
+   timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool BenchRunner::matches(const std::string &name) const {
+   return (_filter.empty() || (name.find(_filter) != std::string::npos));
+}
+
+/*****************************************************************************************
+ * run - calls the benchmark body with an increasing iteration count until a run takes at
+ *       least min_time, then records the per-iteration times of that final run
+ *
+ *    Params:  name - benchmark name, in the Family/arg1/arg2 form
+ *             fn - the body to time
+ *             bytes_per_iter - bytes processed by one iteration, for throughput reporting
+ *****************************************************************************************/
+
+void BenchRunner::run(const std::string &name, BenchFunc fn, uint64_t bytes_per_iter) {
+   if (!matches(name))
+      return;
+
+   double target_ns = _min_time * 1e9;
+   uint64_t iters = 1;
+
+   while (true) {
+      uint64_t real_start = nowNS();
+      uint64_t cpu_start = cpuNS();
+
+      fn(iters);
+
+      double real = (double) (nowNS() - real_start);
+      double cpu = (double) (cpuNS() - cpu_start);
+
+      if ((real >= target_ns) || (iters >= max_iterations)) {
+         BenchResult result;
+         result.name = name;
+         result.iterations = iters;
+         result.real_ns = real / iters;
+         result.cpu_ns = cpu / iters;
+         result.bytes_per_iter = bytes_per_iter;
+         addResult(result);
+         return;
+      }
+
+      // Aim a little past the target so we usually only need one more run
+      double mult = 10.0;
+      if (real > target_ns / 10.0)
+         mult = (target_ns * 1.4) / real;
+
+      uint64_t next = (uint64_t) (iters * mult);
+      iters = std::min(std::max(next, iters + 1), max_iterations);
+   }
+}
+
+void BenchRunner::addResult(BenchResult &result) {
+   _results.push_back(result);
+   printResult(result);
+}
+
+void BenchRunner::printResult(BenchResult &result) {
+   fprintf(stderr, "%-44s %14.1f ns %14.1f ns %12lu", result.name.c_str(), result.real_ns,
+           result.cpu_ns, (unsigned long) result.iterations);
+   if ((result.bytes_per_iter > 0) && (result.real_ns > 0.0))
+      fprintf(stderr, " %10.2f MB/s", (result.bytes_per_iter * 1e3) / result.real_ns);
+   for (auto &counter : result.counters)
+      fprintf(stderr, " %s=%.3f", counter.first.c_str(), counter.second);
+   fprintf(stderr, "\n");
+}
+
+/*****************************************************************************************
+ * writeJSON - writes all results in the Google Benchmark JSON layout
+ *
+ *    Params:  out - an open file to write to
+ *             executable - program name for the context block
+ *****************************************************************************************/
+
+void BenchRunner::writeJSON(FILE *out, const char *executable) {
+   char hostname[256] = "";
+   gethostname(hostname, sizeof(hostname) - 1);
+
+   char date[64];
+   time_t now = time(NULL);
+   strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+   fprintf(out, "{\n  \"context\": {\n");
+   fprintf(out, "    \"date\": \"%s\",\n", date);
+   fprintf(out, "    \"host_name\": \"%s\",\n", hostname);
+   fprintf(out, "    \"executable\": \"%s\",\n", executable);
+   fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+   fprintf(out, "    \"min_time\": %.3f\n", _min_time);
+   fprintf(out, "  },\n  \"benchmarks\": [\n");
+
+   for (unsigned int i = 0; i < _results.size(); i++) {
+      BenchResult &r = _results[i];
+      fprintf(out, "    {\n");
+      fprintf(out, "      \"name\": \"%s\",\n", r.name.c_str());
+      fprintf(out, "      \"run_name\": \"%s\",\n", r.name.c_str());
+      fprintf(out, "      \"run_type\": \"iteration\",\n");
+      fprintf(out, "      \"iterations\": %lu,\n", (unsigned long) r.iterations);
+      fprintf(out, "      \"real_time\": %.3f,\n", r.real_ns);
+      fprintf(out, "      \"cpu_time\": %.3f,\n", r.cpu_ns);
+      if ((r.bytes_per_iter > 0) && (r.real_ns > 0.0))
+         fprintf(out, "      \"bytes_per_second\": %.1f,\n", (r.bytes_per_iter * 1e9) / r.real_ns);
+      for (auto &counter : r.counters)
+         fprintf(out, "      \"%s\": %.3f,\n", counter.first.c_str(), counter.second);
+      fprintf(out, "      \"time_unit\": \"ns\"\n");
+      fprintf(out, "    }%s\n", (i + 1 < _results.size()) ? "," : "");
+   }
+
+   fprintf(out, "  ]\n}\n");
+   fflush(out);
+}
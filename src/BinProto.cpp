@@ -0,0 +1,62 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "BinProto.h"
+
+namespace binproto {
+
+/*****************************************************************************************
+ * parseHeader - decodes a frame header in place, without copying the buffer
+ *
+ *    Params:  data, len - the received bytes, starting at a frame boundary
+ *             hdr - filled in with the decoded header
+ *
+ *    Returns: true if a whole header was available, false if more data is needed
+ *****************************************************************************************/
+
+bool parseHeader(const char *data, size_t len, FrameHeader &hdr) {
+   if (len < header_size)
+      return false;
+
+   uint32_t reqid, length;
+   memcpy(&reqid, data + 4, sizeof(reqid));
+   memcpy(&length, data + 8, sizeof(length));
+
+   hdr.opcode = (uint8_t) data[0];
+   hdr.status = (uint8_t) data[1];
+   hdr.reqid = ntohl(reqid);
+   hdr.length = ntohl(length);
+   return true;
+}
+
+/*****************************************************************************************
+ * writeHeader - encodes a header into header_size bytes at out
+ *
+ *****************************************************************************************/
+
+void writeHeader(char *out, uint8_t opcode, uint8_t status, uint32_t reqid, uint32_t length) {
+   uint32_t n_reqid = htonl(reqid);
+   uint32_t n_length = htonl(length);
+
+   out[0] = (char) opcode;
+   out[1] = (char) status;
+   out[2] = out[3] = 0;
+   memcpy(out + 4, &n_reqid, sizeof(n_reqid));
+   memcpy(out + 8, &n_length, sizeof(n_length));
+}
+
+/*****************************************************************************************
+ * appendFrame - encodes a header and its payload onto the end of an output buffer
+ *
+ *****************************************************************************************/
+
+void appendFrame(std::string &out, uint8_t opcode, uint8_t status, uint32_t reqid,
+                 const char *payload, uint32_t length) {
+   char hdr[header_size];
+   writeHeader(hdr, opcode, status, reqid, length);
+
+   out.append(hdr, header_size);
+   if (length > 0)
+      out.append(payload, length);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include <time.h>
+#include <algorithm>
+#include <functional>
+#include "ConnTable.h"
+
+ConnTable::ConnTable(size_t capacity):_capacity(capacity) {
+   // C++17 new[] honors the cache line alignment of ConnHot
+   _slots = std::make_unique<ConnHot[]>(capacity);
+}
+
+
+ConnTable::~ConnTable() {
+
+}
+
+/*****************************************************************************************
+ * claim - takes the lowest free slot for a connection and resets it
+ *
+ *    Returns: the slot, or NULL if every slot is in use
+ *****************************************************************************************/
+
+ConnHot *ConnTable::claim(TCPConn *conn) {
+   size_t i;
+   if (!_free.empty()) {
+      // _free is a min-heap
+      std::pop_heap(_free.begin(), _free.end(), std::greater<uint32_t>());
+      i = _free.back();
+      _free.pop_back();
+   } else if (_limit < _capacity) {
+      i = _limit++;
+   } else {
+      return NULL;
+   }
+
+   _slots[i] = ConnHot();
+   _slots[i].conn = conn;
+   _used++;
+   return &_slots[i];
+}
+
+/*****************************************************************************************
+ * release - frees a slot. Freeing the top slot shrinks the range the server loop walks.
+ *
+ *****************************************************************************************/
+
+void ConnTable::release(ConnHot *slot) {
+   size_t i = slot - _slots.get();
+   _slots[i].conn = NULL;
+   _slots[i].fd = -1;
+   _used--;
+
+   if (i + 1 < _limit) {
+      _free.push_back((uint32_t) i);
+      std::push_heap(_free.begin(), _free.end(), std::greater<uint32_t>());
+      return;
+   }
+
+   // Drop the top slot and any free ones right below it
+   _limit = i;
+   while ((_limit > 0) && (_slots[_limit - 1].conn == NULL))
+      _limit--;
+   _free.erase(std::remove_if(_free.begin(), _free.end(), [this](uint32_t f) { return f >= _limit; }),
+               _free.end());
+   std::make_heap(_free.begin(), _free.end(), std::greater<uint32_t>());
+}
+
+uint64_t ConnTable::nowMS() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
@@ -0,0 +1,53 @@
+#include <new>
+#include "CoroPool.h"
+
+CoroPool::CoroPool() {
+
+}
+
+
+CoroPool::~CoroPool() {
+   for (auto &list : _free) {
+      for (void *frame : list)
+         ::operator delete(frame);
+   }
+}
+
+CoroPool &CoroPool::local() {
+   thread_local CoroPool pool;
+   return pool;
+}
+
+/*****************************************************************************************
+ * allocate - hands out a frame of at least size bytes, reusing a freed one if there is one
+ *
+ *    Throws: bad_alloc if the heap is out of memory
+ *****************************************************************************************/
+
+void *CoroPool::allocate(size_t size) {
+   _allocs++;
+   if (size > max_pooled)
+      return ::operator new(size);
+
+   size_t idx = (size + granule - 1) / granule - 1;
+   if (!_free[idx].empty()) {
+      void *frame = _free[idx].back();
+      _free[idx].pop_back();
+      _reuses++;
+      return frame;
+   }
+   return ::operator new((idx + 1) * granule);
+}
+
+/*****************************************************************************************
+ * deallocate - takes back a frame; size must be what it was allocated with
+ *
+ *****************************************************************************************/
+
+void CoroPool::deallocate(void *ptr, size_t size) {
+   if (size > max_pooled) {
+      ::operator delete(ptr);
+      return;
+   }
+   _free[(size + granule - 1) / granule - 1].push_back(ptr);
+}
@@ -0,0 +1,404 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "CredIndex.h"
+#include "Epoch.h"
+#include "Replicator.h"
+#include "exceptions.h"
+
+CredIndex::CredIndex(const char *pwd_file):_mgr(pwd_file) {
+   Snapshot *snap = new Snapshot;
+   snap->ids = std::make_shared<const IdMap>();
+   _snap.store(snap);
+}
+
+
+CredIndex::~CredIndex() {
+   // Nobody can be reading any more; older versions are already with the Epoch
+   delete _snap.load();
+}
+
+/*****************************************************************************************
+ * find - looks up a username without copying it
+ *
+ *    Returns: the user's ID, or no_user if they are not in the password file
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+userid CredIndex::find(std::string_view name) {
+   Epoch::Reader reading;
+   const Snapshot *snap = refresh();
+
+   auto it = snap->ids->find(name);
+   if ((it == snap->ids->end()) || !snap->creds[it->second])
+      return no_user;
+   return it->second;
+}
+
+/*****************************************************************************************
+ * lookup - like find, but also returns names that are interned without a credential: users
+ *          removed from the file, and users interned by internRemote
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+userid CredIndex::lookup(std::string_view name) {
+   Epoch::Reader reading;
+   const Snapshot *snap = refresh();
+
+   auto it = snap->ids->find(name);
+   return (it == snap->ids->end()) ? no_user : it->second;
+}
+
+/*****************************************************************************************
+ * internRemote - gives a name with no credential here an ID. Only the first time a name is
+ *                seen publishes a new snapshot.
+ *
+ *    Throws: pwfile_error if the index is full
+ *****************************************************************************************/
+
+userid CredIndex::internRemote(std::string_view name) {
+   {
+      Epoch::Reader reading;
+      const Snapshot *snap = current();
+      auto it = snap->ids->find(name);
+      if (it != snap->ids->end())
+         return it->second;
+   }
+
+   std::lock_guard<std::mutex> lock(_write_lock);
+   const Snapshot *snap = current();
+   std::shared_ptr<IdMap> newids;
+   const IdMap *ids = snap->ids.get();
+   userid id = idOf(std::string(name), ids, newids);
+   if (!newids)
+      return id;
+
+   Snapshot *next = new Snapshot(*snap);
+   next->ids = std::move(newids);
+   next->creds.resize(size());
+   publish(next);
+   return id;
+}
+
+const std::string &CredIndex::getName(userid id) const {
+   static const std::string none;
+   if (id >= size())
+      return none;
+   return nameAt(id);
+}
+
+/*****************************************************************************************
+ * getCred - copies a user's hash, salt and profile
+ *
+ *    Returns: false if the user is no longer in the password file
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+bool CredIndex::getCred(userid id, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                        Argon2Profile &profile) {
+   Epoch::Reader reading;
+   const Snapshot *snap = refresh();
+
+   if ((id >= snap->creds.size()) || !snap->creds[id])
+      return false;
+
+   const Cred &cred = *snap->creds[id];
+   hash = cred.hash;
+   salt = cred.salt;
+   profile = cred.profile;
+   return true;
+}
+
+/*****************************************************************************************
+ * replace - writes a user's new credential to the password file, then publishes it
+ *
+ *    Returns: false if the user is no longer in the password file
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten
+ *****************************************************************************************/
+
+bool CredIndex::replace(userid id, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                        const Argon2Profile &profile) {
+   std::lock_guard<std::mutex> lock(_write_lock);
+
+   // Writers hold the lock, so the current snapshot can't be retired under us
+   const Snapshot *snap = current();
+   if (id >= snap->creds.size())
+      return false;
+
+   Snapshot *next = new Snapshot(*snap);
+   bool replaced = _mgr.replaceUser(nameAt(id).c_str(), hash, salt, profile);
+   if (replaced) {
+      next->creds[id] = std::make_shared<const Cred>(Cred{hash, salt, profile});
+
+      // Our own rewrite doesn't need a reload, pick up the new file's identity
+      struct stat st;
+      if (stat(_mgr.getFilename().c_str(), &st) == 0)
+         next->setFile(st);
+   } else
+      next->creds[id] = nullptr;
+
+   publish(next);
+
+   if (replaced && (_repl != nullptr)) {
+      PasswdChange change;
+      change.rec = {nameAt(id), hash, salt, profile};
+      _repl->changed(change, Replicator::s_local);
+   }
+   return replaced;
+}
+
+/*****************************************************************************************
+ * apply - writes changes received through replication to the password file in one
+ *         rewrite, then publishes them, adding users the index hasn't seen
+ *
+ *    Throws: pwfile_error if the password file could not be read or rewritten
+ *****************************************************************************************/
+
+void CredIndex::apply(const std::vector<PasswdChange> &changes) {
+   std::lock_guard<std::mutex> lock(_write_lock);
+
+   // Pick up (and report) edits to the file first, so the new identity below doesn't hide them
+   struct stat st;
+   if (stat(_mgr.getFilename().c_str(), &st) != 0)
+      throw pwfile_error("Could not open passwd file for reading");
+   if (!current()->sameFile(st))
+      load(st);
+
+   _mgr.updateUsers(changes);
+
+   const Snapshot *snap = current();
+   Snapshot *next = new Snapshot(*snap);
+   std::shared_ptr<IdMap> newids;
+   const IdMap *ids = snap->ids.get();
+
+   for (const PasswdChange &change : changes) {
+      if (change.removed) {
+         auto it = ids->find(change.rec.name);
+         if ((it != ids->end()) && (it->second < next->creds.size()))
+            next->creds[it->second] = nullptr;
+         continue;
+      }
+
+      userid id = idOf(change.rec.name, ids, newids);
+      if (next->creds.size() <= id)
+         next->creds.resize(size());
+      next->creds[id] = std::make_shared<const Cred>(Cred{change.rec.hash, change.rec.salt, change.rec.profile});
+   }
+   next->creds.resize(size());
+   if (newids)
+      next->ids = std::move(newids);
+
+   if (stat(_mgr.getFilename().c_str(), &st) == 0)
+      next->setFile(st);
+   publish(next);
+
+   if (_repl != nullptr) {
+      for (const PasswdChange &change : changes)
+         _repl->changed(change, Replicator::s_remote);
+   }
+}
+
+/*****************************************************************************************
+ * setReplicator - attaches a Replicator, after loading the file if it hasn't been yet
+ *                 (that first load is not reported as changes), and hands it the current
+ *                 credentials. NULL detaches it.
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+void CredIndex::setReplicator(Replicator *repl) {
+   std::lock_guard<std::mutex> lock(_write_lock);
+
+   _repl = nullptr;
+   if (repl == nullptr)
+      return;
+
+   struct stat st;
+   if (stat(_mgr.getFilename().c_str(), &st) != 0)
+      throw pwfile_error("Could not open passwd file for reading");
+   if (!current()->sameFile(st))
+      load(st);
+
+   const Snapshot *snap = current();
+   std::vector<PasswdRecord> records;
+   for (userid id = 0; id < snap->creds.size(); id++) {
+      if (snap->creds[id])
+         records.push_back({nameAt(id), snap->creds[id]->hash, snap->creds[id]->salt, snap->creds[id]->profile});
+   }
+
+   _repl = repl;
+   repl->attached(records);
+}
+
+/*****************************************************************************************
+ * refresh - reloads the index if the password file was replaced or modified since it was
+ *           last loaded. One stat when nothing changed. Must be called inside a read
+ *           section.
+ *
+ *    Returns: the snapshot to read from
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+const CredIndex::Snapshot *CredIndex::refresh() {
+   struct stat st;
+   if (stat(_mgr.getFilename().c_str(), &st) != 0)
+      throw pwfile_error("Could not open passwd file for reading");
+
+   const Snapshot *snap = current();
+   if (snap->sameFile(st))
+      return snap;
+
+   reload(st);
+   return current();
+}
+
+/*****************************************************************************************
+ * reload - loads the password file into a new snapshot, unless another thread already
+ *          has. Names already interned keep their IDs; users no longer in the file are only
+ *          marked absent.
+ *
+ *    Params:  st - the file's identity, taken before reading it, so a change made while
+ *                  we read is seen on the next lookup
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+void CredIndex::reload(const struct stat &st) {
+   std::lock_guard<std::mutex> lock(_write_lock);
+
+   // Another thread may have got here first
+   if (!current()->sameFile(st))
+      load(st);
+}
+
+/*****************************************************************************************
+ * load - reads the password file into a new snapshot and publishes it, reporting what
+ *        changed since the last load to the Replicator. Called with the write lock held.
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+void CredIndex::load(const struct stat &st) {
+   std::vector<PasswdRecord> records;
+   _mgr.readAll(records);
+
+   // The name map is shared with the old snapshot unless someone new shows up
+   const Snapshot *snap = current();
+   std::shared_ptr<IdMap> newids;
+   const IdMap *ids = snap->ids.get();
+   std::vector<std::shared_ptr<const Cred>> creds;
+
+   for (PasswdRecord &rec : records) {
+      userid id = idOf(rec.name, ids, newids);
+      if (creds.size() <= id)
+         creds.resize(size());
+      creds[id] = std::make_shared<const Cred>(Cred{std::move(rec.hash), std::move(rec.salt), rec.profile});
+   }
+   creds.resize(size());
+
+   Snapshot *next = new Snapshot;
+   if (newids)
+      next->ids = std::move(newids);
+   else
+      next->ids = snap->ids;
+   next->creds = std::move(creds);
+   next->setFile(st);
+
+   // The first load is where we start from, not a change
+   if ((_repl != nullptr) && snap->loaded)
+      reportReload(*snap, *next);
+   publish(next);
+}
+
+/*****************************************************************************************
+ * reportReload - tells the Replicator about every user added, changed or removed between
+ *                two loads of the file
+ *
+ *****************************************************************************************/
+
+void CredIndex::reportReload(const Snapshot &was, const Snapshot &now) {
+   for (userid id = 0; id < now.creds.size(); id++) {
+      const Cred *before = (id < was.creds.size()) ? was.creds[id].get() : nullptr;
+      const Cred *after = now.creds[id].get();
+      if (before == after)
+         continue;
+      if ((before != nullptr) && (after != nullptr) && (before->hash == after->hash) &&
+          (before->salt == after->salt) && (before->profile == after->profile))
+         continue;
+
+      PasswdChange change;
+      change.rec.name = nameAt(id);
+      change.removed = (after == nullptr);
+      if (after != nullptr) {
+         change.rec.hash = after->hash;
+         change.rec.salt = after->salt;
+         change.rec.profile = after->profile;
+      }
+      _repl->changed(change, Replicator::s_file);
+   }
+}
+
+/*****************************************************************************************
+ * publish - makes snap the current snapshot and retires the one it replaces. Called with
+ *           the write lock held.
+ *
+ *****************************************************************************************/
+
+void CredIndex::publish(Snapshot *snap) {
+   const Snapshot *old = _snap.exchange(snap, std::memory_order_seq_cst);
+   Epoch::global().retire(old);
+}
+
+/*****************************************************************************************
+ * idOf - the ID of a name, interning it if it is new. The first new name copies the map
+ *        into newids; ids is pointed at whichever map is current.
+ *
+ *****************************************************************************************/
+
+userid CredIndex::idOf(const std::string &name, const IdMap *&ids, std::shared_ptr<IdMap> &newids) {
+   auto it = ids->find(name);
+   if (it != ids->end())
+      return it->second;
+
+   if (!newids) {
+      newids = std::make_shared<IdMap>(*ids);
+      ids = newids.get();
+   }
+   userid id = intern(name);
+   newids->emplace(std::string_view(nameAt(id)), id);
+   return id;
+}
+
+/*****************************************************************************************
+ * intern - gives a new name the next ID. Called with the write lock held.
+ *
+ *    Throws: pwfile_error if the index is full
+ *****************************************************************************************/
+
+userid CredIndex::intern(const std::string &name) {
+   size_t id = _name_count.load(std::memory_order_relaxed);
+   if (id >= name_chunk * max_chunks)
+      throw pwfile_error("Too many users in passwd file");
+
+   if (id % name_chunk == 0)
+      _names[id / name_chunk] = std::make_unique<std::string[]>(name_chunk);
+   _names[id / name_chunk][id % name_chunk] = name;
+   _name_count.store(id + 1, std::memory_order_release);
+   return (userid) id;
+}
+
+bool CredIndex::Snapshot::sameFile(const struct stat &st) const {
+   return loaded && (st.st_ino == ino) && (st.st_size == size) &&
+          (st.st_mtim.tv_sec == mtime.tv_sec) && (st.st_mtim.tv_nsec == mtime.tv_nsec);
+}
+
+void CredIndex::Snapshot::setFile(const struct stat &st) {
+   loaded = true;
+   ino = st.st_ino;
+   size = st.st_size;
+   mtime = st.st_mtim;
+}
@@ -0,0 +1,135 @@
+#include <stdexcept>
+#include "Epoch.h"
+
+namespace {
+
+// The calling thread's slot, handed back when the thread exits
+struct LocalSlot {
+   std::atomic<bool> *used = nullptr;
+   void *slot = nullptr;
+
+   ~LocalSlot() {
+      if (used != nullptr)
+         used->store(false, std::memory_order_release);
+   };
+};
+
+thread_local LocalSlot local_slot;
+
+}
+
+Epoch::Epoch() {
+
+}
+
+
+Epoch::~Epoch() {
+   for (Retired &r : _retired)
+      r.deleter(r.obj);
+}
+
+Epoch &Epoch::global() {
+   static Epoch domain;
+   return domain;
+}
+
+/*****************************************************************************************
+ * enter - starts a read section on the calling thread's slot. The slot is published
+ *         before the caller loads anything, so a writer that retires what it loads will
+ *         see the slot and wait.
+ *
+ *    Returns: the slot, for the Reader to leave through
+ *
+ *    Throws: runtime_error if more than max_readers threads are reading at once
+ *****************************************************************************************/
+
+Epoch::Slot *Epoch::enter() {
+   Slot *slot = static_cast<Slot *>(local_slot.slot);
+   if (slot == nullptr)
+      slot = attach();
+
+   if (slot->depth++ == 0)
+      slot->epoch.store(_epoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+   return slot;
+}
+
+Epoch::Slot *Epoch::attach() {
+   for (Slot &slot : _slots) {
+      bool expected = false;
+      if (!slot.used.load(std::memory_order_relaxed) &&
+          slot.used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+         slot.depth = 0;
+         local_slot.used = &slot.used;
+         local_slot.slot = &slot;
+         return &slot;
+      }
+   }
+   throw std::runtime_error("Too many threads reading through Epoch");
+}
+
+/*****************************************************************************************
+ * retire - queues obj to be freed once the readers that might hold it are done, then frees
+ *          whatever is already safe
+ *
+ *****************************************************************************************/
+
+void Epoch::retire(void *obj, void (*deleter)(void *)) {
+   std::vector<Retired> freeing;
+   {
+      std::lock_guard<std::mutex> lock(_lock);
+
+      // Readers entering from here on see the new epoch, and so the new version
+      uint64_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst);
+      _retired.push_back({obj, deleter, epoch});
+      _retired_count++;
+      collect(freeing);
+   }
+
+   // Deleters run without the lock, since they might retire something themselves
+   for (Retired &r : freeing)
+      r.deleter(r.obj);
+}
+
+/*****************************************************************************************
+ * reclaim - frees whatever no reader can still see, without retiring anything
+ *
+ *    Returns: the number of objects freed
+ *****************************************************************************************/
+
+size_t Epoch::reclaim() {
+   std::vector<Retired> freeing;
+   {
+      std::lock_guard<std::mutex> lock(_lock);
+      collect(freeing);
+   }
+
+   for (Retired &r : freeing)
+      r.deleter(r.obj);
+   return freeing.size();
+}
+
+/*****************************************************************************************
+ * collect - moves everything retired before the oldest active reader entered (which no
+ *           reader can see any more) from the retired list to freeing. Called with the
+ *           lock held.
+ *
+ *****************************************************************************************/
+
+void Epoch::collect(std::vector<Retired> &freeing) {
+   uint64_t oldest = UINT64_MAX;
+   for (Slot &slot : _slots) {
+      uint64_t entered = slot.epoch.load(std::memory_order_seq_cst);
+      if ((entered != 0) && (entered < oldest))
+         oldest = entered;
+   }
+
+   size_t kept = 0;
+   for (Retired &r : _retired) {
+      if (r.epoch < oldest)
+         freeing.push_back(r);
+      else
+         _retired[kept++] = r;
+   }
+   _retired.resize(kept);
+   _freed_count += freeing.size();
+}
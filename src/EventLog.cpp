@@ -0,0 +1,242 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "EventLog.h"
+
+namespace evlog {
+
+static const char *event_names[num_events] = {"serverStart", "newConn_NOT_WL", "newConn_ON_WL",
+   "usrName_NOT_recog", "paswd_failed_twice", "succ_login", "discon", "paswd_rate_limited", "serverStop"};
+
+const char *eventName(uint8_t ev) {
+   if (ev >= num_events)
+      return "unknown";
+   return event_names[ev];
+}
+
+bool eventFromName(const std::string &name, uint8_t &ev) {
+   for (uint8_t i = 0; i < num_events; i++) {
+      if (name == event_names[i]) {
+         ev = i;
+         return true;
+      }
+   }
+   return false;
+}
+
+size_t putVarint(char *out, uint64_t v) {
+   size_t len = 0;
+   while (v >= 0x80) {
+      out[len++] = (char) ((v & 0x7f) | 0x80);
+      v >>= 7;
+   }
+   out[len++] = (char) v;
+   return len;
+}
+
+bool getVarint(const char *&p, const char *end, uint64_t &v) {
+   v = 0;
+   for (unsigned int shift = 0; (p < end) && (shift < 64); shift += 7) {
+      uint8_t byte = (uint8_t) *p++;
+      v |= (uint64_t) (byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+         return true;
+   }
+   return false;
+}
+
+void appendFileHeader(std::string &out) {
+   out.append(magic, sizeof(magic));
+   out += (char) version;
+   out.append(3, '\0');
+}
+
+bool checkFileHeader(const char *data, size_t len) {
+   return (len >= file_header_size) && (memcmp(data, magic, sizeof(magic)) == 0) &&
+          ((uint8_t) data[4] == version);
+}
+
+/*****************************************************************************************
+ * next - decodes one record. Batch and user records only update the decoder's state.
+ *
+ *    Params:  p, end - the bytes read so far, p at a record boundary
+ *             ev - filled in when an event was decoded
+ *
+ *    Returns: d_event for an event, d_meta for a record with nothing to show, d_more if the
+ *             record is not all there yet (p is left alone), d_bad if it was malformed or
+ *             came before any batch record (it is skipped)
+ *****************************************************************************************/
+
+Decoder::result Decoder::next(const char *&p, const char *end, Event &ev) {
+   if ((size_t) (end - p) < record_header_size)
+      return d_more;
+
+   uint8_t type = (uint8_t) p[0];
+   size_t len = (uint8_t) p[1];
+   if ((size_t) (end - p) < record_header_size + len)
+      return d_more;
+
+   const char *body = p + record_header_size;
+   const char *body_end = body + len;
+   p = body_end;
+
+   uint64_t a, b, c;
+   if (type == rec_batch) {
+      if (!getVarint(body, body_end, a) || !getVarint(body, body_end, b) || !getVarint(body, body_end, c))
+         return d_bad;
+      _pid = (uint32_t) a;
+      _mono_base = b;
+      _wall_base = c;
+      _in_batch = true;
+      return d_meta;
+   }
+
+   if (!_in_batch)
+      return d_bad;
+
+   if (type == rec_user) {
+      if (!getVarint(body, body_end, a))
+         return d_bad;
+      _names[((uint64_t) _pid << 32) | (uint32_t) a].assign(body, body_end - body);
+      return d_meta;
+   }
+
+   if (type >= num_events)
+      return d_meta;
+
+   uint64_t ipaddr, port, user;
+   if (!getVarint(body, body_end, a) || !getVarint(body, body_end, b) || !getVarint(body, body_end, ipaddr) ||
+       !getVarint(body, body_end, port) || !getVarint(body, body_end, user))
+      return d_bad;
+
+   ev.type = type;
+   ev.pid = _pid;
+   ev.mono_ns = _mono_base + a;
+   ev.wall_ns = _wall_base + unzigzag(b);
+   ev.ipaddr = htonl((uint32_t) ipaddr);
+   ev.port = (uint16_t) port;
+
+   if (user != 0) {
+      auto it = _names.find(((uint64_t) _pid << 32) | (uint32_t) (user - 1));
+      ev.has_user = true;
+      if (it != _names.end())
+         ev.user = it->second;
+      else
+         ev.user = "#" + std::to_string(user - 1);
+   } else {
+      ev.has_user = (body != body_end);
+      ev.user.assign(body, body_end - body);
+   }
+   return d_event;
+}
+
+/*****************************************************************************************
+ * renderText - formats an event the way the server wrote server.log before the log went
+ *              binary, so existing scripts reading it keep working
+ *
+ *****************************************************************************************/
+
+void renderText(const Event &ev, std::string &out) {
+   char ipstr[INET_ADDRSTRLEN] = "";
+   inet_ntop(AF_INET, &ev.ipaddr, ipstr, sizeof(ipstr));
+
+   switch (ev.type) {
+      case serverStart:
+         out += "Server started, ";
+         break;
+
+      case serverStop:
+         out += "Server shut down, ";
+         break;
+
+      case newConn_NOT_WL:
+         out += "IP address \"";
+         out += ipstr;
+         out += "\" NOT on whitelist attempted to connect,";
+         break;
+
+      case newConn_ON_WL:
+         out += "IP address \"";
+         out += ipstr;
+         out += "\" on whitelist connected,";
+         break;
+
+      case usrName_NOT_recog:
+         out += "Username \"" + ev.user + "\" NOT recognized, IP: \"";
+         out += ipstr;
+         out += ",\"";
+         break;
+
+      case paswd_failed_twice:
+         out += "Username \"" + ev.user + "\" failed to password twice, IP: \"";
+         out += ipstr;
+         out += "\"";
+         break;
+
+      case succ_login:
+         out += "Username \"" + ev.user + "\" succesful login, IP: \"";
+         out += ipstr;
+         out += "\"";
+         break;
+
+      case discon:
+         out += "Username \"" + ev.user + "\" disconnected, IP: \"";
+         out += ipstr;
+         out += "\"";
+         break;
+
+      case paswd_rate_limited:
+         out += "Username \"" + ev.user + "\" refused, too many failed logins, IP: \"";
+         out += ipstr;
+         out += "\"";
+         break;
+
+      default:
+         break;
+   }
+
+   char timestr[32];
+   time_t secs = (time_t) (ev.wall_ns / 1000000000ULL);
+   ctime_r(&secs, timestr);
+   out += " ";
+   out += timestr;
+}
+
+// Names come from clients, so anything may be in them
+static void appendJSONString(std::string &out, const std::string &str) {
+   out += '"';
+   for (unsigned char c : str) {
+      if ((c == '"') || (c == '\\')) {
+         out += '\\';
+         out += (char) c;
+      } else if (c < 0x20) {
+         char esc[8];
+         snprintf(esc, sizeof(esc), "\\u%04x", c);
+         out += esc;
+      } else {
+         out += (char) c;
+      }
+   }
+   out += '"';
+}
+
+void renderJSON(const Event &ev, std::string &out) {
+   char ipstr[INET_ADDRSTRLEN] = "";
+   inet_ntop(AF_INET, &ev.ipaddr, ipstr, sizeof(ipstr));
+
+   out += "{\"wall_ns\":" + std::to_string(ev.wall_ns) + ",\"mono_ns\":" + std::to_string(ev.mono_ns);
+   out += ",\"pid\":" + std::to_string(ev.pid) + ",\"event\":\"" + eventName(ev.type) + "\"";
+   if ((ev.type != serverStart) && (ev.type != serverStop)) {
+      out += ",\"ip\":\"";
+      out += ipstr;
+      out += "\",\"port\":" + std::to_string(ev.port);
+   }
+   if (ev.has_user) {
+      out += ",\"user\":";
+      appendJSONString(out, ev.user);
+   }
+   out += "}\n";
+}
+
+}
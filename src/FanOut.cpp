@@ -0,0 +1,153 @@
+#include <string.h>
+#include <new>
+#include "FanOut.h"
+#include "ConnTable.h"
+#include "TCPConn.h"
+#include "BinProto.h"
+
+/*****************************************************************************************
+ * create - allocates a block for len bytes, with the header in front of them
+ *
+ *    Throws: bad_alloc if the heap is out of memory
+ *****************************************************************************************/
+
+MsgBuf *MsgBuf::create(size_t len) {
+   void *mem = ::operator new(sizeof(MsgBuf) + len);
+   return new (mem) MsgBuf(len);
+}
+
+MsgBuf *MsgBuf::copyOf(const char *data, size_t len) {
+   MsgBuf *buf = create(len);
+   memcpy(buf->data(), data, len);
+   return buf;
+}
+
+FanOut::FanOut() {
+
+}
+
+FanOut::~FanOut() {
+
+}
+
+/*****************************************************************************************
+ * broadcast - queues text from sender to every other logged-in session
+ *
+ *    Returns: the number of sessions it was queued to
+ *****************************************************************************************/
+
+size_t FanOut::broadcast(ConnTable &table, TCPConn &sender, std::string_view text) {
+   size_t textlen;
+   MsgRef msg = build(binproto::op_broadcast, "broadcast from", sender.getUsernameStr(), text, textlen);
+
+   size_t sent = 0;
+   for (size_t i = 0; i < table.limit(); i++) {
+      ConnHot &hot = table[i];
+      if ((hot.user == 0) || (hot.fd == -1) || (hot.conn == &sender))
+         continue;
+      deliver(hot, msg, textlen);
+      sent++;
+   }
+   _messages++;
+   return sent;
+}
+
+/*****************************************************************************************
+ * message - queues text from sender to every session logged in as the given user, other
+ *           than the sender's own
+ *
+ *    Returns: the number of sessions it was queued to
+ *****************************************************************************************/
+
+size_t FanOut::message(ConnTable &table, TCPConn &sender, userid to, std::string_view text) {
+   if (to == no_user)
+      return 0;
+
+   MsgRef msg;
+   size_t textlen = 0;
+   size_t sent = 0;
+   for (size_t i = 0; i < table.limit(); i++) {
+      ConnHot &hot = table[i];
+      if ((hot.user != to + 1) || (hot.fd == -1) || (hot.conn == &sender))
+         continue;
+
+      // Built on the first recipient, so a user who is not logged in costs nothing
+      if (msg.get() == nullptr)
+         msg = build(binproto::op_message, "message from", sender.getUsernameStr(), text, textlen);
+      deliver(hot, msg, textlen);
+      sent++;
+   }
+   _messages++;
+   return sent;
+}
+
+/*****************************************************************************************
+ * flush - sends every queue that was added to since the last flush. Whatever a socket
+ *         won't take now stays queued; the connection sends it when it polls writable.
+ *
+ *****************************************************************************************/
+
+void FanOut::flush() {
+   for (ConnHot *hot : _pending) {
+      // The slot may have been closed (its queue is gone then) or even reused
+      if ((hot->conn != NULL) && (hot->fd != -1))
+         hot->conn->sendQueued();
+   }
+   _pending.clear();
+}
+
+/*****************************************************************************************
+ * build - makes the one block a message is delivered from: the text protocol's line,
+ *         "[<label> <from>] <text>\n", followed by the binary frame
+ *
+ *    Params:  textlen - set to the length of the text line, where the frame starts
+ *
+ *****************************************************************************************/
+
+MsgRef FanOut::build(uint8_t opcode, const char *label, std::string_view from, std::string_view text,
+                     size_t &textlen) {
+   size_t labellen = strlen(label);
+   textlen = 1 + labellen + 1 + from.size() + 2 + text.size() + 1;
+   uint32_t payloadlen = (uint32_t) (from.size() + 1 + text.size());
+
+   MsgRef msg(MsgBuf::create(textlen + binproto::header_size + payloadlen));
+   char *p = msg->data();
+
+   *p++ = '[';
+   memcpy(p, label, labellen);
+   p += labellen;
+   *p++ = ' ';
+   memcpy(p, from.data(), from.size());
+   p += from.size();
+   *p++ = ']';
+   *p++ = ' ';
+   memcpy(p, text.data(), text.size());
+   p += text.size();
+   *p++ = '\n';
+
+   binproto::writeHeader(p, opcode, binproto::st_ok, 0, payloadlen);
+   p += binproto::header_size;
+   memcpy(p, from.data(), from.size());
+   p += from.size();
+   *p++ = '\0';
+   memcpy(p, text.data(), text.size());
+
+   return msg;
+}
+
+/*****************************************************************************************
+ * deliver - queues the part of msg a recipient's protocol reads on its connection
+ *
+ *****************************************************************************************/
+
+void FanOut::deliver(ConnHot &hot, const MsgRef &msg, size_t textlen) {
+   bool first;
+   if (hot.flags & ConnHot::f_binary)
+      first = hot.conn->queueMessage(msg, msg->data() + textlen, msg->size() - textlen);
+   else
+      first = hot.conn->queueMessage(msg, msg->data(), textlen);
+
+   if (first)
+      _pending.push_back(&hot);
+   _deliveries++;
+}
@@ -1,10 +1,14 @@
 #include <stdexcept>
 #include <strings.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <cstring>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -12,7 +16,7 @@
 
 const unsigned int bufsize = 500;
 
-FileDesc::FileDesc() {
+FileDesc::FileDesc():_fd(-1) {
 
 }
 
@@ -28,10 +32,11 @@ FileDesc::~FileDesc() {
  *
  *****************************************************************************************/
 
-void FileDesc::setNonBlocking() {
+void FileDesc::setNonBlocking(bool nonblocking) {
    // Set the socket to nonblocking
    int flags = fcntl(_fd, F_GETFL);
-   if ((flags < 0) || (fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+   flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+   if ((flags < 0) || (fcntl(_fd, F_SETFL, flags) < 0)) {
       throw socket_error("Failed setting file descriptor to nonblocking.");
    }
 
@@ -92,6 +97,7 @@ bool FileDesc::hasData(long ms_timeout) {
  * readFD - simply reads all available string data (up to bufsize) from the FD
  *
  *    Params: buf - string to store the data in
+ *            data, len - raw buffer to read into instead (keeps NUL bytes)
  *
  *    Returns: returns the amount of data read or -1 for failure
  *****************************************************************************************/
@@ -110,6 +116,10 @@ ssize_t FileDesc::readFD(std::string &buf) {
    return amt_read;
 }
 
+ssize_t FileDesc::readFD(char *data, unsigned int len) {
+   return read(_fd, data, len);
+}
+
 /*****************************************************************************************
  * writeFD - writes all the string data provided in str to the FD
  *
@@ -137,16 +147,22 @@ ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
  *
  *************************************************************************************/
 bool FileDesc::isOpen() {
+   if (_fd == -1)
+      return false;
    if ((fcntl(_fd, F_GETFD) == -1) && (errno == EBADF))
       return false;
    return true;
 }
 
 /***************************************************************************************
- * closeFD - closes the FD cleanly
+ * closeFD - closes the FD cleanly. The descriptor is forgotten so a number the kernel
+ *           later hands out again is never mistaken for this (closed) one
  ***************************************************************************************/
 void FileDesc::closeFD() {
+   if (_fd == -1)
+      return;
    close(_fd);
+   _fd = -1;
 }
 
 /****************************************************************************************
@@ -156,7 +172,10 @@ void FileDesc::closeFD() {
    
  ****************************************************************************************/
 
-SocketFD::SocketFD():FileDesc() {
+SocketFD::SocketFD(bool create):FileDesc() {
+
+   if (!create)
+      return;
 
    // Create the socket
    _fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -219,6 +238,50 @@ bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
    return true;
 }
 
+/*****************************************************************************************
+ * startConnect - creates a nonblocking socket and starts connecting it to the given ip
+ *                address and port, without waiting for the handshake
+ *
+ *    Returns: true if the connect is under way (or already done), false if it failed
+ *
+ *    Throws: socket_error if the socket could not be created
+ *****************************************************************************************/
+
+bool SocketFD::startConnect(const char *ip_addr, unsigned short port) {
+   closeFD();
+   if ((_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+      throw socket_error("Socket creation failed.");
+
+   bzero(&_fd_addr, sizeof(_fd_addr));
+   _fd_addr.sin_family = AF_INET;
+   inet_pton(AF_INET, ip_addr, &_fd_addr.sin_addr.s_addr);
+   _fd_addr.sin_port = htons(port);
+
+   if ((connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0) && (errno != EINPROGRESS)) {
+      closeFD();
+      return false;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * finishConnect - checks how a connect begun by startConnect went, once the socket polled
+ *                 writable (or with an error)
+ *
+ *    Returns: true if the socket is connected
+ *****************************************************************************************/
+
+bool SocketFD::finishConnect() {
+   int err = 0;
+   socklen_t len = sizeof(err);
+   return (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0) && (err == 0);
+}
+
+void SocketFD::setNoDelay() {
+   int on = 1;
+   setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
 /*****************************************************************************************
  * listenFD - starts listening for connections on a bound socket FD
  *
@@ -245,13 +308,65 @@ void SocketFD::listenFD(int backlog) {
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
-   _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
-   if (_fd == -1)
+   int fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
+   if (fd == -1)
       return false;
 
+   // Don't leak whatever socket this FD held before
+   closeFD();
+   _fd = fd;
    return true;
 }
 
+/*****************************************************************************************
+ * takeFD - moves another socket's descriptor and address into this one, leaving the other
+ *          closed. Lets the server vet an accepted connection before building a TCPConn.
+ *
+ *****************************************************************************************/
+
+void SocketFD::takeFD(SocketFD &other) {
+   closeFD();
+   _fd = other._fd;
+   _fd_addr = other._fd_addr;
+   other._fd = -1;
+}
+
+/*****************************************************************************************
+ * adoptFD - takes ownership of a socket opened elsewhere (e.g. received from another
+ *           process), loading the peer's address, or the local one for a listening socket
+ *
+ *****************************************************************************************/
+
+void SocketFD::adoptFD(int fd) {
+   closeFD();
+   _fd = fd;
+
+   socklen_t len = sizeof(_fd_addr);
+   bzero(&_fd_addr, sizeof(_fd_addr));
+   if (getpeername(_fd, (struct sockaddr *) &_fd_addr, &len) == -1) {
+      len = sizeof(_fd_addr);
+      getsockname(_fd, (struct sockaddr *) &_fd_addr, &len);
+   }
+}
+
+/*****************************************************************************************
+ * recvFD - reads up to len bytes that have already arrived, never waiting for more
+ *
+ *    Returns: bytes read, 0 if the peer closed the connection, -1 for failure or -2 if no
+ *             data was waiting
+ *****************************************************************************************/
+
+ssize_t SocketFD::recvFD(char *data, unsigned int len) {
+   ssize_t amt;
+   do {
+      amt = recv(_fd, data, len, MSG_DONTWAIT);
+   } while ((amt == -1) && (errno == EINTR));
+
+   if ((amt == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return -2;
+   return amt;
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -315,15 +430,16 @@ FileFD::~FileFD() {
  *                   readfd - read only
  *                   writefd - write only
  *                   appendfd - write only, moves pointer to the end
+ *                   createfd - write only, creates the file (mode 0600) or truncates it
  *
  *    Returns: false if the file failed to open, true otherwise
  *
  ******************************************************************************************/
 
 bool FileFD::openFile(fd_file_type ftype) {
-   int file_flags[] = {O_RDONLY, O_WRONLY, O_WRONLY | O_APPEND};
+   int file_flags[] = {O_RDONLY, O_WRONLY, O_WRONLY | O_APPEND, O_WRONLY | O_CREAT | O_TRUNC};
 
-   if ((_fd = open(_filename.c_str(), file_flags[ftype])) == -1)
+   if ((_fd = open(_filename.c_str(), file_flags[ftype], 0600)) == -1)
       return false;
 
    return true;
@@ -367,3 +483,33 @@ ssize_t FileDesc::readStr(std::string &buf) {
    return buf.size();
 }
 
+
+/*****************************************************************************************
+ * SignalFD (constructor) - blocks the signals and opens a nonblocking signalfd for them
+ *
+ *    Throws: runtime_error if the signalfd could not be created
+ *****************************************************************************************/
+
+SignalFD::SignalFD(std::initializer_list<int> signals):FileDesc() {
+   sigset_t mask;
+   sigemptyset(&mask);
+   for (int sig : signals)
+      sigaddset(&mask, sig);
+
+   if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+      throw std::runtime_error("Could not block signals for the signalfd.");
+
+   if ((_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+      throw std::runtime_error("Could not create signalfd.");
+}
+
+SignalFD::~SignalFD() {
+   closeFD();
+}
+
+int SignalFD::readSignal() {
+   signalfd_siginfo info;
+   if (read(_fd, &info, sizeof(info)) != sizeof(info))
+      return -1;
+   return (int) info.ssi_signo;
+}
@@ -0,0 +1,206 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include "Handoff.h"
+#include "exceptions.h"
+
+// Largest state message we accept from a predecessor
+const uint32_t max_handoff_msg = 1 << 20;
+
+Handoff::Handoff(const char *path):_path(path) {
+
+}
+
+
+Handoff::~Handoff() {
+   if (_listenfd != -1)
+      close(_listenfd);
+}
+
+static bool fillAddr(const std::string &path, sockaddr_un &addr) {
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(addr.sun_path))
+      return false;
+   strcpy(addr.sun_path, path.c_str());
+   return true;
+}
+
+/*****************************************************************************************
+ * listen - binds the handoff path (replacing a stale socket file) and listens on it,
+ *          nonblocking so the server loop can poll it
+ *
+ *    Throws: socket_error if the socket could not be set up
+ *****************************************************************************************/
+
+void Handoff::listen() {
+   sockaddr_un addr;
+   if (!fillAddr(_path, addr))
+      throw socket_error("Handoff socket path too long.");
+
+   if ((_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+      throw socket_error("Handoff socket creation failed.");
+
+   unlink(_path.c_str());
+   if ((bind(_listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) || (::listen(_listenfd, 1) == -1))
+      throw socket_error("Could not listen on the handoff socket.");
+}
+
+/*****************************************************************************************
+ * acceptSuccessor - accepts a new server waiting on the handoff socket
+ *
+ *    Returns: the connected (blocking) socket, or -1 if nobody is waiting
+ *****************************************************************************************/
+
+int Handoff::acceptSuccessor() {
+   if (_listenfd == -1)
+      return -1;
+
+   int sock = accept4(_listenfd, NULL, NULL, SOCK_CLOEXEC);
+   return sock;
+}
+
+void Handoff::closeListener() {
+   if (_listenfd == -1)
+      return;
+   close(_listenfd);
+   _listenfd = -1;
+   unlink(_path.c_str());
+}
+
+/*****************************************************************************************
+ * connectPredecessor - connects to the server currently listening on the handoff path
+ *
+ *    Returns: the connected socket, or -1 if no server is listening (a leftover socket file
+ *             from a server that died is not an error)
+ *****************************************************************************************/
+
+int Handoff::connectPredecessor() {
+   sockaddr_un addr;
+   if (!fillAddr(_path, addr))
+      return -1;
+
+   int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (sock == -1)
+      return -1;
+
+   if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+      close(sock);
+      return -1;
+   }
+   return sock;
+}
+
+/*****************************************************************************************
+ * sendMsg - sends one handoff message, with fd attached if it is not -1
+ *
+ *    Returns: true if the whole message was sent
+ *****************************************************************************************/
+
+bool Handoff::sendMsg(int sock, char type, const std::string &payload, int fd) {
+   char hdr[5];
+   uint32_t len = htonl((uint32_t) payload.size());
+   memcpy(hdr, &len, 4);
+   hdr[4] = type;
+
+   iovec iov[2];
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = (void *) payload.data();
+   iov[1].iov_len = payload.size();
+
+   msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = iov;
+   msg.msg_iovlen = payload.empty() ? 1 : 2;
+
+   char cbuf[CMSG_SPACE(sizeof(int))];
+   if (fd != -1) {
+      memset(cbuf, 0, sizeof(cbuf));
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+      cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+   }
+
+   ssize_t total = sizeof(hdr) + payload.size();
+   ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+   if (sent == total)
+      return true;
+   if (sent < (ssize_t) sizeof(hdr))
+      return false;
+
+   // The header (and the descriptor) went, finish the payload
+   size_t done = sent - sizeof(hdr);
+   while (done < payload.size()) {
+      ssize_t amt = send(sock, payload.data() + done, payload.size() - done, MSG_NOSIGNAL);
+      if (amt <= 0)
+         return false;
+      done += amt;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * recvMsg - receives one handoff message
+ *
+ *    Params:  payload - filled with the message body
+ *             fd - the attached descriptor, or -1 if none came with it
+ *
+ *    Returns: the message type, or 0 if the connection failed or the message was invalid
+ *****************************************************************************************/
+
+char Handoff::recvMsg(int sock, std::string &payload, int &fd) {
+   char hdr[5];
+   iovec iov;
+   iov.iov_base = hdr;
+   iov.iov_len = sizeof(hdr);
+
+   char cbuf[CMSG_SPACE(sizeof(int))];
+   msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+
+   fd = -1;
+   ssize_t amt = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+   if (amt != (ssize_t) sizeof(hdr))
+      return 0;
+
+   for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+         memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+   }
+
+   uint32_t len;
+   memcpy(&len, hdr, 4);
+   len = ntohl(len);
+   if (len > max_handoff_msg) {
+      if (fd != -1)
+         close(fd);
+      fd = -1;
+      return 0;
+   }
+
+   payload.resize(len);
+   size_t done = 0;
+   while (done < len) {
+      ssize_t got = recv(sock, &payload[done], len - done, MSG_WAITALL);
+      if (got <= 0) {
+         if (fd != -1)
+            close(fd);
+         fd = -1;
+         return 0;
+      }
+      done += got;
+   }
+   return hdr[4];
+}
@@ -0,0 +1,202 @@
+#include <string.h>
+#include <iterator>
+#include "HashScheduler.h"
+
+const unsigned int hash_len = 32;
+
+// Cap on remembered IPs; the set is simply reset when it fills
+const size_t max_known_ips = 65536;
+
+HashJob::HashJob(const char *passwd, const std::vector<uint8_t> &salt, const Argon2Profile &profile):
+                     passwd(passwd), salt(salt), profile(profile) {
+
+}
+
+HashJob::~HashJob() {
+   if (!passwd.empty())
+      explicit_bzero(&passwd[0], passwd.size());
+}
+
+/*****************************************************************************************
+ * run - hashes the password with the job's salt and profile and publishes the result
+ *
+ *****************************************************************************************/
+
+void HashJob::run() {
+   setStatus(running);
+
+   uint8_t out[hash_len];
+   if (!profile.hash(passwd.c_str(), passwd.size(), salt.data(), salt.size(), out, hash_len)) {
+      setStatus(failed);
+      return;
+   }
+
+   hash.assign(out, out + hash_len);
+   setStatus(done);
+}
+
+/*****************************************************************************************
+ * HashScheduler (constructor) - starts the worker threads
+ *
+ *    Params:  threads - number of hashes that may run at once (at least 1)
+ *             mem_budget_kib - total Argon2 memory the running hashes may use
+ *             max_queue - how many jobs may wait before requests are refused
+ *****************************************************************************************/
+
+HashScheduler::HashScheduler(unsigned int threads, uint32_t mem_budget_kib, unsigned int max_queue):
+                                 _mem_budget_kib(mem_budget_kib), _max_queue(max_queue) {
+   if (threads == 0)
+      threads = 1;
+
+   for (unsigned int i = 0; i < threads; i++)
+      _workers.emplace_back(&HashScheduler::worker, this);
+}
+
+
+HashScheduler::~HashScheduler() {
+   stop();
+}
+
+/*****************************************************************************************
+ * submit - queues a password hash
+ *
+ *    Params:  type - login or password change, the main priority key
+ *             ipaddr - client address; logins from known IPs go first
+ *             passwd, salt, profile - what to hash
+ *
+ *    Returns: the queued job, or NULL if the queue is full of equal or higher priority work
+ *****************************************************************************************/
+
+std::shared_ptr<HashJob> HashScheduler::submit(jobtype type, unsigned long ipaddr, const char *passwd,
+                                const std::vector<uint8_t> &salt, const Argon2Profile &profile) {
+   std::unique_lock<std::mutex> lock(_mutex);
+
+   if (_stopping) {
+      _rejected++;
+      return NULL;
+   }
+
+   int priority = (type == login) ? 0 : 2;
+   if ((type == login) && (_known_ips.find(ipaddr) == _known_ips.end()))
+      priority = 1;
+
+   if (_queue.size() >= _max_queue) {
+      // Make room by bumping the lowest priority waiter, if we outrank it
+      if (_queue.empty() || (std::prev(_queue.end())->priority <= priority)) {
+         _rejected++;
+         return NULL;
+      }
+
+      auto lowest = std::prev(_queue.end());
+      lowest->job->setStatus(HashJob::busy);
+      _queue.erase(lowest);
+      _displaced++;
+   }
+
+   auto job = std::make_shared<HashJob>(passwd, salt, profile);
+   job->priority = priority;
+   job->seq = _seq++;
+   _queue.insert(QueueEntry{priority, job->seq, job});
+
+   lock.unlock();
+   _cv.notify_one();
+   return job;
+}
+
+/*****************************************************************************************
+ * cancel - removes a job from the queue if it has not started. Running jobs finish and
+ *          their result is simply never read.
+ *
+ *****************************************************************************************/
+
+void HashScheduler::cancel(std::shared_ptr<HashJob> &job) {
+   if (!job)
+      return;
+
+   std::lock_guard<std::mutex> lock(_mutex);
+   auto it = _queue.find(QueueEntry{job->priority, job->seq, NULL});
+   if ((it != _queue.end()) && (it->job == job)) {
+      _queue.erase(it);
+      job->setStatus(HashJob::busy);
+   }
+}
+
+void HashScheduler::markKnown(unsigned long ipaddr) {
+   std::lock_guard<std::mutex> lock(_mutex);
+   if (_known_ips.size() >= max_known_ips)
+      _known_ips.clear();
+   _known_ips.insert(ipaddr);
+}
+
+size_t HashScheduler::getQueued() {
+   std::lock_guard<std::mutex> lock(_mutex);
+   return _queue.size();
+}
+
+/*****************************************************************************************
+ * canStart - true if the highest priority job fits in the remaining memory budget. A job
+ *            bigger than the whole budget is still allowed to run on its own.
+ *
+ *            Must be called with _mutex held.
+ *****************************************************************************************/
+
+bool HashScheduler::canStart() {
+   if (_queue.empty())
+      return false;
+
+   uint32_t need = _queue.begin()->job->profile.memoryKiB();
+   return ((_mem_inuse_kib == 0) || (_mem_inuse_kib + need <= _mem_budget_kib));
+}
+
+/*****************************************************************************************
+ * worker - thread body: waits until the head of the queue fits in the budget, reserves its
+ *          memory, runs it and gives the memory back
+ *
+ *****************************************************************************************/
+
+void HashScheduler::worker() {
+   std::unique_lock<std::mutex> lock(_mutex);
+
+   while (true) {
+      _cv.wait(lock, [this] { return _stopping || canStart(); });
+      if (_stopping)
+         return;
+
+      auto head = _queue.begin();
+      std::shared_ptr<HashJob> job = head->job;
+      _queue.erase(head);
+
+      uint32_t mem = job->profile.memoryKiB();
+      _mem_inuse_kib += mem;
+      if (_mem_inuse_kib > _peak_mem_kib)
+         _peak_mem_kib = _mem_inuse_kib;
+
+      lock.unlock();
+      job->run();
+      _completed++;
+      lock.lock();
+
+      _mem_inuse_kib -= mem;
+
+      // Freed memory may let more than one waiting job start
+      _cv.notify_all();
+   }
+}
+
+void HashScheduler::stop() {
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_stopping && _workers.empty())
+         return;
+      _stopping = true;
+
+      for (auto &entry : _queue)
+         entry.job->setStatus(HashJob::busy);
+      _queue.clear();
+   }
+   _cv.notify_all();
+
+   for (auto &thread : _workers)
+      thread.join();
+   _workers.clear();
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include "LatencyHist.h"
+
+// Each power of two is split into 2^sub_bits linear slices
+const unsigned int sub_bits = 5;
+const unsigned int sub_count = 1 << sub_bits;
+const unsigned int num_buckets = (64 - sub_bits + 1) * sub_count;
+
+LatencyHist::LatencyHist():_buckets(num_buckets, 0) {
+
+}
+
+
+LatencyHist::~LatencyHist() {
+
+}
+
+/*****************************************************************************************
+ * bucketOf - maps a value to its bucket index. Values below sub_count get their own bucket,
+ *            above that the top sub_bits bits after the most significant bit pick the slice
+ *
+ *****************************************************************************************/
+
+unsigned int LatencyHist::bucketOf(uint64_t ns) {
+   if (ns < sub_count)
+      return (unsigned int) ns;
+
+   unsigned int msb = 63 - __builtin_clzll(ns);
+   unsigned int group = msb - sub_bits + 1;
+   return group * sub_count + (unsigned int) ((ns >> (msb - sub_bits)) & (sub_count - 1));
+}
+
+/*****************************************************************************************
+ * bucketValue - returns the midpoint of the range of values that fall in the given bucket
+ *
+ *****************************************************************************************/
+
+uint64_t LatencyHist::bucketValue(unsigned int idx) {
+   unsigned int group = idx / sub_count;
+   uint64_t sub = idx % sub_count;
+
+   if (group == 0)
+      return sub;
+
+   unsigned int shift = group - 1;
+   uint64_t lower = (sub_count + sub) << shift;
+   return lower + ((1ULL << shift) >> 1);
+}
+
+/*****************************************************************************************
+ * record - adds one sample to the histogram
+ *
+ *    Params:  ns - the latency in nanoseconds
+ *****************************************************************************************/
+
+void LatencyHist::record(uint64_t ns) {
+   _buckets[bucketOf(ns)]++;
+
+   if ((_count == 0) || (ns < _min))
+      _min = ns;
+   if (ns > _max)
+      _max = ns;
+
+   _count++;
+   _sum += ns;
+}
+
+/*****************************************************************************************
+ * merge - adds all samples from other into this histogram
+ *
+ *****************************************************************************************/
+
+void LatencyHist::merge(const LatencyHist &other) {
+   if (other._count == 0)
+      return;
+
+   for (unsigned int i = 0; i < num_buckets; i++)
+      _buckets[i] += other._buckets[i];
+
+   if ((_count == 0) || (other._min < _min))
+      _min = other._min;
+   _max = std::max(_max, other._max);
+   _count += other._count;
+   _sum += other._sum;
+}
+
+void LatencyHist::clear() {
+   std::fill(_buckets.begin(), _buckets.end(), 0);
+   _count = 0;
+   _min = 0;
+   _max = 0;
+   _sum = 0.0;
+}
+
+/*****************************************************************************************
+ * percentile - walks the buckets to find the value at the given percentile
+ *
+ *    Params:  pct - percentile between 0 and 100 (e.g. 99.9 for p999)
+ *
+ *    Returns: the approximate value in nanoseconds, clamped to the observed min/max, or 0
+ *             if there are no samples
+ *****************************************************************************************/
+
+uint64_t LatencyHist::percentile(double pct) const {
+   if (_count == 0)
+      return 0;
+
+   uint64_t target = (uint64_t) ((pct / 100.0) * _count + 0.5);
+   if (target < 1)
+      target = 1;
+   if (target > _count)
+      target = _count;
+
+   uint64_t seen = 0;
+   for (unsigned int i = 0; i < num_buckets; i++) {
+      seen += _buckets[i];
+      if (seen >= target)
+         return std::min(std::max(bucketValue(i), _min), _max);
+   }
+   return _max;
+}
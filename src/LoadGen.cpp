@@ -0,0 +1,553 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <strings.h>
+#include <stdexcept>
+#include <algorithm>
+#include <random>
+#include "LoadGen.h"
+#include "BinProto.h"
+#include "exceptions.h"
+
+const unsigned int max_events = 256;
+const unsigned int readbuf_size = 4096;
+
+const char *phase_names[] = {"connect", "username", "password", "command"};
+
+/**********************************************************************************************
+ * LoadGen (constructor) - stores the scenario and the server address, lays out the order in
+ *                         which the scripts are handed to sessions and creates the epoll
+ *                         instance used to drive all the sessions
+ *
+ *    Throws: socket_error if the address is invalid or epoll could not be created
+ *            invalid_argument if no logins were given
+ **********************************************************************************************/
+
+LoadGen::LoadGen(const char *ip_addr, unsigned short port, LoadGenParams &params):_params(params) {
+   bzero(&_srvaddr, sizeof(_srvaddr));
+   _srvaddr.sin_family = AF_INET;
+   if (inet_pton(AF_INET, ip_addr, &_srvaddr.sin_addr.s_addr) != 1)
+      throw socket_error("Invalid IP address for load generation.");
+   _srvaddr.sin_port = htons(port);
+
+   if (_params.conns == 0)
+      _params.conns = 1;
+
+   if (_params.creds.empty())
+      throw std::invalid_argument("Load generation needs at least one login.");
+
+   if (_params.scripts.empty())
+      _params.scripts.push_back(LoadGenScript());
+
+   // Fixed seed so runs with the same mix send the same sequence of sessions
+   for (unsigned int i = 0; i < _params.scripts.size(); i++)
+      _schedule.insert(_schedule.end(), _params.scripts[i].weight, i);
+   if (_schedule.empty())
+      _schedule.push_back(0);
+   std::shuffle(_schedule.begin(), _schedule.end(), std::mt19937(1));
+   _script_done.resize(_params.scripts.size(), 0);
+
+   if ((_epfd = epoll_create1(0)) == -1)
+      throw socket_error("Could not create epoll instance.");
+}
+
+
+LoadGen::~LoadGen() {
+   for (Session *sess : _active) {
+      close(sess->fd);
+      delete sess;
+   }
+   _active.clear();
+
+   if (_epfd != -1)
+      close(_epfd);
+}
+
+uint64_t LoadGen::nowNS() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+LoadGen::phase LoadGen::phaseOf(sesstatus status) {
+   switch (status) {
+      case s_connecting:
+         return p_connect;
+      case s_username:
+         return p_username;
+      case s_passwd:
+         return p_passwd;
+      default:
+         return p_command;
+   }
+}
+
+/**********************************************************************************************
+ * run - Main loop. Starts sessions at the requested rate (never exceeding conns at once),
+ *       waits on epoll for activity on the sessions in flight and expires the ones that
+ *       stall. Returns once every session has either completed or failed.
+ *
+ *    Throws: socket_error for unrecoverable socket or epoll errors
+ **********************************************************************************************/
+
+void LoadGen::run() {
+   epoll_event events[max_events];
+
+   uint64_t interval = 0;
+   if (_params.rate > 0.0)
+      interval = (uint64_t) (1000000000.0 / _params.rate);
+
+   uint64_t start = nowNS();
+   uint64_t next_launch = start;
+
+   while ((_started < _params.sessions) || (!_active.empty())) {
+      uint64_t now = nowNS();
+
+      // Open new sessions if we are due and have room for them
+      while ((_started < _params.sessions) && (_active.size() < _params.conns) && (now >= next_launch)) {
+         startSession();
+         next_launch += interval;
+      }
+
+      // Wake up in time for the next launch, or at least often enough to check timeouts
+      int wait_ms = 100;
+      if ((_started < _params.sessions) && (_active.size() < _params.conns) && (next_launch > now)) {
+         uint64_t until = (next_launch - now + 999999) / 1000000;
+         if (until < (uint64_t) wait_ms)
+            wait_ms = (int) until;
+      }
+
+      int n = epoll_wait(_epfd, events, max_events, wait_ms);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+         throw socket_error("epoll_wait failed during load generation.");
+      }
+
+      for (int i = 0; i < n; i++)
+         handleEvent((Session *) events[i].data.ptr, events[i].events);
+
+      checkTimeouts(nowNS());
+   }
+
+   _elapsed = (nowNS() - start) / 1e9;
+}
+
+/**********************************************************************************************
+ * startSession - creates a non-blocking socket, starts the connect and registers it with epoll.
+ *                The connect phase timer starts here.
+ *
+ *    Throws: socket_error if the socket could not be created or registered
+ **********************************************************************************************/
+
+void LoadGen::startSession() {
+   int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (fd == -1)
+      throw socket_error("Socket creation failed.");
+
+   Session *sess = new Session();
+   sess->fd = fd;
+   sess->slot = _active.size();
+   sess->cred = _started % _params.creds.size();
+   sess->script = _schedule[_started % _schedule.size()];
+   sess->phase_start = nowNS();
+   _active.push_back(sess);
+   _started++;
+
+   // Goes out as soon as the connect completes
+   if (_params.binary) {
+      sess->outbuf += (char) binproto::magic;
+      sess->outbuf += (char) binproto::version;
+   }
+
+   if ((connect(fd, (struct sockaddr *) &_srvaddr, sizeof(_srvaddr)) != 0) && (errno != EINPROGRESS)) {
+      endSession(sess, false);
+      return;
+   }
+
+   epoll_event ev;
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+   ev.data.ptr = sess;
+   if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      throw socket_error("Could not add session socket to epoll.");
+}
+
+/**********************************************************************************************
+ * handleEvent - dispatches an epoll event for a session: completes the connect, flushes
+ *               pending output and reads and interprets any server replies
+ *
+ **********************************************************************************************/
+
+void LoadGen::handleEvent(Session *sess, uint32_t events) {
+   if (events & EPOLLERR) {
+      endSession(sess, false);
+      return;
+   }
+
+   if (events & EPOLLOUT) {
+      if (!sess->connected) {
+         int err = 0;
+         socklen_t len = sizeof(err);
+         if ((getsockopt(sess->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0)) {
+            endSession(sess, false);
+            return;
+         }
+         sess->connected = true;
+      }
+
+      if (!flushSession(sess)) {
+         endSession(sess, false);
+         return;
+      }
+   }
+
+   if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+      bool open = readSession(sess);
+
+      if (!advance(sess))
+         return;
+
+      // The server closing the connection is only expected after we sent exit
+      if (!open)
+         endSession(sess, sess->status == s_exit);
+   }
+}
+
+/**********************************************************************************************
+ * readSession - reads everything available on the socket into the session's input buffer
+ *
+ *    Returns: false if the server closed the connection or the read failed, true otherwise
+ **********************************************************************************************/
+
+bool LoadGen::readSession(Session *sess) {
+   char buf[readbuf_size];
+
+   while (true) {
+      ssize_t amt = read(sess->fd, buf, readbuf_size);
+      if (amt > 0) {
+         sess->inbuf.append(buf, amt);
+         continue;
+      }
+
+      if (amt == 0)
+         return false;
+
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+         return true;
+      if (errno == EINTR)
+         continue;
+      return false;
+   }
+}
+
+/**********************************************************************************************
+ * advance - looks at what the server has sent so far and moves the session through the
+ *           scenario, sending the next line whenever the current phase has been answered
+ *
+ *    Returns: false if the session was ended (and freed), true if it is still active
+ **********************************************************************************************/
+
+bool LoadGen::advance(Session *sess) {
+   if (_params.binary)
+      return advanceBinary(sess);
+
+   switch (sess->status) {
+      case s_connecting:
+         if (sess->inbuf.find("Username: ") == std::string::npos)
+            break;
+         sess->connected = true;
+         finishPhase(sess, p_connect);
+         sess->status = s_username;
+         sendLine(sess, _params.creds[sess->cred].username);
+         break;
+
+      case s_username:
+         if (sess->inbuf.find("not recognized") != std::string::npos) {
+            endSession(sess, false);
+            return false;
+         }
+         if (sess->inbuf.find("Password: ") == std::string::npos)
+            break;
+         finishPhase(sess, p_username);
+         sess->status = s_passwd;
+         sendLine(sess, _params.creds[sess->cred].passwd);
+         break;
+
+      case s_passwd:
+         if (sess->inbuf.find("Invalid Password") != std::string::npos) {
+            endSession(sess, false);
+            return false;
+         }
+         if (sess->inbuf.find("Log in successful") == std::string::npos)
+            break;
+         finishPhase(sess, p_passwd);
+         nextCommand(sess);
+         break;
+
+      case s_command: {
+         // Either a complete reply or a prompt asking for more input
+         size_t len = sess->inbuf.size();
+         bool line = (len > 0) && (sess->inbuf[len - 1] == '\n');
+         bool prompt = (len > 1) && (sess->inbuf.compare(len - 2, 2, ": ") == 0);
+         if (!line && !prompt)
+            break;
+         finishPhase(sess, p_command);
+         nextCommand(sess);
+         break;
+      }
+
+      case s_exit:
+         sess->inbuf.clear();
+         break;
+   }
+
+   if (!flushSession(sess)) {
+      endSession(sess, false);
+      return false;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * advanceBinary - binary protocol version of advance: waits for the server's side of the
+ *                 negotiation, pipelines the whole session and then matches the reply frames
+ *                 as they arrive
+ *
+ *    Returns: false if the session was ended (and freed), true if it is still active
+ **********************************************************************************************/
+
+bool LoadGen::advanceBinary(Session *sess) {
+   if (sess->status == s_connecting) {
+      // The text banner comes first; it never contains the magic byte
+      const char hello[2] = {(char) binproto::magic, (char) binproto::version};
+      size_t pos = sess->inbuf.find(hello, 0, 2);
+      if (pos == std::string::npos)
+         return true;
+
+      sess->inbuf.erase(0, pos + 2);
+      std::string rest = sess->inbuf;
+      finishPhase(sess, p_connect);
+      sess->inbuf = rest;
+
+      sendFrames(sess);
+   }
+
+   size_t pos = 0;
+   binproto::FrameHeader hdr;
+   while (binproto::parseHeader(sess->inbuf.data() + pos, sess->inbuf.size() - pos, hdr)) {
+      if (sess->inbuf.size() - pos < binproto::header_size + hdr.length)
+         break;
+      pos += binproto::header_size + hdr.length;
+
+      uint64_t now = nowNS();
+      if (hdr.opcode == binproto::op_login) {
+         if (hdr.status != binproto::st_ok) {
+            endSession(sess, false);
+            return false;
+         }
+         _hist[p_passwd].record(now - sess->phase_start);
+         sess->status = s_command;
+      } else if (hdr.reqid == sess->last_reqid) {
+         sess->status = s_exit;
+      } else {
+         _hist[p_command].record(now - sess->phase_start);
+      }
+      _requests++;
+   }
+   sess->inbuf.erase(0, pos);
+
+   if (!flushSession(sess)) {
+      endSession(sess, false);
+      return false;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * sendFrames - queues the session's login, every scripted command and exit as binary frames.
+ *              "passwd" is dropped from the script, since op_passwd carries the new password
+ *              itself ("%p").
+ *
+ **********************************************************************************************/
+
+void LoadGen::sendFrames(Session *sess) {
+   LoadGenCred &cred = _params.creds[sess->cred];
+   uint32_t reqid = 1;
+
+   std::string login = cred.username;
+   login += '\0';
+   login += cred.passwd;
+   binproto::appendFrame(sess->outbuf, binproto::op_login, 0, reqid++, login);
+
+   for (std::string &cmd : _params.scripts[sess->script].commands) {
+      if (cmd == "passwd")
+         continue;
+      if (cmd == "%p")
+         binproto::appendFrame(sess->outbuf, binproto::op_passwd, 0, reqid++, cred.passwd);
+      else
+         binproto::appendFrame(sess->outbuf, binproto::op_command, 0, reqid++, cmd);
+   }
+
+   sess->last_reqid = reqid;
+   binproto::appendFrame(sess->outbuf, binproto::op_exit, 0, reqid, NULL, 0);
+   sess->status = s_passwd;
+}
+
+/**********************************************************************************************
+ * nextCommand - sends the next scripted menu command, or exit once the script is done
+ *
+ **********************************************************************************************/
+
+void LoadGen::nextCommand(Session *sess) {
+   std::vector<std::string> &commands = _params.scripts[sess->script].commands;
+
+   if (sess->cmd_idx < commands.size()) {
+      sess->status = s_command;
+      std::string &cmd = commands[sess->cmd_idx++];
+      if (cmd == "%p")
+         sendLine(sess, _params.creds[sess->cred].passwd);
+      else
+         sendLine(sess, cmd);
+   } else {
+      sess->status = s_exit;
+      sendLine(sess, "exit");
+   }
+}
+
+void LoadGen::sendLine(Session *sess, const std::string &line) {
+   sess->outbuf += line;
+   sess->outbuf += "\n";
+}
+
+/**********************************************************************************************
+ * flushSession - writes as much of the session's output buffer as the socket will take and
+ *                only asks epoll for EPOLLOUT while there is something left to send
+ *
+ *    Returns: false if the write failed, true otherwise
+ **********************************************************************************************/
+
+bool LoadGen::flushSession(Session *sess) {
+   if (!sess->connected)
+      return true;
+
+   while (!sess->outbuf.empty()) {
+      ssize_t amt = send(sess->fd, sess->outbuf.data(), sess->outbuf.size(), MSG_NOSIGNAL);
+      if (amt < 0) {
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      sess->outbuf.erase(0, amt);
+   }
+
+   bool want_write = !sess->outbuf.empty();
+   if (want_write != sess->want_write) {
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+      ev.data.ptr = sess;
+      if (epoll_ctl(_epfd, EPOLL_CTL_MOD, sess->fd, &ev) == -1)
+         return false;
+      sess->want_write = want_write;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * finishPhase - records the latency of the phase that just got its reply and restarts the
+ *               phase timer for the request that is about to be sent
+ *
+ **********************************************************************************************/
+
+void LoadGen::finishPhase(Session *sess, phase p) {
+   uint64_t now = nowNS();
+   _hist[p].record(now - sess->phase_start);
+   if (p != p_connect)
+      _requests++;
+
+   sess->phase_start = now;
+   sess->inbuf.clear();
+}
+
+/**********************************************************************************************
+ * endSession - closes the session's socket, tallies the result and frees it. Failures are
+ *              charged to the phase the session was in.
+ *
+ **********************************************************************************************/
+
+void LoadGen::endSession(Session *sess, bool success) {
+   epoll_ctl(_epfd, EPOLL_CTL_DEL, sess->fd, NULL);
+   close(sess->fd);
+
+   if (success) {
+      _completed++;
+      _script_done[sess->script]++;
+   } else {
+      _failed++;
+      _phase_failed[phaseOf(sess->status)]++;
+   }
+
+   // Swap-remove from the active list
+   Session *last = _active.back();
+   _active[sess->slot] = last;
+   last->slot = sess->slot;
+   _active.pop_back();
+
+   delete sess;
+}
+
+/**********************************************************************************************
+ * checkTimeouts - fails any session whose current phase has been waiting longer than the
+ *                 configured timeout
+ *
+ **********************************************************************************************/
+
+void LoadGen::checkTimeouts(uint64_t now) {
+   uint64_t limit = (uint64_t) _params.timeout_ms * 1000000ULL;
+
+   // Walk backwards so swap-removal does not skip anything
+   for (size_t i = _active.size(); i > 0; i--) {
+      Session *sess = _active[i - 1];
+      if (now - sess->phase_start > limit)
+         endSession(sess, false);
+   }
+}
+
+/**********************************************************************************************
+ * report - prints overall throughput followed by the per-phase latency percentiles
+ *
+ *    Params:  out - the stream to print to (normally stdout)
+ **********************************************************************************************/
+
+void LoadGen::report(FILE *out) {
+   double secs = (_elapsed > 0.0) ? _elapsed : 1e-9;
+
+   fprintf(out, "Sessions: %lu completed, %lu failed in %.3f s\n",
+           (unsigned long) _completed, (unsigned long) _failed, _elapsed);
+   fprintf(out, "Throughput: %.2f sessions/s, %.2f requests/s\n\n",
+           _completed / secs, _requests / secs);
+
+   fprintf(out, "%-10s %10s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "failed",
+           "mean(ms)", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+   for (int p = 0; p < p_numphases; p++) {
+      const LatencyHist &h = _hist[p];
+      fprintf(out, "%-10s %10lu %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", phase_names[p],
+              (unsigned long) h.count(), (unsigned long) _phase_failed[p], h.mean() / 1e6,
+              h.percentile(50.0) / 1e6, h.percentile(99.0) / 1e6, h.percentile(99.9) / 1e6,
+              h.max() / 1e6);
+   }
+
+   if (_params.scripts.size() > 1) {
+      fprintf(out, "\n%-10s %10s %10s\n", "script", "weight", "completed");
+      for (unsigned int i = 0; i < _params.scripts.size(); i++)
+         fprintf(out, "%-10s %10u %10lu\n", _params.scripts[i].name.c_str(), _params.scripts[i].weight,
+                 (unsigned long) _script_done[i]);
+   }
+   fflush(out);
+}
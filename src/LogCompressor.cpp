@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <iostream>
+#include <vector>
+#include "LogCompressor.h"
+
+// Bytes read from a segment at a time
+const size_t compress_chunk = 65536;
+
+LogCompressor::LogCompressor(const std::string &index_file):_index_file(index_file) {
+
+}
+
+
+LogCompressor::~LogCompressor() {
+   stop();
+}
+
+/*****************************************************************************************
+ * submit - queues a segment that has been renamed out of the way of the writer
+ *
+ *    Params:  segment - path of the closed segment
+ *             first_ns, last_ns - wall clock range of its events
+ *****************************************************************************************/
+
+void LogCompressor::submit(const std::string &segment, uint64_t first_ns, uint64_t last_ns) {
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back({segment, first_ns, last_ns});
+
+      // Started here rather than in the constructor so the thread inherits the server's
+      // blocked signals
+      if (!_thread.joinable())
+         _thread = std::thread(&LogCompressor::worker, this);
+   }
+   _cv.notify_one();
+}
+
+void LogCompressor::stop() {
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+   }
+   _cv.notify_one();
+
+   if (_thread.joinable())
+      _thread.join();
+}
+
+/*****************************************************************************************
+ * worker - thread body: compresses and indexes segments in the order they were closed
+ *
+ *****************************************************************************************/
+
+void LogCompressor::worker() {
+   // Only this thread: compression should yield to the server loop and the hash workers
+   setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+
+   std::unique_lock<std::mutex> lock(_mutex);
+   while (true) {
+      _cv.wait(lock, [this] { return _stopping || !_queue.empty(); });
+      if (_queue.empty())
+         return;
+
+      Segment seg = _queue.front();
+      _queue.pop_front();
+      lock.unlock();
+
+      std::string gzpath = seg.path + ".gz";
+      if (compress(seg.path, gzpath)) {
+         unlink(seg.path.c_str());
+         addToIndex(seg, gzpath);
+      } else {
+         // Left as it is, still readable
+         std::cerr << "Could not compress log segment " << seg.path << std::endl;
+         addToIndex(seg, seg.path);
+      }
+
+      lock.lock();
+   }
+}
+
+/*****************************************************************************************
+ * compress - gzips path into gzpath, through a temporary file so gzpath only ever appears
+ *            complete
+ *
+ *    Returns: true if gzpath was written
+ *****************************************************************************************/
+
+bool LogCompressor::compress(const std::string &path, const std::string &gzpath) {
+   int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (in == -1)
+      return false;
+
+   std::string tmppath = gzpath + ".tmp";
+   gzFile out = gzopen(tmppath.c_str(), "wb6");
+   if (out == NULL) {
+      close(in);
+      return false;
+   }
+
+   std::vector<char> buf(compress_chunk);
+   ssize_t amt;
+   bool ok = true;
+   while ((amt = read(in, buf.data(), buf.size())) > 0) {
+      if (gzwrite(out, buf.data(), (unsigned int) amt) != (int) amt) {
+         ok = false;
+         break;
+      }
+   }
+   close(in);
+
+   if ((gzclose(out) != Z_OK) || (amt < 0))
+      ok = false;
+
+   if (!ok || (rename(tmppath.c_str(), gzpath.c_str()) != 0)) {
+      unlink(tmppath.c_str());
+      return false;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * addToIndex - appends the segment's line to the index in a single write
+ *
+ *****************************************************************************************/
+
+void LogCompressor::addToIndex(const Segment &seg, const std::string &path) {
+   // The index sits next to the segments, so it records their names without the directory
+   size_t slash = path.rfind('/');
+   std::string line = std::to_string(seg.first_ns) + " " + std::to_string(seg.last_ns) + " " +
+                      path.substr((slash == std::string::npos) ? 0 : slash + 1) + "\n";
+
+   int fd = open(_index_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+   if ((fd == -1) || (write(fd, line.data(), line.size()) != (ssize_t) line.size()))
+      std::cerr << "Could not add " << path << " to the log index " << _index_file << std::endl;
+   if (fd != -1)
+      close(fd);
+}
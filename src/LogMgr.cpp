@@ -0,0 +1,271 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "LogMgr.h"
+#include "exceptions.h"
+
+static uint64_t clockNS(clockid_t clock) {
+   timespec ts;
+   clock_gettime(clock, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+LogMgr::LogMgr(const char *filename, const CredIndex *creds):_filename(filename),_creds(creds) {
+   _pid = getpid();
+   _buf.reserve(log_flush_bytes + 2 * (evlog::record_header_size + evlog::max_body));
+}
+
+
+LogMgr::~LogMgr() {
+   try {
+      flush();
+   } catch (logfile_error &e) {
+      // Nowhere left to report it
+   }
+
+   if (_fd != -1)
+      close(_fd);
+
+   // Segments already closed are compressed before we go
+   if (_compressor)
+      _compressor->stop();
+}
+
+void LogMgr::setRotation(uint64_t max_bytes, unsigned int interval_secs) {
+   _rotate_bytes = max_bytes;
+   _rotate_interval_ns = interval_secs * 1000000000ULL;
+}
+
+/*****************************************************************************************
+ * record - encodes an event into the buffer; flush writes it out
+ *
+ *    Params:  ev - what happened
+ *             ipaddr, port - the client's address (network byte order) and port, 0 for none
+ *             user - the user, or no_user
+ *             name - instead of user, a name that is not in the CredIndex
+ *
+ *    Throws: logfile_error if a forced flush could not write the log
+ *****************************************************************************************/
+
+void LogMgr::record(evlog::event ev, uint32_t ipaddr, uint16_t port, userid user) {
+   if (_buf.empty())
+      startBatch();
+   if (user != no_user)
+      defineUser(user);
+
+   append(ev, ipaddr, port, (user == no_user) ? 0 : (uint64_t) user + 1, std::string_view());
+}
+
+void LogMgr::record(evlog::event ev, uint32_t ipaddr, uint16_t port, std::string_view name) {
+   if (_buf.empty())
+      startBatch();
+
+   append(ev, ipaddr, port, 0, name.substr(0, evlog::max_name));
+}
+
+/*****************************************************************************************
+ * append - encodes one event record onto the buffer, flushing if the buffer is full
+ *
+ *****************************************************************************************/
+
+void LogMgr::append(evlog::event ev, uint32_t ipaddr, uint16_t port, uint64_t user, std::string_view name) {
+   char rec[evlog::record_header_size + 5 * 10];
+   size_t len = evlog::record_header_size;
+
+   len += evlog::putVarint(rec + len, clockNS(CLOCK_MONOTONIC) - _mono_base);
+   len += evlog::putVarint(rec + len, evlog::zigzag((int64_t) (clockNS(CLOCK_REALTIME) - _wall_base)));
+   len += evlog::putVarint(rec + len, ntohl(ipaddr));
+   len += evlog::putVarint(rec + len, port);
+   len += evlog::putVarint(rec + len, user);
+
+   rec[0] = (char) ev;
+   rec[1] = (char) (len - evlog::record_header_size + name.size());
+   _buf.append(rec, len);
+   _buf.append(name.data(), name.size());
+
+   if (_buf.size() >= log_flush_bytes)
+      flush();
+}
+
+/*****************************************************************************************
+ * startBatch - opens a batch with the clock readings its events are encoded against. This
+ *              is where the log is rotated: nothing is buffered yet, so every rec_user the
+ *              new segment needs is still to be written.
+ *
+ *    Throws: logfile_error if a rotated log could not be reopened
+ *****************************************************************************************/
+
+void LogMgr::startBatch() {
+   _wall_base = clockNS(CLOCK_REALTIME);
+   if ((_fd != -1) && rotationDue(_wall_base))
+      rotate(_wall_base);
+
+   _mono_base = clockNS(CLOCK_MONOTONIC);
+
+   char rec[evlog::record_header_size + 3 * 10];
+   size_t len = evlog::record_header_size;
+   len += evlog::putVarint(rec + len, (uint64_t) _pid);
+   len += evlog::putVarint(rec + len, _mono_base);
+   len += evlog::putVarint(rec + len, _wall_base);
+
+   rec[0] = (char) evlog::rec_batch;
+   rec[1] = (char) (len - evlog::record_header_size);
+   _buf.append(rec, len);
+}
+
+/*****************************************************************************************
+ * defineUser - writes the user's name the first time this process logs their ID
+ *
+ *****************************************************************************************/
+
+void LogMgr::defineUser(userid user) {
+   if ((user < _defined.size()) && _defined[user])
+      return;
+   if (user >= _defined.size())
+      _defined.resize(user + 1, false);
+   _defined[user] = true;
+
+   std::string_view name;
+   if (_creds != NULL)
+      name = std::string_view(_creds->getName(user)).substr(0, evlog::max_name);
+
+   char rec[evlog::record_header_size + 10];
+   size_t len = evlog::record_header_size + evlog::putVarint(rec + evlog::record_header_size, user);
+
+   rec[0] = (char) evlog::rec_user;
+   rec[1] = (char) (len - evlog::record_header_size + name.size());
+   _buf.append(rec, len);
+   _buf.append(name.data(), name.size());
+}
+
+/*****************************************************************************************
+ * flush - appends the buffered records to the log in one write. The log is created (with
+ *         its file header) if needed and kept open.
+ *
+ *    Throws: logfile_error if the log could not be opened or written
+ *****************************************************************************************/
+
+void LogMgr::flush() {
+   if (_buf.empty())
+      return;
+
+   if (_fd == -1) {
+      try {
+         openLog();
+      } catch (logfile_error &e) {
+         _buf.clear();
+         _defined.clear();
+         throw;
+      }
+   }
+
+   if (_seg_bytes == 0) {
+      std::string hdr;
+      evlog::appendFileHeader(hdr);
+      _buf.insert(0, hdr);
+   }
+   if (_seg_first_ns == 0)
+      _seg_first_ns = _wall_base;
+   _seg_last_ns = clockNS(CLOCK_REALTIME);
+
+   size_t done = 0;
+   while (done < _buf.size()) {
+      ssize_t amt = write(_fd, _buf.data() + done, _buf.size() - done);
+      if (amt <= 0) {
+         _buf.clear();
+         _defined.clear();
+         throw logfile_error("Could not write to the log file");
+      }
+      done += amt;
+   }
+   _seg_bytes += done;
+   _buf.clear();
+}
+
+/*****************************************************************************************
+ * openLog - opens (or creates) the log and notes which file it is and how big
+ *
+ *    Throws: logfile_error if it could not be opened
+ *****************************************************************************************/
+
+void LogMgr::openLog() {
+   _fd = open(_filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+   if (_fd == -1)
+      throw logfile_error("Could not open log file for writing");
+
+   struct stat st;
+   if (fstat(_fd, &st) != 0) {
+      close(_fd);
+      _fd = -1;
+      throw logfile_error("Could not stat the log file");
+   }
+   _ino = st.st_ino;
+   _seg_bytes = st.st_size;
+   _seg_opened_ns = clockNS(CLOCK_REALTIME);
+   _seg_first_ns = 0;
+}
+
+/*****************************************************************************************
+ * rotationDue - checks the size and interval limits. Also reopens the log if another
+ *               process (the other server during a hot upgrade) has rotated it already.
+ *
+ *****************************************************************************************/
+
+bool LogMgr::rotationDue(uint64_t now_ns) {
+   struct stat st;
+   if ((stat(_filename.c_str(), &st) != 0) || (st.st_ino != _ino)) {
+      close(_fd);
+      _fd = -1;
+      _defined.clear();
+      openLog();
+      return false;
+   }
+
+   // A segment is never left holding nothing but the header
+   if (_seg_bytes <= evlog::file_header_size)
+      return false;
+
+   if ((_rotate_bytes > 0) && (_seg_bytes >= _rotate_bytes))
+      return true;
+   if ((_rotate_interval_ns > 0) && (now_ns - _seg_opened_ns >= _rotate_interval_ns))
+      return true;
+   return false;
+}
+
+/*****************************************************************************************
+ * rotate - renames the log out of the way, opens a new one and hands the closed segment
+ *          to the compressor. Only a rename and an open on the server loop. User names are
+ *          written again in the new segment, so each one can be read on its own.
+ *
+ *    Throws: logfile_error if the new log could not be opened
+ *****************************************************************************************/
+
+void LogMgr::rotate(uint64_t now_ns) {
+   time_t secs = (time_t) (_seg_opened_ns / 1000000000ULL);
+   struct tm tm;
+   gmtime_r(&secs, &tm);
+
+   char stamp[32];
+   strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+   std::string segment = _filename + "." + stamp + "." + std::to_string(_pid) + "." + std::to_string(++_rotations);
+
+   uint64_t first_ns = _seg_first_ns ? _seg_first_ns : _seg_opened_ns;
+   uint64_t last_ns = _seg_last_ns;
+
+   if (rename(_filename.c_str(), segment.c_str()) != 0) {
+      // Keep writing where we are and try again next batch
+      _seg_opened_ns = now_ns;
+      return;
+   }
+   close(_fd);
+   _fd = -1;
+   _defined.clear();
+   openLog();
+
+   if (!_compressor)
+      _compressor = std::make_unique<LogCompressor>(_filename + ".index");
+   _compressor->submit(segment, first_ns, last_ns);
+}
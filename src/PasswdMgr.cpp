@@ -5,7 +5,10 @@
 #include <algorithm>
 #include <cstring>
 #include <list>
+#include <unordered_map>
 #include <ctime>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "PasswdMgr.h"
 #include "FileDesc.h"
 #include "strfuncts.h"
@@ -34,8 +37,9 @@ PasswdMgr::~PasswdMgr() {
 bool PasswdMgr::checkUser(const char *name) {
    //creates empty container to used the find user
    std::vector<uint8_t> passwd, salt;
+   Argon2Profile profile;
 
-   bool result = findUser(name, passwd, salt);
+   bool result = findUser(name, passwd, salt, profile);
 
    return result;
      
@@ -43,7 +47,9 @@ bool PasswdMgr::checkUser(const char *name) {
 
 /*******************************************************************************************
  * checkPasswd - Checks the password for a given user to see if it matches the password
- *               in the passwd file
+ *               in the passwd file. The password is hashed with the profile stored in the
+ *               user's record; if that profile is not the current one, the record is
+ *               rehashed with the current profile once the password has been verified.
  *
  *    Params:  name - username string to check (case insensitive)
  *             passwd - password string to hash and compare (case sensitive)
@@ -58,21 +64,30 @@ bool PasswdMgr::checkPasswd(const char *name, const char *passwd) {
    std::vector<uint8_t> userhash; // hash from the password file
    std::vector<uint8_t> passhash; // hash derived from the parameter passwd
    std::vector<uint8_t> salt;
+   Argon2Profile profile;         // parameters the stored hash was made with
 
    // Check if the user exists and get the passwd string
-   if (!findUser(name, userhash, salt))
+   if (!findUser(name, userhash, salt, profile))
       return false;
 
-   hashArgon2(passhash, salt, passwd, &salt);
+   hashArgon2(passhash, salt, passwd, &salt, &profile);
 
-   if (userhash == passhash)
-      return true;
+   if (userhash != passhash)
+      return false;
 
-   return false;
+   // Upgrade records hashed with outdated parameters while we have the plaintext
+   if (profile != _profile) {
+      std::vector<uint8_t> newhash, newsalt;
+      hashArgon2(newhash, newsalt, passwd, NULL, &_profile);
+      replaceUser(name, newhash, newsalt, _profile);
+   }
+
+   return true;
 }
 
 /*******************************************************************************************
- * changePasswd - Changes the password for the given user to the password string given
+ * changePasswd - Changes the password for the given user to the password string given,
+ *                hashing it with a fresh salt and the current profile
  *
  *    Params:  name - username string to change (case insensitive)
  *             passwd - the new password (case sensitive)
@@ -88,71 +103,12 @@ bool PasswdMgr::changePasswd(const char *name, const char *passwd) {
    //container that stores the hashed passwd
    std::vector<uint8_t> ret_hash{};
    std::vector<uint8_t> ret_salt{};
-   //std::vector<uint8_t> in_salt{1,7,7,5,7,1,3,6,1,5,4,5,7,5,4,9};//testing
-   std::vector<uint8_t> in_salt{};
-   
-   // Insert your insane code here
-   //Keeps track of where it needs to overwrite passwd file
-   int offset = 0;
-
-   //opens password file to find user, hash, & salt
-   FileFD pwfile(_pwd_file.c_str());
-   if (!pwfile.openFile(FileFD::readfd))
-      throw pwfile_error("Could not open passwd file for reading");
-
-   bool eof = false;
-   
-   //Find the name in passwd file ans stores the location in the file in offset variable
-   while (!eof) {
-      ret_hash.clear();
-      in_salt.clear();
-      std::string tempBuffer;
-      ssize_t bytes = pwfile.readStr(tempBuffer);
-      offset = offset + bytes + 1;
-
-      if (tempBuffer.size() == 0) {
-         eof = true;
-         continue;
-      }
-
-      if (!tempBuffer.compare(name)) {
-         pwfile.closeFD();
-         break;
-      }
-      pwfile.readBytes(ret_hash, 32);
-      pwfile.readBytes(in_salt, 16);
-      offset = offset + 48;
-      tempBuffer.clear();
-      pwfile.readStr(tempBuffer);
-      offset = offset + 1;
-   }
 
    //Hashes the new passwd and creates new salt
-   ret_hash.clear();
-   hashArgon2(ret_hash, ret_salt, passwd, &in_salt);
-
-   pwfile.closeFD();
-
-   //opens file to write new hash and salt
-   FileFD pwfile2(_pwd_file.c_str());
-   if (!pwfile2.openFile(FileFD::writefd))
-      throw pwfile_error("Could not open passwd file for reading");
+   hashArgon2(ret_hash, ret_salt, passwd);
 
-   int fd = pwfile2.getFD();
-
-   //goes to the location of of the previos user hash
-   lseek(fd, offset, SEEK_SET);
-
-   //overwrites exiting hash and salt with the new 
-   int writeResult = writeHash(pwfile2, ret_hash, ret_salt);
-
-   pwfile2.closeFD();
-
-   if (writeResult == 0){
-      return false;
-   }
-
-   return true;
+   //Records are variable length now, so the file is rewritten rather than patched in place
+   return replaceUser(name, ret_hash, ret_salt, _profile);
 }
 
 /*****************************************************************************************************
@@ -162,6 +118,8 @@ bool PasswdMgr::changePasswd(const char *name, const char *passwd) {
  *    Params:  pwfile - FileDesc of password file already opened for reading
  *             name - std string to store the name read in
  *             hash, salt - vectors to store the read-in hash and salt respectively
+ *             profile - the Argon2 profile the hash was made with (the legacy default for
+ *                       records written before profiles were stored)
  *
  *    Returns: true if a new entry was read, false if eof reached 
  * 
@@ -169,7 +127,8 @@ bool PasswdMgr::changePasswd(const char *name, const char *passwd) {
  *
  *****************************************************************************************************/
 
-bool PasswdMgr::readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt)
+bool PasswdMgr::readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                         Argon2Profile &profile)
 {
 
    // Insert your perfect code here!
@@ -180,11 +139,16 @@ bool PasswdMgr::readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t>
    
    std::string tempString;
 
-   //reads hash & salt 
-   pwfile.readBytes(hash, 32);
-   pwfile.readBytes(salt, 16);
+   //reads hash & salt, then the profile string that ends the record
+   pwfile.readBytes(hash, hashlen);
+   pwfile.readBytes(salt, saltlen);
    pwfile.readStr(tempString);
 
+   if (tempString.empty())
+      profile = Argon2Profile();
+   else if (!profile.fromString(tempString))
+      throw pwfile_error("Password file record has an invalid Argon2 profile");
+
    return true;
 }
 
@@ -194,6 +158,7 @@ bool PasswdMgr::readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t>
  *    Params:  pwfile - FileDesc of password file already opened for writing
  *             name - std string of the name 
  *             hash, salt - vectors of the hash and salt to write to disk
+ *             profile - the Argon2 profile the hash was made with
  *
  *    Returns: bytes written
  *
@@ -201,28 +166,142 @@ bool PasswdMgr::readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t>
  *
  *****************************************************************************************************/
 
-int PasswdMgr::writeUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt)
+int PasswdMgr::writeUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                         const Argon2Profile &profile)
 {
-   //writes the name, hash, and salt
-   int results;
-   results = pwfile.writeFD(name);
-   results = pwfile.writeFD("\n");
-   results = pwfile.writeBytes(hash);
-   results = pwfile.writeBytes(salt);
-   results = pwfile.writeFD("\n");
-
-   return results; 
+   // Record format is username\n{32 byte hash}{16 byte salt}{profile string}\n
+   std::string profstr = profile.toString();
+
+   //writes the name, hash, salt, and profile
+   int results = 0;
+   if ((results = pwfile.writeFD(name)) < 0 ||
+       (results = pwfile.writeFD("\n")) < 0 ||
+       (results = pwfile.writeBytes(hash)) < 0 ||
+       (results = pwfile.writeBytes(salt)) < 0 ||
+       (results = pwfile.writeFD(profstr)) < 0 ||
+       (results = pwfile.writeFD("\n")) < 0)
+      throw pwfile_error("Could not write to the passwd file");
+
+   return name.size() + hash.size() + salt.size() + profstr.size() + 2; 
 }
 
-int PasswdMgr::writeHash(FileFD &pwfile, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt)
-{
-   //writes hash and salt
-   int results;
-   results = pwfile.writeBytes(hash);
-   results = pwfile.writeBytes(salt);
-   results = pwfile.writeFD("\n");
+/*****************************************************************************************************
+ * replaceUser - Rewrites the password file with a new hash, salt and profile for one user
+ *
+ *    Params:  name - the user to update
+ *             hash, salt, profile - the user's new credential
+ *
+ *    Returns: true if the user was found and updated, false if not found
+ *
+ *    Throws: pwfile_error exception if the files could not be read, written or renamed
+ *
+ *****************************************************************************************************/
+
+bool PasswdMgr::replaceUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                            const Argon2Profile &profile) {
+   std::vector<PasswdChange> changes(1);
+   changes[0].rec = {name, hash, salt, profile};
+   return rewrite(changes, false) > 0;
+}
+
+/*****************************************************************************************************
+ * updateUsers - Applies a batch of changes (see Replicator) with a single rewrite of the file. Later
+ *               changes to a user win over earlier ones in the batch; users not in the file are
+ *               appended in the order they first appear.
+ *
+ *    Returns: the number of records written or removed
+ *
+ *    Throws: pwfile_error exception if the files could not be read, written or renamed
+ *
+ *****************************************************************************************************/
 
-   return results; 
+size_t PasswdMgr::updateUsers(const std::vector<PasswdChange> &changes) {
+   return rewrite(changes, true);
+}
+
+/*****************************************************************************************************
+ * rewrite - Rewrites the password file with changes applied. The new file is written beside the old
+ *           one and renamed over it, so a crash part way through never leaves a truncated password
+ *           file. If no record ends up changed, the old file is left as it is.
+ *
+ *    Params:  changes - new credentials, or removals, by username
+ *             add_missing - append the users that are not in the file (else they are ignored)
+ *
+ *    Returns: the number of records written or removed
+ *
+ *    Throws: pwfile_error exception if the files could not be read, written or renamed
+ *
+ *****************************************************************************************************/
+
+size_t PasswdMgr::rewrite(const std::vector<PasswdChange> &changes, bool add_missing) {
+   // The last change to each name, and whether the file had that name
+   std::unordered_map<std::string, size_t> latest;
+   for (size_t i = 0; i < changes.size(); i++)
+      latest[changes[i].rec.name] = i;
+   std::vector<bool> seen(changes.size(), false);
+
+   FileFD pwfile(_pwd_file.c_str());
+   if (!pwfile.openFile(FileFD::readfd))
+      throw pwfile_error("Could not open passwd file for reading");
+
+   std::string tmpname = _pwd_file + ".tmp";
+   FileFD tmpfile(tmpname.c_str());
+   if (!tmpfile.openFile(FileFD::createfd)) {
+      pwfile.closeFD();
+      throw pwfile_error("Could not create temporary passwd file");
+   }
+
+   // Keep the permissions of the file we are replacing
+   struct stat st;
+   if (fstat(pwfile.getFD(), &st) == 0)
+      fchmod(tmpfile.getFD(), st.st_mode & 07777);
+
+   size_t written = 0;
+   PasswdRecord urec;
+
+   try {
+      while (readUser(pwfile, urec.name, urec.hash, urec.salt, urec.profile)) {
+         auto it = latest.find(urec.name);
+         if (it == latest.end()) {
+            writeUser(tmpfile, urec.name, urec.hash, urec.salt, urec.profile);
+            continue;
+         }
+
+         seen[it->second] = true;
+         written++;
+         if (!changes[it->second].removed) {
+            PasswdRecord rec = changes[it->second].rec;
+            writeUser(tmpfile, rec.name, rec.hash, rec.salt, rec.profile);
+         }
+      }
+
+      for (size_t i = 0; add_missing && (i < changes.size()); i++) {
+         if (seen[i] || changes[i].removed || (latest[changes[i].rec.name] != i))
+            continue;
+         PasswdRecord rec = changes[i].rec;
+         writeUser(tmpfile, rec.name, rec.hash, rec.salt, rec.profile);
+         written++;
+      }
+   } catch (pwfile_error &e) {
+      pwfile.closeFD();
+      tmpfile.closeFD();
+      unlink(tmpname.c_str());
+      throw;
+   }
+
+   pwfile.closeFD();
+   fsync(tmpfile.getFD());
+   tmpfile.closeFD();
+
+   if (written == 0) {
+      unlink(tmpname.c_str());
+      return 0;
+   }
+
+   if (rename(tmpname.c_str(), _pwd_file.c_str()) != 0)
+      throw pwfile_error("Could not replace passwd file");
+
+   return written;
 }
 
 /*****************************************************************************************************
@@ -232,6 +311,7 @@ int PasswdMgr::writeHash(FileFD &pwfile, std::vector<uint8_t> &hash, std::vector
  *    Params:  name - the username to search for
  *             hash - vector to store the user's password hash
  *             salt - vector to store the user's salt string
+ *             profile - stores the Argon2 profile the user's hash was made with
  *
  *    Returns: true if found, false if not
  *
@@ -239,7 +319,8 @@ int PasswdMgr::writeHash(FileFD &pwfile, std::vector<uint8_t> &hash, std::vector
  *
  *****************************************************************************************************/
 
-bool PasswdMgr::findUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt) {
+bool PasswdMgr::findUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt,
+                         Argon2Profile &profile) {
 
    FileFD pwfile(_pwd_file.c_str());
 
@@ -249,13 +330,13 @@ bool PasswdMgr::findUser(const char *name, std::vector<uint8_t> &hash, std::vect
    if (!pwfile.openFile(FileFD::readfd))
       throw pwfile_error("Could not open passwd file for reading");
 
-   // Password file should be in the format username\n{32 byte hash}{16 byte salt}\n
+   // Password file should be in the format username\n{32 byte hash}{16 byte salt}{profile}\n
    // reads file until the find the specified name
    bool eof = false;
    while (!eof) {
       std::string uname{};
 
-      if (!readUser(pwfile, uname, hash, salt)) {
+      if (!readUser(pwfile, uname, hash, salt, profile)) {
          eof = true;
          continue;
       }
@@ -273,70 +354,88 @@ bool PasswdMgr::findUser(const char *name, std::vector<uint8_t> &hash, std::vect
 }
 
 
+/*****************************************************************************************************
+ * readAll - Reads the whole password file into records, in file order
+ *
+ *    Throws: pwfile_error exception if the pwfile could not be opened or was corrupted
+ *
+ *****************************************************************************************************/
+
+void PasswdMgr::readAll(std::vector<PasswdRecord> &records) {
+   FileFD pwfile(_pwd_file.c_str());
+   if (!pwfile.openFile(FileFD::readfd))
+      throw pwfile_error("Could not open passwd file for reading");
+
+   records.clear();
+   PasswdRecord rec;
+   try {
+      while (readUser(pwfile, rec.name, rec.hash, rec.salt, rec.profile))
+         records.push_back(rec);
+   } catch (pwfile_error &e) {
+      pwfile.closeFD();
+      throw;
+   }
+   pwfile.closeFD();
+}
+
 /*****************************************************************************************************
  * hashArgon2 - Performs a hash on the password using the Argon2 library. Implementation algorithm
  *              taken from the http://github.com/P-H-C/phc-winner-argon2 example. 
  *
- *    Params:  dest - the std string object to store the hash
+ *    Params:  ret_hash - vector to store the hash
+ *             ret_salt - vector to store a newly generated salt (when in_salt is not given)
  *             passwd - the password to be hashed
+ *             in_salt - salt to hash with; NULL or empty to generate a new one
+ *             profile - Argon2 parameters to use; NULL for the current profile
  *
- *    Throws: runtime_error if the salt passed in is not the right size
+ *    Throws: runtime_error if Argon2 could not compute the hash
  *****************************************************************************************************/
 void PasswdMgr::hashArgon2(std::vector<uint8_t> &ret_hash, std::vector<uint8_t> &ret_salt, 
-                           const char *in_passwd, std::vector<uint8_t> *in_salt) {
+                           const char *in_passwd, std::vector<uint8_t> *in_salt, const Argon2Profile *profile) {
    // Hash those passwords!!!!
    //code based off usage example at https://github.com/P-H-C/phc-winner-argon2
-   int HASHLEN = 32;
-   int SALTLEN = 16;
+   uint8_t hash1[hashlen];
 
-   uint8_t hash1[HASHLEN];
+   uint8_t salt[saltlen];
+   memset( salt, 0x00, saltlen );
 
-   uint8_t salt[SALTLEN];
-   memset( salt, 0x00, SALTLEN );
+   if (profile == NULL)
+      profile = &_profile;
 
    //checks if new salt is needs to be created
-   if (in_salt->empty())
+   if ((in_salt == NULL) || in_salt->empty())
    {
-      ret_salt.clear();
-      //creates salt
-      for (int i = 0; i < 16; i++){
-         int randomNum = rand() % 30;
-         ret_salt.push_back(randomNum);
-         salt[i] = randomNum;
-      }
+      makeSalt(ret_salt);
+      std::copy(ret_salt.begin(), ret_salt.end(), salt);
    }
    else
    {
-      for (int i = 0; i < 16; i++){
+      for (int i = 0; i < saltlen; i++){
          salt[i] = in_salt->at(i);
       }
    }
 
-   //convert char * to uint8_t as needed for argon2 function
-   uint8_t *pwd = (uint8_t *)strdup(in_passwd);
-   uint32_t pwdlen = strlen((char *)pwd);
-
-   uint32_t t_cost = 2;            // 1-pass computation
-   uint32_t m_cost = (1<<16);      // 64 mebibytes memory usage
-   uint32_t parallelism = 1;       // number of threads and lanes
-
-    // high-level API
-   //argon2i_hash_raw(t_cost, m_cost, parallelism, pwd, pwdlen, in_salt, SALTLEN, hash1, HASHLEN);
-   argon2i_hash_raw(t_cost, m_cost, parallelism, pwd, pwdlen, salt, SALTLEN, hash1, HASHLEN);
+   if (!profile->hash(in_passwd, strlen(in_passwd), salt, saltlen, hash1, hashlen))
+      throw std::runtime_error("Argon2 hashing failed");
 
    //pushing returned hash in to vector container
-   for (int i = 0; i < 32; i++){
-      ret_hash.push_back(hash1[i]);
-   }
+   ret_hash.assign(hash1, hash1 + hashlen);
+}
 
-   //delete created memory
-   delete pwd;
+/*****************************************************************************************************
+ * makeSalt - fills salt with a newly generated salt, for callers that hash outside of hashArgon2
+ *
+ *****************************************************************************************************/
 
+void PasswdMgr::makeSalt(std::vector<uint8_t> &salt) {
+   salt.clear();
+   for (int i = 0; i < saltlen; i++)
+      salt.push_back(rand() % 30);
 }
 
 /****************************************************************************************************
  * addUser - First, confirms the user doesn't exist. If not found, then adds the new user with a new
- *           password and salt
+ *           password and salt, hashed with the current profile
  *
  *    Throws: pwfile_error if issues editing the password file
  ****************************************************************************************************/
@@ -348,17 +447,9 @@ void PasswdMgr::addUser(const char *name, const char *passwd) {
    // Add those users!
    std::vector<uint8_t> ret_hash;
    std::vector<uint8_t> ret_salt;
-   //std::vector<uint8_t> in_salt{1,7,7,5,7,1,3,6,1,5,4,5,7,5,4,9};//Testing
-   std::vector<uint8_t> in_salt{};
 
-   //creates a random 16 byte salt
-   for (int i = 0; i < 16; i++){
-      int randomNum = rand() % 30;
-      in_salt.push_back(randomNum);
-   }
-   
-   //hashes passwd with Argon2 function
-   hashArgon2(ret_hash, ret_salt, passwd, &in_salt);
+   //hashes passwd with Argon2 function, creating a random 16 byte salt
+   hashArgon2(ret_hash, ret_salt, passwd);
    
    //adding username, passwd, and salt to file
    FileFD pwfile(_pwd_file.c_str());
@@ -368,10 +459,9 @@ void PasswdMgr::addUser(const char *name, const char *passwd) {
       throw pwfile_error("Could not open passwd file for reading");
 
    
-   // Password file should be in the format username\n{32 byte hash}{16 byte salt}\n
-   writeUser(pwfile, nameStr, ret_hash, in_salt);
+   // Password file should be in the format username\n{32 byte hash}{16 byte salt}{profile}\n
+   writeUser(pwfile, nameStr, ret_hash, ret_salt, _profile);
 
    pwfile.closeFD();
    
 }
-
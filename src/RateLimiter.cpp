@@ -0,0 +1,154 @@
+#include <time.h>
+#include <algorithm>
+#include "RateLimiter.h"
+
+// Slots per set; 8 x 16 bytes = two cache lines
+const size_t limiter_ways = 8;
+
+// Tokens are stored in 1/256ths in the low bits of the state word, the refill time in ms
+// above them (40 bits of ms is decades of uptime)
+const unsigned int token_bits = 24;
+const uint64_t token_mask = (1ULL << token_bits) - 1;
+const double token_scale = 256.0;
+
+RateLimiter::RateLimiter(double rate, double burst, size_t capacity) {
+   size_t sets = 1;
+   while (sets * limiter_ways < capacity)
+      sets <<= 1;
+
+   _slots = std::make_unique<Slot[]>(sets * limiter_ways);
+   _set_mask = sets - 1;
+
+   _rate_per_ms = rate * token_scale / 1000.0;
+   double max_burst = (double) token_mask;
+   _burst = (uint64_t) std::min(std::max(burst, 1.0) * token_scale, max_burst);
+
+   // Times are kept relative to construction so they fit in the state word
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   _epoch_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+RateLimiter::~RateLimiter() {
+
+}
+
+/*****************************************************************************************
+ * allow - takes tokens for one event from the IP's bucket
+ *
+ *    Params:  ipaddr - the client address as returned by SocketFD::getIPAddr
+ *             cost - tokens the event costs
+ *
+ *    Returns: true if the event is allowed, false if the IP is over its rate
+ *****************************************************************************************/
+
+bool RateLimiter::allow(unsigned long ipaddr, double cost) {
+   return take(ipaddr, cost, true);
+}
+
+bool RateLimiter::check(unsigned long ipaddr, double cost) {
+   return take(ipaddr, cost, false);
+}
+
+/*****************************************************************************************
+ * take - refills the IP's bucket for the time since it was last touched and, if it holds
+ *        enough tokens, optionally takes them. Retries if another thread updated the bucket
+ *        in between.
+ *
+ *****************************************************************************************/
+
+bool RateLimiter::take(unsigned long ipaddr, double cost, bool consume) {
+   uint64_t now = nowMS();
+   Slot &slot = findSlot(ipaddr, now);
+   uint64_t need = (uint64_t) (cost * token_scale);
+
+   uint64_t old = slot.state.load(std::memory_order_relaxed);
+   while (true) {
+      uint64_t cur = refill(old, now);
+      uint64_t tokens = cur & token_mask;
+
+      if (tokens < need) {
+         _denied++;
+         // Keep the refill so the partial tokens are not counted again
+         slot.state.compare_exchange_weak(old, cur, std::memory_order_relaxed);
+         return false;
+      }
+      if (!consume)
+         return true;
+
+      if (slot.state.compare_exchange_weak(old, cur - need, std::memory_order_relaxed))
+         return true;
+   }
+}
+
+/*****************************************************************************************
+ * refill - adds the tokens earned since the state's timestamp, capped at the burst size.
+ *          The timestamp only moves when at least one token fraction was added, so slow
+ *          rates polled often still accumulate.
+ *
+ *****************************************************************************************/
+
+uint64_t RateLimiter::refill(uint64_t state, uint64_t now) const {
+   uint64_t last = state >> token_bits;
+   uint64_t tokens = state & token_mask;
+
+   if (now <= last)
+      return state;
+
+   uint64_t added = (uint64_t) ((now - last) * _rate_per_ms);
+   if (added == 0)
+      return state;
+
+   tokens = std::min(tokens + added, _burst);
+   return (now << token_bits) | tokens;
+}
+
+/*****************************************************************************************
+ * findSlot - finds the IP's slot in its set, or claims the least recently used slot of the
+ *            set with a full bucket. An eviction racing with another thread's update of the
+ *            same slot can leave one IP with the other's tokens; that is the price of never
+ *            locking and only ever errs by one bucket's worth.
+ *
+ *****************************************************************************************/
+
+RateLimiter::Slot &RateLimiter::findSlot(unsigned long ipaddr, uint64_t now) {
+   uint64_t key = (uint64_t) ipaddr + 1;
+   size_t set = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & _set_mask;
+   Slot *ways = &_slots[set * limiter_ways];
+
+   while (true) {
+      Slot *victim = NULL;
+      uint64_t victim_key = 0;
+      uint64_t oldest = UINT64_MAX;
+
+      for (size_t i = 0; i < limiter_ways; i++) {
+         uint64_t k = ways[i].key.load(std::memory_order_acquire);
+         if (k == key)
+            return ways[i];
+
+         // Empty slots always go first
+         uint64_t last = (k == 0) ? 0 : (ways[i].state.load(std::memory_order_relaxed) >> token_bits) + 1;
+         if (last < oldest) {
+            oldest = last;
+            victim = &ways[i];
+            victim_key = k;
+         }
+      }
+
+      if (victim->key.compare_exchange_strong(victim_key, key, std::memory_order_acq_rel)) {
+         if (victim_key != 0)
+            _evictions++;
+         victim->state.store((now << token_bits) | _burst, std::memory_order_release);
+         return *victim;
+      }
+      // Someone else claimed it first, look again (they may have inserted this very IP)
+   }
+}
+
+uint64_t RateLimiter::nowMS() const {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   uint64_t ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+   return (ns - _epoch_ns) / 1000000ULL;
+}
@@ -0,0 +1,314 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ReplLog.h"
+#include "exceptions.h"
+
+namespace repl {
+
+static void put32(std::string &out, uint32_t v) {
+   uint32_t n = htonl(v);
+   out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+static void put64(std::string &out, uint64_t v) {
+   put32(out, (uint32_t) (v >> 32));
+   put32(out, (uint32_t) v);
+}
+
+static uint32_t get32(const char *data) {
+   uint32_t n;
+   memcpy(&n, data, sizeof(n));
+   return ntohl(n);
+}
+
+uint64_t get64(const char *data) {
+   return ((uint64_t) get32(data) << 32) | get32(data + 4);
+}
+
+// A length byte and the bytes; longer fields are cut (no valid field is anywhere close)
+static void putField(std::string &out, const void *data, size_t len) {
+   if (len > 255)
+      len = 255;
+   out += (char) len;
+   out.append(static_cast<const char *>(data), len);
+}
+
+static bool getField(const char *&p, const char *end, const char *&data, size_t &len) {
+   if (p >= end)
+      return false;
+   len = (uint8_t) *p++;
+   if ((size_t) (end - p) < len)
+      return false;
+   data = p;
+   p += len;
+   return true;
+}
+
+/*****************************************************************************************
+ * parseFrame - decodes a frame header in place
+ *
+ *    Params:  data, avail - the received bytes, starting at a frame boundary
+ *             type, len - set to the frame's type and body length
+ *
+ *    Returns: true if the whole frame is there, false if more data is needed. A length
+ *             over max_frame is returned as is for the caller to reject.
+ *****************************************************************************************/
+
+bool parseFrame(const char *data, size_t avail, char &type, uint32_t &len) {
+   if (avail < frame_header_size)
+      return false;
+
+   uint32_t total = get32(data);
+   if ((total == 0) || (total > max_frame)) {
+      type = 0;
+      len = total;
+      return true;
+   }
+   if (avail < 4 + (size_t) total)
+      return false;
+
+   type = data[4];
+   len = total - 1;
+   return true;
+}
+
+void appendSubscribe(std::string &out, uint64_t next) {
+   put32(out, 1 + 8);
+   out += f_subscribe;
+   put64(out, next);
+}
+
+/*****************************************************************************************
+ * appendChange - appends a change as a frame of the given type; seq is only written for
+ *                an f_record
+ *
+ *****************************************************************************************/
+
+void appendChange(std::string &out, char type, uint64_t seq, const PasswdChange &change) {
+   size_t start = out.size();
+   put32(out, 0);
+   out += type;
+   if (type == f_record)
+      put64(out, seq);
+
+   std::string profile = change.removed ? std::string() : change.rec.profile.toString();
+   out += change.removed ? op_delete : op_put;
+   putField(out, change.rec.name.data(), change.rec.name.size());
+   putField(out, change.rec.hash.data(), change.removed ? 0 : change.rec.hash.size());
+   putField(out, change.rec.salt.data(), change.removed ? 0 : change.rec.salt.size());
+   putField(out, profile.data(), profile.size());
+
+   uint32_t total = htonl((uint32_t) (out.size() - start - 4));
+   memcpy(&out[start], &total, sizeof(total));
+}
+
+void appendRefused(std::string &out, const std::string &why) {
+   put32(out, (uint32_t) (1 + why.size()));
+   out += f_refused;
+   out += why;
+}
+
+/*****************************************************************************************
+ * parseChange - decodes a change body
+ *
+ *    Returns: false if it is malformed
+ *****************************************************************************************/
+
+bool parseChange(const char *body, size_t len, PasswdChange &change) {
+   const char *p = body, *end = body + len;
+   if (p >= end)
+      return false;
+
+   char op = *p++;
+   if ((op != op_put) && (op != op_delete))
+      return false;
+
+   const char *name, *hash, *salt, *profile;
+   size_t namelen, hashlen, saltlen, proflen;
+   if (!getField(p, end, name, namelen) || !getField(p, end, hash, hashlen) ||
+       !getField(p, end, salt, saltlen) || !getField(p, end, profile, proflen) ||
+       (p != end) || (namelen == 0))
+      return false;
+
+   change.removed = (op == op_delete);
+   change.rec.name.assign(name, namelen);
+   change.rec.hash.assign(hash, hash + hashlen);
+   change.rec.salt.assign(salt, salt + saltlen);
+   change.rec.profile = Argon2Profile();
+   if (!change.removed && (proflen > 0) &&
+       !change.rec.profile.fromString(std::string(profile, proflen)))
+      return false;
+   return true;
+}
+
+}
+
+ReplLog::ReplLog(const char *filename):_filename(filename) {
+
+}
+
+
+ReplLog::~ReplLog() {
+   if (_fd != -1)
+      close(_fd);
+}
+
+/*****************************************************************************************
+ * open - opens the log, creating it if needed, and indexes its records. A record cut
+ *        short by a crash while it was being appended is truncated away.
+ *
+ *    Throws: pwfile_error if the log could not be opened, or is not a replication log
+ *****************************************************************************************/
+
+void ReplLog::open() {
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   // The log holds password hashes, so it gets the same permissions as the passwd file
+   _fd = ::open(_filename.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+   if (_fd == -1)
+      throw pwfile_error("Could not open the replication log " + _filename);
+
+   off_t size = lseek(_fd, 0, SEEK_END);
+   _offsets.clear();
+   _end = 0;
+
+   char hdr[repl::frame_header_size + 8];
+   while (_end + (off_t) sizeof(hdr) <= size) {
+      if (pread(_fd, hdr, sizeof(hdr), _end) != (ssize_t) sizeof(hdr))
+         break;
+
+      uint32_t total;
+      memcpy(&total, hdr, sizeof(total));
+      total = ntohl(total);
+      if ((hdr[4] != repl::f_record) || (total < 1 + 8) || (total > repl::max_frame) ||
+          (repl::get64(hdr + 5) != _offsets.size() + 1))
+         throw pwfile_error("Replication log " + _filename + " is corrupt");
+
+      if (_end + 4 + (off_t) total > size)
+         break;
+      _offsets.push_back(_end);
+      _end += 4 + total;
+   }
+
+   if ((_end < size) && (ftruncate(_fd, _end) != 0))
+      throw pwfile_error("Could not truncate the torn end of the replication log");
+}
+
+/*****************************************************************************************
+ * append - numbers a change and appends it to the log
+ *
+ *    Returns: the change's sequence number
+ *
+ *    Throws: pwfile_error if the log could not be written
+ *****************************************************************************************/
+
+uint64_t ReplLog::append(const PasswdChange &change) {
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   uint64_t seq = _offsets.size() + 1;
+   std::string frame;
+   repl::appendChange(frame, repl::f_record, seq, change);
+   writeAll(frame);
+   return seq;
+}
+
+/*****************************************************************************************
+ * appendRecord - appends a record as the primary sent it
+ *
+ *    Returns: false (appending nothing) if seq is not the next sequence number
+ *
+ *    Throws: pwfile_error if the log could not be written
+ *****************************************************************************************/
+
+bool ReplLog::appendRecord(uint64_t seq, const char *frame, size_t len) {
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   if (seq != _offsets.size() + 1)
+      return false;
+   writeAll(std::string(frame, len));
+   return true;
+}
+
+/*****************************************************************************************
+ * writeAll - writes one whole record and syncs it, then indexes it. Called with the mutex
+ *            held.
+ *
+ *    Throws: pwfile_error if the log could not be written
+ *****************************************************************************************/
+
+void ReplLog::writeAll(const std::string &data) {
+   size_t done = 0;
+   while (done < data.size()) {
+      ssize_t n = write(_fd, data.data() + done, data.size() - done);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+
+         // Don't leave half a record for the next one to follow (open() would cut it anyway)
+         if ((done > 0) && (ftruncate(_fd, _end) != 0))
+            throw pwfile_error("Could not write to the replication log, which now ends in a torn record");
+         throw pwfile_error("Could not write to the replication log");
+      }
+      done += n;
+   }
+
+   if (fdatasync(_fd) != 0)
+      throw pwfile_error("Could not sync the replication log");
+
+   _offsets.push_back(_end);
+   _end += data.size();
+}
+
+uint64_t ReplLog::lastSeq() {
+   std::lock_guard<std::mutex> lock(_mutex);
+   return _offsets.size();
+}
+
+bool ReplLog::offsetOf(uint64_t seq, off_t &offset) {
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   if (seq == 0)
+      seq = 1;
+   if (seq > _offsets.size() + 1)
+      return false;
+   offset = (seq == _offsets.size() + 1) ? _end : _offsets[seq - 1];
+   return true;
+}
+
+off_t ReplLog::end() {
+   std::lock_guard<std::mutex> lock(_mutex);
+   return _end;
+}
+
+/*****************************************************************************************
+ * readState - replays the log into every user's latest credential; removed users are
+ *             left out
+ *
+ *    Throws: pwfile_error if the log could not be read
+ *****************************************************************************************/
+
+void ReplLog::readState(std::unordered_map<std::string, PasswdRecord> &state) {
+   std::lock_guard<std::mutex> lock(_mutex);
+
+   state.clear();
+   char buf[repl::max_frame + 4];
+   PasswdChange change;
+   for (size_t i = 0; i < _offsets.size(); i++) {
+      off_t next = (i + 1 < _offsets.size()) ? _offsets[i + 1] : _end;
+      size_t len = next - _offsets[i];
+      if (pread(_fd, buf, len, _offsets[i]) != (ssize_t) len)
+         throw pwfile_error("Could not read the replication log");
+
+      const size_t body = repl::frame_header_size + 8;
+      if ((len < body) || !repl::parseChange(buf + body, len - body, change))
+         throw pwfile_error("Replication log " + _filename + " is corrupt");
+
+      if (change.removed)
+         state.erase(change.rec.name);
+      else
+         state[change.rec.name] = change.rec;
+   }
+}
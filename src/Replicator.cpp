@@ -0,0 +1,544 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+#include "Replicator.h"
+#include "CredIndex.h"
+#include "exceptions.h"
+
+// Bytes read from a replication socket at a time
+const size_t repl_readbuf = 65536;
+
+Replicator::Replicator(CredIndex &creds, ReplLog &log):_creds(creds),_log(log) {
+
+}
+
+
+Replicator::~Replicator() {
+   stop();
+}
+
+void Replicator::setPrimary(const char *ip_addr, unsigned short port) {
+   _primary = true;
+   _ip_addr = ip_addr;
+   _port = port;
+}
+
+void Replicator::setFollower(const char *ip_addr, unsigned short port) {
+   _primary = false;
+   _ip_addr = ip_addr;
+   _port = port;
+}
+
+/*****************************************************************************************
+ * start - opens the log and, on the primary, the socket followers connect to, hooks into
+ *         the credential index (which brings the log up to date with the passwd file on
+ *         the primary) and starts the replication thread
+ *
+ *    Throws: socket_error if the primary's port could not be bound, pwfile_error if the log
+ *            or the passwd file could not be read or written
+ *****************************************************************************************/
+
+void Replicator::start() {
+   _log.open();
+
+   if ((_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      throw socket_error("Could not create the replication wakeup descriptor.");
+
+   if (_primary) {
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(_port);
+      if (inet_pton(AF_INET, _ip_addr.c_str(), &addr.sin_addr) != 1)
+         throw socket_error("Invalid replication address " + _ip_addr);
+
+      int on = 1;
+      if (((_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) ||
+          (setsockopt(_listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+          (bind(_listenfd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+          (::listen(_listenfd, 16) != 0))
+         throw socket_error("Could not listen for replication followers on port " + std::to_string(_port));
+   }
+
+   uint64_t before = _log.lastSeq();
+   _creds.setReplicator(this);
+
+   if (_primary) {
+      std::cout << "Replicating credentials to followers on port " << _port << ", log at record "
+                << _log.lastSeq();
+      if (_log.lastSeq() > before)
+         std::cout << " (" << (_log.lastSeq() - before) << " passwd file changes logged)";
+      std::cout << std::endl;
+   } else {
+      std::cout << "Following the credentials of " << _ip_addr << ":" << _port << " from record "
+                << (_log.lastSeq() + 1) << std::endl;
+   }
+
+   _stopping = false;
+   _thread = std::thread(&Replicator::run, this);
+}
+
+/*****************************************************************************************
+ * stop - stops the thread, detaches from the credential index and closes every socket.
+ *        Changes made here afterwards are no longer replicated.
+ *
+ *****************************************************************************************/
+
+void Replicator::stop() {
+   if (_thread.joinable()) {
+      _stopping = true;
+      wake();
+      _thread.join();
+      _creds.setReplicator(nullptr);
+   }
+
+   for (Follower &f : _followers)
+      close(f.fd);
+   _followers.clear();
+
+   if (_listenfd != -1)
+      close(_listenfd);
+   if (_wakefd != -1)
+      close(_wakefd);
+   _listenfd = _wakefd = -1;
+}
+
+/*****************************************************************************************
+ * attached - on the primary, logs whatever the passwd file has that the log doesn't (all
+ *            of it, the first time), so the log always leads to the file's contents
+ *
+ *    Throws: pwfile_error if the log could not be read or written
+ *****************************************************************************************/
+
+void Replicator::attached(const std::vector<PasswdRecord> &current) {
+   if (!_primary)
+      return;
+
+   std::unordered_map<std::string, PasswdRecord> logged;
+   _log.readState(logged);
+
+   PasswdChange change;
+   for (const PasswdRecord &rec : current) {
+      auto it = logged.find(rec.name);
+      if ((it == logged.end()) || (it->second.hash != rec.hash) || (it->second.salt != rec.salt) ||
+          (it->second.profile != rec.profile)) {
+         change.rec = rec;
+         change.removed = false;
+         _log.append(change);
+      }
+      if (it != logged.end())
+         logged.erase(it);
+   }
+
+   // Whoever is left was removed from the file
+   for (auto &gone : logged) {
+      change.rec = PasswdRecord();
+      change.rec.name = gone.first;
+      change.removed = true;
+      _log.append(change);
+   }
+}
+
+/*****************************************************************************************
+ * changed - takes a change made to the credential index. The primary logs every change,
+ *           which wakes the thread to stream it; a follower sends the ones made here to the
+ *           primary, and ignores the ones it got from the primary.
+ *
+ *    Throws: pwfile_error if the primary's log could not be written
+ *****************************************************************************************/
+
+void Replicator::changed(const PasswdChange &change, source src) {
+   if (_primary) {
+      _log.append(change);
+      wake();
+      return;
+   }
+
+   if (src == s_remote)
+      return;
+
+   std::lock_guard<std::mutex> lock(_upstream_mutex);
+   _pending.push_back(change);
+   if (_connected)
+      repl::appendChange(_upstream, repl::f_write, 0, change);
+   wake();
+}
+
+void Replicator::run() {
+   try {
+      if (_primary)
+         runPrimary();
+      else
+         runFollower();
+   } catch (std::runtime_error &e) {
+      std::cerr << "Replication stopped: " << e.what() << std::endl;
+   }
+}
+
+/*****************************************************************************************
+ * runPrimary - the primary's thread: accepts followers, applies the changes they send and
+ *              streams each one the log from where it subscribed, straight from the file
+ *
+ *    Throws: pwfile_error if a follower's change could not be applied or logged
+ *****************************************************************************************/
+
+void Replicator::runPrimary() {
+   std::vector<pollfd> pfds;
+
+   while (!_stopping) {
+      off_t end = _log.end();
+
+      pfds.resize(2 + _followers.size());
+      pfds[0] = {_wakefd, POLLIN, 0};
+      pfds[1] = {_listenfd, POLLIN, 0};
+      for (size_t i = 0; i < _followers.size(); i++) {
+         Follower &f = _followers[i];
+         short events = (f.subscribed && (f.pos < end)) ? (POLLIN | POLLOUT) : POLLIN;
+         pfds[2 + i] = {f.fd, events, 0};
+      }
+
+      if (poll(pfds.data(), pfds.size(), -1) == -1) {
+         if (errno != EINTR)
+            throw socket_error("poll failed in the replication thread.");
+         continue;
+      }
+
+      if (pfds[0].revents & POLLIN)
+         clearWake();
+
+      // Followers accepted now are past the end of the poll set
+      size_t polled = _followers.size();
+      if (pfds[1].revents & POLLIN) {
+         sockaddr_in addr;
+         socklen_t len = sizeof(addr);
+         int fd;
+         while ((fd = accept4(_listenfd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            char ipstr[INET_ADDRSTRLEN] = "";
+            inet_ntop(AF_INET, &addr.sin_addr, ipstr, sizeof(ipstr));
+            _followers.push_back({fd, ipstr});
+            len = sizeof(addr);
+         }
+      }
+
+      end = _log.end();
+      for (size_t i = polled; i > 0; i--) {
+         Follower &f = _followers[i - 1];
+         if ((pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !readFollower(f)) {
+            dropFollower(i - 1, "disconnected");
+            continue;
+         }
+         if (f.subscribed && (f.pos < end) && !sendLog(f))
+            dropFollower(i - 1, "could not be written to");
+      }
+   }
+}
+
+/*****************************************************************************************
+ * readFollower - reads what a follower sent: its subscription, and changes made on it,
+ *                which are applied (and so logged) as one batch
+ *
+ *    Returns: false if the follower closed, sent something invalid or asked for records we
+ *             don't have
+ *
+ *    Throws: pwfile_error if the changes could not be applied or logged
+ *****************************************************************************************/
+
+bool Replicator::readFollower(Follower &f) {
+   char buf[repl_readbuf];
+   ssize_t n;
+   while ((n = recv(f.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      f.in.append(buf, n);
+   if ((n == 0) || ((n == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+      return false;
+
+   std::vector<PasswdChange> changes;
+   PasswdChange change;
+   size_t used = 0;
+   char type;
+   uint32_t len;
+   bool ok = true;
+   while (ok && repl::parseFrame(f.in.data() + used, f.in.size() - used, type, len)) {
+      const char *body = f.in.data() + used + repl::frame_header_size;
+
+      if ((type == repl::f_subscribe) && (len == 8) && !f.subscribed) {
+         uint64_t next = repl::get64(body);
+         if (!_log.offsetOf(next, f.pos)) {
+            std::string refused;
+            repl::appendRefused(refused, "asked for record " + std::to_string(next) + " but the log ends at " +
+                                std::to_string(_log.lastSeq()));
+            send(f.fd, refused.data(), refused.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            ok = false;
+            break;
+         }
+         f.subscribed = true;
+         std::cout << "Replication follower " << f.ipaddr << " subscribed from record " << next << std::endl;
+
+      } else if ((type == repl::f_write) && repl::parseChange(body, len, change)) {
+         changes.push_back(change);
+
+      } else {
+         ok = false;
+         break;
+      }
+      used += repl::frame_header_size + len;
+   }
+   f.in.erase(0, used);
+
+   if (!changes.empty()) {
+      _creds.apply(changes);
+      _applied += changes.size();
+   }
+   return ok;
+}
+
+/*****************************************************************************************
+ * sendLog - sends a follower as much of the log after its position as its socket takes
+ *
+ *    Returns: false if the socket failed
+ *****************************************************************************************/
+
+bool Replicator::sendLog(Follower &f) {
+   off_t end = _log.end();
+   while (f.pos < end) {
+      ssize_t n = sendfile(f.fd, _log.getFD(), &f.pos, end - f.pos);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+         return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+      }
+      if (n == 0)
+         return false;
+   }
+   return true;
+}
+
+void Replicator::dropFollower(size_t idx, const char *why) {
+   std::cout << "Replication follower " << _followers[idx].ipaddr << " " << why << std::endl;
+   close(_followers[idx].fd);
+   _followers.erase(_followers.begin() + idx);
+}
+
+/*****************************************************************************************
+ * runFollower - a follower's thread: keeps a connection to the primary, subscribing from
+ *               the end of our log each time, applies the records it streams and sends it
+ *               the changes made here
+ *
+ *    Throws: pwfile_error if records could not be applied or logged
+ *****************************************************************************************/
+
+void Replicator::runFollower() {
+   std::string in;
+
+   while (!_stopping) {
+      int sock = connectPrimary();
+      if (sock == -1) {
+         waitWake(repl_retry_ms);
+         continue;
+      }
+
+      // Subscribe, then send again whatever we changed that hasn't come back as a record
+      {
+         std::lock_guard<std::mutex> lock(_upstream_mutex);
+         _upstream.clear();
+         repl::appendSubscribe(_upstream, _log.lastSeq() + 1);
+         for (const PasswdChange &change : _pending)
+            repl::appendChange(_upstream, repl::f_write, 0, change);
+         _connected = true;
+      }
+      std::cout << "Connected to the replication primary " << _ip_addr << ":" << _port << std::endl;
+
+      in.clear();
+      bool ok = true;
+      while (ok && !_stopping) {
+         bool sending;
+         {
+            std::lock_guard<std::mutex> lock(_upstream_mutex);
+            sending = !_upstream.empty();
+         }
+
+         pollfd pfds[2] = {{_wakefd, POLLIN, 0}, {sock, (short) (sending ? (POLLIN | POLLOUT) : POLLIN), 0}};
+         if (poll(pfds, 2, -1) == -1) {
+            if (errno != EINTR)
+               throw socket_error("poll failed in the replication thread.");
+            continue;
+         }
+
+         if (pfds[0].revents & POLLIN)
+            clearWake();
+         if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+            ok = readPrimary(sock, in);
+         if (ok)
+            ok = sendUpstream(sock);
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(_upstream_mutex);
+         _connected = false;
+         _upstream.clear();
+      }
+      close(sock);
+
+      if (!_stopping) {
+         std::cout << "Lost the replication primary, retrying" << std::endl;
+         waitWake(repl_retry_ms);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * connectPrimary - connects to the primary, waiting at most repl_retry_ms
+ *
+ *    Returns: the connected nonblocking socket, or -1
+ *****************************************************************************************/
+
+int Replicator::connectPrimary() {
+   sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(_port);
+   if (inet_pton(AF_INET, _ip_addr.c_str(), &addr.sin_addr) != 1)
+      throw socket_error("Invalid replication primary address " + _ip_addr);
+
+   int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (sock == -1)
+      return -1;
+
+   if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+      pollfd pfd = {sock, POLLOUT, 0};
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if ((errno != EINPROGRESS) || (poll(&pfd, 1, repl_retry_ms) != 1) ||
+          (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0)) {
+         close(sock);
+         return -1;
+      }
+   }
+   return sock;
+}
+
+/*****************************************************************************************
+ * readPrimary - reads the records the primary streamed, applies them as one batch and
+ *               appends them to our log. Records we already have are skipped.
+ *
+ *    Returns: false if the primary closed, refused us, sent something invalid or skipped
+ *             a record
+ *
+ *    Throws: pwfile_error if the records could not be applied or logged
+ *****************************************************************************************/
+
+bool Replicator::readPrimary(int sock, std::string &in) {
+   char buf[repl_readbuf];
+   ssize_t n;
+   while ((n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      in.append(buf, n);
+   bool open = !((n == 0) || ((n == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)));
+
+   std::vector<PasswdChange> changes;
+   std::vector<std::pair<size_t, size_t>> frames;
+   uint64_t next = _log.lastSeq() + 1;
+   uint64_t first = next;
+   PasswdChange change;
+   size_t used = 0;
+   char type;
+   uint32_t len;
+   bool ok = true;
+   while (repl::parseFrame(in.data() + used, in.size() - used, type, len)) {
+      const char *body = in.data() + used + repl::frame_header_size;
+      size_t framelen = repl::frame_header_size + len;
+
+      if (type == repl::f_refused) {
+         std::cout << "The replication primary refused us: " << std::string(body, len) << std::endl;
+         ok = false;
+         break;
+      }
+      if ((type != repl::f_record) || (len < 8) || !repl::parseChange(body + 8, len - 8, change)) {
+         std::cout << "The replication primary sent an invalid frame" << std::endl;
+         ok = false;
+         break;
+      }
+
+      uint64_t seq = repl::get64(body);
+      if (seq > next) {
+         std::cout << "The replication primary skipped from record " << next << " to " << seq << std::endl;
+         ok = false;
+         break;
+      }
+      if (seq == next) {
+         changes.push_back(change);
+         frames.push_back({used, framelen});
+         next++;
+      }
+      used += framelen;
+   }
+
+   if (!changes.empty()) {
+      // Applied before they are logged: after a crash in between they are just applied again
+      _creds.apply(changes);
+      for (size_t i = 0; i < frames.size(); i++)
+         _log.appendRecord(first + i, in.data() + frames[i].first, frames[i].second);
+      _applied += changes.size();
+
+      // Our own changes are done once the primary has ordered them
+      std::lock_guard<std::mutex> lock(_upstream_mutex);
+      for (const PasswdChange &done : changes) {
+         for (size_t i = 0; i < _pending.size(); i++) {
+            const PasswdChange &p = _pending[i];
+            if ((p.rec.name == done.rec.name) && (p.removed == done.removed) && (p.rec.hash == done.rec.hash) &&
+                (p.rec.salt == done.rec.salt)) {
+               _pending.erase(_pending.begin() + i);
+               break;
+            }
+         }
+      }
+   }
+   in.erase(0, used);
+   return ok && open;
+}
+
+/*****************************************************************************************
+ * sendUpstream - sends the primary as much of what is waiting for it as the socket takes
+ *
+ *    Returns: false if the socket failed
+ *****************************************************************************************/
+
+bool Replicator::sendUpstream(int sock) {
+   std::lock_guard<std::mutex> lock(_upstream_mutex);
+   while (!_upstream.empty()) {
+      ssize_t n = send(sock, _upstream.data(), _upstream.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+         return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+      }
+      _upstream.erase(0, n);
+   }
+   return true;
+}
+
+void Replicator::waitWake(int ms) {
+   pollfd pfd = {_wakefd, POLLIN, 0};
+   if (poll(&pfd, 1, ms) == 1)
+      clearWake();
+}
+
+void Replicator::wake() {
+   // Can only fail (short of EINTR) when the count is about to overflow, i.e. already set
+   uint64_t one = 1;
+   while ((_wakefd != -1) && (write(_wakefd, &one, sizeof(one)) == -1) && (errno == EINTR))
+      ;
+}
+
+void Replicator::clearWake() {
+   uint64_t count;
+   while (read(_wakefd, &count, sizeof(count)) == sizeof(count))
+      ;
+}
@@ -0,0 +1,685 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include "ShardNode.h"
+#include "ConnTable.h"
+#include "exceptions.h"
+
+// Bytes read from an RPC socket at a time
+const size_t shard_readbuf = 16384;
+
+ShardCall::ShardCall(uint8_t op, std::string_view name, const char *passwd, uint32_t ipaddr):
+                     op(op),name(name),passwd(passwd),ipaddr(ipaddr) {
+
+}
+
+
+ShardCall::~ShardCall() {
+   if (!passwd.empty())
+      explicit_bzero(&passwd[0], passwd.size());
+}
+
+/*****************************************************************************************
+ * parseAddr - reads a node's "ip:port"
+ *
+ *    Returns: false if it is not a valid IPv4 address and port
+ *****************************************************************************************/
+
+static bool parseAddr(const std::string &node, sockaddr_in &addr) {
+   size_t colon = node.rfind(':');
+   if (colon == std::string::npos)
+      return false;
+
+   long port = strtol(node.c_str() + colon + 1, NULL, 10);
+   if ((port < 1) || (port > 65535))
+      return false;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((unsigned short) port);
+   return (inet_pton(AF_INET, node.substr(0, colon).c_str(), &addr.sin_addr) == 1);
+}
+
+// Requests and answers are a few dozen bytes each; don't let Nagle hold them back
+static void setNoDelay(int fd) {
+   int on = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+ShardNode::ShardNode(CredIndex &creds, const std::string &self, unsigned int vnodes):
+                     _creds(creds),_ring(vnodes) {
+   _self = _ring.addNode(self);
+}
+
+
+ShardNode::~ShardNode() {
+   stop();
+}
+
+void ShardNode::addPeer(const std::string &addr) {
+   _ring.addNode(addr);
+}
+
+/*****************************************************************************************
+ * start - opens the port the other nodes connect to and starts the RPC thread
+ *
+ *    Throws: socket_error if a node address is invalid or our port could not be bound,
+ *            runtime_error if no hash scheduler was set
+ *****************************************************************************************/
+
+void ShardNode::start() {
+   if (_hasher == NULL)
+      throw std::runtime_error("The shard RPC needs a hash scheduler.");
+
+   sockaddr_in addr;
+   _node_ips.clear();
+   for (size_t i = 0; i < _ring.size(); i++) {
+      if (!parseAddr(_ring.node(i), addr))
+         throw socket_error("Invalid shard node address " + _ring.node(i));
+      _node_ips.push_back(addr.sin_addr.s_addr);
+   }
+
+   parseAddr(_ring.node(_self), addr);
+   int on = 1;
+   if (((_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) ||
+       (setsockopt(_listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+       (bind(_listenfd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+       (::listen(_listenfd, 16) != 0))
+      throw socket_error("Could not listen for shard nodes on " + _ring.node(_self));
+
+   if ((_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      throw socket_error("Could not create the shard RPC wakeup descriptor.");
+
+   _peers.assign(_ring.size(), Peer());
+
+   std::cout << "Sharding users over " << _ring.size() << " nodes, answering the others on "
+             << _ring.node(_self) << std::endl;
+
+   _stopping = false;
+   {
+      std::lock_guard<std::mutex> lock(_queue_mutex);
+      _running = true;
+   }
+   _thread = std::thread(&ShardNode::run, this);
+}
+
+/*****************************************************************************************
+ * stop - stops the thread and closes every socket. Calls still in flight fail, and the
+ *        other nodes' requests are dropped (they see their connection close).
+ *
+ *****************************************************************************************/
+
+void ShardNode::stop() {
+   if (_thread.joinable()) {
+      _stopping = true;
+      wake();
+      _thread.join();
+   }
+
+   for (size_t i = _inbound.size(); i > 0; i--)
+      dropInbound(i - 1, NULL);
+   _upgrades.clear();
+
+   if (_listenfd != -1)
+      close(_listenfd);
+   if (_wakefd != -1)
+      close(_wakefd);
+   _listenfd = _wakefd = -1;
+}
+
+/*****************************************************************************************
+ * call - queues a request for the node owning name and wakes the thread to send it
+ *
+ *    Returns: the call, which the caller polls; already failed if the thread isn't running
+ *****************************************************************************************/
+
+std::shared_ptr<ShardCall> ShardNode::call(uint8_t op, std::string_view name, const char *passwd,
+                                           uint32_t ipaddr) {
+   auto call = std::make_shared<ShardCall>(op, name, passwd, ipaddr);
+   size_t owner = _ring.owner(name);
+
+   std::lock_guard<std::mutex> lock(_queue_mutex);
+   if (!_running || (owner == _self)) {
+      call->setStatus(ShardCall::failed);
+      return call;
+   }
+   _queued.emplace_back(owner, call);
+   wake();
+   return call;
+}
+
+void ShardNode::run() {
+   try {
+      loop();
+   } catch (std::runtime_error &e) {
+      std::cerr << "Shard RPC stopped: " << e.what() << std::endl;
+   }
+   failAll();
+}
+
+/*****************************************************************************************
+ * loop - the RPC thread: sends queued calls and matches up their answers, and answers the
+ *        other nodes' requests once their hashes are done
+ *
+ *    Throws: socket_error if poll fails, pwfile_error if a new password could not be stored
+ *****************************************************************************************/
+
+void ShardNode::loop() {
+   std::vector<pollfd> pfds;
+   std::vector<size_t> polled_peers;
+
+   while (!_stopping) {
+      sendCalls();
+
+      pfds.clear();
+      polled_peers.clear();
+      pfds.push_back({_wakefd, POLLIN, 0});
+      pfds.push_back({_listenfd, POLLIN, 0});
+      for (Inbound &c : _inbound)
+         pfds.push_back({c.fd, (short) (c.out.empty() ? POLLIN : (POLLIN | POLLOUT)), 0});
+      for (size_t i = 0; i < _peers.size(); i++) {
+         Peer &p = _peers[i];
+         if (p.fd == -1)
+            continue;
+         short events = (p.connecting || (p.sent < p.out.size())) ? (POLLIN | POLLOUT) : POLLIN;
+         pfds.push_back({p.fd, events, 0});
+         polled_peers.push_back(i);
+      }
+
+      // A hash finishing is not an event on any descriptor
+      if (poll(pfds.data(), pfds.size(), hashing() ? shard_poll_ms : -1) == -1) {
+         if (errno != EINTR)
+            throw socket_error("poll failed in the shard RPC thread.");
+         continue;
+      }
+
+      if (pfds[0].revents & POLLIN)
+         clearWake();
+
+      // Nodes accepted now are past the end of the poll set
+      size_t inbound = _inbound.size();
+      if (pfds[1].revents & POLLIN)
+         acceptNodes();
+
+      // Answers to our calls
+      for (size_t j = 0; j < polled_peers.size(); j++) {
+         size_t idx = polled_peers[j];
+         Peer &p = _peers[idx];
+         short revents = pfds[2 + inbound + j].revents;
+         if (revents == 0)
+            continue;
+
+         if (p.connecting) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if ((getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0)) {
+               failPeer(idx, "could not be reached");
+               continue;
+            }
+            p.connecting = false;
+         }
+         if ((revents & (POLLIN | POLLHUP | POLLERR)) && !readPeer(p))
+            failPeer(idx, "closed the connection");
+         else if (!writePeer(p))
+            failPeer(idx, "could not be written to");
+      }
+
+      // Requests from the other nodes
+      for (size_t i = inbound; i > 0; i--) {
+         if ((pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) && !readInbound(_inbound[i - 1]))
+            dropInbound(i - 1, "disconnected");
+      }
+      for (size_t i = _inbound.size(); i > 0; i--) {
+         finishRequests(_inbound[i - 1]);
+         if (!writeInbound(_inbound[i - 1]))
+            dropInbound(i - 1, "could not be written to");
+      }
+      finishUpgrades();
+   }
+}
+
+/*****************************************************************************************
+ * sendCalls - moves the queued calls onto their peers' connections, connecting to a peer
+ *             first if needed. The plaintext is wiped from the call as it is encoded.
+ *
+ *****************************************************************************************/
+
+void ShardNode::sendCalls() {
+   std::vector<std::pair<size_t, std::shared_ptr<ShardCall>>> queued;
+   {
+      std::lock_guard<std::mutex> lock(_queue_mutex);
+      queued.swap(_queued);
+   }
+
+   uint64_t now = ConnTable::nowMS();
+   std::string payload;
+   for (auto &q : queued) {
+      Peer &p = _peers[q.first];
+      ShardCall &call = *q.second;
+
+      if ((p.fd == -1) && (now >= p.retry_at))
+         connectPeer(q.first);
+      if (p.fd == -1) {
+         call.setStatus(ShardCall::failed);
+         continue;
+      }
+
+      uint32_t reqid = _next_reqid++;
+      if (reqid == 0)
+         reqid = _next_reqid++;
+
+      payload.assign(reinterpret_cast<const char *>(&call.ipaddr), sizeof(call.ipaddr));
+      payload += call.name;
+      payload += '\0';
+      payload += call.passwd;
+      binproto::appendFrame(p.out, call.op, binproto::st_ok, reqid, payload);
+      explicit_bzero(&payload[0], payload.size());
+      if (!call.passwd.empty()) {
+         explicit_bzero(&call.passwd[0], call.passwd.size());
+         call.passwd.clear();
+      }
+
+      p.calls.emplace(reqid, q.second);
+      _forwarded++;
+   }
+}
+
+/*****************************************************************************************
+ * connectPeer - starts a nonblocking connect to another node; loop finishes it when the
+ *               socket polls writable. On failure the node is left alone for
+ *               shard_retry_ms.
+ *
+ *****************************************************************************************/
+
+void ShardNode::connectPeer(size_t idx) {
+   Peer &p = _peers[idx];
+   sockaddr_in addr;
+   parseAddr(_ring.node(idx), addr);
+
+   int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (sock != -1) {
+      setNoDelay(sock);
+      if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+         p.fd = sock;
+         p.connecting = false;
+         return;
+      }
+      if (errno == EINPROGRESS) {
+         p.fd = sock;
+         p.connecting = true;
+         return;
+      }
+      close(sock);
+   }
+
+   std::cout << "Shard node " << _ring.node(idx) << " could not be reached" << std::endl;
+   p.retry_at = ConnTable::nowMS() + shard_retry_ms;
+}
+
+/*****************************************************************************************
+ * readPeer - reads a peer's answers and finishes the calls they belong to
+ *
+ *    Returns: false if the peer closed the connection or sent something invalid
+ *****************************************************************************************/
+
+bool ShardNode::readPeer(Peer &p) {
+   char buf[shard_readbuf];
+   ssize_t n;
+   while ((n = recv(p.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      p.in.append(buf, n);
+   bool open = !((n == 0) || ((n == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)));
+
+   size_t used = 0;
+   binproto::FrameHeader hdr;
+   while (binproto::parseHeader(p.in.data() + used, p.in.size() - used, hdr)) {
+      if (hdr.length > binproto::max_payload)
+         return false;
+      if (p.in.size() - used < binproto::header_size + hdr.length)
+         break;
+
+      auto it = p.calls.find(hdr.reqid);
+      if (it != p.calls.end()) {
+         it->second->result = hdr.status;
+         it->second->setStatus(ShardCall::done);
+         p.calls.erase(it);
+      }
+      used += binproto::header_size + hdr.length;
+   }
+   p.in.erase(0, used);
+   return open;
+}
+
+/*****************************************************************************************
+ * writePeer - sends as many queued requests as the socket takes. Once all are out the
+ *             buffer is wiped, since requests carry passwords.
+ *
+ *    Returns: false if the socket failed
+ *****************************************************************************************/
+
+bool ShardNode::writePeer(Peer &p) {
+   if (p.connecting)
+      return true;
+
+   while (p.sent < p.out.size()) {
+      ssize_t n = send(p.fd, p.out.data() + p.sent, p.out.size() - p.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+         return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+      }
+      p.sent += n;
+   }
+
+   if (!p.out.empty()) {
+      explicit_bzero(&p.out[0], p.out.size());
+      p.out.clear();
+   }
+   p.sent = 0;
+   return true;
+}
+
+/*****************************************************************************************
+ * failPeer - closes a peer's connection and fails the calls waiting on it. A peer that
+ *            could not be connected to is left alone for shard_retry_ms; one that closed
+ *            an open connection is tried again by the next call.
+ *
+ *****************************************************************************************/
+
+void ShardNode::failPeer(size_t idx, const char *why) {
+   Peer &p = _peers[idx];
+   std::cout << "Shard node " << _ring.node(idx) << " " << why;
+   if (!p.calls.empty())
+      std::cout << ", failing " << p.calls.size() << " calls";
+   std::cout << std::endl;
+
+   if (p.connecting)
+      p.retry_at = ConnTable::nowMS() + shard_retry_ms;
+
+   close(p.fd);
+   p.fd = -1;
+   p.connecting = false;
+   for (auto &c : p.calls)
+      c.second->setStatus(ShardCall::failed);
+   p.calls.clear();
+
+   if (!p.out.empty())
+      explicit_bzero(&p.out[0], p.out.size());
+   p.out.clear();
+   p.sent = 0;
+   p.in.clear();
+}
+
+/*****************************************************************************************
+ * failAll - on the way out of the thread: stops taking calls and fails every one not
+ *           answered yet
+ *
+ *****************************************************************************************/
+
+void ShardNode::failAll() {
+   std::vector<std::pair<size_t, std::shared_ptr<ShardCall>>> queued;
+   {
+      std::lock_guard<std::mutex> lock(_queue_mutex);
+      _running = false;
+      queued.swap(_queued);
+   }
+   for (auto &q : queued)
+      q.second->setStatus(ShardCall::failed);
+
+   for (size_t i = 0; i < _peers.size(); i++) {
+      if (_peers[i].fd != -1)
+         failPeer(i, "disconnected, shard RPC stopping");
+   }
+}
+
+/*****************************************************************************************
+ * acceptNodes - accepts connections from the other nodes; anyone else is turned away
+ *
+ *****************************************************************************************/
+
+void ShardNode::acceptNodes() {
+   sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   int fd;
+   while ((fd = accept4(_listenfd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+      char ipstr[INET_ADDRSTRLEN] = "";
+      inet_ntop(AF_INET, &addr.sin_addr, ipstr, sizeof(ipstr));
+
+      if (std::find(_node_ips.begin(), _node_ips.end(), addr.sin_addr.s_addr) == _node_ips.end()) {
+         std::cout << "Refused a shard RPC connection from " << ipstr << ", which is not a node" << std::endl;
+         close(fd);
+      } else {
+         setNoDelay(fd);
+         _inbound.push_back({fd, ipstr});
+      }
+      len = sizeof(addr);
+   }
+}
+
+/*****************************************************************************************
+ * readInbound - reads another node's requests and starts on each
+ *
+ *    Returns: false if the node closed the connection or sent something invalid
+ *****************************************************************************************/
+
+bool ShardNode::readInbound(Inbound &c) {
+   char buf[shard_readbuf];
+   ssize_t n;
+   while ((n = recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      c.in.append(buf, n);
+   if ((n == 0) || ((n == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+      return false;
+
+   size_t used = 0;
+   binproto::FrameHeader hdr;
+   while (binproto::parseHeader(c.in.data() + used, c.in.size() - used, hdr)) {
+      if (hdr.length > binproto::max_payload)
+         return false;
+      if (c.in.size() - used < binproto::header_size + hdr.length)
+         break;
+
+      handleRequest(c, hdr, c.in.data() + used + binproto::header_size);
+      used += binproto::header_size + hdr.length;
+   }
+
+   // The requests held passwords
+   explicit_bzero(&c.in[0], used);
+   c.in.erase(0, used);
+   return true;
+}
+
+/*****************************************************************************************
+ * handleRequest - answers a lookup right away, and queues the hash for a verify or a
+ *                 password change (answered by finishRequests)
+ *
+ *    Params:  c - the node that sent it
+ *             hdr - the decoded header
+ *             payload - hdr.length bytes of payload, inside the input buffer
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *****************************************************************************************/
+
+void ShardNode::handleRequest(Inbound &c, const binproto::FrameHeader &hdr, const char *payload) {
+   const char *sep = (hdr.length > sizeof(uint32_t)) ?
+      (const char *) memchr(payload + sizeof(uint32_t), '\0', hdr.length - sizeof(uint32_t)) : NULL;
+   if (sep == NULL) {
+      binproto::appendFrame(c.out, hdr.opcode, binproto::st_badreq, hdr.reqid, "", 0);
+      return;
+   }
+
+   Request req;
+   req.reqid = hdr.reqid;
+   req.op = hdr.opcode;
+   memcpy(&req.ipaddr, payload, sizeof(req.ipaddr));
+   std::string_view name(payload + sizeof(uint32_t), sep - (payload + sizeof(uint32_t)));
+   std::string passwd(sep + 1, payload + hdr.length - (sep + 1));
+   req.id = _creds.find(name);
+
+   uint8_t status = binproto::st_unknown;
+   std::vector<uint8_t> salt;
+   switch (hdr.opcode) {
+      case shard::op_lookup:
+         if (req.id != no_user)
+            status = binproto::st_ok;
+         break;
+
+      case shard::op_verify:
+         if ((req.id != no_user) && _creds.getCred(req.id, req.hash, salt, req.profile)) {
+            req.job = _hasher->submit(HashScheduler::login, req.ipaddr, passwd.c_str(), salt, req.profile);
+            status = binproto::st_busy;
+         }
+         break;
+
+      case shard::op_change:
+         if (req.id != no_user) {
+            _creds.makeSalt(salt);
+            req.job = _hasher->submit(HashScheduler::changepwd, req.ipaddr, passwd.c_str(), salt, _creds.getProfile());
+            status = binproto::st_busy;
+         }
+         break;
+
+      default:
+         status = binproto::st_badreq;
+         break;
+   }
+   if (!passwd.empty())
+      explicit_bzero(&passwd[0], passwd.size());
+
+   if (req.job) {
+      c.requests.push_back(std::move(req));
+      return;
+   }
+   binproto::appendFrame(c.out, hdr.opcode, status, hdr.reqid, "", 0);
+   _served++;
+}
+
+/*****************************************************************************************
+ * finishRequests - answers the requests whose hashes are done. A verified password whose
+ *                  record has an outdated profile is rehashed, as a local login would.
+ *
+ *    Throws: pwfile_error if a new password could not be stored
+ *****************************************************************************************/
+
+void ShardNode::finishRequests(Inbound &c) {
+   for (size_t i = 0; i < c.requests.size(); ) {
+      Request &req = c.requests[i];
+      if (!req.job->isFinished()) {
+         i++;
+         continue;
+      }
+
+      uint8_t status;
+      HashJob &job = *req.job;
+      if (job.getStatus() != HashJob::done) {
+         // Dropped under load
+         status = binproto::st_busy;
+      } else if (req.op == shard::op_change) {
+         status = _creds.replace(req.id, job.hash, job.salt, job.profile) ? binproto::st_ok : binproto::st_unknown;
+      } else if (job.hash != req.hash) {
+         status = binproto::st_denied;
+      } else {
+         status = binproto::st_ok;
+         _hasher->markKnown(req.ipaddr);
+
+         if (req.profile != _creds.getProfile()) {
+            std::vector<uint8_t> newsalt;
+            _creds.makeSalt(newsalt);
+            auto upgrade = _hasher->submit(HashScheduler::changepwd, req.ipaddr, job.passwd.c_str(), newsalt,
+                                           _creds.getProfile());
+            if (upgrade)
+               _upgrades.push_back({req.id, req.hash, upgrade});
+         }
+      }
+
+      binproto::appendFrame(c.out, req.op, status, req.reqid, "", 0);
+      _served++;
+      c.requests.erase(c.requests.begin() + i);
+   }
+}
+
+/*****************************************************************************************
+ * finishUpgrades - stores finished rehashes, unless the record changed since the password
+ *                  was verified
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten
+ *****************************************************************************************/
+
+void ShardNode::finishUpgrades() {
+   for (size_t i = 0; i < _upgrades.size(); ) {
+      Upgrade &up = _upgrades[i];
+      if (!up.job->isFinished()) {
+         i++;
+         continue;
+      }
+
+      std::vector<uint8_t> hash, salt;
+      Argon2Profile profile;
+      if ((up.job->getStatus() == HashJob::done) && _creds.getCred(up.id, hash, salt, profile) &&
+          (hash == up.oldhash))
+         _creds.replace(up.id, up.job->hash, up.job->salt, up.job->profile);
+      _upgrades.erase(_upgrades.begin() + i);
+   }
+}
+
+bool ShardNode::writeInbound(Inbound &c) {
+   while (!c.out.empty()) {
+      ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n == -1) {
+         if (errno == EINTR)
+            continue;
+         return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+      }
+      c.out.erase(0, n);
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * dropInbound - closes another node's connection; its queued hashes are cancelled
+ *
+ *    Params:  why - logged unless NULL
+ *****************************************************************************************/
+
+void ShardNode::dropInbound(size_t idx, const char *why) {
+   Inbound &c = _inbound[idx];
+   if (why != NULL)
+      std::cout << "Shard node at " << c.ipstr << " " << why << std::endl;
+
+   for (Request &req : c.requests)
+      _hasher->cancel(req.job);
+   close(c.fd);
+   _inbound.erase(_inbound.begin() + idx);
+}
+
+bool ShardNode::hashing() const {
+   if (!_upgrades.empty())
+      return true;
+   for (const Inbound &c : _inbound) {
+      if (!c.requests.empty())
+         return true;
+   }
+   return false;
+}
+
+void ShardNode::wake() {
+   // Can only fail (short of EINTR) when the count is about to overflow, i.e. already set
+   uint64_t one = 1;
+   while ((_wakefd != -1) && (write(_wakefd, &one, sizeof(one)) == -1) && (errno == EINTR))
+      ;
+}
+
+void ShardNode::clearWake() {
+   uint64_t count;
+   while (read(_wakefd, &count, sizeof(count)) == sizeof(count))
+      ;
+}
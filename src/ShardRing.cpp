@@ -0,0 +1,73 @@
+#include <algorithm>
+#include "ShardRing.h"
+
+ShardRing::ShardRing(unsigned int vnodes):_vnodes(vnodes) {
+   if (_vnodes == 0)
+      _vnodes = 1;
+}
+
+
+ShardRing::~ShardRing() {
+
+}
+
+/*****************************************************************************************
+ * addNode - places a node's points on the ring. A tie between two nodes' points goes to
+ *           the one whose address sorts first, so every node breaks it the same way.
+ *
+ *    Returns: the node's index
+ *****************************************************************************************/
+
+size_t ShardRing::addNode(const std::string &addr) {
+   for (size_t i = 0; i < _nodes.size(); i++) {
+      if (_nodes[i] == addr)
+         return i;
+   }
+
+   uint32_t idx = (uint32_t) _nodes.size();
+   _nodes.push_back(addr);
+   for (unsigned int v = 0; v < _vnodes; v++)
+      _points.push_back({hash(addr + "#" + std::to_string(v)), idx});
+
+   // Indexes depend on the order nodes were added in; addresses don't
+   std::sort(_points.begin(), _points.end(), [this](const Point &a, const Point &b) {
+      return (a.pos < b.pos) || ((a.pos == b.pos) && (_nodes[a.node] < _nodes[b.node]));
+   });
+   return idx;
+}
+
+/*****************************************************************************************
+ * owner - finds the node owning a name: a binary search for the first point at or after
+ *         its hash, wrapping around to the first point
+ *
+ *****************************************************************************************/
+
+size_t ShardRing::owner(std::string_view name) const {
+   uint64_t pos = hash(name);
+   auto it = std::lower_bound(_points.begin(), _points.end(), pos,
+                              [](const Point &p, uint64_t v) { return p.pos < v; });
+   if (it == _points.end())
+      it = _points.begin();
+   return it->node;
+}
+
+/*****************************************************************************************
+ * hash - 64 bit FNV-1a, finished with the splitmix64 mixer so that names differing only in
+ *        their last characters (user1, user2...) still land all over the ring
+ *
+ *****************************************************************************************/
+
+uint64_t ShardRing::hash(std::string_view data) {
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (unsigned char c : data) {
+      h ^= c;
+      h *= 0x100000001b3ULL;
+   }
+
+   h ^= h >> 30;
+   h *= 0xbf58476d1ce4e5b9ULL;
+   h ^= h >> 27;
+   h *= 0x94d049bb133111ebULL;
+   h ^= h >> 31;
+   return h;
+}
@@ -0,0 +1,156 @@
+#include <time.h>
+#include <stdexcept>
+#include "StreamCompressor.h"
+
+// Thread CPU time in ns, so only the time spent compressing is counted
+static uint64_t cpuNs() {
+   timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************************************************************************
+ * compressDictionary - the server's canned replies, the strings compressed sessions send
+ *                      most. zlib matches closer history with shorter codes, so the ones
+ *                      sent most often (the menu, the prompts) come last. Changing it
+ *                      breaks clients built with the old one, like changing the protocol.
+ *
+ *****************************************************************************************/
+
+const std::string &compressDictionary() {
+   static const std::string dict =
+      "Upload failed: could not store the file\nUploads are not available\n"
+      "Downloads are not available\nInvalid file name\nNo such file: "
+      "Usage: get <name>\nUsage: put <name> <length>\nReady for  bytes\nStored , bytes\n"
+      "Password change error occured\nType \"passwd\" to try again\nPassword successfully changed\n"
+      "Messages cannot contain control characters\nMessage too long\n is not logged in\n"
+      "Message sent to Broadcast sent to  sessions\nUnrecognized command: "
+      "I'm singing, I'm in a computer and I'm siiiingiiiing! I'm in a\n"
+      "computer and I'm siiiiiiinnnggiiinnggg!\n"
+      "You want a prediction about the weather? You're asking the wrong Phil.\n"
+      "I'm going to give you a prediction about this winter. It's going to be\n"
+      "cold, it's going to be dark and it's going to last you for the rest of\n"
+      "your lives!\n"
+      "That seems like a terrible idea.\n42\n"
+      "Available choices: \n"
+      "  1). Provide weather report.\n"
+      "  2). Learn the secret of the universe.\n"
+      "  3). Play global thermonuclear war\n"
+      "  4). Do nothing.\n"
+      "  5). Sing. Sing a song. Make it simple, to last the whole day long.\n\n"
+      "Other commands: \n"
+      "  Hello - self-explanatory\n"
+      "  Passwd - change your password\n"
+      "  Broadcast <text> - send a message to everyone logged in\n"
+      "  Msg <user> <text> - send a message to one user\n"
+      "  Get <name> - download a file\n"
+      "  Put <name> <length> - upload a file of length bytes\n"
+      "  Compress - compress everything the server sends from here on\n"
+      "  Menu - display this menu\n"
+      "  Exit - disconnect.\n\n"
+      "Sending New Password: Hello back!\n";
+   return dict;
+}
+
+StreamCompressor::StreamCompressor(int level, CompressStats *stats):_level(level),
+                                                                    _cur_level(level),
+                                                                    _stats(stats) {
+   _zs = {};
+   if (deflateInit2(&_zs, level, Z_DEFLATED, compress_window_bits, compress_mem_level,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("Could not set up a compression stream.");
+
+   const std::string &dict = compressDictionary();
+   deflateSetDictionary(&_zs, (const Bytef *) dict.data(), (uInt) dict.size());
+
+   if (_stats != NULL)
+      _stats->streams++;
+}
+
+
+StreamCompressor::~StreamCompressor() {
+   deflateEnd(&_zs);
+}
+
+/*****************************************************************************************
+ * compress - deflates a batch onto out and sync flushes it. A small batch is only stored,
+ *            which still keeps it in the history later batches match against.
+ *
+ *****************************************************************************************/
+
+void StreamCompressor::compress(const char *data, size_t len, std::string &out) {
+   uint64_t start = (_stats != NULL) ? cpuNs() : 0;
+   size_t before = out.size();
+
+   setLevel((len < compress_threshold) ? Z_NO_COMPRESSION : _level, out);
+
+   _zs.next_in = (Bytef *) data;
+   _zs.avail_in = (uInt) len;
+   do {
+      // Room for the batch stored, plus block headers and the flush marker
+      size_t used = out.size();
+      size_t room = len + len / 1000 + 64;
+      out.resize(used + room);
+      _zs.next_out = (Bytef *) &out[used];
+      _zs.avail_out = (uInt) room;
+      deflate(&_zs, Z_SYNC_FLUSH);
+      out.resize(used + room - _zs.avail_out);
+   } while (_zs.avail_out == 0);
+
+   if (_stats != NULL) {
+      _stats->bytes_in += len;
+      _stats->bytes_out += out.size() - before;
+      _stats->cpu_ns += cpuNs() - start;
+   }
+}
+
+// Switches the level between batches; the previous one was flushed, so nothing is pending
+void StreamCompressor::setLevel(int level, std::string &out) {
+   if (level == _cur_level)
+      return;
+
+   char tail[64];
+   _zs.next_out = (Bytef *) tail;
+   _zs.avail_out = sizeof(tail);
+   deflateParams(&_zs, level, Z_DEFAULT_STRATEGY);
+   out.append(tail, sizeof(tail) - _zs.avail_out);
+   _cur_level = level;
+}
+
+
+StreamDecompressor::StreamDecompressor() {
+   _zs = {};
+   if (inflateInit(&_zs) != Z_OK)
+      throw std::runtime_error("Could not set up a decompression stream.");
+}
+
+
+StreamDecompressor::~StreamDecompressor() {
+   inflateEnd(&_zs);
+}
+
+bool StreamDecompressor::decompress(const char *data, size_t len, std::string &out) {
+   _zs.next_in = (Bytef *) data;
+   _zs.avail_in = (uInt) len;
+
+   char buf[16384];
+   do {
+      _zs.next_out = (Bytef *) buf;
+      _zs.avail_out = sizeof(buf);
+      int rc = inflate(&_zs, Z_SYNC_FLUSH);
+      if (rc == Z_NEED_DICT) {
+         const std::string &dict = compressDictionary();
+         if (inflateSetDictionary(&_zs, (const Bytef *) dict.data(), (uInt) dict.size()) != Z_OK)
+            return false;
+         continue;
+      }
+      if ((rc != Z_OK) && (rc != Z_BUF_ERROR))
+         return false;
+      out.append(buf, sizeof(buf) - _zs.avail_out);
+
+      // Everything given is decoded and nothing more is held back
+      if (rc == Z_BUF_ERROR)
+         break;
+   } while ((_zs.avail_in > 0) || (_zs.avail_out == 0));
+   return true;
+}
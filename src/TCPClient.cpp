@@ -7,9 +7,9 @@
 #include <strings.h>
 #include <stropts.h>
 #include <string.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
 #include <stdio.h>
-#include <stdexcept>
 
 #include "TCPClient.h"
 
@@ -45,60 +45,60 @@ void TCPClient::connectTo(const char *ip_addr, unsigned short port) {
 }
 
 /**********************************************************************************************
- * handleConnection - Performs a loop that checks if the connection is still open, then 
- *                    looks for user input and sends it if available. Finally, looks for data
- *                    on the socket and sends it.
+ * handleConnection - Performs a loop that waits in poll on stdin and the socket, forwarding
+ *                    every complete line of user input in one write and collecting what the
+ *                    server sends into large writes to stdout. Stdin is left alone while the
+ *                    server is behind; at end of input the client keeps running until the
+ *                    server closes the connection.
  * 
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPClient::handleConnection() {
-   
-   bool connected = true;
-   int sin_bufsize = 0;
-   ssize_t rsize = 0;
 
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 1000000;
+   // Anything already printed through stdio goes out before our own writes to stdout
+   fflush(stdout);
+
+   // A slow reader on the other end must not block us while it has replies for us
+   _sockfd.setNonBlocking();
 
+   bool stdin_open = true;
+   pollfd fds[2];
 
    // Loop while we have a valid connection
-   while (connected) {
+   while (_sockfd.isOpen()) {
 
-      // If the connection was closed, exit
-      if (!_sockfd.isOpen())
-         break;
+      // poll skips negative descriptors
+      fds[0].fd = (stdin_open && (_out_buf.size() < max_pending_send)) ? _stdin.getFD() : -1;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = _sockfd.getFD();
+      fds[1].events = _out_buf.empty() ? POLLIN : (POLLIN | POLLOUT);
+      fds[1].revents = 0;
 
-      // Send any user input
-      if ((sin_bufsize = readStdin()) > 0)  {
-         std::string subbuf = _in_buf.substr(0, sin_bufsize+1);
-         _sockfd.writeFD(subbuf);
-         _in_buf.erase(0, sin_bufsize+1);
+      // Show everything the server sent so far before waiting
+      flushStdout();
+
+      if (poll(fds, 2, -1) == -1) {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error("Poll failed on the client connection.");
       }
 
-      // Read any data from the socket and display to the screen and handle errors
-      std::string buf;
-      if (_sockfd.hasData()) {
-         if ((rsize = _sockfd.readFD(buf)) == -1) {
-            throw std::runtime_error("Read on client socket failed.");
-         }
-
-         // Select indicates data, but 0 bytes...usually because it's disconnected
-         if (rsize == 0) {
-            closeConn();
-            break;
-         }
-
-         // Display to the screen
-         if (rsize > 0) {
-            printf("%s", buf.c_str());
-            fflush(stdout);
-         }
+      if (fds[0].revents != 0)
+         stdin_open = readStdin();
+
+      // Read any data from the socket; 0 bytes means the server closed the connection
+      if ((fds[1].revents != 0) && !readSocket()) {
+         closeConn();
+         break;
       }
 
-      nanosleep(&sleeptime, NULL);
+      if (!_out_buf.empty())
+         sendPending();
    }
+
+   flushStdout();
 }
 
 /**********************************************************************************************
@@ -112,35 +112,151 @@ void TCPClient::closeConn() {
 }
 
 /******************************************************************************
- * readStdin - takes input from the user and stores it in a buffer. We only send
- *             the buffer after a carriage return
+ * readStdin - takes input from the user and stores it in a buffer. Everything up
+ *             to the last newline is queued for the server; a partial line only
+ *             once it reaches stdin_bufsize. At end of input whatever is left is
+ *             queued as it is.
  *
- *    Return: 0 if not ready to send, buffer length if ready
+ *    Return: false at end of input, true otherwise
  *****************************************************************************/
-int TCPClient::readStdin() {
-
-   if (!_stdin.hasData()) {
-      return 0;
-   }
+bool TCPClient::readStdin() {
 
    // More input, get it and concat it to the buffer
-   std::string readbuf;
-   int amt_read;
-   if ((amt_read = _stdin.readFD(readbuf)) < 0) {
+   char readbuf[client_readbuf];
+   ssize_t amt_read;
+   if ((amt_read = _stdin.readFD(readbuf, client_readbuf)) < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN))
+         return true;
       throw std::runtime_error("Read on stdin failed unexpectedly.");
    }
-   
-   _in_buf += readbuf;
+
+   if (amt_read == 0) {
+      _out_buf += _in_buf;
+      _in_buf.clear();
+      return false;
+   }
+
+   _in_buf.append(readbuf, amt_read);
 
    // Did we either fill up the buffer or is there a newline/carriage return?
-   unsigned int sendto;
-   if (_in_buf.length() >= stdin_bufsize)
-      sendto = _in_buf.length();
-   else if ((sendto = _in_buf.find("\n")) == std::string::npos) {
-      return 0;
+   size_t sendto = _in_buf.length();
+   if (sendto < stdin_bufsize) {
+      size_t lastnl = _in_buf.rfind('\n');
+      sendto = (lastnl == std::string::npos) ? 0 : lastnl + 1;
+   }
+
+   _out_buf.append(_in_buf, 0, sendto);
+   _in_buf.erase(0, sendto);
+   return true;
+}
+
+/******************************************************************************
+ * readSocket - reads everything the server has sent so far onto the stdout
+ *              buffer, writing it out whenever stdout_flush_bytes build up
+ *
+ *    Return: false if the server closed the connection, true otherwise
+ *
+ *    Throws: runtime_error if the read fails
+ *****************************************************************************/
+bool TCPClient::readSocket() {
+   char readbuf[client_readbuf];
+
+   while (true) {
+      ssize_t amt = _sockfd.recvFD(readbuf, client_readbuf);
+      if (amt == -2)
+         return true;
+      if (amt == 0)
+         return false;
+      if (amt < 0)
+         throw std::runtime_error("Read on client socket failed.");
+
+      takeOutput(readbuf, amt);
+      if (_stdout_buf.size() >= stdout_flush_bytes)
+         flushStdout();
+   }
+}
+
+/******************************************************************************
+ * takeOutput - adds bytes from the server to the stdout buffer. With compression
+ *              asked for, it sends "compress" after "Log in successful" and
+ *              inflates everything after the server's compress_reply.
+ *
+ *    Throws: runtime_error if the compressed stream is corrupt
+ *****************************************************************************/
+void TCPClient::takeOutput(const char *data, size_t len) {
+   if (_inflate) {
+      if (!_inflate->decompress(data, len, _stdout_buf))
+         throw std::runtime_error("Server sent a corrupt compressed stream.");
+      return;
+   }
+   if (!_compress) {
+      _stdout_buf.append(data, len);
+      return;
+   }
+
+   // Only until the server answers, so byte by byte is cheap enough
+   for (size_t i = 0; i < len; i++) {
+      _stdout_buf += data[i];
+      if (data[i] != '\n') {
+         _zline += data[i];
+         continue;
+      }
+
+      // The prompts before it have no newline of their own
+      _zline += '\n';
+      const std::string loggedin("Log in successful\n");
+      if ((_zline.size() >= loggedin.size()) &&
+          (_zline.compare(_zline.size() - loggedin.size(), loggedin.size(), loggedin) == 0)) {
+         _out_buf += "compress\n";
+      } else if (_zline.compare(compress_reply) == 0) {
+         _inflate = std::make_unique<StreamDecompressor>();
+         _compress = false;
+         takeOutput(data + i + 1, len - i - 1);
+         return;
+
+      // Refused; the session carries on uncompressed
+      } else if (_zline.compare(0, 12, "Compression ") == 0) {
+         _compress = false;
+         _stdout_buf.append(data + i + 1, len - i - 1);
+         return;
+      }
+      _zline.clear();
    }
-   
-   return sendto;
 }
 
+/******************************************************************************
+ * sendPending - writes as much of the queued input as the socket will take. If
+ *               the server has gone away the rest is dropped; readSocket sees
+ *               the close.
+ *
+ *****************************************************************************/
+void TCPClient::sendPending() {
+   ssize_t amt;
+   do {
+      amt = send(_sockfd.getFD(), _out_buf.data(), _out_buf.size(), MSG_NOSIGNAL);
+   } while ((amt == -1) && (errno == EINTR));
 
+   if (amt >= 0)
+      _out_buf.erase(0, amt);
+   else if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      _out_buf.clear();
+}
+
+/******************************************************************************
+ * flushStdout - writes the buffered server output to stdout
+ *
+ *    Throws: runtime_error if stdout can't be written
+ *****************************************************************************/
+void TCPClient::flushStdout() {
+   size_t pos = 0;
+   while (pos < _stdout_buf.size()) {
+      ssize_t amt = write(STDOUT_FILENO, _stdout_buf.data() + pos, _stdout_buf.size() - pos);
+      if (amt < 0) {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error("Write to stdout failed.");
+      }
+      pos += amt;
+   }
+   _stdout_buf.clear();
+}
@@ -1,26 +1,64 @@
+#include <arpa/inet.h>
 #include <stdexcept>
 #include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <memory>
-#include <sstream>
 #include "TCPConn.h"
 #include "strfuncts.h"
+#include "TextKernels.h"
 #include "PasswdMgr.h"
 
-// The filename/path of the password file
-const char pwdfilename[] = "passwd";
+// Most bytes taken off the socket per read
+const unsigned int readbuf_size = 4096;
 
-TCPConn::TCPConn(){ // LogMgr &server_log):_server_log(server_log) {
-   this->PWMgr = std::make_unique<PasswdMgr>(pwdfilename);
+// Names "get" and "put" accept: no paths, and no hidden files (uploads in progress are)
+static bool isFileName(std::string_view name) {
+   return !name.empty() && (name.size() <= NAME_MAX) && (name[0] != '.') &&
+          std::all_of(name.begin(), name.end(), [](char c) {
+             return isalnum((unsigned char) c) || (c == '.') || (c == '_') || (c == '-'); });
 }
 
+TCPConn::TCPConn(const Argon2Profile &profile){
+   this->_own_hot = std::make_unique<ConnHot>();
+   this->_hot = _own_hot.get();
+   this->_hot->conn = this;
 
-TCPConn::~TCPConn() {
+   this->_own_creds = std::make_unique<CredIndex>(pwdfilename);
+   this->_own_creds->setProfile(profile);
+   this->_creds = _own_creds.get();
 
+   this->_own_log = std::make_unique<LogMgr>(logfilename, _creds);
+   this->_log = _own_log.get();
+}
+
+/**********************************************************************************************
+ * TCPConn (constructor) - a server connection whose hot state lives in a slot of the server's
+ *                         ConnTable and which shares the server's CredIndex and log
+ *
+ *    Throws: runtime_error if the table is full (the server checks before accepting)
+ **********************************************************************************************/
+
+TCPConn::TCPConn(ConnTable &table, CredIndex &creds, LogMgr &log):_table(&table),_creds(&creds),_log(&log) {
+   this->_hot = table.claim(this);
+   if (this->_hot == NULL)
+      throw std::runtime_error("Connection table is full.");
+}
+
+
+TCPConn::~TCPConn() {
+   abortUpload();
+   if (_table != NULL)
+      _table->release(_hot);
 }
 
 /**********************************************************************************************
@@ -32,293 +70,1629 @@ TCPConn::~TCPConn() {
  **********************************************************************************************/
 
 bool TCPConn::accept(SocketFD &server) {
-   return _connfd.acceptFD(server);
+   bool accepted = _connfd.acceptFD(server);
+   _hot->fd = _connfd.getFD();
+   cacheAddress();
+   return accepted;
+}
+
+/**********************************************************************************************
+ * adoptSocket - takes over a client socket the server has already accepted
+ *
+ **********************************************************************************************/
+
+void TCPConn::adoptSocket(SocketFD &client) {
+   _connfd.takeFD(client);
+   _hot->fd = _connfd.getFD();
+   cacheAddress();
+}
+
+/**********************************************************************************************
+ * cacheAddress - records the peer's address and formats it once, for the whitelist check, the
+ *                console and anything else wanting it as text for the life of the connection
+ *
+ **********************************************************************************************/
+
+void TCPConn::cacheAddress() {
+   _ipaddr = (uint32_t) _connfd.getIPAddr();
+   _port = _connfd.getPort();
+   if (inet_ntop(AF_INET, &_ipaddr, _ipstr, sizeof(_ipstr)) == NULL)
+      _ipstr[0] = '\0';
+}
+
+/**********************************************************************************************
+ * sendText - simply calls the sendText FileDesc method to send a string to this FD. While
+ *            messages are queued the text is queued behind them instead.
+ *
+ *    Params:  msg - the string to be sent
+ *             size - if we know how much data we should expect to send, this should be populated
+ *
+ *    Throws: runtime_error for unrecoverable errors
+ **********************************************************************************************/
+
+int TCPConn::sendText(const char *msg) {
+   return sendText(msg, strlen(msg));
+}
+
+int TCPConn::sendText(const char *msg, int size) {
+   if (!_msgq.empty() || _zstream) {
+      MsgRef copy(MsgBuf::copyOf(msg, size));
+      queueMessage(copy, copy->data(), size);
+      sendQueued();
+      return isConnected() ? 0 : -1;
+   }
+
+   if (_connfd.writeFD(msg, size) < 0) {
+      return -1;  
+   }
+   return 0;
+}
+
+/**********************************************************************************************
+ * queueMessage - adds a chunk of a shared buffer to the output queue. Binary replies still
+ *                waiting in _outbuf are queued ahead of it so frames stay in order.
+ *
+ *    Params:  buf - keeps the bytes alive until they are sent
+ *             data, len - the bytes to send, inside buf
+ *
+ *    Returns: true if the queue was empty before
+ **********************************************************************************************/
+
+bool TCPConn::queueMessage(const MsgRef &buf, const char *data, size_t len) {
+   bool first = _msgq.empty();
+
+   queueReplies();
+   _msgq.push_back({buf, data, len});
+   _msgq_bytes += len;
+   updateOutLen();
+   return first;
+}
+
+/**********************************************************************************************
+ * queueFile - adds a stretch of a file to the output queue, behind everything queued before
+ *             it. The socket goes nonblocking until the queue is empty again (see
+ *             updateBlocking).
+ *
+ **********************************************************************************************/
+
+void TCPConn::queueFile(const std::shared_ptr<FileFD> &file, off_t offset, size_t len) {
+   queueReplies();
+   _msgq.push_back({MsgRef(), NULL, len, file, offset});
+   _msgq_bytes += len;
+   updateBlocking();
+   updateOutLen();
+}
+
+// Moves binary replies waiting in _outbuf onto the queue, so they go before what comes next
+void TCPConn::queueReplies() {
+   if (_outbuf.empty())
+      return;
+
+   MsgRef replies(MsgBuf::copyOf(_outbuf.data(), _outbuf.size()));
+   _msgq.push_back({replies, replies->data(), _outbuf.size()});
+   _msgq_bytes += _outbuf.size();
+   _outbuf.clear();
+}
+
+/**********************************************************************************************
+ * sendQueued - writes the queue with sendmsg, up to max_send_iov chunks a call, until it is
+ *              empty or the socket is full. Files in the queue go out with sendfile instead,
+ *              straight from the page cache. Never blocks; the rest goes once the socket polls
+ *              writable, a file picking up from the offset it got to. A failed send
+ *              disconnects. On a compressed connection, the chunks queued before compression
+ *              started go out this way and the rest through sendCompressed.
+ *
+ **********************************************************************************************/
+
+void TCPConn::sendQueued() {
+   while (isConnected() && (_msgq_head < _msgq.size()) && (!_zstream || (_zraw > 0))) {
+      if (_msgq[_msgq_head].file) {
+         if (!sendFileChunk(_msgq_head))
+            break;
+         _msgq[_msgq_head++].file.reset();
+         if (_zstream)
+            _zraw--;
+         continue;
+      }
+
+      // Buffers up to the next file, or the first chunk to compress
+      size_t limit = _zstream ? std::min(max_send_iov, _zraw) : max_send_iov;
+      iovec iov[max_send_iov];
+      size_t n = 0;
+      for (size_t i = _msgq_head; (i < _msgq.size()) && !_msgq[i].file && (n < limit); i++, n++) {
+         iov[n].iov_base = (void *) _msgq[i].data;
+         iov[n].iov_len = _msgq[i].len;
+      }
+
+      msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n;
+      ssize_t amt = sendmsg(_connfd.getFD(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (amt < 0) {
+         if (errno == EINTR)
+            continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
+         disconnect();
+         return;
+      }
+
+      // Drop what went, releasing the buffers as we pass them
+      _msgq_bytes -= amt;
+      while (amt > 0) {
+         OutChunk &chunk = _msgq[_msgq_head];
+         if ((size_t) amt < chunk.len) {
+            chunk.data += amt;
+            chunk.len -= amt;
+            break;
+         }
+         amt -= chunk.len;
+         chunk.buf = MsgRef();
+         _msgq_head++;
+         if (_zstream)
+            _zraw--;
+      }
+   }
+
+   if (_zstream && (_zraw == 0) && isConnected())
+      sendCompressed();
+
+   // The vector keeps its capacity, so the next message to this connection doesn't allocate
+   if (_msgq_head == _msgq.size()) {
+      _msgq.clear();
+      _msgq_head = 0;
+      updateBlocking();
+   }
+   updateOutLen();
+}
+
+/**********************************************************************************************
+ * sendCompressed - deflates the queue a batch at a time and writes the result, until the
+ *                  queue is empty or the socket is full. A batch takes up to compress_batch
+ *                  bytes across chunks, reading files with pread, so many small replies share
+ *                  one flush and a large file is never held in memory whole. What the socket
+ *                  didn't take waits in _zout; nothing more is compressed until it has gone.
+ *
+ **********************************************************************************************/
+
+void TCPConn::sendCompressed() {
+   while (isConnected()) {
+      if (_zsent < _zout.size()) {
+         ssize_t amt = send(_connfd.getFD(), _zout.data() + _zsent, _zout.size() - _zsent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+         if (amt < 0) {
+            if (errno == EINTR)
+               continue;
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+               disconnect();
+            return;
+         }
+         _zsent += amt;
+         continue;
+      }
+      _zout.clear();
+      _zsent = 0;
+
+      if (_msgq_head == _msgq.size())
+         return;
+
+      _zin.clear();
+      while ((_msgq_head < _msgq.size()) && (_zin.size() < compress_batch)) {
+         OutChunk &chunk = _msgq[_msgq_head];
+         size_t take = std::min(chunk.len, compress_batch - _zin.size());
+         if (chunk.file) {
+            size_t used = _zin.size();
+            _zin.resize(used + take);
+            ssize_t amt;
+            do {
+               amt = pread(chunk.file->getFD(), &_zin[used], take, chunk.offset);
+            } while ((amt < 0) && (errno == EINTR));
+
+            // The file shrank under us; the client was promised bytes that are gone
+            if (amt <= 0) {
+               disconnect();
+               return;
+            }
+            _zin.resize(used + amt);
+            take = amt;
+            chunk.offset += amt;
+         } else {
+            _zin.append(chunk.data, take);
+            chunk.data += take;
+         }
+
+         chunk.len -= take;
+         _msgq_bytes -= take;
+         if (chunk.len == 0) {
+            chunk.buf = MsgRef();
+            chunk.file.reset();
+            _msgq_head++;
+         }
+      }
+      _zstream->compress(_zin.data(), _zin.size(), _zout);
+   }
+}
+
+/**********************************************************************************************
+ * updateBlocking - makes the socket nonblocking while a file is queued, an upload is coming
+ *                  in or the connection is compressed, since sendfile and splice have no
+ *                  MSG_DONTWAIT and compressed output is always queued, and blocking again
+ *                  after, since replies are otherwise written directly
+ *
+ **********************************************************************************************/
+
+void TCPConn::updateBlocking() {
+   bool want = !_msgq.empty() || _upload || _zstream;
+   if ((want != _nonblocking) && isConnected()) {
+      _connfd.setNonBlocking(want);
+      _nonblocking = want;
+   }
+}
+
+/**********************************************************************************************
+ * sendFileChunk - sends what the socket takes of the file chunk at idx, moving its offset
+ *                 along
+ *
+ *    Returns: true once the whole chunk is sent, false if the socket is full or failed (and
+ *             was disconnected)
+ **********************************************************************************************/
+
+bool TCPConn::sendFileChunk(size_t idx) {
+   OutChunk &chunk = _msgq[idx];
+   while (chunk.len > 0) {
+      // sendfile moves at most this much per call anyway
+      size_t want = std::min<size_t>(chunk.len, 0x7ffff000);
+      ssize_t amt = sendfile(_connfd.getFD(), chunk.file->getFD(), &chunk.offset, want);
+      if (amt < 0) {
+         if (errno == EINTR)
+            continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return false;
+         disconnect();
+         return false;
+      }
+
+      // The file shrank under us; the client was promised bytes that are gone
+      if (amt == 0) {
+         disconnect();
+         return false;
+      }
+      chunk.len -= amt;
+      _msgq_bytes -= amt;
+   }
+   return true;
+}
+
+void TCPConn::updateOutLen() {
+   size_t pending = _outbuf.size() + _msgq_bytes + (_zout.size() - _zsent);
+   _hot->out_len = (pending > UINT32_MAX) ? UINT32_MAX : (uint32_t) pending;
+}
+
+/**********************************************************************************************
+ * startAuthentication - Sets the status to request username and starts the session coroutine
+ *
+ *    Throws: runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPConn::startAuthentication() {
+   //initializes attempts to zero
+   _hot->attempts = 0;
+   _hot->deadline = ConnTable::nowMS() + login_timeout_secs * 1000ULL;
+   //client console output
+   sendText("Username: "); 
+
+   // A quick client may already have sent enough to start a hash
+   startSession(s_username);
+   updateFlags();
+}
+
+/**********************************************************************************************
+ * handleConnection - performs a check of the connection, looking for data on the socket and
+ *                    resuming the session if it has what the session is waiting for
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::handleConnection() {
+
+   try {
+      // Whatever the socket wouldn't take last time, now that it polled writable
+      if (!_msgq.empty() || (_zsent < _zout.size()))
+         sendQueued();
+
+      if (isBinary()) {
+         // The session was waiting on a line that will never come
+         _session.reset();
+         handleBinary();
+      } else {
+         resumeSession();
+      }
+
+      checkUpgrade();
+   } catch (socket_error &e) {
+      std::cout << "Socket error, disconnecting.";
+      disconnect();
+   }
+
+   updateFlags();
+}
+
+/**********************************************************************************************
+ * startSession - creates the session coroutine at the given stage (s_username for a new
+ *                client, wherever a handed over one was) and runs it to its first wait
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::startSession(statustype start) {
+   _wait = w_none;
+   _session = textSession(start);
+   _session.resume();
+}
+
+/**********************************************************************************************
+ * resumeSession - resumes the session if what it is suspended on is here: the next input line,
+ *                 the end of its hash or the last byte of its upload
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::resumeSession() {
+   switch (_wait) {
+      case w_line:
+         if (!getUserInput(*_wait_line, _wait_lower))
+            return;
+         break;
+
+      case w_hash:
+         if (!hashFinished())
+            return;
+         break;
+
+      case w_upload:
+         if (!pumpUpload())
+            return;
+         break;
+
+      default:
+         return;
+   }
+
+   _wait = w_none;
+   _session.resume();
+}
+
+/**********************************************************************************************
+ * textSession - the text protocol, from the username prompt to "exit", as one coroutine. It
+ *               suspends whenever it needs a line the client hasn't sent yet or a hash that
+ *               hasn't finished, and keeps status up to date for handoff and the login timer.
+ *               Users get two tries at their password before they are disconnected.
+ *
+ *    Params:  start - where to begin: s_username, s_passwd, s_menu or s_changepwd
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten, runtime_error for
+ *            unrecoverable issues
+ **********************************************************************************************/
+
+Session TCPConn::textSession(statustype start) {
+   std::string line;
+
+   if (start == s_username) {
+      while (true) {
+         setStatus(s_username);
+         co_await readLine(line);
+
+         //look the name (case-sensitive) up, keeping only its ID. A name another node owns
+         //is looked up there.
+         authresult found = a_ok;
+         _remote_name.clear();
+         if (isRemoteUser(line)) {
+            _remote_name = line;
+            _shardcall = _shards->call(shard::op_lookup, line, "", _ipaddr);
+            co_await hashDone();
+            found = finishLookup();
+         } else {
+            _userid = _creds->find(line);
+         }
+
+         // The user's node couldn't answer--the user just tries again
+         if (found == a_busy) {
+            sendText("Server busy, please retry\n");
+            sendText("Username: ");
+            continue;
+         }
+         break;
+      }
+
+      if (_userid == no_user) {
+         sendText("Username not recognized\n");
+         //Logs message with client IP address & disconnects
+         logUnknownUser(line);
+         disconnect();
+         //Server terminal message for Admin notification
+         std::cout << "Username not found: disconnected client" << std::endl;
+         co_return;
+      }
+      std::cout << "Username found" << std::endl;
+      sendText("Password: "); 
+      start = s_passwd;
+   }
+
+   if (start == s_passwd) {
+      bool loggedin = false;
+      while (!loggedin) {
+         setStatus(s_passwd);
+         co_await readLine(line);
+
+         authresult result = startLogin(line.c_str());
+         explicit_bzero(&line[0], line.size());
+
+         if ((result == a_unknown) || (result == a_limited)) {
+            sendText((result == a_unknown) ? "Username not recognized\n" :
+                                                    "Too many failed logins, try again later\n");
+            disconnect();
+            co_return;
+         }
+
+         // Over capacity--doesn't count as an attempt, the user just tries again
+         if (result != a_started) {
+            sendText("Server busy, please retry\n");
+            sendText("Password: ");
+            continue;
+         }
+
+         setStatus(s_passwd_wait);
+         co_await hashDone();
+
+         switch (finishLogin()) {
+            case a_ok:
+               sendText("Log in successful\n");
+               loggedin = true;
+               break;
+
+            case a_denied:
+               sendText("Invalid Password\n"); 
+               sendText("Password: "); 
+               break;
+
+            case a_locked:
+               sendText("Invalid Password\n"); 
+               sendText("Too many login attempts\n"); 
+               disconnect();
+               co_return;
+
+            // Removed on its node since the username was looked up
+            case a_unknown:
+               sendText("Username not recognized\n");
+               disconnect();
+               co_return;
+
+            default:
+               sendText("Server busy, please retry\n");
+               sendText("Password: ");
+               break;
+         }
+      }
+   }
+
+   bool changing = (start == s_changepwd);
+   while (true) {
+      if (!changing) {
+         setStatus(s_menu);
+         co_await readLine(line);
+
+         // Messages keep their case; everything else is matched lowercased
+         std::string msg;
+         if (messageCommand(line, msg) != m_none) {
+            sendText(msg);
+            continue;
+         }
+
+         // A file goes out behind its header line; only failures have a reply
+         if (getCommand(line, msg) != m_none) {
+            if (!msg.empty())
+               sendText(msg);
+            continue;
+         }
+
+         // An upload's bytes skip the input buffer; the reply comes once they are stored
+         msgresult put = putCommand(line, msg);
+         if (put == m_sent) {
+            setStatus(s_upload);
+            co_await uploadDone();
+            finishUpload(msg);
+         }
+         if (put != m_none) {
+            sendText(msg);
+            continue;
+         }
+
+         // The reply is the last thing sent as is
+         msgresult comp = compressCommand(line, msg);
+         if (comp != m_none) {
+            sendText(msg);
+            if (comp == m_sent)
+               startCompression();
+            continue;
+         }
+         lower(line);
+
+         if (line.compare("exit") == 0) {
+            sendText("Disconnecting...goodbye!\n");
+            disconnect();
+            co_return;
+         } else if (line.compare("passwd") == 0) {
+            sendText("New Password: ");
+            changing = true;
+         } else {
+            menuReply(line, msg);
+            sendText(msg);
+         }
+         continue;
+      }
+
+      setStatus(s_changepwd);
+      co_await readLine(line);
+
+      authresult result = startChangePasswd(line.c_str());
+      explicit_bzero(&line[0], line.size());
+
+      if (result != a_started) {
+         sendText("Server busy, please retry\n");
+         sendText("New Password: ");
+         continue;
+      }
+
+      setStatus(s_changepwd_wait);
+      co_await hashDone();
+
+      switch (finishChangePasswd()) {
+         case a_ok:
+            //Confirmation message to client
+            sendText("Password successfully changed\n");
+            changing = false;
+            break;
+
+         case a_busy:
+            sendText("Server busy, please retry\n");
+            sendText("New Password: ");
+            break;
+
+         default:
+            sendText("Password change error occured\n");
+            sendText("Type \"passwd\" to try again\n");
+            changing = false;
+            break;
+      }
+   }
+}
+
+/**********************************************************************************************
+ * hashFinished - true once the hash or the call to the user's node that the session is
+ *                waiting on has finished
+ *
+ **********************************************************************************************/
+
+bool TCPConn::hashFinished() const {
+   if (_shardcall)
+      return _shardcall->isFinished();
+   return _hashjob && _hashjob->isFinished();
+}
+
+/**********************************************************************************************
+ * finishLookup - takes the answer to looking _remote_name up on the node that owns it. A
+ *                user it has gets an ID here.
+ *
+ *    Returns: a_ok (_userid set), a_unknown (_userid is no_user) or a_busy if the node could
+ *             not answer
+ **********************************************************************************************/
+
+TCPConn::authresult TCPConn::finishLookup() {
+   std::shared_ptr<ShardCall> call = std::move(_shardcall);
+
+   _userid = no_user;
+   if ((call->getStatus() != ShardCall::done) || (call->result == binproto::st_busy))
+      return a_busy;
+   if (call->result != binproto::st_ok)
+      return a_unknown;
+
+   _userid = _creds->internRemote(_remote_name);
+   return a_ok;
+}
+
+/**********************************************************************************************
+ * startLogin - looks up _userid's record and queues the hash of the given password against it. Shared
+ *              by the text and binary protocols, which only differ in how they answer.
+ *
+ *    Returns: a_started if the hash was queued (in _hashjob, or for a user another node owns,
+ *             sent there in _shardcall), a_unknown if there is no such user, a_limited if the
+ *             IP is out of failed logins, a_busy if the server is at capacity
+ **********************************************************************************************/
+
+TCPConn::authresult TCPConn::startLogin(const char *passwd) {
+   // An IP that keeps failing doesn't get to make us hash again until its bucket refills
+   if ((_login_limiter != NULL) && !_login_limiter->check(getIPAddr())) {
+      log(evlog::paswd_rate_limited);
+      return a_limited;
+   }
+
+   // The owner verifies with its own record and hash workers
+   if (!_remote_name.empty()) {
+      _shardcall = _shards->call(shard::op_verify, _remote_name, passwd, _ipaddr);
+      return a_started;
+   }
+
+   // Unknown names were logged when they were looked up
+   if (_userid == no_user)
+      return a_unknown;
+
+   std::vector<uint8_t> salt;
+   if (!_creds->getCred(_userid, _userhash, salt, _userprofile)) {
+      log(evlog::usrName_NOT_recog);
+      return a_unknown;
+   }
+
+   _hashjob = startHash(HashScheduler::login, passwd, salt, _userprofile);
+   return _hashjob ? a_started : a_busy;
+}
+
+/**********************************************************************************************
+ * finishLogin - checks the finished login hash against the user's record. Failed attempts are
+ *               counted and charged to the IP. Records with an outdated profile are queued for
+ *               a rehash with the current one. For a user another node owns, that node's
+ *               answer is taken instead (and it does any rehash).
+ *
+ *    Returns: a_ok, a_denied (wrong password), a_locked (wrong password, out of attempts),
+ *             a_unknown (the owner doesn't have the user) or a_busy (the hash was dropped
+ *             under load, or the owner could not answer)
+ **********************************************************************************************/
+
+TCPConn::authresult TCPConn::finishLogin() {
+   std::shared_ptr<HashJob> job = std::move(_hashjob);
+   std::shared_ptr<ShardCall> call = std::move(_shardcall);
+
+   bool matched;
+   if (call) {
+      if ((call->getStatus() != ShardCall::done) || (call->result == binproto::st_busy))
+         return a_busy;
+      if (call->result == binproto::st_unknown) {
+         logUnknownUser(_remote_name);
+         return a_unknown;
+      }
+
+      // A binary login goes straight to the verify, so this is where the user gets an ID
+      if (_userid == no_user)
+         _userid = _creds->internRemote(_remote_name);
+      matched = (call->result == binproto::st_ok);
+   } else {
+      if (job->getStatus() != HashJob::done)
+         return a_busy;
+      matched = (job->hash == _userhash);
+   }
+
+   if (!matched) {
+      std::cout << "invalid password" << std::endl;
+      if (_login_limiter != NULL)
+         _login_limiter->allow(getIPAddr());
+      _hot->attempts++;
+      if (_hot->attempts == max_attempts) {
+         //logs fail attempts
+         log(evlog::paswd_failed_twice);
+         return a_locked;
+      }
+      return a_denied;
+   }
+
+   std::cout << "Password verified" << std::endl;
+   log(evlog::succ_login);
+   _hot->deadline = 0;
+   _hot->user = _userid + 1;
+
+   if (_hasher != NULL)
+      _hasher->markKnown(getIPAddr());
+
+   // Upgrade records hashed with outdated parameters while we have the plaintext. If the
+   // scheduler is too busy we just try again on the next login.
+   if (job && (_userprofile != _creds->getProfile())) {
+      std::vector<uint8_t> newsalt;
+      _creds->makeSalt(newsalt);
+      _upgradejob = startHash(HashScheduler::changepwd, job->passwd.c_str(), newsalt, _creds->getProfile());
+   }
+   return a_ok;
+}
+
+/**********************************************************************************************
+ * startChangePasswd - queues a hash of the new password with a fresh salt and the current
+ *                     profile, on the node that owns the user
+ *
+ *    Returns: a_started if queued (in _hashjob, or _shardcall), a_busy if the server is at
+ *             capacity
+ **********************************************************************************************/
+
+TCPConn::authresult TCPConn::startChangePasswd(const char *passwd) {
+   if (!_remote_name.empty()) {
+      _shardcall = _shards->call(shard::op_change, _remote_name, passwd, _ipaddr);
+      return a_started;
+   }
+
+   std::vector<uint8_t> salt;
+   _creds->makeSalt(salt);
+   _hashjob = startHash(HashScheduler::changepwd, passwd, salt, _creds->getProfile());
+   if (!_hashjob)
+      return a_busy;
+
+   // A pending rehash of the old password must not land after the new one
+   if (_upgradejob) {
+      if (_hasher != NULL)
+         _hasher->cancel(_upgradejob);
+      _upgradejob.reset();
+   }
+   return a_started;
+}
+
+/**********************************************************************************************
+ * finishChangePasswd - saves the finished hash of a new password to the database
+ *
+ *    Returns: a_ok, a_busy (the hash was dropped under load) or a_error
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten
+ **********************************************************************************************/
+
+TCPConn::authresult TCPConn::finishChangePasswd() {
+   std::shared_ptr<HashJob> job = std::move(_hashjob);
+   std::shared_ptr<ShardCall> call = std::move(_shardcall);
+
+   if (call) {
+      if ((call->getStatus() != ShardCall::done) || (call->result == binproto::st_busy))
+         return a_busy;
+      return (call->result == binproto::st_ok) ? a_ok : a_error;
+   }
+
+   if (job->getStatus() != HashJob::done)
+      return a_busy;
+
+   if (!_creds->replace(_userid, job->hash, job->salt, job->profile))
+      return a_error;
+   return a_ok;
+}
+
+/**********************************************************************************************
+ * startHash - hands a hash to the scheduler, or computes it on the spot if there is none
+ *
+ *    Returns: the job, or NULL if the scheduler is over capacity
+ **********************************************************************************************/
+
+std::shared_ptr<HashJob> TCPConn::startHash(HashScheduler::jobtype type, const char *passwd,
+                                   const std::vector<uint8_t> &salt, const Argon2Profile &profile) {
+   if (_hasher != NULL)
+      return _hasher->submit(type, getIPAddr(), passwd, salt, profile);
+
+   auto job = std::make_shared<HashJob>(passwd, salt, profile);
+   job->run();
+   return job;
+}
+
+/**********************************************************************************************
+ * checkUpgrade - stores a finished rehash of the logged-in user's record. Skipped if the
+ *                record changed since the login was verified.
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten
+ **********************************************************************************************/
+
+void TCPConn::checkUpgrade() {
+   if (!_upgradejob || !_upgradejob->isFinished())
+      return;
+
+   std::shared_ptr<HashJob> job = std::move(_upgradejob);
+   if (job->getStatus() != HashJob::done)
+      return;
+
+   std::vector<uint8_t> hash, salt;
+   Argon2Profile profile;
+   if (!_creds->getCred(_userid, hash, salt, profile) || (hash != _userhash))
+      return;
+
+   _creds->replace(_userid, job->hash, job->salt, job->profile);
+}
+
+/**********************************************************************************************
+ * handleBinary - called from handleConnection for clients that negotiated the binary
+ *                protocol. Answers a finished hash, then works through the complete frames
+ *                in the input buffer and sends all the replies in one write.
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::handleBinary() {
+   if (!readInput())
+      return;
+
+   if (hashFinished())
+      finishBinaryHash();
+
+   // Frames are parsed where they sit in the input buffer; the consumed bytes are dropped
+   // once at the end rather than after each frame
+   size_t pos = 0;
+   binproto::FrameHeader hdr;
+   while (isConnected() &&
+          binproto::parseHeader(inputData() + pos, inputLen() - pos, hdr)) {
+      if (hdr.length > binproto::max_payload) {
+         binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_badreq, hdr.reqid, "Frame too large");
+         flushOutput();
+         disconnect();
+         return;
+      }
+      if (inputLen() - pos < binproto::header_size + hdr.length)
+         break;
+
+      if (!dispatchFrame(hdr, inputData() + pos + binproto::header_size))
+         break;
+      pos += binproto::header_size + hdr.length;
+   }
+   consumeInput(pos);
+
+   flushOutput();
+}
+
+/**********************************************************************************************
+ * dispatchFrame - answers one binary request. Requests that depend on a hash still in flight
+ *                 are left in the buffer until it finishes; menu commands from a logged-in
+ *                 user are answered even while their password change is hashing.
+ *
+ *    Params:  hdr - the decoded header
+ *             payload - hdr.length bytes of payload, inside the input buffer
+ *
+ *    Returns: true if the frame was handled, false if it has to wait
+ **********************************************************************************************/
+
+bool TCPConn::dispatchFrame(const binproto::FrameHeader &hdr, const char *payload) {
+   bool hashing = (status() == s_passwd_wait) || (status() == s_changepwd_wait);
+   bool loggedin = (status() == s_menu) || (status() == s_changepwd_wait);
+
+   switch (hdr.opcode) {
+      case binproto::op_login: {
+         if (hashing)
+            return false;
+         if (loggedin) {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_badreq, hdr.reqid, "Already logged in");
+            return true;
+         }
+
+         const char *sep = (const char *) memchr(payload, '\0', hdr.length);
+         if (sep == NULL) {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_badreq, hdr.reqid, "Expected username\\0password");
+            return true;
+         }
+         // A name another node owns is looked up there by the verify itself
+         std::string_view name(payload, sep - payload);
+         _userid = no_user;
+         _remote_name.clear();
+         if (isRemoteUser(name))
+            _remote_name = name;
+         else if ((_userid = _creds->find(name)) == no_user)
+            logUnknownUser(name);
+         std::string passwd(sep + 1, payload + hdr.length - (sep + 1));
+
+         authresult result = startLogin(passwd.c_str());
+         explicit_bzero(&passwd[0], passwd.size());
+
+         if (result == a_started) {
+            _hot->hash_reqid = hdr.reqid;
+            setStatus(s_passwd_wait);
+         } else if (result == a_busy) {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_busy, hdr.reqid, "Server busy, please retry");
+         } else {
+            bool limited = (result == a_limited);
+            binproto::appendFrame(_outbuf, hdr.opcode, limited ? binproto::st_limited : binproto::st_denied,
+                        hdr.reqid, limited ? "Too many failed logins" : "Username not recognized");
+            flushOutput();
+            disconnect();
+         }
+         return true;
+      }
+
+      case binproto::op_command: {
+         if (status() == s_passwd_wait)
+            return false;
+         if (!loggedin) {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_denied, hdr.reqid, "Not logged in");
+            return true;
+         }
+
+         std::string cmd(payload, hdr.length);
+         std::string reply;
+         msgresult sent = messageCommand(cmd, reply);
+         if (sent == m_none)
+            sent = getCommand(cmd, reply);
+         if (sent == m_none)
+            sent = putCommand(cmd, reply);
+         if (sent == m_none)
+            sent = compressCommand(cmd, reply);
+         if (sent != m_none) {
+            binproto::appendFrame(_outbuf, hdr.opcode, (sent == m_sent) ? binproto::st_ok : binproto::st_badreq,
+                                  hdr.reqid, reply);
+            return true;
+         }
+
+         lower(cmd);
+         bool known = menuReply(cmd, reply);
+         binproto::appendFrame(_outbuf, hdr.opcode, known ? binproto::st_ok : binproto::st_unknown, hdr.reqid, reply);
+         return true;
+      }
+
+      case binproto::op_passwd: {
+         if (hashing)
+            return false;
+         if (!loggedin) {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_denied, hdr.reqid, "Not logged in");
+            return true;
+         }
+
+         std::string passwd(payload, hdr.length);
+         authresult result = startChangePasswd(passwd.c_str());
+         explicit_bzero(&passwd[0], passwd.size());
+
+         if (result == a_started) {
+            _hot->hash_reqid = hdr.reqid;
+            setStatus(s_changepwd_wait);
+         } else {
+            binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_busy, hdr.reqid, "Server busy, please retry");
+         }
+         return true;
+      }
+
+      case binproto::op_exit:
+         if (hashing)
+            return false;
+         binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_ok, hdr.reqid, "Disconnecting...goodbye!");
+         flushOutput();
+         disconnect();
+         return true;
+
+      default:
+         binproto::appendFrame(_outbuf, hdr.opcode, binproto::st_badreq, hdr.reqid, "Unknown opcode");
+         return true;
+   }
+}
+
+/**********************************************************************************************
+ * finishBinaryHash - answers the login or password change request whose hash just finished
+ *
+ *    Throws: pwfile_error if the password file could not be rewritten
+ **********************************************************************************************/
+
+void TCPConn::finishBinaryHash() {
+   if (status() == s_changepwd_wait) {
+      setStatus(s_menu);
+      switch (finishChangePasswd()) {
+         case a_ok:
+            binproto::appendFrame(_outbuf, binproto::op_passwd, binproto::st_ok, _hot->hash_reqid, "Password successfully changed");
+            break;
+         case a_busy:
+            binproto::appendFrame(_outbuf, binproto::op_passwd, binproto::st_busy, _hot->hash_reqid, "Server busy, please retry");
+            break;
+         default:
+            binproto::appendFrame(_outbuf, binproto::op_passwd, binproto::st_badreq, _hot->hash_reqid, "Password change error occured");
+            break;
+      }
+      return;
+   }
+
+   setStatus(s_passwd);
+   switch (finishLogin()) {
+      case a_ok:
+         binproto::appendFrame(_outbuf, binproto::op_login, binproto::st_ok, _hot->hash_reqid, "Log in successful");
+         setStatus(s_menu);
+         break;
+      case a_denied:
+         binproto::appendFrame(_outbuf, binproto::op_login, binproto::st_denied, _hot->hash_reqid, "Invalid Password");
+         break;
+      case a_locked:
+         binproto::appendFrame(_outbuf, binproto::op_login, binproto::st_denied, _hot->hash_reqid, "Too many login attempts");
+         flushOutput();
+         disconnect();
+         break;
+      case a_unknown:
+         binproto::appendFrame(_outbuf, binproto::op_login, binproto::st_denied, _hot->hash_reqid, "Username not recognized");
+         flushOutput();
+         disconnect();
+         break;
+      default:
+         binproto::appendFrame(_outbuf, binproto::op_login, binproto::st_busy, _hot->hash_reqid, "Server busy, please retry");
+         break;
+   }
+}
+
+/**********************************************************************************************
+ * flushOutput - writes the queued binary replies to the socket
+ *
+ **********************************************************************************************/
+
+void TCPConn::flushOutput() {
+   if (_outbuf.empty() || !isConnected())
+      return;
+
+   // Behind the queued messages; queueMessage moves them over
+   if (!_msgq.empty()) {
+      MsgRef replies(MsgBuf::copyOf(_outbuf.data(), _outbuf.size()));
+      _outbuf.clear();
+      queueMessage(replies, replies->data(), replies->size());
+      sendQueued();
+      return;
+   }
+
+   ssize_t written = _connfd.writeFD(_outbuf.data(), _outbuf.size());
+   if (written < 0) {
+      _outbuf.clear();
+      disconnect();
+   } else {
+      _outbuf.erase(0, written);
+   }
+   updateOutLen();
+}
+
+/**********************************************************************************************
+ * readInput - reads any new data on the socket onto the input buffer. The first bytes of a
+ *             connection decide the protocol: binproto::magic switches it to binary frames.
+ *
+ *    Returns: false if the client hung up (and was disconnected), true otherwise
+ **********************************************************************************************/
+
+bool TCPConn::readInput() {
+   if (!isConnected())
+      return false;
+
+   char readbuf[readbuf_size];
+   ssize_t amt = _connfd.recvFD(readbuf, readbuf_size);
+   if (amt == -2)
+      return true;
+
+   // Readable but nothing to read means the client hung up
+   if (amt <= 0) {
+      disconnect();
+      return false;
+   }
+
+   // Consumed bytes are dropped here, once they make up half the buffer, rather than after
+   // every line or frame
+   if ((_hot->in_head > 0) && (_hot->in_head * 2 >= _hot->in_tail)) {
+      _inputbuf.erase(0, _hot->in_head);
+      _hot->in_tail -= _hot->in_head;
+      _hot->in_head = 0;
+   }
+
+   // concat the data onto anything we've read before
+   _inputbuf.append(readbuf, amt);
+   _hot->in_tail = _inputbuf.size();
+
+   if (!(_hot->flags & ConnHot::f_negotiated)) {
+      if ((unsigned char) inputData()[0] != binproto::magic) {
+         _hot->flags |= ConnHot::f_negotiated;
+         return true;
+      }
+      if (inputLen() < 2)
+         return true;
+
+      _hot->flags |= ConnHot::f_negotiated;
+      if ((unsigned char) inputData()[1] != binproto::version) {
+         _connfd.writeFD("Unsupported protocol version\n");
+         disconnect();
+         return false;
+      }
+
+      const char hello[2] = {(char) binproto::magic, (char) binproto::version};
+      _outbuf.append(hello, 2);
+      consumeInput(2);
+      _hot->flags |= ConnHot::f_binary;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * consumeInput - marks len bytes at the front of the input buffer as handled
+ *
+ **********************************************************************************************/
+
+void TCPConn::consumeInput(size_t len) {
+   _hot->in_head += len;
+   if (_hot->in_head == _hot->in_tail) {
+      _inputbuf.clear();
+      _hot->in_head = _hot->in_tail = 0;
+   }
+}
+
+/**********************************************************************************************
+ * hasRequest - true if a complete line (or binary frame) is waiting in the input buffer
+ *
+ **********************************************************************************************/
+
+bool TCPConn::hasRequest() {
+   if (isBinary()) {
+      binproto::FrameHeader hdr;
+      return (binproto::parseHeader(inputData(), inputLen(), hdr) &&
+              (inputLen() >= binproto::header_size + hdr.length));
+   }
+   return (textk::findNewline(inputData(), inputLen()) != NULL);
+}
+
+/**********************************************************************************************
+ * updateFlags - refreshes the hot flags the server loop uses to decide whether this connection
+ *               needs a pass without new data on its socket
+ *
+ **********************************************************************************************/
+
+void TCPConn::updateFlags() {
+   uint8_t flags = _hot->flags & ~(ConnHot::f_hashing | ConnHot::f_request);
+   if (_hashjob || _upgradejob || _shardcall)
+      flags |= ConnHot::f_hashing;
+   if (isConnected() && hasRequest())
+      flags |= ConnHot::f_request;
+   _hot->flags = flags;
+   updateOutLen();
+}
+
+/**********************************************************************************************
+ * getUserInput - Gets user data and includes a buffer to look for a carriage return before it is
+ *                considered a complete user input. Performs some post-processing on it, removing
+ *                the newlines. Lines that arrived together are handed out one per call even if
+ *                nothing new is waiting on the socket, and a closed socket disconnects.
+ *
+ *    Params: cmd - the buffer to store commands - contents left alone if no command found
+ *            lowercase - also lowercase the line, in the same pass that removes the newlines
+ *
+ *    Returns: true if a carriage return was found and cmd was populated, false otherwise.
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::getUserInput(std::string &cmd, bool lowercase) {
+
+   // A client that just switched to binary frames has no lines for us
+   if (!readInput() || isBinary())
+      return false;
+
+   // If it doesn't have a carriage return, then it's not a command
+   const char *data = inputData();
+   const char *crpos = textk::findNewline(data, inputLen());
+   if (crpos == NULL)
+      return false;
+
+   cmd.assign(data, crpos - data);
+   consumeInput(crpos - data + 1);
+
+   // Remove \r if it is there
+   if (lowercase)
+      clrNewlinesLower(cmd);
+   else
+      clrNewlines(cmd);
+
+   return true;
 }
 
 /**********************************************************************************************
- * sendText - simply calls the sendText FileDesc method to send a string to this FD
+ * menuReply - builds the reply to a menu command that doesn't change the connection's state,
+ *             for both the text and binary protocols
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params:  cmd - the lowercased command
+ *             msg - filled with the reply text
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Returns: true if the command was recognized, false otherwise (msg says so)
  **********************************************************************************************/
 
-int TCPConn::sendText(const char *msg) {
-   return sendText(msg, strlen(msg));
-}
+bool TCPConn::menuReply(const std::string &cmd, std::string &msg) {
+   // Don't be lazy and use my outputs--make your own!
+   msg.clear();
+   if (cmd.compare("hello") == 0) {
+      msg = "Hello back!\n";
+   } else if (cmd.compare("menu") == 0) {
+      buildMenu(msg);
+   } else if (cmd.compare("1") == 0) {
+      msg += "You want a prediction about the weather? You're asking the wrong Phil.\n";
+      msg += "I'm going to give you a prediction about this winter. It's going to be\n";
+      msg += "cold, it's going to be dark and it's going to last you for the rest of\n";
+      msg += "your lives!\n";
+   } else if (cmd.compare("2") == 0) {
+      msg = "42\n";
+   } else if (cmd.compare("3") == 0) {
+      msg = "That seems like a terrible idea.\n";
+   } else if (cmd.compare("4") == 0) {
 
-int TCPConn::sendText(const char *msg, int size) {
-   if (_connfd.writeFD(msg, size) < 0) {
-      return -1;  
+   } else if (cmd.compare("5") == 0) {
+      msg += "I'm singing, I'm in a computer and I'm siiiingiiiing! I'm in a\n";
+      msg += "computer and I'm siiiiiiinnnggiiinnggg!\n";
+   } else {
+      msg = "Unrecognized command: ";
+      msg += cmd;
+      msg += "\n";
+      return false;
    }
-   return 0;
+   return true;
 }
 
 /**********************************************************************************************
- * startAuthentication - Sets the status to request username
+ * messageCommand - handles "broadcast <text>" and "msg <user> <text>" for both protocols. The
+ *                  command word is matched in any case; the user name and text are kept as
+ *                  typed.
  *
- *    Throws: runtime_error for unrecoverable types
+ *    Params:  cmd - the command line as received
+ *             msg - filled with the reply for the sender
+ *
+ *    Returns: m_none if cmd is not a message command, m_sent if it was delivered (to however
+ *             many sessions msg says), m_error if not (msg says why)
  **********************************************************************************************/
 
-void TCPConn::startAuthentication() {
-   //initializes attempts to zero
-   this->_pwd_attempts = 0;
-   //transition username state
-   _status = s_username;
-   //client console output
-   _connfd.writeFD("Username: "); 
+TCPConn::msgresult TCPConn::messageCommand(const std::string &cmd, std::string &msg) {
+   std::string_view line(cmd);
+   size_t sp = line.find(' ');
+   std::string_view word = line.substr(0, sp);
+   std::string_view rest = (sp == std::string_view::npos) ? std::string_view() : line.substr(sp + 1);
+
+   bool bcast = (word.size() == 9) && (strncasecmp(word.data(), "broadcast", 9) == 0);
+   bool direct = (word.size() == 3) && (strncasecmp(word.data(), "msg", 3) == 0);
+   if (!bcast && !direct)
+      return m_none;
+
+   std::string_view to;
+   if (direct) {
+      sp = rest.find(' ');
+      to = rest.substr(0, sp);
+      rest = (sp == std::string_view::npos) ? std::string_view() : rest.substr(sp + 1);
+   }
+
+   if (rest.empty() || (direct && to.empty())) {
+      msg = bcast ? "Usage: broadcast <text>\n" : "Usage: msg <user> <text>\n";
+      return m_error;
+   }
+   if (rest.size() > max_message_len) {
+      msg = "Message too long\n";
+      return m_error;
+   }
+
+   // A newline would let the text pass itself off as a separate line from the server
+   if (std::any_of(rest.begin(), rest.end(), [](char c) { return (unsigned char) c < ' ' && c != '\t'; })) {
+      msg = "Messages cannot contain control characters\n";
+      return m_error;
+   }
+   if (_fanout == NULL) {
+      msg = "Messaging is not available\n";
+      return m_error;
+   }
 
+   if (bcast) {
+      size_t sent = _fanout->broadcast(*_table, *this, rest);
+      msg = "Broadcast sent to " + std::to_string(sent) + " sessions\n";
+      return m_sent;
+   }
+
+   // Users other nodes own are interned too once they log in here
+   userid id = _creds->lookup(to);
+   size_t sent = _fanout->message(*_table, *this, id, rest);
+   if (sent == 0) {
+      msg = std::string(to) + " is not logged in\n";
+      return m_error;
+   }
+   msg = "Message sent to " + std::string(to) + "\n";
+   return m_sent;
 }
 
 /**********************************************************************************************
- * handleConnection - performs a check of the connection, looking for data on the socket and
- *                    handling it based on the _status, or stage, of the connection
+ * getCommand - handles "get <name>" from the text protocol: queues a line announcing the
+ *              file's size, then the file itself, which sendQueued streams with sendfile. Only
+ *              plain names of regular files directly in the content directory are served.
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Params:  cmd - the command line as received
+ *             msg - filled with the reply when the file can't be sent
+ *
+ *    Returns: m_none if cmd is not a get command, m_sent if the file is queued, m_error if
+ *             not (msg says why)
  **********************************************************************************************/
 
-void TCPConn::handleConnection() {
-
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
-
-   //testing
-   //std::cout << "_status: " << _status << std::endl;
-
-   try {
-      switch (_status) {
-         case s_username:
-            getUsername();
-            break;
+TCPConn::msgresult TCPConn::getCommand(const std::string &cmd, std::string &msg) {
+   std::string_view line(cmd);
+   size_t sp = line.find(' ');
+   std::string_view word = line.substr(0, sp);
+   if ((word.size() != 3) || (strncasecmp(word.data(), "get", 3) != 0))
+      return m_none;
+
+   std::string name = (sp == std::string_view::npos) ? std::string() : std::string(line.substr(sp + 1));
+   if (name.empty()) {
+      msg = "Usage: get <name>\n";
+      return m_error;
+   }
 
-         case s_passwd:
-            getPasswd();
-            break;
-   
-         case s_changepwd:
-         case s_confirmpwd:
-            changePassword();
-            break;
+   // A binary reply can't carry more than max_payload
+   if (isBinary()) {
+      msg = "Downloads are only available in the text protocol\n";
+      return m_error;
+   }
+   if (_contentdir == NULL) {
+      msg = "Downloads are not available\n";
+      return m_error;
+   }
 
-         case s_menu:
-            getMenuChoice();
+   if (!isFileName(name)) {
+      msg = "Invalid file name\n";
+      return m_error;
+   }
 
-            break;
+   // Checked before opening, so a FIFO can't block the loop in open
+   std::string path = std::string(_contentdir) + "/" + name;
+   struct stat st;
+   if ((stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode)) {
+      msg = "No such file: " + name + "\n";
+      return m_error;
+   }
 
-         default:
-            throw std::runtime_error("Invalid connection status!");
-            break;
-      }
-   } catch (socket_error &e) {
-      std::cout << "Socket error, disconnecting.";
-      disconnect();
-      return;
+   std::shared_ptr<FileFD> file(new FileFD(path.c_str()), [](FileFD *f) { f->closeFD(); delete f; });
+   if (!file->openFile(FileFD::readfd) || (fstat(file->getFD(), &st) != 0)) {
+      msg = "No such file: " + name + "\n";
+      return m_error;
    }
 
-   nanosleep(&sleeptime, NULL);
+   // Read ahead so sendfile mostly finds the pages already in the cache
+   posix_fadvise(file->getFD(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   std::string header = "Sending " + name + ", " + std::to_string(st.st_size) + " bytes\n";
+   MsgRef hdr(MsgBuf::copyOf(header.data(), header.size()));
+   queueMessage(hdr, hdr->data(), header.size());
+   if (st.st_size > 0)
+      queueFile(file, 0, (size_t) st.st_size);
+   sendQueued();
+   return m_sent;
 }
 
 /**********************************************************************************************
- * getUsername - called from handleConnection when status is s_username--if it finds user data,
- *               it expects a username and compares it against the password database
+ * putCommand - handles "put <name> <length>" from the text protocol: creates the user's file
+ *              under a hidden name, preallocates it and tells the client to send. The session
+ *              then waits on uploadDone while pumpUpload moves the bytes.
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Params:  cmd - the command line as received
+ *             msg - filled with the reply when the upload can't start
+ *
+ *    Returns: m_none if cmd is not a put command, m_sent if the upload started, m_error if
+ *             not (msg says why)
  **********************************************************************************************/
 
-void TCPConn::getUsername() {
-   // Insert your mind-blowing code here
-   //Check if user has inputed name
-   if (!_connfd.hasData())
-      return;
-   std::string userNameInput;
-   if (!getUserInput(userNameInput))
-      return;
+TCPConn::msgresult TCPConn::putCommand(const std::string &cmd, std::string &msg) {
+   std::string_view line(cmd);
+   size_t sp = line.find(' ');
+   std::string_view word = line.substr(0, sp);
+   if ((word.size() != 3) || (strncasecmp(word.data(), "put", 3) != 0))
+      return m_none;
+
+   std::string_view rest = (sp == std::string_view::npos) ? std::string_view() : line.substr(sp + 1);
+   sp = rest.find(' ');
+   std::string name(rest.substr(0, sp));
+   std::string lenstr = (sp == std::string_view::npos) ? std::string() : std::string(rest.substr(sp + 1));
+
+   char *end = NULL;
+   unsigned long long len = strtoull(lenstr.c_str(), &end, 10);
+   if (name.empty() || lenstr.empty() || !isdigit((unsigned char) lenstr[0]) || (*end != '\0')) {
+      msg = "Usage: put <name> <length>\n";
+      return m_error;
+   }
+
+   // The bytes would have to come in frames
+   if (isBinary()) {
+      msg = "Uploads are only available in the text protocol\n";
+      return m_error;
+   }
+   if (_uploaddir == NULL) {
+      msg = "Uploads are not available\n";
+      return m_error;
+   }
+   if (!isFileName(name)) {
+      msg = "Invalid file name\n";
+      return m_error;
+   }
+   if (len > max_upload_bytes) {
+      msg = "Upload too large, the limit is " + std::to_string(max_upload_bytes) + " bytes\n";
+      return m_error;
+   }
 
-   //store name (case-sensitive) in object
-   this->_username = userNameInput;   
-   //std::cout << "Got User Name: " << _username << std::endl;//testing
+   std::string dir = std::string(_uploaddir) + "/" + getUsernameStr();
+   mkdir(_uploaddir, 0700);
+   mkdir(dir.c_str(), 0700);
 
-   if (!PWMgr->checkUser(this->_username.c_str()) )
-   {
-      sendText("Username not recognized\n");
-      //Logs message with client IP address & disconnects
-      log(usrName_NOT_recog);
-      disconnect();
-      //Server terminal message for Admin notification
-      std::cout << "Username not found: disconnected client" << std::endl;
+   auto up = std::make_unique<Upload>();
+   up->name = name;
+   up->path = dir + "/" + name;
+   up->partpath = dir + "/." + name + "." + std::to_string(getpid()) + "." + std::to_string(getFD()) + ".part";
+   up->total = up->remaining = len;
+
+   up->file = std::make_unique<FileFD>(up->partpath.c_str());
+   if (!up->file->openFile(FileFD::createfd)) {
+      msg = "Upload failed: could not create the file\n";
+      return m_error;
    }
-   else{
-      //Server terminal message for Admin notification
-      std::cout << "Username found" << std::endl;
+   _upload = std::move(up);
+
+   // Claim the space now, so a full disk fails the command instead of the transfer
+   if ((len > 0) && (fallocate(_upload->file->getFD(), 0, 0, (off_t) len) != 0) &&
+       (errno != EOPNOTSUPP)) {
+      msg = (errno == ENOSPC) ? "Upload failed: not enough space\n" : "Upload failed: could not allocate the file\n";
+      abortUpload();
+      return m_error;
+   }
+
+   if (pipe2(_upload->pipefd, O_NONBLOCK | O_CLOEXEC) != 0) {
+      msg = "Upload failed: out of resources\n";
+      abortUpload();
+      return m_error;
    }
-   //transitions to password state
-   _connfd.writeFD("Password: "); 
-   this->_status = s_passwd;
 
+   sendText("Ready for " + std::to_string(len) + " bytes\n");
+   updateBlocking();
+   return m_sent;
 }
 
 /**********************************************************************************************
- * getPasswd - called from handleConnection when status is s_passwd--if it finds user data,
- *             it assumes it's a password and hashes it, comparing to the database hash. Users
- *             get two tries before they are disconnected
+ * pumpUpload - writes out whatever of the upload has arrived: first the bytes that came in
+ *              with the command line and are already in the input buffer, then straight from
+ *              the socket, spliced through the pipe into the file without passing through
+ *              userspace. Syncs every _upload_sync_bytes with sync_every.
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Returns: true once all of it is in the file, false if more has to come first or the
+ *             client went away (and was disconnected)
  **********************************************************************************************/
 
-void TCPConn::getPasswd() {
-   // Insert your mind-blowing code here
-   //Check if user has inputed passwd
-   if (!_connfd.hasData())
-      return;
-   std::string userPasswdInput;
-   if (!getUserInput(userPasswdInput))
-      return;
+bool TCPConn::pumpUpload() {
+   if (!_upload)
+      return false;
 
-   //checks if password is correct
-   bool validPW = this->PWMgr->checkPasswd(this->_username.c_str(), userPasswdInput.c_str());
+   Upload &up = *_upload;
+   int filefd = up.file->getFD();
 
-   if (!validPW)
-   {
-      std::cout << "invalid password" << std::endl;
-      _connfd.writeFD("Invalid Password\n"); 
-      this->_pwd_attempts++;
-      if (this->_pwd_attempts == 2 ){
-         //logs fail attempts
-         log(paswd_failed_twice);
-         _connfd.writeFD("Too many login attempts\n"); 
+   size_t buffered = (size_t) std::min<uint64_t>(inputLen(), up.remaining);
+   while (buffered > 0) {
+      ssize_t n = write(filefd, inputData(), buffered);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         disconnect();
+         return false;
+      }
+      consumeInput(n);
+      buffered -= n;
+      up.remaining -= n;
+      up.unsynced += n;
+   }
+
+   while ((up.remaining > 0) || (up.in_pipe > 0)) {
+      if (up.in_pipe > 0) {
+         ssize_t n = splice(up.pipefd[0], NULL, filefd, NULL, up.in_pipe, SPLICE_F_MOVE);
+         if (n <= 0) {
+            if ((n < 0) && (errno == EINTR))
+               continue;
+            disconnect();
+            return false;
+         }
+         up.in_pipe -= n;
+         up.unsynced += n;
+         continue;
+      }
+
+      size_t want = (size_t) std::min<uint64_t>(up.remaining, upload_chunk);
+      ssize_t n = splice(_connfd.getFD(), NULL, up.pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
+      }
+
+      // Hung up (or failed) partway
+      if (n <= 0) {
          disconnect();
+         return false;
       }
-      _connfd.writeFD("Password: "); 
+      up.in_pipe += n;
+      up.remaining -= n;
    }
-   else{
-      std::cout << "Password verified" << std::endl;
-      log(succ_login);
-      _connfd.writeFD("Log in successful\n");
-      this->_status = s_menu;
+
+   if ((_upload_sync == sync_every) && (up.unsynced >= _upload_sync_bytes)) {
+      fdatasync(filefd);
+      up.unsynced = 0;
    }
+   return (up.remaining == 0) && (up.in_pipe == 0);
 }
 
 /**********************************************************************************************
- * changePassword - called from handleConnection when status is s_changepwd or s_confirmpwd--
- *                  if it finds user data, with status s_changepwd, it saves the user-entered
- *                  password. If s_confirmpwd, it checks to ensure the saved password from
- *                  the s_changepwd phase is equal, then saves the new pwd to the database
+ * finishUpload - makes a complete upload durable as the sync policy asks and renames it into
+ *                place, replacing any earlier file of that name
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Params:  msg - filled with the reply for the client
  **********************************************************************************************/
 
-void TCPConn::changePassword() {
-   // Insert your amazing code here
-   //
-   if (!_connfd.hasData())
-      return;
-   std::string newPasswdInput;
-   if (!getUserInput(newPasswdInput))
-      return;
-
+void TCPConn::finishUpload(std::string &msg) {
+   Upload &up = *_upload;
+   int filefd = up.file->getFD();
 
-   //Calls PasswdMgr function w/ error handling
-   if (!this->PWMgr->changePasswd(this->_username.c_str(), newPasswdInput.c_str()) )
-   {
-      _connfd.writeFD("Password change error occured\n");
-      _connfd.writeFD("Type \"passwd\" to try again\n");
+   bool ok = (_upload_sync == sync_none) || (fsync(filefd) == 0);
+   ok = ok && (rename(up.partpath.c_str(), up.path.c_str()) == 0);
+   if (ok) {
+      msg = "Stored " + up.name + ", " + std::to_string(up.total) + " bytes\n";
+      up.partpath.clear();
+   } else {
+      msg = "Upload failed: could not store the file\n";
    }
+   abortUpload();
+}
 
-   //Confirmation message to client
-   _connfd.writeFD("Password successfully changed\n");
+/**********************************************************************************************
+ * abortUpload - closes the upload's file and pipe, removing the file unless it was stored
+ *
+ **********************************************************************************************/
 
-   //Transitions to menu state
-   this->_status = s_menu;
+void TCPConn::abortUpload() {
+   if (!_upload)
+      return;
 
+   _upload->file->closeFD();
+   if (!_upload->partpath.empty())
+      unlink(_upload->partpath.c_str());
+   for (int fd : _upload->pipefd) {
+      if (fd != -1)
+         close(fd);
+   }
+   _upload.reset();
+   updateBlocking();
 }
 
-
 /**********************************************************************************************
- * getUserInput - Gets user data and includes a buffer to look for a carriage return before it is
- *                considered a complete user input. Performs some post-processing on it, removing
- *                the newlines
- *
- *    Params: cmd - the buffer to store commands - contents left alone if no command found
+ * compressCommand - handles "compress" from the text protocol, which a client sends right
+ *                   after logging in to have the rest of the session deflated
  *
- *    Returns: true if a carriage return was found and cmd was populated, false otherwise.
+ *    Params:  cmd - the command line as received
+ *             msg - filled with the reply; after compress_reply, the stream is compressed
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Returns: m_none if cmd is not "compress", m_sent if the caller should startCompression
+ *             once the reply is sent, m_error if not (msg says why)
  **********************************************************************************************/
 
-bool TCPConn::getUserInput(std::string &cmd) {
-   std::string readbuf;
-
-   // read the data on the socket
-   _connfd.readFD(readbuf);
+TCPConn::msgresult TCPConn::compressCommand(const std::string &cmd, std::string &msg) {
+   if (strcasecmp(cmd.c_str(), "compress") != 0)
+      return m_none;
 
-   // concat the data onto anything we've read before
-   _inputbuf += readbuf;
-
-   // If it doesn't have a carriage return, then it's not a command
-   unsigned int crpos;
-   if ((crpos = _inputbuf.find("\n")) == std::string::npos)
-      return false;
-
-   cmd = _inputbuf.substr(0, crpos);
-   _inputbuf.erase(0, crpos+1);
-
-   // Remove \r if it is there
-   clrNewlines(cmd);
+   // Frames are read one at a time, by length; the client can't find where one ends
+   if (isBinary()) {
+      msg = "Compression is only available in the text protocol\n";
+      return m_error;
+   }
+   if (_zlevel == 0) {
+      msg = "Compression is not available\n";
+      return m_error;
+   }
+   if (_zstream) {
+      msg = "Compression is already on\n";
+      return m_error;
+   }
 
-   return true;
+   msg = compress_reply;
+   return m_sent;
 }
 
 /**********************************************************************************************
- * getMenuChoice - Gets the user's command and interprets it, calling the appropriate function
- *                 if required.
+ * startCompression - sends everything queued from here on through a new deflate stream. What
+ *                    is already queued, the "compress" reply included, still goes out as is.
  *
- *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::getMenuChoice() {
-   if (!_connfd.hasData())
+void TCPConn::startCompression() {
+   if (!isConnected())
       return;
-   std::string cmd;
-   if (!getUserInput(cmd))
-      return;
-   lower(cmd);      
 
-   // Don't be lazy and use my outputs--make your own!
-   std::string msg;
-   if (cmd.compare("hello") == 0) {
-      _connfd.writeFD("Hello back!\n");
-   } else if (cmd.compare("menu") == 0) {
-      sendMenu();
-   } else if (cmd.compare("exit") == 0) {
-      _connfd.writeFD("Disconnecting...goodbye!\n");
+   try {
+      _zstream = std::make_unique<StreamCompressor>(_zlevel, _zstats);
+   } catch (std::runtime_error &e) {
+      std::cout << "Compression failed, disconnecting: " << e.what() << std::endl;
       disconnect();
-   } else if (cmd.compare("passwd") == 0) {
-      _connfd.writeFD("New Password: ");
-      _status = s_changepwd;
-   } else if (cmd.compare("1") == 0) {
-      msg += "You want a prediction about the weather? You're asking the wrong Phil.\n";
-      msg += "I'm going to give you a prediction about this winter. It's going to be\n";
-      msg += "cold, it's going to be dark and it's going to last you for the rest of\n";
-      msg += "your lives!\n";
-      _connfd.writeFD(msg);
-   } else if (cmd.compare("2") == 0) {
-      _connfd.writeFD("42\n");
-   } else if (cmd.compare("3") == 0) {
-      _connfd.writeFD("That seems like a terrible idea.\n");
-   } else if (cmd.compare("4") == 0) {
-
-   } else if (cmd.compare("5") == 0) {
-      _connfd.writeFD("I'm singing, I'm in a computer and I'm siiiingiiiing! I'm in a\n");
-      _connfd.writeFD("computer and I'm siiiiiiinnnggiiinnggg!\n");
-   } else {
-      msg = "Unrecognized command: ";
-      msg += cmd;
-      msg += "\n";
-      _connfd.writeFD(msg);
+      return;
    }
 
+   queueReplies();
+   _zraw = _msgq.size() - _msgq_head;
+   updateBlocking();
 }
 
 /**********************************************************************************************
@@ -328,7 +1702,11 @@ void TCPConn::getMenuChoice() {
  **********************************************************************************************/
 void TCPConn::sendMenu() {
    std::string menustr;
+   buildMenu(menustr);
+   sendText(menustr);
+}
 
+void TCPConn::buildMenu(std::string &menustr) {
    // Make this your own!
    menustr += "Available choices: \n";
    menustr += "  1). Provide weather report.\n";
@@ -339,10 +1717,13 @@ void TCPConn::sendMenu() {
    menustr += "Other commands: \n";
    menustr += "  Hello - self-explanatory\n";
    menustr += "  Passwd - change your password\n";
+   menustr += "  Broadcast <text> - send a message to everyone logged in\n";
+   menustr += "  Msg <user> <text> - send a message to one user\n";
+   menustr += "  Get <name> - download a file\n";
+   menustr += "  Put <name> <length> - upload a file of length bytes\n";
+   menustr += "  Compress - compress everything the server sends from here on\n";
    menustr += "  Menu - display this menu\n";
    menustr += "  Exit - disconnect.\n\n";
-
-   _connfd.writeFD(menustr);
 }
 
 
@@ -353,29 +1734,186 @@ void TCPConn::sendMenu() {
  **********************************************************************************************/
 void TCPConn::disconnect() {
    //logs disconnetion
-   log(discon);
+   log(evlog::discon);
    _connfd.closeFD();
+   _hot->fd = -1;
+
+   // Queued messages are dropped, releasing their buffers
+   _msgq.clear();
+   _msgq_head = 0;
+   _msgq_bytes = 0;
+   _zstream.reset();
+   _zout.clear();
+   _zsent = 0;
+   _zraw = 0;
+
+   // Nobody is waiting on a queued login hash any more
+   if (_hashjob && (_hasher != NULL))
+      _hasher->cancel(_hashjob);
+   _hashjob.reset();
+
+   // The user's node still answers; nobody reads it
+   _shardcall.reset();
+
+   abortUpload();
 }
 
 
 /**********************************************************************************************
- * isConnected - performs a simple check on the socket to see if it is still open 
+ * isIdle - true if the connection has no hash in flight, no complete request waiting in its
+ *          buffer or on the socket and no unsent reply, so it can be closed without losing
+ *          anything the client asked for
  *
- *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
-bool TCPConn::isConnected() {
-   return _connfd.isOpen();
+bool TCPConn::isIdle() {
+   if (_hashjob || _upgradejob || _shardcall || _upload || !_outbuf.empty() || !_msgq.empty() ||
+       (_zsent < _zout.size()))
+      return false;
+
+   if (_connfd.hasData(0))
+      return false;
+
+   return !hasRequest();
+}
+
+/**********************************************************************************************
+ * closeForShutdown - tells the client the server is going down and disconnects. Binary
+ *                    clients get an unsolicited op_exit reply with request ID 0.
+ *
+ **********************************************************************************************/
+void TCPConn::closeForShutdown() {
+   if (isBinary()) {
+      binproto::appendFrame(_outbuf, binproto::op_exit, binproto::st_ok, 0, "Server shutting down");
+      flushOutput();
+   } else {
+      sendText("\nServer shutting down...goodbye!\n");
+   }
+   disconnect();
+}
+
+/**********************************************************************************************
+ * loginTimedOut - closes a connection that did not log in within login_timeout_secs. Binary
+ *                 clients get an op_exit with request ID 0 saying why.
+ *
+ **********************************************************************************************/
+void TCPConn::loginTimedOut() {
+   if (isBinary()) {
+      binproto::appendFrame(_outbuf, binproto::op_exit, binproto::st_denied, 0, "Login timed out");
+      flushOutput();
+   } else {
+      sendText("\nLogin timed out\n");
+   }
+   disconnect();
+}
+
+/**********************************************************************************************
+ * canHandOff - true if this connection can move to a new server process: idle and waiting at
+ *              a prompt, so nothing but the state saveState writes needs to travel with it.
+ *              Bytes already received are pulled in first so a partial line travels too. A
+ *              compressed connection stays, since its stream's history can't travel.
+ *
+ **********************************************************************************************/
+bool TCPConn::canHandOff() {
+   if (!isConnected() || _zstream || !readInput() || !isIdle())
+      return false;
+   return ((status() == s_username) || (status() == s_passwd) || (status() == s_menu) ||
+           (status() == s_changepwd));
+}
+
+/**********************************************************************************************
+ * saveState - serializes what restoreState needs to pick the session up in another process:
+ *             status, protocol, attempts, username and any partial input, as
+ *                status, flags, attempts (1 byte each), username '\0', partial input
+ *
+ **********************************************************************************************/
+void TCPConn::saveState(std::string &state) {
+   state.clear();
+   state += (char) status();
+   state += (char) (((_hot->flags & ConnHot::f_negotiated) ? 1 : 0) | (isBinary() ? 2 : 0));
+   state += (char) _hot->attempts;
+   state += _creds->getName(_userid);
+   state += '\0';
+   state.append(inputData(), inputLen());
+}
+
+/**********************************************************************************************
+ * restoreState - takes over a connection handed over by the previous server process
+ *
+ *    Params:  fd - the connection's socket
+ *             state - what saveState wrote
+ *
+ *    Returns: false if the state was not valid (the socket is then closed)
+ **********************************************************************************************/
+bool TCPConn::restoreState(int fd, const std::string &state) {
+   _connfd.adoptFD(fd);
+   _hot->fd = fd;
+   cacheAddress();
+
+   size_t sep = state.find('\0', 3);
+   statustype status = (state.size() > 3) ? (statustype) state[0] : s_confirmpwd;
+   if ((sep == std::string::npos) ||
+       ((status != s_username) && (status != s_passwd) && (status != s_menu) && (status != s_changepwd))) {
+      _connfd.closeFD();
+      _hot->fd = -1;
+      return false;
+   }
+
+   setStatus(status);
+   _hot->flags = ((state[1] & 1) ? ConnHot::f_negotiated : 0) | ((state[1] & 2) ? ConnHot::f_binary : 0);
+   _hot->attempts = (unsigned char) state[2];
+
+   // IDs are local to a process, look the name up again
+   std::string_view name(state.data() + 3, sep - 3);
+   _userid = name.empty() ? no_user : _creds->find(name);
+
+   // Users another node owns were already known to it
+   if ((_userid == no_user) && !name.empty() && isRemoteUser(name)) {
+      _remote_name = name;
+      _userid = _creds->internRemote(name);
+   }
+   if ((_userid == no_user) && (status != s_username)) {
+      _connfd.closeFD();
+      _hot->fd = -1;
+      return false;
+   }
+   if ((status == s_menu) || (status == s_changepwd))
+      _hot->user = _userid + 1;
+   _inputbuf.assign(state, sep + 1, std::string::npos);
+   _hot->in_head = 0;
+   _hot->in_tail = _inputbuf.size();
+
+   // The login clock starts over in the new process
+   if ((status == s_username) || (status == s_passwd))
+      _hot->deadline = ConnTable::nowMS() + login_timeout_secs * 1000ULL;
+
+   // Binary clients are driven frame by frame; text ones pick their session up where it was
+   if (!isBinary())
+      startSession(status);
+
+   updateFlags();
+   return true;
+}
+
+/**********************************************************************************************
+ * releaseFD - closes this process's copy of the socket after handing it over, without logging
+ *             a disconnect or telling the client anything
+ *
+ **********************************************************************************************/
+void TCPConn::releaseFD() {
+   _connfd.closeFD();
+   _hot->fd = -1;
 }
 
 /**********************************************************************************************
- * getIPAddrStr - gets a string format of the IP address and loads it in buf
+ * isConnected - performs a simple check on the socket to see if it is still open 
  *
+ *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
-void TCPConn::getIPAddrStr(std::string &buf) {
-   return _connfd.getIPAddrStr(buf);
+bool TCPConn::isConnected() {
+   return (_hot->fd != -1);
 }
 
-bool TCPConn::isNewIPAllowed(std::string inputIP){
+bool TCPConn::isNewIPAllowed(std::string_view inputIP){
    std::ifstream whitelistFile("whitelist");
    if(!whitelistFile){
       std::cout << "whitelist file not found" << std::endl;
@@ -398,88 +1936,21 @@ bool TCPConn::isNewIPAllowed(std::string inputIP){
 
 }
 
-void TCPConn::log(std::string logString){
-
-   std::string logFileName = "server.log";
-
-   FileFD logFile(logFileName.c_str());
-
-   if (!logFile.openFile(FileFD::appendfd))
-      throw pwfile_error("Could not open log file for writing");
-
-   logFile.writeFD(logString);
-
-   // current date/time based on current system
-   time_t now = time(0);
-   
-   // convert now to string form
-   char* date_Time = ctime(&now);
-
-   logFile.writeFD(" ");
-   logFile.writeFD(date_Time);
-
-   logFile.closeFD();
-}
-
-void TCPConn::log(std::string ipAddress, enum logMessage inputLogOption){
-   std::stringstream ss;
-
-   switch (inputLogOption){
-
-      case newConn_NOT_WL:
-         ss << "IP address \"" << ipAddress << "\" NOT on whitelist attempted to connect,";
-         break;
-
-      case newConn_ON_WL:
-         ss << "IP address \"" << ipAddress << "\" on whitelist connected,";
-         break;
-
-      default:
-         ss << "";
-         break;
-   }
-
-   log(ss.str());
-
+/**********************************************************************************************
+ * log - queues an event about this connection with the log; it is written out later
+ *
+ **********************************************************************************************/
 
+void TCPConn::log(evlog::event ev) {
+   _log->record(ev, _ipaddr, _port, _userid);
 }
 
+/**********************************************************************************************
+ * logUnknownUser - logs a username that is not in the password file. It never gets an ID, so
+ *                  the name the client sent is logged as is.
+ *
+ **********************************************************************************************/
 
-void TCPConn::log(enum logMessage inputLogOption){
-
-   std::stringstream ss;
-
-   std::string IPAddress;
-   this->getIPAddrStr(IPAddress);
-
-   switch (inputLogOption)
-   {
-      case serverStart:
-         ss << "Server started, ";
-         break;
-
-      case usrName_NOT_recog:
-         ss << "Username \"" << _username << "\" NOT recognized, " << "IP: \"" << IPAddress << ",\"";
-         break;
-
-      case paswd_failed_twice:
-         ss << "Username \"" << _username << "\" failed to password twice, " << "IP: \"" << IPAddress << "\"";
-         break;
-      
-      case succ_login:
-         ss << "Username \"" << _username << "\" succesful login, " << "IP: \"" << IPAddress << "\"";
-         break;
-      
-      case discon:
-         ss << "Username \"" << _username << "\" disconnected, " << "IP: \"" << IPAddress << "\"";
-         break;
-
-      default:
-         ss << "";
-         break;
-   }
-
-   //std::string logString(ss.str());
-
-   log(ss.str());
+void TCPConn::logUnknownUser(std::string_view name) {
+   _log->record(evlog::usrName_NOT_recog, _ipaddr, _port, name);
 }
@@ -0,0 +1,575 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "TCPProxy.h"
+#include "exceptions.h"
+
+// Milliseconds on the monotonic clock
+static uint64_t nowMS() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+TCPProxy::TCPProxy():Server() {
+   _sigfd = std::make_unique<SignalFD>(std::initializer_list<int>{SIGTERM, SIGINT, SIGHUP});
+}
+
+
+TCPProxy::~TCPProxy() {
+
+}
+
+/**********************************************************************************************
+ * bindSvr - sets the listening socket nonblocking, so each pass accepts whatever is waiting,
+ *           and binds it to the ip address and port
+ *
+ *    Throws: socket_error if the bind failed
+ **********************************************************************************************/
+
+void TCPProxy::bindSvr(const char *ip_addr, unsigned short port) {
+   _sockfd.setNonBlocking();
+   _sockfd.bindFD(ip_addr, port);
+}
+
+/**********************************************************************************************
+ * addBackend - adds a backend to the rotation, or sets whether an existing one is draining
+ *
+ *    Throws: std::invalid_argument if addr is not an IPv4 "ip:port"
+ **********************************************************************************************/
+
+void TCPProxy::addBackend(const std::string &addr, bool drain) {
+   for (auto &b : _backends) {
+      if (b->addr == addr) {
+         b->removed = false;
+         b->draining = drain;
+         return;
+      }
+   }
+
+   auto b = std::make_unique<Backend>();
+   if (!parseAddr(addr, b->ip, b->port))
+      throw std::invalid_argument("Invalid backend " + addr + ". Format is <ip_addr>:<port>");
+   b->addr = addr;
+   b->draining = drain;
+   _backends.push_back(std::move(b));
+}
+
+void TCPProxy::setBackendFile(const char *path) {
+   _backend_file = path;
+   loadBackends();
+}
+
+void TCPProxy::setHealthCheck(int interval_ms, unsigned int fails) {
+   _health_ms = std::max(interval_ms, 10);
+   _health_fails = std::max(fails, 1U);
+}
+
+bool TCPProxy::parseAddr(const std::string &addr, std::string &ip, unsigned short &port) {
+   size_t colon = addr.rfind(':');
+   if (colon == std::string::npos)
+      return false;
+
+   ip = addr.substr(0, colon);
+   in_addr parsed;
+   if (inet_pton(AF_INET, ip.c_str(), &parsed) != 1)
+      return false;
+
+   char *end;
+   long portval = strtol(addr.c_str() + colon + 1, &end, 10);
+   if ((*end != '\0') || (portval < 1) || (portval > 65535))
+      return false;
+   port = (unsigned short) portval;
+   return true;
+}
+
+/**********************************************************************************************
+ * loadBackends - reads the backends file and makes the rotation match it. Backends no longer
+ *                listed stop getting sessions and are forgotten once their last one ends. The
+ *                whole file is checked before anything changes, so a bad edit leaves the
+ *                current backends in place.
+ *
+ *    Throws: std::runtime_error if the file can't be read or has a bad line
+ **********************************************************************************************/
+
+void TCPProxy::loadBackends() {
+   std::ifstream in(_backend_file);
+   if (!in)
+      throw std::runtime_error("Could not read backends file " + _backend_file);
+
+   std::vector<std::pair<std::string, bool>> listed;
+   std::string line;
+   unsigned int lineno = 0;
+   while (std::getline(in, line)) {
+      lineno++;
+      std::istringstream words(line);
+      std::string addr, flag;
+      if (!(words >> addr) || (addr[0] == '#'))
+         continue;
+
+      std::string ip;
+      unsigned short port;
+      words >> flag;
+      if (!parseAddr(addr, ip, port) || (!flag.empty() && (flag != "drain")))
+         throw std::runtime_error(_backend_file + " line " + std::to_string(lineno) +
+                                  ": expected <ip_addr>:<port> [drain]");
+      listed.emplace_back(addr, flag == "drain");
+   }
+
+   std::vector<bool> was_draining;
+   for (auto &b : _backends) {
+      was_draining.push_back(b->draining || b->removed);
+      b->removed = true;
+   }
+
+   size_t known = _backends.size();
+   for (auto &entry : listed)
+      addBackend(entry.first, entry.second);
+
+   for (size_t i = 0; i < _backends.size(); i++) {
+      Backend &b = *_backends[i];
+      if (i >= known)
+         std::cout << "Added backend " << b.addr << (b.draining ? " (draining)" : "") << std::endl;
+      else if (b.removed)
+         std::cout << "Removing backend " << b.addr << " once its " << b.conns << " sessions end" << std::endl;
+      else if (b.draining && !was_draining[i])
+         std::cout << "Draining backend " << b.addr << std::endl;
+      else if (!b.draining && was_draining[i])
+         std::cout << "Backend " << b.addr << " back in rotation" << std::endl;
+   }
+}
+
+/**********************************************************************************************
+ * listenSvr - the proxy loop: accepts clients, relays every session's traffic, runs the health
+ *             checks and handles the signals. Returns once a SIGTERM or SIGINT has let the
+ *             sessions drain, or the drain timeout (or a second signal) cut them short;
+ *             shutdown closes whatever is left.
+ *
+ *    Throws: socket_error if poll fails
+ **********************************************************************************************/
+
+void TCPProxy::listenSvr() {
+   bool online = true;
+   bool draining = false;
+   uint64_t deadline = 0;
+
+   _sockfd.listenFD(128);
+
+   while (online) {
+      int timeout = pollTimeout(nowMS());
+      if (poll(_pollfds.data(), _pollfds.size(), timeout) == -1) {
+         if (errno != EINTR)
+            throw socket_error("poll failed in the proxy loop.");
+         continue;
+      }
+
+      // Hand the results to their owners before anything is added or removed
+      size_t next = 2;
+      for (auto &b : _backends)
+         b->revents = _pollfds[next++].revents;
+      for (auto &s : _sessions) {
+         s->client_rev = _pollfds[next++].revents;
+         s->server_rev = _pollfds[next++].revents;
+      }
+
+      int sig;
+      while ((sig = _sigfd->readSignal()) != -1) {
+         if (sig == SIGHUP) {
+            if (_backend_file.empty())
+               continue;
+            try {
+               loadBackends();
+            } catch (std::runtime_error &e) {
+               std::cerr << "Keeping the current backends: " << e.what() << std::endl;
+            }
+         } else if (!draining) {
+            std::cout << "Shutting down, letting " << _sessions.size() << " sessions finish" << std::endl;
+            _sockfd.closeFD();
+            draining = true;
+            deadline = nowMS() + (uint64_t) (_drain_secs * 1000.0);
+         } else {
+            // Asked twice, stop waiting
+            deadline = 0;
+         }
+      }
+
+      if (!draining && (_pollfds[1].revents & POLLIN))
+         acceptClients();
+
+      // Backwards, so a session moved into an ended one's slot has already been served
+      for (size_t i = _sessions.size(); i > 0; i--) {
+         Session &s = *_sessions[i - 1];
+         serveSession(s);
+         if (s.failed || (s.up.shut && s.down.shut))
+            endSession(i - 1);
+      }
+
+      checkHealth(nowMS());
+      reapBackends();
+
+      if (draining && (_sessions.empty() || (nowMS() >= deadline)))
+         online = false;
+   }
+}
+
+/**********************************************************************************************
+ * pollTimeout - rebuilds the poll set and works out how long the loop may sleep: until the
+ *               next health check is due or one in flight times out, at most 100 ms so a
+ *               drain deadline is noticed
+ *
+ *               Each side of a session is read only while its pipe is empty and written only
+ *               while the other direction's pipe holds data, so a slow reader stalls its
+ *               writer through TCP flow control instead of the proxy buffering for it.
+ **********************************************************************************************/
+
+int TCPProxy::pollTimeout(uint64_t now) {
+   int timeout = 100;
+
+   _pollfds.resize(2 + _backends.size() + 2 * _sessions.size());
+   _pollfds[0] = {_sigfd->getFD(), POLLIN, 0};
+   _pollfds[1] = {_sockfd.getFD(), POLLIN, 0};
+
+   size_t next = 2;
+   for (auto &bp : _backends) {
+      Backend &b = *bp;
+      _pollfds[next++] = {b.check.getFD(), POLLOUT, 0};
+
+      uint64_t due = (b.check.getFD() != -1) ? b.check_started + _health_ms : b.next_check;
+      if (!b.removed)
+         timeout = (due <= now) ? 0 : (int) std::min<uint64_t>(timeout, due - now);
+   }
+
+   for (auto &sp : _sessions) {
+      Session &s = *sp;
+      short client = 0, server = POLLOUT;
+      if (!s.connecting) {
+         client = ((!s.up.eof && (s.up.pipe.len == 0)) ? POLLIN : 0) | ((s.down.pipe.len > 0) ? POLLOUT : 0);
+         server = ((!s.down.eof && (s.down.pipe.len == 0)) ? POLLIN : 0) | ((s.up.pipe.len > 0) ? POLLOUT : 0);
+      }
+      _pollfds[next++] = {s.client.getFD(), client, 0};
+      _pollfds[next++] = {s.server.getFD(), server, 0};
+   }
+   return timeout;
+}
+
+/**********************************************************************************************
+ * acceptClients - accepts every waiting client and starts connecting each to a backend. Past
+ *                 the session limit, or with no backend to send them to, clients are closed
+ *                 right away.
+ *
+ **********************************************************************************************/
+
+void TCPProxy::acceptClients() {
+   while (true) {
+      auto s = std::make_unique<Session>();
+      if (!s->client.acceptFD(_sockfd))
+         return;
+      _accepted++;
+
+      bool ok = (_sessions.size() < _max_conns);
+      if (ok) {
+         s->client.setNonBlocking();
+         s->client.setNoDelay();
+         ok = getPipe(s->up.pipe) && getPipe(s->down.pipe) && connectBackend(*s, NULL);
+      }
+
+      if (!ok) {
+         s->client.closeFD();
+         putPipe(s->up.pipe);
+         putPipe(s->down.pipe);
+         _refused++;
+         continue;
+      }
+      _sessions.push_back(std::move(s));
+   }
+}
+
+/**********************************************************************************************
+ * pickBackend - the least loaded backend in rotation. The scan starts one further along each
+ *               time, so backends with equal loads take turns.
+ *
+ *    Params:  skip - a backend not to pick (one that just refused), or NULL
+ *
+ *    Returns: the backend, or NULL if none is healthy and in rotation
+ **********************************************************************************************/
+
+TCPProxy::Backend *TCPProxy::pickBackend(const Backend *skip) {
+   Backend *best = NULL;
+   size_t n = _backends.size();
+   for (size_t k = 0; k < n; k++) {
+      Backend *b = _backends[(_next + k) % n].get();
+      if (!b->healthy || b->draining || b->removed || (b == skip))
+         continue;
+      if ((best == NULL) || (b->conns < best->conns))
+         best = b;
+   }
+   _next++;
+   return best;
+}
+
+/**********************************************************************************************
+ * connectBackend - starts the session's backend connect, moving on to the next backend while
+ *                  they refuse outright
+ *
+ *    Returns: false if no backend could be tried
+ **********************************************************************************************/
+
+bool TCPProxy::connectBackend(Session &s, const Backend *skip) {
+   for (size_t tries = 0; tries < _backends.size(); tries++) {
+      Backend *b = pickBackend(skip);
+      if (b == NULL)
+         return false;
+
+      if (s.server.startConnect(b->ip.c_str(), b->port)) {
+         s.backend = b;
+         s.connecting = true;
+         b->conns++;
+         b->total++;
+         return true;
+      }
+      noteFailure(*b, "refused a connection");
+      skip = b;
+   }
+   return false;
+}
+
+/**********************************************************************************************
+ * serveSession - finishes the backend connect once it polls ready (trying another backend if
+ *                it failed), then relays whichever directions had socket activity
+ *
+ **********************************************************************************************/
+
+void TCPProxy::serveSession(Session &s) {
+   bool connected = false;
+
+   if (s.connecting) {
+      if (s.server_rev == 0)
+         return;
+
+      if (!s.server.finishConnect()) {
+         Backend *b = s.backend;
+         b->conns--;
+         b->total--;
+         s.server.closeFD();
+         noteFailure(*b, "refused a connection");
+         if (!connectBackend(s, b))
+            s.failed = true;
+         return;
+      }
+
+      s.connecting = false;
+      s.server.setNonBlocking();
+      s.server.setNoDelay();
+      noteSuccess(*s.backend);
+
+      // The client may have sent its first bytes already
+      connected = true;
+   }
+
+   if ((s.client_rev | s.server_rev) & POLLERR) {
+      s.failed = true;
+      return;
+   }
+
+   const short readable = POLLIN | POLLHUP;
+   if (connected || (s.client_rev & readable) || (s.server_rev & POLLOUT)) {
+      if (!pump(s.client.getFD(), s.server.getFD(), s.up))
+         s.failed = true;
+   }
+   if ((s.server_rev & readable) || (s.client_rev & POLLOUT)) {
+      if (!pump(s.server.getFD(), s.client.getFD(), s.down))
+         s.failed = true;
+   }
+}
+
+/**********************************************************************************************
+ * pump - moves one direction's bytes along: empties the pipe into dst, then refills it from
+ *        src, for as long as both sides keep up. At EOF with the pipe empty the FIN is passed
+ *        on to dst.
+ *
+ *    Returns: false if either socket failed
+ **********************************************************************************************/
+
+bool TCPProxy::pump(int src, int dst, Direction &d) {
+   while (true) {
+      while (d.pipe.len > 0) {
+         ssize_t n = splice(d.pipe.rd, NULL, dst, NULL, d.pipe.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+         if (n == -1) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+               return true;
+            return false;
+         }
+         d.pipe.len -= n;
+      }
+
+      if (d.eof)
+         break;
+
+      ssize_t n = splice(src, NULL, d.pipe.wr, NULL, relay_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0) {
+         d.eof = true;
+      } else if (n == -1) {
+         if ((errno == EAGAIN) || (errno == EINTR))
+            return true;
+         return false;
+      } else {
+         d.pipe.len += n;
+      }
+   }
+
+   if (!d.shut) {
+      ::shutdown(dst, SHUT_WR);
+      d.shut = true;
+   }
+   return true;
+}
+
+void TCPProxy::endSession(size_t idx) {
+   Session &s = *_sessions[idx];
+   s.client.closeFD();
+   s.server.closeFD();
+   if (s.backend != NULL)
+      s.backend->conns--;
+   putPipe(s.up.pipe);
+   putPipe(s.down.pipe);
+
+   _sessions[idx] = std::move(_sessions.back());
+   _sessions.pop_back();
+}
+
+/**********************************************************************************************
+ * checkHealth - finishes the health checks that connected, failed or timed out, and starts
+ *               the ones due. Backends being removed aren't checked anymore.
+ *
+ **********************************************************************************************/
+
+void TCPProxy::checkHealth(uint64_t now) {
+   for (auto &bp : _backends) {
+      Backend &b = *bp;
+
+      if (b.check.getFD() != -1) {
+         if (b.revents != 0) {
+            if (b.check.finishConnect())
+               noteSuccess(b);
+            else
+               noteFailure(b, "failed a health check");
+         } else if (now >= b.check_started + _health_ms) {
+            noteFailure(b, "timed out on a health check");
+         } else {
+            continue;
+         }
+         b.check.closeFD();
+         b.revents = 0;
+         b.next_check = b.check_started + _health_ms;
+
+      } else if (!b.removed && (now >= b.next_check)) {
+         b.check_started = now;
+         if (!b.check.startConnect(b.ip.c_str(), b.port)) {
+            noteFailure(b, "failed a health check");
+            b.next_check = now + _health_ms;
+         }
+      }
+   }
+}
+
+void TCPProxy::noteFailure(Backend &b, const char *what) {
+   b.fails++;
+   if (b.healthy && (b.fails >= _health_fails)) {
+      b.healthy = false;
+      std::cout << "Backend " << b.addr << " is down: " << what << std::endl;
+   }
+}
+
+void TCPProxy::noteSuccess(Backend &b) {
+   b.fails = 0;
+   if (!b.healthy) {
+      b.healthy = true;
+      std::cout << "Backend " << b.addr << " is up" << std::endl;
+   }
+}
+
+// Forgets the removed backends whose last session has ended
+void TCPProxy::reapBackends() {
+   for (size_t i = _backends.size(); i > 0; i--) {
+      Backend &b = *_backends[i - 1];
+      if (!b.removed || (b.conns > 0))
+         continue;
+
+      std::cout << "Removed backend " << b.addr << " after " << b.total << " sessions" << std::endl;
+      b.check.closeFD();
+      _backends.erase(_backends.begin() + (i - 1));
+   }
+}
+
+/**********************************************************************************************
+ * getPipe/putPipe - hand out pipes for a session's directions from the pool, and take them
+ *                   back when it ends. Only empty pipes go back in the pool; one still holding
+ *                   bytes for a client that went away is closed.
+ *
+ **********************************************************************************************/
+
+bool TCPProxy::getPipe(Pipe &p) {
+   if (!_pipes.empty()) {
+      p = _pipes.back();
+      _pipes.pop_back();
+      return true;
+   }
+
+   int fds[2];
+   if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+      return false;
+   p.rd = fds[0];
+   p.wr = fds[1];
+   p.len = 0;
+   return true;
+}
+
+void TCPProxy::putPipe(Pipe &p) {
+   if (p.rd == -1)
+      return;
+
+   if ((p.len == 0) && (_pipes.size() < max_pooled_pipes)) {
+      _pipes.push_back(p);
+   } else {
+      close(p.rd);
+      close(p.wr);
+   }
+   p = Pipe();
+}
+
+/**********************************************************************************************
+ * shutdown - closes the sessions still open, the pooled pipes and the listening socket, and
+ *            reports how the sessions were spread
+ *
+ **********************************************************************************************/
+
+void TCPProxy::shutdown() {
+   for (size_t i = _sessions.size(); i > 0; i--)
+      endSession(i - 1);
+
+   for (Pipe &p : _pipes) {
+      close(p.rd);
+      close(p.wr);
+   }
+   _pipes.clear();
+
+   for (auto &b : _backends)
+      b->check.closeFD();
+   _sockfd.closeFD();
+
+   std::cout << "Relayed " << (_accepted - _refused) << " sessions, refused " << _refused << std::endl;
+   for (auto &b : _backends) {
+      std::cout << "   " << b->addr << ": " << b->total << " sessions"
+                << (b->healthy ? "" : ", down") << (b->draining ? ", draining" : "") << std::endl;
+   }
+}
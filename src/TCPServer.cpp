@@ -10,15 +10,84 @@
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <thread>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <algorithm>
 #include "TCPServer.h"
 
+// Seconds on the monotonic clock
+static double nowSecs() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 TCPServer::TCPServer(){ 
-   this->_serverLog = std::make_unique<TCPConn>();
+   // Before any hash worker threads exist, so none of them can take the signals
+   this->_sigfd = std::make_unique<SignalFD>(std::initializer_list<int>{SIGTERM, SIGINT});
+
+   // Without a profile file we keep hashing with the original parameters
+   if (_profile.load(profilefilename))
+      std::cout << "Using Argon2 profile " << _profile.toString() << std::endl;
+
+   _creds = std::make_unique<CredIndex>(pwdfilename);
+   _creds->setProfile(_profile);
+   _log.setCredIndex(_creds.get());
+   setLogRotation(default_log_rotate_mib, 0);
+
+   setMaxConns(default_max_conns);
+   setHashLimits(default_hash_threads, default_hash_mem_mib, default_hash_queue);
+   setRateLimits(default_conn_rate, default_login_fail_rate);
 }
 
 
 TCPServer::~TCPServer() {
+   // The connections give their slots back to the table as they go
+   for (size_t i = _conntable->limit(); i > 0; i--) {
+      if ((*_conntable)[i - 1].conn != NULL)
+         delete (*_conntable)[i - 1].conn;
+   }
+}
+
+/**********************************************************************************************
+ * setMaxConns - replaces the (empty) connection table with one of this many slots
+ *
+ **********************************************************************************************/
+
+void TCPServer::setMaxConns(size_t max_conns) {
+   _conntable = std::make_unique<ConnTable>(max_conns);
+}
+
+/**********************************************************************************************
+ * setHashLimits - replaces the hash scheduler with one using these limits. Only call this
+ *                 before listenSvr.
+ *
+ *    Params:  threads - hashes run in parallel, 0 for one per CPU
+ *             mem_budget_mib - Argon2 memory all running hashes together may use
+ *             max_queue - hashes that may wait before clients are told the server is busy
+ **********************************************************************************************/
 
+void TCPServer::setHashLimits(unsigned int threads, uint32_t mem_budget_mib, unsigned int max_queue) {
+   if (threads == 0)
+      threads = std::thread::hardware_concurrency();
+
+   _hasher.reset();
+   _hasher = std::make_unique<HashScheduler>(threads, mem_budget_mib * 1024, max_queue);
+}
+
+/**********************************************************************************************
+ * setRateLimits - replaces the per-IP limiters. Only call this before listenSvr.
+ *
+ *    Params:  conn_rate - connections per second an IP may open
+ *             login_fail_rate - failed password attempts per minute an IP may make
+ **********************************************************************************************/
+
+void TCPServer::setRateLimits(double conn_rate, double login_fail_rate) {
+   _conn_limiter = std::make_unique<RateLimiter>(conn_rate, 2.0 * conn_rate);
+   _login_limiter = std::make_unique<RateLimiter>(login_fail_rate / 60.0, 2.0 * login_fail_rate);
 }
 
 /**********************************************************************************************
@@ -32,8 +101,7 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 
    //struct sockaddr_in servaddr;
 
-   // _server_log.writeLog("Server started.");
-   this->_serverLog->log(TCPConn::serverStart);
+   _log.record(evlog::serverStart);
 
    // Set the socket to nonblocking
    _sockfd.setNonBlocking();
@@ -43,10 +111,179 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
  
 }
 
+/**********************************************************************************************
+ * setHandoffPath - makes the server listen on a Unix socket at path for a replacement binary
+ *                  to take its sockets over (see Handoff.h). Only call this before takeOver or
+ *                  bindSvr.
+ *
+ **********************************************************************************************/
+
+void TCPServer::setHandoffPath(const char *path) {
+   _handoff = std::make_unique<Handoff>(path);
+}
+
+/**********************************************************************************************
+ * setReplication - replicates credentials with other servers, as the primary (listening for
+ *                  followers on ip_addr:port) or as a follower of the primary at ip_addr:port.
+ *                  Only call this before listenSvr.
+ *
+ **********************************************************************************************/
+
+void TCPServer::setReplication(bool primary, const char *ip_addr, unsigned short port) {
+   _repllog = std::make_unique<ReplLog>(repllogfilename);
+   _replicator = std::make_unique<Replicator>(*_creds, *_repllog);
+   if (primary)
+      _replicator->setPrimary(ip_addr, port);
+   else
+      _replicator->setFollower(ip_addr, port);
+}
+
+/**********************************************************************************************
+ * setSharding - runs the server as one node of a partitioned cluster: each node's passwd file
+ *               holds only the users it owns, and logins for the others are verified by
+ *               their node. Only call this before listenSvr or takeOver.
+ *
+ **********************************************************************************************/
+
+void TCPServer::setSharding(const std::string &self, const std::vector<std::string> &peers) {
+   _shards = std::make_unique<ShardNode>(*_creds, self);
+   for (const std::string &peer : peers)
+      _shards->addPeer(peer);
+}
+
+/**********************************************************************************************
+ * takeOver - used instead of bindSvr when upgrading: receives the listening socket and the idle
+ *            connections from the server running on the handoff path. Clients keep their
+ *            sessions, and connects arriving meanwhile wait in the listen backlog.
+ *
+ *    Returns: true if the sockets were taken over, false if no server is running on the path
+ *
+ *    Throws: socket_error if the handoff broke off partway
+ **********************************************************************************************/
+
+bool TCPServer::takeOver() {
+   if (!_handoff)
+      return false;
+
+   int sock = _handoff->connectPredecessor();
+   if (sock == -1)
+      return false;
+
+   unsigned int conns = 0, dropped = 0;
+   bool got_listener = false;
+   std::string state;
+   int fd;
+   char type;
+   while ((type = Handoff::recvMsg(sock, state, fd)) != 'E') {
+      if (type == 'L' && fd != -1) {
+         _sockfd.adoptFD(fd);
+         got_listener = true;
+
+      } else if (type == 'C' && fd != -1) {
+         if (_conntable->size() >= _conntable->capacity()) {
+            close(fd);
+            dropped++;
+            continue;
+         }
+
+         // Everything the session needs is set before restoreState resumes it
+         TCPConn *conn = new TCPConn(*_conntable, *_creds, _log);
+         conn->setHashScheduler(_hasher.get());
+         conn->setLoginLimiter(_login_limiter.get());
+         conn->setCoroPool(&_coropool);
+         conn->setFanOut(&_fanout);
+         conn->setShardNode(_shards.get());
+         conn->setContentDir(_contentdir.c_str());
+         conn->setUploadDir(_uploaddir.c_str(), _upload_sync, _upload_sync_bytes);
+         conn->setCompression(_zlevel, &_zstats);
+         if (!conn->restoreState(fd, state)) {
+            delete conn;
+            dropped++;
+            continue;
+         }
+         conns++;
+
+      } else {
+         if (fd != -1)
+            close(fd);
+         if (type == 0) {
+            close(sock);
+            throw socket_error("Handoff from the running server failed.");
+         }
+      }
+   }
+   close(sock);
+
+   if (!got_listener)
+      throw socket_error("Running server did not hand over its listening socket.");
+
+   _log.record(evlog::serverStart);
+   std::cout << "Took over the listening socket and " << conns << " connections";
+   if (dropped > 0)
+      std::cout << " (" << dropped << " dropped: invalid state or no room)";
+   std::cout << std::endl;
+   return true;
+}
+
+/**********************************************************************************************
+ * handOff - gives the listening socket and every idle connection to the replacement server
+ *           connected on sock, then releases the handoff path for it. Connections busy with a
+ *           hash or unsent output stay here and are drained like a shutdown.
+ *
+ **********************************************************************************************/
+
+void TCPServer::handOff(int sock) {
+   unsigned int conns = 0;
+   bool ok = Handoff::sendMsg(sock, 'L', std::string(), _sockfd.getFD());
+
+   std::string state;
+   for (size_t i = 0; ok && (i < _conntable->limit()); i++) {
+      ConnHot &hot = (*_conntable)[i];
+      if ((hot.conn == NULL) || !hot.conn->canHandOff())
+         continue;
+
+      hot.conn->saveState(state);
+      ok = Handoff::sendMsg(sock, 'C', state, hot.fd);
+      if (!ok)
+         break;
+      hot.conn->releaseFD();
+      removeConn(hot);
+      conns++;
+   }
+
+   // The successor takes over replication and the shard RPC (and their ports) too
+   if (_replicator)
+      _replicator->stop();
+   if (_shards)
+      _shards->stop();
+
+   // The successor now owns the listener; stop accepting here and free the path for it
+   _sockfd.closeFD();
+   _handoff->closeListener();
+   if (ok)
+      ok = Handoff::sendMsg(sock, 'E', std::string());
+   close(sock);
+
+   if (ok)
+      std::cout << "Handed the listening socket and " << conns << " connections to the new server, draining "
+                << _conntable->size() << " busy connections" << std::endl;
+   else
+      std::cout << "Handoff to the new server failed, draining " << _conntable->size() << " connections" << std::endl;
+}
+
 /**********************************************************************************************
  * listenSvr - Performs a loop to look for connections and create TCPConn objects to handle
  *             them. Also loops through the list of connections and handles data received and
- *             sending of data. 
+ *             sending of data. Returns once a SIGTERM or SIGINT shutdown has drained the
+ *             connections.
+ *
+ *             On shutdown the listening socket is closed, then each connection keeps being
+ *             served until it is idle--no hash in flight, no buffered request, no unsent
+ *             reply--and is then told goodbye and closed. Whatever is still busy when the
+ *             drain timeout runs out (or on a second signal) is closed anyway.
+ *
+ *             With a handoff path set, a replacement server connecting to it gets the listening
+ *             socket and the idle connections, and this one drains the rest the same way.
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
@@ -54,86 +291,256 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 void TCPServer::listenSvr() {
 
    bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
+   bool draining = false;
+   double deadline = 0.0;
    //int num_read = 0;
 
    // Start the server socket listening
    _sockfd.listenFD(5);
 
+   // Wait for a replacement to hand our sockets over to
+   if (_handoff)
+      _handoff->listen();
+
+   // After takeOver, so a predecessor has already stopped replicating and given up its
+   // shard RPC port
+   if (_replicator)
+      _replicator->start();
+   if (_shards) {
+      _shards->setHashScheduler(_hasher.get());
+      _shards->start();
+   }
     
    while (online) {
-      //struct sockaddr_in cliaddr;
-      //socklen_t len = sizeof(cliaddr);
+      // Sleep until a socket has something for us, a hash may be done or a deadline is due
+      int timeout = pollTimeout(ConnTable::nowMS());
+      if (poll(_pollfds.data(), _pollfds.size(), timeout) == -1) {
+         if (errno != EINTR)
+            throw socket_error("poll failed in the server loop.");
+         continue;
+      }
 
-      if (_sockfd.hasData()) {
-         TCPConn *new_conn = new TCPConn();
-         if (!new_conn->accept(_sockfd)) {
-            // _server_log.strerrLog("Data received on socket but failed to accept.");
-            continue;
+      int sig = _sigfd->readSignal();
+      if (sig != -1) {
+         if (!draining) {
+            beginShutdown(sig);
+            draining = true;
+            deadline = nowSecs() + _drain_secs;
+         } else {
+            // Asked twice, stop waiting
+            deadline = 0.0;
          }
-         
-         // Get their IP Address string to use in logging
-         std::string ipaddr_str;
-         new_conn->getIPAddrStr(ipaddr_str);
-
-         std::cout << "Client IP: " << ipaddr_str << std::endl;//testing
-
-         //check is the client ip address on the whitelist
-         if ( !new_conn->isNewIPAllowed(ipaddr_str) ){
-            std::cout << "This IP address is not authorized" << std::endl;
-            //logs login attempt
-            this->_serverLog->log(ipaddr_str, TCPConn::newConn_NOT_WL);
-            new_conn->sendText("Not Authorized To Log into System\n");
-            new_conn->disconnect();
-            continue;  
+      }
+
+      if (!draining && _handoff) {
+         int sock = _handoff->acceptSuccessor();
+         if (sock != -1) {
+            handOff(sock);
+            draining = true;
+            deadline = nowSecs() + _drain_secs;
          }
+      }
 
-         std::cout << "***Got a connection***\n";
-         
-         this->_serverLog->log(ipaddr_str, TCPConn::newConn_ON_WL);
+      if (!draining && (_pollfds[1].revents & POLLIN))
+         acceptConnections();
+
+      serveConns(draining, ConnTable::nowMS());
+      _fanout.flush();
+      _log.flush();
+
+      if (draining && ((_conntable->size() == 0) || (nowSecs() >= deadline))) {
+         closeAll();
+         online = false;
+      }
+   } 
+
+   _log.record(evlog::serverStop);
+   _log.flush();
+}
+
+/**********************************************************************************************
+ * pollTimeout - rebuilds the poll set from the connection table and works out how long the
+ *               loop may sleep: not at all if a connection has a request buffered or needs
+ *               reaping, hash_poll_ms while hashes are in flight, otherwise until the next
+ *               login deadline (at most 100 ms, so the handoff socket is still checked)
+ *
+ **********************************************************************************************/
+
+int TCPServer::pollTimeout(uint64_t now) {
+   int timeout = 100;
+
+   _pollfds.resize(2 + _conntable->limit());
+   _pollfds[0] = {_sigfd->getFD(), POLLIN, 0};
+   _pollfds[1] = {_sockfd.getFD(), POLLIN, 0};
+
+   for (size_t i = 0; i < _conntable->limit(); i++) {
+      const ConnHot &hot = (*_conntable)[i];
+      pollfd &pfd = _pollfds[2 + i];
 
-         _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+      // poll skips negative descriptors
+      pfd.fd = hot.fd;
+      pfd.events = (hot.out_len > 0) ? (POLLIN | POLLOUT) : POLLIN;
+      pfd.revents = 0;
 
-         new_conn->sendText("Welcome to the CSCE 689 Server!\n");
+      if (hot.conn == NULL)
+         continue;
 
-         // Change this later
-         new_conn->startAuthentication();
+      if (hot.flags & ConnHot::f_hashing) {
+         timeout = std::min(timeout, hash_poll_ms);
+      } else if ((hot.fd == -1) || (hot.flags & ConnHot::f_request)) {
+         timeout = 0;
+      } else if (hot.deadline != 0) {
+         timeout = (hot.deadline <= now) ? 0 : (int) std::min<uint64_t>(timeout, hot.deadline - now);
       }
+   }
+   return timeout;
+}
 
-      // Loop through our connections, handling them
-      std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
-      while (tptr != _connlist.end())
-      {
-         // If the user lost connection
-         if (!(*tptr)->isConnected()) {
-            // Log it
-
-            // Remove them from the connect list
-            tptr = _connlist.erase(tptr);
-            std::cout << "Connection disconnected.\n";
-            continue;
-         }
+/**********************************************************************************************
+ * serveConns - walks the connection table once, handling the connections with socket activity,
+ *              a finished hash or a buffered request, enforcing login deadlines and reaping the
+ *              closed ones. Only the hot slots are read for connections with nothing to do.
+ *
+ *    Params:  draining - on shutdown, idle connections are told goodbye and closed
+ *             now - ConnTable::nowMS() for the deadlines
+ **********************************************************************************************/
 
-         // Process any user inputs
-         (*tptr)->handleConnection();
+void TCPServer::serveConns(bool draining, uint64_t now) {
+   // Connections accepted this pass are past the end of the poll set
+   size_t polled = _pollfds.size() - 2;
 
-         // Increment our iterator
-         tptr++;
+   for (size_t i = 0; i < _conntable->limit(); i++) {
+      ConnHot &hot = (*_conntable)[i];
+      if (hot.conn == NULL)
+         continue;
+
+      // If the user lost connection, remove them
+      if (hot.fd == -1) {
+         removeConn(hot);
+         std::cout << "Connection disconnected.\n";
+         continue;
       }
 
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
-   } 
+      // Process any user inputs
+      bool ready = (i < polled) && (_pollfds[2 + i].revents != 0);
+      if (ready || (hot.flags & (ConnHot::f_request | ConnHot::f_hashing)))
+         hot.conn->handleConnection();
 
+      if ((hot.deadline != 0) && (now >= hot.deadline) && (hot.fd != -1) && !(hot.flags & ConnHot::f_hashing))
+         hot.conn->loginTimedOut();
 
-   
+      // Nothing left to finish for this one
+      if (draining && (hot.fd != -1) && hot.conn->isIdle())
+         hot.conn->closeForShutdown();
+   }
 }
 
+/**********************************************************************************************
+ * removeConn - deletes a connection, which gives its slot back to the table
+ *
+ **********************************************************************************************/
+
+void TCPServer::removeConn(ConnHot &hot) {
+   delete hot.conn;
+}
+
+/**********************************************************************************************
+ * beginShutdown - stops accepting connections so the existing ones can drain
+ *
+ **********************************************************************************************/
+
+void TCPServer::beginShutdown(int sig) {
+   std::cout << "Received " << strsignal(sig) << ", draining " << _conntable->size()
+             << " connections (up to " << _drain_secs << " s)" << std::endl;
+   _sockfd.closeFD();
+}
+
+/**********************************************************************************************
+ * closeAll - closes every connection still open when the drain ends
+ *
+ **********************************************************************************************/
+
+void TCPServer::closeAll() {
+   unsigned int forced = 0;
+   for (size_t i = _conntable->limit(); i > 0; i--) {
+      ConnHot &hot = (*_conntable)[i - 1];
+      if (hot.conn == NULL)
+         continue;
+      if (hot.fd != -1) {
+         hot.conn->closeForShutdown();
+         forced++;
+      }
+      removeConn(hot);
+   }
+
+   if (forced > 0)
+      std::cout << "Drain timed out, closed " << forced << " busy connections" << std::endl;
+}
+
+/**********************************************************************************************
+ * acceptConnections - accepts the waiting connections (up to max_accepts_per_loop). IPs over
+ *                     their connect rate, or out of failed-login allowance, are closed right
+ *                     away, before a TCPConn, whitelist lookup or log write is spent on them.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::acceptConnections() {
+   for (unsigned int i = 0; i < max_accepts_per_loop; i++) {
+      // The listening socket is nonblocking, so this fails once the backlog is empty
+      SocketFD client(false);
+      if (!client.acceptFD(_sockfd))
+         return;
+
+      unsigned long ipaddr = client.getIPAddr();
+      if ((_conntable->size() >= _conntable->capacity()) ||
+          !_conn_limiter->allow(ipaddr) || !_login_limiter->check(ipaddr)) {
+         client.closeFD();
+         _shed++;
+         continue;
+      }
+
+      TCPConn *new_conn = new TCPConn(*_conntable, *_creds, _log);
+      new_conn->adoptSocket(client);
+      new_conn->setHashScheduler(_hasher.get());
+      new_conn->setLoginLimiter(_login_limiter.get());
+      new_conn->setCoroPool(&_coropool);
+      new_conn->setFanOut(&_fanout);
+      new_conn->setShardNode(_shards.get());
+      new_conn->setContentDir(_contentdir.c_str());
+      new_conn->setUploadDir(_uploaddir.c_str(), _upload_sync, _upload_sync_bytes);
+      new_conn->setCompression(_zlevel, &_zstats);
+         
+      // Formatted once when the socket was attached
+      const char *ipaddr_str = new_conn->getIPAddrCStr();
+
+      std::cout << "Client IP: " << ipaddr_str << std::endl;//testing
+
+      //check is the client ip address on the whitelist
+      if ( !new_conn->isNewIPAllowed(ipaddr_str) ){
+         std::cout << "This IP address is not authorized" << std::endl;
+         //logs login attempt
+         _log.record(evlog::newConn_NOT_WL, ipaddr, new_conn->getPort());
+         new_conn->sendText("Not Authorized To Log into System\n");
+         new_conn->disconnect();
+         delete new_conn;
+         continue;  
+      }
+
+      std::cout << "***Got a connection***\n";
+         
+      _log.record(evlog::newConn_ON_WL, ipaddr, new_conn->getPort());
+
+      new_conn->sendText("Welcome to the CSCE 689 Server!\n");
+
+      // Change this later
+      new_conn->startAuthentication();
+   }
+}
 
 /**********************************************************************************************
- * shutdown - Cleanly closes the socket FD.
+ * shutdown - Cleanly closes the socket FD and stops the hash workers; hashes still queued are
+ *            dropped and the running ones are waited for.
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
@@ -141,6 +548,22 @@ void TCPServer::listenSvr() {
 void TCPServer::shutdown() {
 
    _sockfd.closeFD();
+   if (_shards) {
+      _shards->stop();
+      std::cout << "Answered " << _shards->getServed() << " shard requests, forwarded "
+                << _shards->getForwarded() << " to other nodes\n";
+   }
+   _hasher->stop();
+   if (_replicator)
+      _replicator->stop();
+
+   std::cout << "Shed " << _shed << " connections over their IP's rate limit or the connection limit\n";
+
+   // Kept apart from the rest of the loop's time, to see what compression costs
+   if (_zstats.streams > 0) {
+      std::cout << "Compressed " << _zstats.streams << " sessions, " << _zstats.bytes_in << " bytes to "
+                << _zstats.bytes_out << ", using " << (_zstats.cpu_ns / 1000000) << " ms of CPU\n";
+   }
 }
 
 
@@ -0,0 +1,284 @@
+#include <string.h>
+#include "TextKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXTK_X86 1
+#endif
+
+namespace textk {
+
+/*****************************************************************************************
+ * Scalar versions - the fallback, and the tails of the vector versions. memchr is libc's
+ *                   and already as fast as the platform allows.
+ *
+ *****************************************************************************************/
+
+static inline char lowerByte(char c) {
+   return ((c >= 'A') && (c <= 'Z')) ? (char) (c | 0x20) : c;
+}
+
+static const char *findNewlineScalar(const char *data, size_t len) {
+   return (const char *) memchr(data, '\n', len);
+}
+
+static size_t cleanTail(char *data, size_t in, size_t out, size_t len, bool lower) {
+   for (; in < len; in++) {
+      char c = data[in];
+      if ((c == '\r') || (c == '\n'))
+         continue;
+      data[out++] = lower ? lowerByte(c) : c;
+   }
+   return out;
+}
+
+static size_t cleanLineScalar(char *data, size_t len, bool lower) {
+   return cleanTail(data, 0, 0, len, lower);
+}
+
+static void lowerASCIIScalar(char *data, size_t len) {
+   for (size_t i = 0; i < len; i++)
+      data[i] = lowerByte(data[i]);
+}
+
+#ifdef TEXTK_X86
+
+/*****************************************************************************************
+ * SSE2 versions - 16 bytes at a time. Letters are found with signed compares, so bytes
+ *                 0x80 and up (negative) are never taken for one. cleanLine compacts in
+ *                 place: a block with nothing to drop is stored whole at the write position,
+ *                 which never passes the read position.
+ *
+ *****************************************************************************************/
+
+__attribute__((target("sse2")))
+static const char *findNewlineSSE2(const char *data, size_t len) {
+   const __m128i lf = _mm_set1_epi8('\n');
+   size_t i = 0;
+   for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+      if (mask != 0)
+         return data + i + __builtin_ctz(mask);
+   }
+   return findNewlineScalar(data + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i lowerSSE2(__m128i v) {
+   __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+   return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static size_t cleanLineSSE2(char *data, size_t len, bool lower) {
+   const __m128i cr = _mm_set1_epi8('\r');
+   const __m128i lf = _mm_set1_epi8('\n');
+   size_t in = 0, out = 0;
+
+   for (; in + 16 <= len; in += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (data + in));
+      if (lower)
+         v = lowerSSE2(v);
+
+      unsigned int drop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+      if (drop == 0) {
+         _mm_storeu_si128((__m128i *) (data + out), v);
+         out += 16;
+      } else {
+         char block[16];
+         _mm_storeu_si128((__m128i *) block, v);
+         for (unsigned int j = 0; j < 16; j++) {
+            if (!(drop & (1U << j)))
+               data[out++] = block[j];
+         }
+      }
+   }
+   return cleanTail(data, in, out, len, lower);
+}
+
+__attribute__((target("sse2")))
+static void lowerASCIISSE2(char *data, size_t len) {
+   size_t i = 0;
+   for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+      _mm_storeu_si128((__m128i *) (data + i), lowerSSE2(v));
+   }
+   lowerASCIIScalar(data + i, len - i);
+}
+
+/*****************************************************************************************
+ * AVX2 versions - the same, 32 bytes at a time
+ *
+ *****************************************************************************************/
+
+__attribute__((target("avx2")))
+static const char *findNewlineAVX2(const char *data, size_t len) {
+   const __m256i lf = _mm256_set1_epi8('\n');
+   size_t i = 0;
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+      unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+      if (mask != 0)
+         return data + i + __builtin_ctz(mask);
+   }
+   return findNewlineSSE2(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lowerAVX2(__m256i v) {
+   __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+   return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static size_t cleanLineAVX2(char *data, size_t len, bool lower) {
+   const __m256i cr = _mm256_set1_epi8('\r');
+   const __m256i lf = _mm256_set1_epi8('\n');
+   size_t in = 0, out = 0;
+
+   for (; in + 32 <= len; in += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (data + in));
+      if (lower)
+         v = lowerAVX2(v);
+
+      unsigned int drop = (unsigned int) _mm256_movemask_epi8(
+                             _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+      if (drop == 0) {
+         _mm256_storeu_si256((__m256i *) (data + out), v);
+         out += 32;
+      } else {
+         char block[32];
+         _mm256_storeu_si256((__m256i *) block, v);
+         for (unsigned int j = 0; j < 32; j++) {
+            if (!(drop & (1U << j)))
+               data[out++] = block[j];
+         }
+      }
+   }
+   return cleanTail(data, in, out, len, lower);
+}
+
+__attribute__((target("avx2")))
+static void lowerASCIIAVX2(char *data, size_t len) {
+   size_t i = 0;
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+      _mm256_storeu_si256((__m256i *) (data + i), lowerAVX2(v));
+   }
+   lowerASCIISSE2(data + i, len - i);
+}
+
+#endif
+
+/*****************************************************************************************
+ * Dispatch - the table starts out pointing at resolvers, so the first call through any
+ *            kernel picks the best implementation, even during static initialization
+ *
+ *****************************************************************************************/
+
+struct Kernels {
+   impl which;
+   const char *(*findNewline)(const char *data, size_t len);
+   size_t (*cleanLine)(char *data, size_t len, bool lower);
+   void (*lowerASCII)(char *data, size_t len);
+};
+
+static const Kernels scalar_kernels = {scalar, findNewlineScalar, cleanLineScalar, lowerASCIIScalar};
+#ifdef TEXTK_X86
+static const Kernels sse2_kernels = {sse2, findNewlineSSE2, cleanLineSSE2, lowerASCIISSE2};
+static const Kernels avx2_kernels = {avx2, findNewlineAVX2, cleanLineAVX2, lowerASCIIAVX2};
+#endif
+
+static const char *findNewlineResolve(const char *data, size_t len);
+static size_t cleanLineResolve(char *data, size_t len, bool lower);
+static void lowerASCIIResolve(char *data, size_t len);
+
+static Kernels kernels = {scalar, findNewlineResolve, cleanLineResolve, lowerASCIIResolve};
+static bool resolved = false;
+
+static bool supported(impl which) {
+#ifdef TEXTK_X86
+   __builtin_cpu_init();
+   if (which == avx2)
+      return __builtin_cpu_supports("avx2");
+   if (which == sse2)
+      return __builtin_cpu_supports("sse2");
+#endif
+   return which == scalar;
+}
+
+bool select(impl which) {
+   if (!supported(which))
+      return false;
+
+   switch (which) {
+#ifdef TEXTK_X86
+      case avx2:
+         kernels = avx2_kernels;
+         break;
+
+      case sse2:
+         kernels = sse2_kernels;
+         break;
+#endif
+      default:
+         kernels = scalar_kernels;
+         break;
+   }
+   resolved = true;
+   return true;
+}
+
+static void resolve() {
+   if (!select(avx2) && !select(sse2))
+      select(scalar);
+}
+
+static const char *findNewlineResolve(const char *data, size_t len) {
+   resolve();
+   return kernels.findNewline(data, len);
+}
+
+static size_t cleanLineResolve(char *data, size_t len, bool lower) {
+   resolve();
+   return kernels.cleanLine(data, len, lower);
+}
+
+static void lowerASCIIResolve(char *data, size_t len) {
+   resolve();
+   kernels.lowerASCII(data, len);
+}
+
+impl active() {
+   if (!resolved)
+      resolve();
+   return kernels.which;
+}
+
+const char *implName(impl which) {
+   switch (which) {
+      case avx2:
+         return "avx2";
+      case sse2:
+         return "sse2";
+      default:
+         return "scalar";
+   }
+}
+
+const char *findNewline(const char *data, size_t len) {
+   return kernels.findNewline(data, len);
+}
+
+size_t cleanLine(char *data, size_t len, bool lower) {
+   return kernels.cleanLine(data, len, lower);
+}
+
+void lowerASCII(char *data, size_t len) {
+   kernels.lowerASCII(data, len);
+}
+
+}
@@ -39,6 +39,11 @@ int main(int argc, char *argv[]) {
    std::vector<uint8_t> hash, salt;
    PasswdMgr pwm("passwd");
    //PasswdMgr pwm("passwd_new");//testing
+
+   // Hash with the server's calibrated profile if there is one
+   Argon2Profile profile;
+   if (profile.load(profilefilename))
+      pwm.setProfile(profile);
    
    if (pwm.checkUser(username.c_str()))
    {
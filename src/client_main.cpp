@@ -9,40 +9,145 @@
 #include <stdexcept>
 #include <iostream>
 #include <getopt.h>
+#include <sstream>
 #include "TCPClient.h"
+#include "LoadGen.h"
 
 using namespace std; 
 
 void displayHelp(const char *execname) {
-   std::cout << execname << " <ip_addr> <port>\n";
+   std::cout << execname << " [-L -u <username> -w <passwd> [-n <conns>] [-s <sessions>] [-r <rate>]\n";
+   std::cout << "          [-c <cmd1,cmd2,...>] [-t <timeout_ms>] [-B]] [-Z] <ip_addr> <port>\n";
+   std::cout << "   L: load generation mode instead of an interactive session\n";
+   std::cout << "   u: username each simulated client logs in with\n";
+   std::cout << "   w: password each simulated client logs in with\n";
+   std::cout << "   n: maximum number of concurrent connections (default 10)\n";
+   std::cout << "   s: total number of sessions to run (default 100)\n";
+   std::cout << "   r: new sessions per second, 0 for as fast as possible (default 0)\n";
+   std::cout << "   c: comma-separated menu commands each session sends after logging in\n";
+   std::cout << "   t: milliseconds a phase may take before the session counts as failed\n";
+   std::cout << "   B: use the binary protocol and pipeline each session's requests\n";
+   std::cout << "   Z: interactive sessions ask the server to compress everything after the login\n";
+}
+
+/****************************************************************************************
+ * runLoadGen - runs the scripted load scenario against the server and prints the report
+ *
+ ****************************************************************************************/
+
+int runLoadGen(const char *ip_addr, unsigned short port, LoadGenParams &params) {
+   if (params.creds.empty() || params.creds[0].username.empty()) {
+      cerr << "Load generation mode requires a username (-u).\n";
+      return -1;
+   }
+
+   try {
+      cout << "Generating load against " << ip_addr << " port " << port << ": " << params.sessions
+           << " sessions, " << params.conns << " concurrent" << endl;
+
+      LoadGen loadgen(ip_addr, port, params);
+      loadgen.run();
+      loadgen.report(stdout);
+
+   } catch (socket_error &e) {
+      cerr << "Load generation failed: " << e.what() << endl;
+      return -1;
+   }
+
+   return 0;
 }
 
 
 int main(int argc, char *argv[]) {
 
+   bool loadmode = false;
+   bool compress = false;
+   LoadGenParams params;
+   LoadGenCred cred;
+   LoadGenScript script;
+
+   // Get the command line arguments and set params appropriately
+   int c = 0;
+   while ((c = getopt(argc, argv, "Lu:w:n:s:r:c:t:BZ")) != -1) {
+      switch (c) {
+      case 'L':
+         loadmode = true;
+         break;
+
+      case 'u':
+         cred.username = optarg;
+         break;
+
+      case 'w':
+         cred.passwd = optarg;
+         break;
+
+      case 'n':
+         params.conns = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 's':
+         params.sessions = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'r':
+         params.rate = strtod(optarg, NULL);
+         break;
+
+      case 'c': {
+         std::stringstream cmds(optarg);
+         std::string cmd;
+         while (std::getline(cmds, cmd, ','))
+            if (!cmd.empty())
+               script.commands.push_back(cmd);
+         break;
+      }
+
+      case 't':
+         params.timeout_ms = strtol(optarg, NULL, 10);
+         break;
+
+      case 'B':
+         params.binary = true;
+         break;
+
+      case 'Z':
+         compress = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
    // Check the command line input
-   if (argc < 3) {
+   if (argc - optind < 2) {
       displayHelp(argv[0]);
       exit(0);
    }
 
    // Read in the IP address from the command line
-   std::string ip_addr(argv[1]);
+   std::string ip_addr(argv[optind]);
 
    // Read in the port
-   long portval = strtol(argv[2], NULL, 10);
+   long portval = strtol(argv[optind + 1], NULL, 10);
    if ((portval < 1) || (portval > 65535)) {
       std::cout << "Invalid port. Value must be between 1 and 65535";
       std::cout << "Format: " << argv[0] << " [<max_range>] [<max_threads>]\n";
        exit(0);
    }
    unsigned short port = (unsigned short) portval;
- 
 
-   // Get the command line arguments and set params appropriately
+   if (loadmode) {
+      params.creds.push_back(cred);
+      params.scripts.push_back(script);
+      return runLoadGen(ip_addr.c_str(), port, params);
+   }
 
    // Try to set up the server for listening
    TCPClient client;
+   client.setCompression(compress);
    try {
       cout << "Connecting to " << ip_addr << " port " << port << endl;
       client.connectTo(ip_addr.c_str(), port);
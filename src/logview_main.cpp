@@ -0,0 +1,231 @@
+/****************************************************************************************
+ * logview - renders the server's binary event log as text (the old server.log lines) or as
+ *           JSON, one object per line, optionally keeping only some users, IPs, events or
+ *           a time range. Rotated segments may be given plain or gzipped; with no files,
+ *           the segments the index lists for the time range are read, then the live log.
+ *
+ ****************************************************************************************/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "EventLog.h"
+#include "LogMgr.h"
+
+using namespace std;
+
+// Bytes read from the log at a time
+const size_t read_chunk = 65536;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-j] [-u <user>] [-i <ip_addr>] [-e <event>[,<event>...]]\n";
+   std::cout << "   " << execname << " [-s <from>] [-t <to>] [<logfile> ...]\n";
+   std::cout << "   j: print JSON, one object per line, instead of the text log\n";
+   std::cout << "   u: only events for this user (may be repeated)\n";
+   std::cout << "   i: only events from this IP address (may be repeated)\n";
+   std::cout << "   e: only these event types: ";
+   for (uint8_t ev = 0; ev < evlog::num_events; ev++)
+      std::cout << (ev ? ", " : "") << evlog::eventName(ev);
+   std::cout << "\n";
+   std::cout << "   s, t: only events from/until this time, in seconds since the epoch\n";
+   std::cout << "   Without logfiles, reads the segments in " << logfilename << ".index that overlap the\n";
+   std::cout << "   time range, then " << logfilename << "\n";
+}
+
+struct Filter {
+   set<string> users;
+   set<uint32_t> ipaddrs;
+   uint32_t events = 0;       // bit per event type, 0 for all
+   uint64_t from_ns = 0;
+   uint64_t to_ns = UINT64_MAX;
+
+   bool matches(const evlog::Event &ev) const {
+      if ((events != 0) && !(events & (1U << ev.type)))
+         return false;
+      if ((ev.wall_ns < from_ns) || (ev.wall_ns > to_ns))
+         return false;
+      if (!users.empty() && (!ev.has_user || (users.count(ev.user) == 0)))
+         return false;
+      if (!ipaddrs.empty() && ((ev.type == evlog::serverStart) || (ev.type == evlog::serverStop) ||
+                               (ipaddrs.count(ev.ipaddr) == 0)))
+         return false;
+      return true;
+   }
+};
+
+/****************************************************************************************
+ * renderFile - decodes one log and writes the events that pass the filter to stdout
+ *
+ *    Returns: false if the file could not be read or is not an event log
+ ****************************************************************************************/
+
+bool renderFile(const char *filename, const Filter &filter, bool json) {
+   // Reads gzipped segments and plain files alike
+   gzFile fd = gzopen(filename, "rb");
+   if (fd == NULL) {
+      cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+      return false;
+   }
+
+   evlog::Decoder decoder;
+   evlog::Event ev;
+   string inbuf, outbuf;
+   bool header = false;
+   unsigned long bad = 0;
+
+   vector<char> chunk(read_chunk);
+   int amt;
+   while ((amt = gzread(fd, chunk.data(), (unsigned int) chunk.size())) > 0) {
+      inbuf.append(chunk.data(), amt);
+
+      const char *p = inbuf.data();
+      const char *end = p + inbuf.size();
+      if (!header) {
+         if (inbuf.size() < evlog::file_header_size)
+            continue;
+         if (!evlog::checkFileHeader(p, inbuf.size())) {
+            cerr << filename << " is not an event log (or is a newer version).\n";
+            gzclose(fd);
+            return false;
+         }
+         header = true;
+         p += evlog::file_header_size;
+      }
+
+      evlog::Decoder::result res;
+      while ((res = decoder.next(p, end, ev)) != evlog::Decoder::d_more) {
+         if (res == evlog::Decoder::d_bad)
+            bad++;
+         else if ((res == evlog::Decoder::d_event) && filter.matches(ev)) {
+            if (json)
+               evlog::renderJSON(ev, outbuf);
+            else
+               evlog::renderText(ev, outbuf);
+         }
+      }
+      inbuf.erase(0, p - inbuf.data());
+
+      fwrite(outbuf.data(), 1, outbuf.size(), stdout);
+      outbuf.clear();
+   }
+   if (amt < 0) {
+      int err;
+      cerr << "Error reading " << filename << ": " << gzerror(fd, &err) << endl;
+   }
+   gzclose(fd);
+
+   if (!inbuf.empty())
+      cerr << filename << ": " << inbuf.size() << " bytes at the end are an incomplete record\n";
+   if (bad > 0)
+      cerr << filename << ": skipped " << bad << " malformed records\n";
+   return amt == 0;
+}
+
+/****************************************************************************************
+ * indexedSegments - the segments listed in the index whose time range overlaps the filter's,
+ *                   in the order they were closed, with the index's directory prepended
+ *
+ ****************************************************************************************/
+
+void indexedSegments(const Filter &filter, vector<string> &files) {
+   string index = string(logfilename) + ".index";
+   ifstream in(index);
+
+   string dir;
+   size_t slash = index.rfind('/');
+   if (slash != string::npos)
+      dir = index.substr(0, slash + 1);
+
+   uint64_t first_ns, last_ns;
+   string name;
+   while (in >> first_ns >> last_ns >> name) {
+      if ((last_ns >= filter.from_ns) && (first_ns <= filter.to_ns))
+         files.push_back(dir + name);
+   }
+}
+
+int main(int argc, char *argv[]) {
+   Filter filter;
+   bool json = false;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "ju:i:e:s:t:h")) != -1) {
+      switch (c) {
+         case 'j':
+            json = true;
+            break;
+
+         case 'u':
+            filter.users.insert(optarg);
+            break;
+
+         case 'i': {
+            in_addr addr;
+            if (inet_pton(AF_INET, optarg, &addr) != 1) {
+               cerr << "Invalid IP address: " << optarg << endl;
+               return -1;
+            }
+            filter.ipaddrs.insert(addr.s_addr);
+            break;
+         }
+
+         case 'e': {
+            string list(optarg);
+            size_t start = 0;
+            while (start <= list.size()) {
+               size_t comma = list.find(',', start);
+               if (comma == string::npos)
+                  comma = list.size();
+
+               uint8_t ev;
+               if (!evlog::eventFromName(list.substr(start, comma - start), ev)) {
+                  cerr << "Unknown event type: " << list.substr(start, comma - start) << endl;
+                  return -1;
+               }
+               filter.events |= 1U << ev;
+               start = comma + 1;
+            }
+            break;
+         }
+
+         case 's':
+            filter.from_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+            break;
+
+         case 't':
+            // Through the end of that second
+            filter.to_ns = strtoull(optarg, NULL, 10) * 1000000000ULL + 999999999ULL;
+            break;
+
+         case 'h':
+         default:
+            displayHelp(argv[0]);
+            return (c == 'h') ? 0 : -1;
+      }
+   }
+
+   vector<string> files;
+   if (optind >= argc) {
+      indexedSegments(filter, files);
+      files.push_back(logfilename);
+   }
+   for (int i = optind; i < argc; i++)
+      files.push_back(argv[i]);
+
+   bool ok = true;
+   for (const string &file : files)
+      ok = renderFile(file.c_str(), filter, json) && ok;
+
+   fflush(stdout);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,384 @@
+/****************************************************************************************
+ * macrobench - end-to-end throughput benchmark. Builds a synthetic passwd file and
+ *              whitelist in a scratch directory, starts the given tcpserver binary on
+ *              loopback and drives it with a weighted mix of login-only, menu and
+ *              password-change sessions through LoadGen. Reports connections/sec,
+ *              commands/sec, server CPU per request and server memory, as text and as
+ *              Google Benchmark style JSON.
+ *
+ *              Point -s at different tcpserver builds to compare them on the same load.
+ *
+ ****************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BenchRunner.h"
+#include "LoadGen.h"
+#include "PasswdMgr.h"
+
+using namespace std;
+
+// Resource usage of the server process at one point in time
+struct ProcStats {
+   double cpu_secs = 0.0;
+   long rss_kib = 0;
+   long peak_rss_kib = 0;
+};
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-s <tcpserver>] [-u <users>] [-n <conns>] [-S <sessions>] [-r <rate>]\n";
+   std::cout << "          [-m <login>:<menu>:<passwd>] [-c <menu_cmds>] [-t <timeout_ms>] [-B] [-o <json_file>]\n";
+   std::cout << "   s: server binary to benchmark (default ./tcpserver)\n";
+   std::cout << "   u: number of synthetic users to create (default 4)\n";
+   std::cout << "   n: maximum concurrent connections (default 8)\n";
+   std::cout << "   S: total sessions to run (default 64)\n";
+   std::cout << "   r: new sessions per second, 0 for as fast as possible (default 0)\n";
+   std::cout << "   m: relative weights of login-only, menu and password change sessions (default 2:6:2)\n";
+   std::cout << "   c: comma-separated commands a menu session sends (default menu,1,2,3,5,hello)\n";
+   std::cout << "   t: milliseconds a phase may take before the session counts as failed\n";
+   std::cout << "   B: clients use the binary protocol and pipeline their requests\n";
+   std::cout << "   o: also write the results as JSON to this file\n";
+}
+
+/****************************************************************************************
+ * findFreePort - asks the kernel for an unused loopback port
+ *
+ *    Throws: socket_error if no port could be found
+ ****************************************************************************************/
+
+unsigned short findFreePort() {
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   socklen_t len = sizeof(addr);
+   if ((fd == -1) || (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+       (getsockname(fd, (struct sockaddr *) &addr, &len) != 0))
+      throw socket_error("Could not find a free port for the benchmark server.");
+
+   close(fd);
+   return ntohs(addr.sin_port);
+}
+
+/****************************************************************************************
+ * isListening - checks /proc/net/tcp for a loopback socket in the LISTEN state on port.
+ *               Probing with a connect instead would leave a stray session on the server.
+ *
+ ****************************************************************************************/
+
+bool isListening(unsigned short port) {
+   std::ifstream tcp("/proc/net/tcp");
+   char local[32];
+   snprintf(local, sizeof(local), "0100007F:%04X", port);
+
+   std::string line;
+   while (std::getline(tcp, line)) {
+      std::stringstream fields(line);
+      std::string slot, laddr, raddr, state;
+      fields >> slot >> laddr >> raddr >> state;
+      if ((laddr == local) && (state == "0A"))
+         return true;
+   }
+   return false;
+}
+
+/****************************************************************************************
+ * readProcStats - reads user+system CPU time from /proc/<pid>/stat and the current and
+ *                 peak resident set size from /proc/<pid>/status
+ *
+ ****************************************************************************************/
+
+ProcStats readProcStats(pid_t pid) {
+   ProcStats stats;
+
+   std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+   std::string line;
+   if (std::getline(stat, line)) {
+      // Skip past the command name, which may contain spaces
+      std::stringstream fields(line.substr(line.rfind(')') + 2));
+      std::string field;
+      unsigned long utime = 0, stime = 0;
+      for (int i = 3; i <= 15; i++) {
+         fields >> field;
+         if (i == 14)
+            utime = strtoul(field.c_str(), NULL, 10);
+         else if (i == 15)
+            stime = strtoul(field.c_str(), NULL, 10);
+      }
+      stats.cpu_secs = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+   }
+
+   std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+   while (std::getline(status, line)) {
+      if (line.compare(0, 6, "VmRSS:") == 0)
+         stats.rss_kib = strtol(line.c_str() + 6, NULL, 10);
+      else if (line.compare(0, 6, "VmHWM:") == 0)
+         stats.peak_rss_kib = strtol(line.c_str() + 6, NULL, 10);
+   }
+   return stats;
+}
+
+/****************************************************************************************
+ * startServer - forks and execs the server in the current (scratch) directory with its
+ *               console output sent to server.out, then waits for it to start listening
+ *
+ *    Returns: the pid of the server
+ *
+ *    Throws: runtime_error if the server could not be started
+ ****************************************************************************************/
+
+pid_t startServer(const std::string &server, unsigned short port) {
+   pid_t pid = fork();
+   if (pid == -1)
+      throw std::runtime_error("fork failed");
+
+   if (pid == 0) {
+      int out = open("server.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      dup2(out, STDOUT_FILENO);
+      dup2(out, STDERR_FILENO);
+      std::string portstr = std::to_string(port);
+      execl(server.c_str(), server.c_str(), "-a", "127.0.0.1", "-p", portstr.c_str(), (char *) NULL);
+      _exit(127);
+   }
+
+   timespec sleeptime;
+   sleeptime.tv_sec = 0;
+   sleeptime.tv_nsec = 20000000;
+
+   for (int i = 0; i < 500; i++) {
+      if (isListening(port))
+         return pid;
+
+      int wstatus;
+      if (waitpid(pid, &wstatus, WNOHANG) == pid)
+         throw std::runtime_error("Server exited during startup, see server.out");
+      nanosleep(&sleeptime, NULL);
+   }
+
+   kill(pid, SIGKILL);
+   waitpid(pid, NULL, 0);
+   throw std::runtime_error("Server did not start listening in time");
+}
+
+void stopServer(pid_t pid) {
+   kill(pid, SIGTERM);
+
+   int wstatus;
+   for (int i = 0; i < 100; i++) {
+      if (waitpid(pid, &wstatus, WNOHANG) == pid)
+         return;
+      usleep(20000);
+   }
+   kill(pid, SIGKILL);
+   waitpid(pid, &wstatus, 0);
+}
+
+int main(int argc, char *argv[]) {
+
+   std::string server = "./tcpserver";
+   unsigned int users = 4;
+   std::string mix = "2:6:2";
+   std::string menu_cmds = "menu,1,2,3,5,hello";
+   const char *outfile = NULL;
+
+   LoadGenParams params;
+   params.conns = 8;
+   params.sessions = 64;
+
+   // Get the command line arguments and set params appropriately
+   int c = 0;
+   while ((c = getopt(argc, argv, "s:u:n:S:r:m:c:t:Bo:")) != -1) {
+      switch (c) {
+      case 's':
+         server = optarg;
+         break;
+
+      case 'u':
+         users = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'n':
+         params.conns = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'S':
+         params.sessions = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'r':
+         params.rate = strtod(optarg, NULL);
+         break;
+
+      case 'm':
+         mix = optarg;
+         break;
+
+      case 'c':
+         menu_cmds = optarg;
+         break;
+
+      case 't':
+         params.timeout_ms = strtol(optarg, NULL, 10);
+         break;
+
+      case 'B':
+         params.binary = true;
+         break;
+
+      case 'o':
+         outfile = optarg;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (users == 0)
+      users = 1;
+
+   // The server path and output file are relative to where we were started
+   char cwd[4096];
+   if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      cerr << "Could not get the working directory.\n";
+      return -1;
+   }
+   if (server[0] != '/')
+      server = std::string(cwd) + "/" + server;
+
+   FILE *out = NULL;
+   if ((outfile != NULL) && ((out = fopen(outfile, "w")) == NULL)) {
+      cerr << "Could not open " << outfile << " for writing.\n";
+      return -1;
+   }
+
+   // Build the session mix
+   unsigned int weights[3] = {2, 6, 2};
+   sscanf(mix.c_str(), "%u:%u:%u", &weights[0], &weights[1], &weights[2]);
+
+   LoadGenScript login, menu, passwd;
+   login.name = "login";
+   login.weight = weights[0];
+
+   menu.name = "menu";
+   menu.weight = weights[1];
+   std::stringstream cmds(menu_cmds);
+   std::string cmd;
+   while (std::getline(cmds, cmd, ','))
+      if (!cmd.empty())
+         menu.commands.push_back(cmd);
+
+   passwd.name = "passwd";
+   passwd.weight = weights[2];
+   passwd.commands.push_back("passwd");
+   passwd.commands.push_back("%p");
+
+   params.scripts.push_back(login);
+   params.scripts.push_back(menu);
+   params.scripts.push_back(passwd);
+
+   char scratch[] = "/tmp/macrobench.XXXXXX";
+   if ((mkdtemp(scratch) == NULL) || (chdir(scratch) != 0)) {
+      cerr << "Could not create the scratch directory.\n";
+      return -1;
+   }
+
+   int result = 0;
+   pid_t pid = -1;
+
+   try {
+      // Synthetic users and whitelist; the server creates its own log
+      cout << "Creating " << users << " users in " << scratch << endl;
+      std::ofstream("passwd").close();
+      std::ofstream("whitelist") << "127.0.0.1\n";
+
+      PasswdMgr pwm("passwd");
+      for (unsigned int i = 0; i < users; i++) {
+         LoadGenCred cred;
+         cred.username = "bench" + std::to_string(i);
+         cred.passwd = "benchpass" + std::to_string(i);
+         pwm.addUser(cred.username.c_str(), cred.passwd.c_str());
+         params.creds.push_back(cred);
+      }
+
+      unsigned short port = findFreePort();
+      cout << "Starting " << server << " on 127.0.0.1 port " << port << endl;
+      pid = startServer(server, port);
+
+      ProcStats before = readProcStats(pid);
+
+      LoadGen loadgen("127.0.0.1", port, params);
+      loadgen.run();
+
+      ProcStats after = readProcStats(pid);
+
+      loadgen.report(stdout);
+
+      double elapsed = (loadgen.getElapsed() > 0.0) ? loadgen.getElapsed() : 1e-9;
+      uint64_t requests = loadgen.getRequests();
+      uint64_t commands = loadgen.getHist(LoadGen::p_command).count();
+      uint64_t connects = loadgen.getHist(LoadGen::p_connect).count();
+      double cpu = after.cpu_secs - before.cpu_secs;
+      double cpu_per_req = (requests > 0) ? (cpu / requests) : 0.0;
+
+      printf("\nServer: %.2f connections/s, %.2f commands/s, %.3f ms CPU/request (%.2f s total)\n",
+             connects / elapsed, commands / elapsed, cpu_per_req * 1e3, cpu);
+      printf("Server memory: %ld KiB RSS, %ld KiB peak RSS\n", after.rss_kib, after.peak_rss_kib);
+
+      if (out != NULL) {
+         BenchRunner runner;
+         BenchResult res;
+         res.name = "BM_Macro/mix:" + mix + "/conns:" + std::to_string(params.conns);
+         if (params.binary)
+            res.name += "/binary";
+         res.iterations = requests;
+         res.real_ns = (requests > 0) ? (elapsed * 1e9 / requests) : 0.0;
+         res.cpu_ns = cpu_per_req * 1e9;
+         res.counters.push_back(std::make_pair("connections_per_second", connects / elapsed));
+         res.counters.push_back(std::make_pair("commands_per_second", commands / elapsed));
+         res.counters.push_back(std::make_pair("sessions_failed", (double) loadgen.getFailed()));
+         res.counters.push_back(std::make_pair("rss_kib", (double) after.rss_kib));
+         res.counters.push_back(std::make_pair("peak_rss_kib", (double) after.peak_rss_kib));
+         runner.addResult(res);
+         runner.writeJSON(out, server.c_str());
+      }
+
+      if (loadgen.getFailed() > 0)
+         result = 1;
+
+   } catch (std::exception &e) {
+      cerr << "Benchmark failed: " << e.what() << endl;
+      result = -1;
+   }
+
+   if (pid > 0)
+      stopServer(pid);
+   if (out != NULL)
+      fclose(out);
+
+   if (chdir(cwd) == 0) {
+      std::string cleanup = std::string("rm -rf ") + scratch;
+      if (system(cleanup.c_str()) != 0)
+         cerr << "Could not remove " << scratch << endl;
+   }
+
+   return result;
+}
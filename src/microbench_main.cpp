@@ -0,0 +1,649 @@
+/****************************************************************************************
+ * microbench - microbenchmarks for the hot paths in FileDesc, PasswdMgr, TCPConn,
+ *              TextKernels, CredIndex, ShardRing, LogMgr and StreamCompressor. Runs everything in a scratch
+ *              directory so the synthetic passwd and whitelist files never touch the real
+ *              ones, and writes the results as Google Benchmark style JSON for regression
+ *              tracking.
+ *
+ ****************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stdexcept>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BenchRunner.h"
+#include "FileDesc.h"
+#include "PasswdMgr.h"
+#include "TCPConn.h"
+#include "LogMgr.h"
+#include "TextKernels.h"
+#include "CoroPool.h"
+#include "Session.h"
+#include "FanOut.h"
+#include "CredIndex.h"
+#include "ConnTable.h"
+#include "ShardRing.h"
+#include "StreamCompressor.h"
+
+using namespace std;
+
+// Keeps the compiler from discarding results we never look at
+volatile long bench_sink = 0;
+
+// (C++20 deprecates += on a volatile)
+static inline void sink(long v) { bench_sink = bench_sink + v; }
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-f <filter>] [-t <min_time>] [-o <json_file>]\n";
+   std::cout << "   f: only run benchmarks whose name contains filter\n";
+   std::cout << "   t: minimum seconds to run each benchmark (default 0.5)\n";
+   std::cout << "   o: write the JSON results to this file instead of stdout\n";
+}
+
+/****************************************************************************************
+ * writeFile - writes data to a file in the scratch directory, creating or truncating it
+ *
+ *    Throws: runtime_error if the file could not be written
+ ****************************************************************************************/
+
+void writeFile(const char *filename, const std::string &data) {
+   FILE *f = fopen(filename, "w");
+   if ((f == NULL) || (fwrite(data.data(), 1, data.size(), f) != data.size()))
+      throw std::runtime_error(std::string("Could not write benchmark file ") + filename);
+   fclose(f);
+}
+
+/****************************************************************************************
+ * makePasswdFile - builds a synthetic password file with the given number of users in the
+ *                  username\n{32 byte hash}{16 byte salt}\n layout. The hashes are random
+ *                  since lookups never verify them.
+ *
+ ****************************************************************************************/
+
+void makePasswdFile(const char *filename, unsigned int users) {
+   std::string data;
+   for (unsigned int i = 0; i < users; i++) {
+      data += "user" + std::to_string(i) + "\n";
+      for (int j = 0; j < 48; j++)
+         data += (char) (rand() % 256);
+      data += "\n";
+   }
+   writeFile(filename, data);
+}
+
+void makeWhitelist(const char *filename, unsigned int entries) {
+   std::string data;
+   for (unsigned int i = 0; i < entries; i++) {
+      data += "10." + std::to_string((i >> 16) & 0xff) + "." + std::to_string((i >> 8) & 0xff) + "."
+            + std::to_string(i & 0xff) + "\n";
+   }
+   writeFile(filename, data);
+}
+
+/****************************************************************************************
+ * FileDesc benchmarks - each iteration rewinds a scratch file and performs one read
+ *
+ ****************************************************************************************/
+
+void benchFileDesc(BenchRunner &runner) {
+   for (unsigned int size : {16, 128, 500}) {
+      writeFile("readfd.dat", std::string(size, 'a'));
+      FileFD file("readfd.dat");
+      if (!file.openFile(FileFD::readfd))
+         throw std::runtime_error("Could not open readfd.dat");
+
+      runner.run("BM_FileDesc_readFD/" + std::to_string(size), [&](uint64_t iters) {
+         std::string buf;
+         for (uint64_t i = 0; i < iters; i++) {
+            lseek(file.getFD(), 0, SEEK_SET);
+            sink(file.readFD(buf));
+         }
+      }, size);
+      file.closeFD();
+   }
+
+   for (unsigned int size : {8, 64, 256}) {
+      writeFile("readstr.dat", std::string(size, 'b') + "\n");
+      FileFD file("readstr.dat");
+      if (!file.openFile(FileFD::readfd))
+         throw std::runtime_error("Could not open readstr.dat");
+
+      runner.run("BM_FileDesc_readStr/" + std::to_string(size), [&](uint64_t iters) {
+         std::string buf;
+         for (uint64_t i = 0; i < iters; i++) {
+            lseek(file.getFD(), 0, SEEK_SET);
+            sink(file.readStr(buf));
+         }
+      }, size + 1);
+      file.closeFD();
+   }
+
+   for (unsigned int size : {16, 48, 256}) {
+      writeFile("readbytes.dat", std::string(size, 'c'));
+      FileFD file("readbytes.dat");
+      if (!file.openFile(FileFD::readfd))
+         throw std::runtime_error("Could not open readbytes.dat");
+
+      runner.run("BM_FileDesc_readBytes/" + std::to_string(size), [&](uint64_t iters) {
+         std::vector<uint8_t> buf;
+         for (uint64_t i = 0; i < iters; i++) {
+            lseek(file.getFD(), 0, SEEK_SET);
+            sink(file.readBytes(buf, size));
+         }
+      }, size);
+      file.closeFD();
+   }
+}
+
+/****************************************************************************************
+ * PasswdMgr benchmarks - findUser (through checkUser) for the last user in the file and
+ *                        for a missing user, which both have to scan the whole file
+ *
+ ****************************************************************************************/
+
+void benchFindUser(BenchRunner &runner) {
+   for (unsigned int users : {10, 100, 1000, 10000}) {
+      std::string filename = "passwd_" + std::to_string(users);
+      std::string name = "BM_PasswdMgr_findUser/" + std::to_string(users);
+      if (!runner.matches(name))
+         continue;
+
+      makePasswdFile(filename.c_str(), users);
+      PasswdMgr pwm(filename.c_str());
+      std::string last = "user" + std::to_string(users - 1);
+
+      runner.run(name + "/last", [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++)
+            sink(pwm.checkUser(last.c_str()));
+      });
+
+      runner.run(name + "/missing", [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++)
+            sink(pwm.checkUser("nosuchuser"));
+      });
+   }
+}
+
+/****************************************************************************************
+ * hashArgon2 benchmarks - PasswdMgr::hashArgon2 with the default (legacy) profile, followed
+ *                         by both variants across a spread of time and memory costs
+ *
+ ****************************************************************************************/
+
+void benchArgon2(BenchRunner &runner) {
+   PasswdMgr pwm("passwd_10");
+
+   runner.run("BM_PasswdMgr_hashArgon2/default", [&](uint64_t iters) {
+      std::vector<uint8_t> hash, salt, in_salt(16, 7);
+      for (uint64_t i = 0; i < iters; i++)
+         pwm.hashArgon2(hash, salt, "benchmark password", &in_salt);
+      sink(hash[0]);
+   });
+
+   const uint32_t costs[][2] = {{1, 1 << 12}, {2, 1 << 12}, {1, 1 << 14}, {2, 1 << 14}, {2, 1 << 16}, {3, 1 << 16}};
+   for (Argon2Profile::variant type : {Argon2Profile::argon2i, Argon2Profile::argon2id}) {
+      for (auto &cost : costs) {
+         Argon2Profile profile(type, cost[0], cost[1], 1);
+         std::string name = (type == Argon2Profile::argon2id) ? "BM_argon2id" : "BM_argon2i";
+
+         runner.run(name + "/t:" + std::to_string(cost[0]) + "/m:" + std::to_string(cost[1]), [&](uint64_t iters) {
+            uint8_t salt[16] = {0}, hash[32];
+            const char pwd[] = "benchmark password";
+            for (uint64_t i = 0; i < iters; i++)
+               profile.hash(pwd, strlen(pwd), salt, sizeof(salt), hash, sizeof(hash));
+            sink(hash[0]);
+         });
+      }
+   }
+}
+
+/****************************************************************************************
+ * TCPConn benchmarks - getUserInput over a loopback connection (one line written and split
+ *                      per iteration) and the whitelist lookup against lists of varying size
+ *
+ ****************************************************************************************/
+
+void benchTCPConn(BenchRunner &runner) {
+   SocketFD listener;
+   listener.bindFD("127.0.0.1", 0);
+   listener.listenFD(1);
+
+   sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   if (getsockname(listener.getFD(), (struct sockaddr *) &addr, &len) != 0)
+      throw socket_error("Could not find the benchmark listener port");
+
+   SocketFD client;
+   if (!client.connectTo("127.0.0.1", ntohs(addr.sin_port)))
+      throw socket_error("Benchmark loopback connect failed");
+
+   TCPConn conn;
+   if (!conn.accept(listener))
+      throw socket_error("Benchmark loopback accept failed");
+
+   for (unsigned int size : {8, 64, 256}) {
+      std::string line = std::string(size - 2, 'd') + "\r\n";
+
+      runner.run("BM_TCPConn_getUserInput/" + std::to_string(size), [&](uint64_t iters) {
+         std::string cmd;
+         for (uint64_t i = 0; i < iters; i++) {
+            client.writeFD(line);
+            sink(conn.getUserInput(cmd));
+         }
+      }, size);
+   }
+   client.closeFD();
+   conn.disconnect();
+   listener.closeFD();
+
+   for (unsigned int entries : {1, 16, 256, 4096}) {
+      std::string name = "BM_TCPConn_isNewIPAllowed/" + std::to_string(entries);
+      if (!runner.matches(name))
+         continue;
+
+      makeWhitelist("whitelist", entries);
+      std::string last = "10." + std::to_string(((entries - 1) >> 16) & 0xff) + "."
+                       + std::to_string(((entries - 1) >> 8) & 0xff) + "." + std::to_string((entries - 1) & 0xff);
+
+      runner.run(name + "/last", [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++)
+            sink(conn.isNewIPAllowed(last));
+      });
+
+      runner.run(name + "/missing", [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++)
+            sink(conn.isNewIPAllowed("192.168.1.1"));
+      });
+   }
+}
+
+/****************************************************************************************
+ * TextKernels benchmarks - each kernel under each implementation the CPU supports, over
+ *                          a pipelined buffer of short lines (newline search) and a single
+ *                          line (cleanLine, lowerASCII)
+ *
+ ****************************************************************************************/
+
+void benchTextKernels(BenchRunner &runner) {
+   textk::impl best = textk::active();
+
+   for (textk::impl which : {textk::scalar, textk::sse2, textk::avx2}) {
+      if (!textk::select(which))
+         continue;
+      std::string suffix = std::string("/") + textk::implName(which) + "/";
+
+      for (unsigned int size : {64, 4096}) {
+         std::string lines;
+         while (lines.size() + 24 <= size)
+            lines += "hello there Server 123\r\n";
+         lines.resize(size, 'x');
+
+         runner.run("BM_textk_findNewline" + suffix + std::to_string(size), [&](uint64_t iters) {
+            for (uint64_t i = 0; i < iters; i++) {
+               const char *p = lines.data(), *end = p + lines.size();
+               while ((p = textk::findNewline(p, end - p)) != NULL) {
+                  sink(1);
+                  p++;
+               }
+            }
+         }, size);
+      }
+
+      for (unsigned int size : {16, 256, 4096}) {
+         std::string line(size - 2, 'M');
+         line += "\r\n";
+         std::string work;
+
+         runner.run("BM_textk_cleanLine" + suffix + std::to_string(size), [&](uint64_t iters) {
+            for (uint64_t i = 0; i < iters; i++) {
+               work = line;
+               sink(textk::cleanLine(&work[0], work.size(), true));
+            }
+         }, size);
+
+         runner.run("BM_textk_lowerASCII" + suffix + std::to_string(size), [&](uint64_t iters) {
+            for (uint64_t i = 0; i < iters; i++) {
+               work = line;
+               textk::lowerASCII(&work[0], work.size());
+               sink(work[0]);
+            }
+         }, size);
+      }
+   }
+   textk::select(best);
+}
+
+/****************************************************************************************
+ * Session benchmarks - a coroutine's life as the server sees it: created, run to its
+ *                      first wait, resumed once and destroyed, with its frame from a pool
+ *                      that already has one free and from a fresh pool (a heap allocation)
+ *
+ ****************************************************************************************/
+
+struct BenchSessionOwner {
+   CoroPool *pool;
+
+   CoroPool &coroPool() { return *pool; };
+
+   Session session(int &count) {
+      count++;
+      co_await std::suspend_always();
+      count++;
+   };
+};
+
+void benchSession(BenchRunner &runner) {
+   CoroPool pool;
+   BenchSessionOwner owner = {&pool};
+   int count = 0;
+
+   runner.run("BM_Session_lifecycle/pooled", [&](uint64_t iters) {
+      for (uint64_t i = 0; i < iters; i++) {
+         Session s = owner.session(count);
+         s.resume();
+         s.resume();
+      }
+      sink(count);
+   });
+
+   runner.run("BM_Session_lifecycle/unpooled", [&](uint64_t iters) {
+      for (uint64_t i = 0; i < iters; i++) {
+         CoroPool fresh;
+         BenchSessionOwner once = {&fresh};
+         Session s = once.session(count);
+         s.resume();
+         s.resume();
+      }
+      sink(count);
+   });
+}
+
+/****************************************************************************************
+ * CredIndex benchmarks - find and getCred over 10000 users, with the lookups split across
+ *                        1 to 8 threads. Time is per lookup, so it should drop with the
+ *                        thread count as far as there are cores to run them.
+ *
+ ****************************************************************************************/
+
+void benchCredIndex(BenchRunner &runner) {
+   const unsigned int users = 10000;
+   makePasswdFile("passwd.creds", users);
+   CredIndex creds("passwd.creds");
+   std::vector<std::string> names;
+   for (unsigned int i = 0; i < users; i++)
+      names.push_back("user" + std::to_string((i * 7919) % users));
+
+   for (unsigned int threads : {1, 2, 4, 8}) {
+      std::string suffix = "/" + std::to_string(users) + "/threads:" + std::to_string(threads);
+
+      runner.run("BM_CredIndex_find" + suffix, [&](uint64_t iters) {
+         std::vector<long> found(threads);
+         std::vector<std::thread> workers;
+         for (unsigned int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+               for (uint64_t i = t; i < iters; i += threads)
+                  found[t] += (creds.find(names[i % users]) != no_user);
+            });
+         }
+         for (std::thread &w : workers)
+            w.join();
+         for (long f : found)
+            sink(f);
+      });
+
+      runner.run("BM_CredIndex_getCred" + suffix, [&](uint64_t iters) {
+         std::vector<long> found(threads);
+         std::vector<std::thread> workers;
+         for (unsigned int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+               std::vector<uint8_t> hash, salt;
+               Argon2Profile profile;
+               for (uint64_t i = t; i < iters; i += threads)
+                  found[t] += creds.getCred((userid) (i % users), hash, salt, profile);
+            });
+         }
+         for (std::thread &w : workers)
+            w.join();
+         for (long f : found)
+            sink(f);
+      });
+   }
+}
+
+/****************************************************************************************
+ * ShardRing benchmarks - finding a username's node on rings of 3 and 64 nodes, done for
+ *                        every username a partitioned server is given. Should only grow
+ *                        with the log of the node count.
+ *
+ ****************************************************************************************/
+
+void benchShardRing(BenchRunner &runner) {
+   const unsigned int users = 10000;
+   std::vector<std::string> names;
+   for (unsigned int i = 0; i < users; i++)
+      names.push_back("user" + std::to_string(i));
+
+   for (unsigned int nodes : {3, 64}) {
+      ShardRing ring;
+      for (unsigned int n = 0; n < nodes; n++)
+         ring.addNode("10.0." + std::to_string(n / 256) + "." + std::to_string(n % 256) + ":7000");
+
+      runner.run("BM_ShardRing_owner/" + std::to_string(nodes), [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++)
+            sink((long) ring.owner(names[i % users]));
+      });
+   }
+}
+
+/****************************************************************************************
+ * FanOut benchmarks - one broadcast to every logged-in session over local socket pairs,
+ *                     queued and flushed as the server loop does it. The receiving ends are
+ *                     drained every 16 broadcasts, which is part of the timing. Payload size
+ *                     should barely matter.
+ *
+ ****************************************************************************************/
+
+void benchFanOut(BenchRunner &runner) {
+   makePasswdFile("passwd.bench", 1);
+   CredIndex creds("passwd.bench");
+   LogMgr log(logfilename);
+
+   for (unsigned int sessions : {16, 256}) {
+      std::string name = "BM_FanOut_broadcast/" + std::to_string(sessions);
+      if (!runner.matches(name))
+         continue;
+
+      ConnTable table(sessions + 1);
+      TCPConn sender(table, creds, log);
+      std::vector<std::unique_ptr<TCPConn>> conns;
+      std::vector<int> readers;
+      for (unsigned int i = 0; i < sessions; i++) {
+         int sv[2];
+         if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            throw socket_error("Benchmark socketpair failed");
+         SocketFD end(false);
+         end.adoptFD(sv[0]);
+         conns.push_back(std::make_unique<TCPConn>(table, creds, log));
+         conns.back()->adoptSocket(end);
+         conns.back()->getHot()->user = 1;
+         readers.push_back(sv[1]);
+      }
+
+      FanOut fanout;
+      char drain[65536];
+      for (unsigned int size : {16, 1024}) {
+         std::string text(size, 'b');
+
+         runner.run(name + "/" + std::to_string(size), [&](uint64_t iters) {
+            for (uint64_t i = 0; i < iters; i++) {
+               sink(fanout.broadcast(table, sender, text));
+               fanout.flush();
+
+               // Keep the socket buffers from filling up
+               if ((i & 15) == 15) {
+                  for (int fd : readers) {
+                     while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+                        ;
+                  }
+               }
+            }
+         });
+      }
+
+      conns.clear();
+      for (int fd : readers)
+         close(fd);
+   }
+   unlink("passwd.bench");
+}
+
+/****************************************************************************************
+ * LogMgr benchmarks - queuing a connection event and, per batch, rendering and appending it
+ *                     to the log (a flush is forced every log_flush_records records)
+ *
+ ****************************************************************************************/
+
+void benchLogMgr(BenchRunner &runner) {
+   LogMgr log(logfilename);
+   uint32_t ipaddr = htonl(0x0a000001);
+
+   runner.run("BM_LogMgr_record", [&](uint64_t iters) {
+      for (uint64_t i = 0; i < iters; i++)
+         log.record(evlog::newConn_ON_WL, ipaddr, 40000);
+      log.flush();
+   });
+}
+
+/****************************************************************************************
+ * StreamCompressor benchmarks - compressing one reply on a connection's long-lived stream,
+ *                               against setting up a fresh stream for it, and a full batch
+ *                               of log-like text as a download would send
+ *
+ ****************************************************************************************/
+
+void benchStreamCompressor(BenchRunner &runner) {
+   const std::string &dict = compressDictionary();
+   std::vector<std::pair<std::string, std::string>> replies = {
+      {"hello", "Hello back!\n"},
+      {"menu", dict.substr(dict.find("Available choices"), dict.find("Sending") - dict.find("Available choices"))},
+   };
+
+   for (auto &reply : replies) {
+      StreamCompressor zs;
+      std::string out;
+      runner.run("BM_StreamCompressor_reply/" + reply.first, [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++) {
+            out.clear();
+            zs.compress(reply.second.data(), reply.second.size(), out);
+         }
+         sink(out.size());
+      });
+
+      runner.run("BM_StreamCompressor_reply/" + reply.first + "/fresh", [&](uint64_t iters) {
+         for (uint64_t i = 0; i < iters; i++) {
+            StreamCompressor fresh;
+            out.clear();
+            fresh.compress(reply.second.data(), reply.second.size(), out);
+         }
+         sink(out.size());
+      });
+   }
+
+   std::string text;
+   for (unsigned int i = 0; text.size() < compress_batch; i++)
+      text += std::to_string(i * 2654435761u) + " user" + std::to_string(i % 97) + " login ok\n";
+   text.resize(compress_batch);
+
+   StreamCompressor zs;
+   std::string out;
+   runner.run("BM_StreamCompressor_batch/" + std::to_string(compress_batch), [&](uint64_t iters) {
+      for (uint64_t i = 0; i < iters; i++) {
+         out.clear();
+         zs.compress(text.data(), text.size(), out);
+      }
+      sink(out.size());
+   });
+}
+
+int main(int argc, char *argv[]) {
+
+   double min_time = 0.5;
+   const char *filter = "";
+   const char *outfile = NULL;
+
+   // Get the command line arguments and set params appropriately
+   int c = 0;
+   while ((c = getopt(argc, argv, "f:t:o:")) != -1) {
+      switch (c) {
+      case 'f':
+         filter = optarg;
+         break;
+
+      case 't':
+         min_time = strtod(optarg, NULL);
+         break;
+
+      case 'o':
+         outfile = optarg;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   FILE *out = stdout;
+   if ((outfile != NULL) && ((out = fopen(outfile, "w")) == NULL)) {
+      cerr << "Could not open " << outfile << " for writing.\n";
+      return -1;
+   }
+
+   // Work in a scratch directory since TCPConn and PasswdMgr use fixed relative filenames
+   char scratch[] = "/tmp/microbench.XXXXXX";
+   if ((mkdtemp(scratch) == NULL) || (chdir(scratch) != 0)) {
+      cerr << "Could not create the scratch directory.\n";
+      return -1;
+   }
+
+   BenchRunner runner(min_time);
+   runner.setFilter(filter);
+
+   // TCPConn reports to the console through cout, which would swamp the results
+   cout.setstate(std::ios_base::failbit);
+
+   try {
+      benchFileDesc(runner);
+      benchFindUser(runner);
+      benchArgon2(runner);
+      benchTCPConn(runner);
+      benchTextKernels(runner);
+      benchSession(runner);
+      benchCredIndex(runner);
+      benchShardRing(runner);
+      benchFanOut(runner);
+      benchLogMgr(runner);
+      benchStreamCompressor(runner);
+   } catch (std::runtime_error &e) {
+      cerr << "Benchmark failed: " << e.what() << endl;
+      return -1;
+   }
+
+   runner.writeJSON(out, argv[0]);
+   if (out != stdout)
+      fclose(out);
+
+   std::string cleanup = std::string("rm -rf ") + scratch;
+   if (system(cleanup.c_str()) != 0)
+      cerr << "Could not remove " << scratch << endl;
+
+   return 0;
+}
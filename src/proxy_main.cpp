@@ -0,0 +1,174 @@
+/****************************************************************************************
+ * tcp_proxy - balances client connections over several tcpservers, relaying the bytes
+ *             between them without looking at the protocol
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include "TCPProxy.h"
+#include "exceptions.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-p <portnum>] [-a <ip_addr>] (-b <ip>:<port>[,<ip>:<port>...] | -f <file>)\n";
+   std::cout << "   " << execname << " [-i <check_ms>] [-x <fails>] [-d <drain_secs>] [-n <max_conns>]\n";
+   std::cout << "   p: the port to bind the proxy to\n";
+   std::cout << "   a: the IP address to bind the proxy\n";
+   std::cout << "   b: the tcpserver backends to balance over\n";
+   std::cout << "   f: read the backends from a file instead, one <ip>:<port> per line. A line\n";
+   std::cout << "      ending in \"drain\" gets no new sessions; the file is read again on SIGHUP\n";
+   std::cout << "   i: ms between health checks of each backend (default " << default_health_ms << ")\n";
+   std::cout << "   x: failed checks in a row before a backend is taken out (default "
+             << default_health_fails << ")\n";
+   std::cout << "   d: on SIGTERM/SIGINT, seconds to let sessions finish (default "
+             << default_proxy_drain_secs << ")\n";
+   std::cout << "   n: sessions relayed at once, more are closed at accept (default "
+             << default_proxy_conns << ")\n";
+   std::cout << "   Backends see every client as coming from the proxy's address, so their per-IP\n";
+   std::cout << "   limits (tcpserver -r and -f) apply to all clients together\n";
+}
+
+// global default values
+const unsigned short default_port = 9998;
+const char default_IP[] = "127.0.0.1";
+
+int main(int argc, char *argv[]) {
+
+   unsigned short port = default_port;
+   std::string ip_addr(default_IP);
+
+   int c = 0;
+   long portval;
+   std::vector<std::string> backends;
+   const char *backend_file = NULL;
+   int health_ms = default_health_ms;
+   unsigned int health_fails = default_health_fails;
+   double drain_secs = default_proxy_drain_secs;
+   unsigned long max_conns = default_proxy_conns;
+   while ((c = getopt(argc, argv, "p:a:b:f:i:x:d:n:")) != -1) {
+      switch (c) {
+
+      case 'p':
+         portval = strtol(optarg, NULL, 10);
+         if ((portval < 1) || (portval > 65535)) {
+            std::cout << "Invalid port. Value must be between 1 and 65535\n";
+            exit(0);
+         }
+         port = (unsigned short) portval;
+         break;
+
+      case 'a':
+         ip_addr = optarg;
+         break;
+
+      case 'b': {
+         std::string list(optarg);
+         size_t start = 0;
+         while (start <= list.size()) {
+            size_t comma = list.find(',', start);
+            if (comma == std::string::npos)
+               comma = list.size();
+            backends.push_back(list.substr(start, comma - start));
+            start = comma + 1;
+         }
+         break;
+      }
+
+      case 'f':
+         backend_file = optarg;
+         break;
+
+      // Health checks
+      case 'i':
+         health_ms = (int) strtol(optarg, NULL, 10);
+         if (health_ms < 10) {
+            std::cout << "Invalid check interval. Value must be at least 10 ms\n";
+            exit(0);
+         }
+         break;
+
+      case 'x':
+         health_fails = (unsigned int) strtoul(optarg, NULL, 10);
+         if (health_fails < 1) {
+            std::cout << "Invalid failure count. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'd':
+         drain_secs = strtod(optarg, NULL);
+         if (drain_secs < 0.0) {
+            std::cout << "Invalid drain time. Value must not be negative\n";
+            exit(0);
+         }
+         break;
+
+      case 'n':
+         max_conns = strtoul(optarg, NULL, 10);
+         if (max_conns < 1) {
+            std::cout << "Invalid session limit. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case '?':
+         displayHelp(argv[0]);
+         break;
+
+      default:
+         std::cout << "Unknown command line option '" << c << "'\n";
+         displayHelp(argv[0]);
+         break;
+      }
+   }
+
+   if (backends.empty() == (backend_file == NULL)) {
+      std::cout << "Give the backends with either -b or -f\n";
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   // A client vanishing mid-relay should cost us that session, not the whole proxy
+   signal(SIGPIPE, SIG_IGN);
+
+   TCPProxy proxy;
+   proxy.setHealthCheck(health_ms, health_fails);
+   proxy.setDrainTimeout(drain_secs);
+   proxy.setMaxConns(max_conns);
+   try {
+      for (auto &addr : backends)
+         proxy.addBackend(addr);
+      if (backend_file != NULL)
+         proxy.setBackendFile(backend_file);
+
+      cout << "Binding proxy to " << ip_addr << " port " << port << " for " << proxy.backends()
+           << " backends" << endl;
+      proxy.bindSvr(ip_addr.c_str(), port);
+
+   } catch (invalid_argument &e) {
+      cerr << "Proxy initialization failed: " << e.what() << endl;
+      return -1;
+   } catch (runtime_error &e) {
+      cerr << "Proxy initialization failed: " << e.what() << endl;
+      return -1;
+   }
+
+   try {
+      cout << "Listening.\n";
+      proxy.listenSvr();
+   } catch (socket_error &e) {
+      cerr << "Unrecoverable socket error. Exiting.\n";
+      cerr << "Error is: " << e.what() << endl;
+      return -1;
+   }
+
+   proxy.shutdown();
+
+   cout << "Proxy shut down\n";
+   return 0;
+}
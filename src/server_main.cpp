@@ -9,21 +9,89 @@
 #include <stdexcept>
 #include <iostream>
 #include <getopt.h>
+#include <signal.h>
+#include <string.h>
 #include "TCPServer.h"
 #include "exceptions.h"
 
 using namespace std; 
 
 void displayHelp(const char *execname) {
-   std::cout << execname << " [-p <portnum>] [-a <ip_addr>]\n";
+   std::cout << execname << " [-p <portnum>] [-a <ip_addr>] [-t <threads>] [-b <mem_MiB>] [-q <max_queue>]\n";
+   std::cout << "   " << execname << " [-r <conns/s>] [-f <fails/min>] [-d <drain_secs>] [-n <max_conns>]\n";
+   std::cout << "   " << execname << " [-H <handoff_path>] [-L <log_MiB>] [-I <log_secs>]\n";
+   std::cout << "   " << execname << " [-D <content_dir>] [-U <upload_dir>] [-Y none|end|<MiB>] [-Z <level>]\n";
+   std::cout << "   " << execname << " [-R <repl_port> | -F <primary_ip>:<repl_port>]\n";
+   std::cout << "   " << execname << " [-S <node_ip>:<rpc_port> [-N <ip>:<rpc_port>[,<ip>:<rpc_port>...]]]\n";
+   std::cout << "   " << execname << " -C <target_ms> [-M <mem_MiB>]\n";
    std::cout << "   p: the port to bind the server to\n";
    std::cout << "   a: the IP address to bind the server\n";
+   std::cout << "   t: password hashes run in parallel (default one per CPU)\n";
+   std::cout << "   b: Argon2 memory all running hashes may use together, in MiB (default "
+             << default_hash_mem_mib << ")\n";
+   std::cout << "   q: hashes that may wait before clients are told to retry (default "
+             << default_hash_queue << ")\n";
+   std::cout << "   r: connections per second allowed from one IP (default " << default_conn_rate << ")\n";
+   std::cout << "   f: failed logins per minute allowed from one IP (default " << default_login_fail_rate << ")\n";
+   std::cout << "      (both may burst to twice the rate)\n";
+   std::cout << "   d: on SIGTERM/SIGINT, seconds to let busy connections finish (default "
+             << default_drain_secs << ")\n";
+   std::cout << "   n: connections served at once, more are closed at accept (default "
+             << default_max_conns << ")\n";
+   std::cout << "   H: Unix socket for zero-downtime upgrades. If a server is already running with this\n";
+   std::cout << "      path, take over its listening socket and idle connections instead of binding;\n";
+   std::cout << "      either way, listen on it for the next upgrade\n";
+   std::cout << "   L: rotate " << logfilename << " when it reaches this size in MiB, 0 for never (default "
+             << default_log_rotate_mib << ")\n";
+   std::cout << "   I: also rotate it every log_secs seconds (default never). Closed segments are\n";
+   std::cout << "      gzipped in the background and listed in " << logfilename << ".index\n";
+   std::cout << "   D: directory logged in users can download files from with \"get <name>\" (default "
+             << default_contentdir << ")\n";
+   std::cout << "   U: directory \"put <name> <length>\" stores each user's uploads under (default "
+             << default_uploaddir << ")\n";
+   std::cout << "   Y: when uploads are synced to disk: none, at the end (default), or also every MiB\n";
+   std::cout << "   Z: zlib level 1-9 for clients that send \"compress\" after logging in, 0 to refuse\n";
+   std::cout << "      them (default " << default_compress_level << ")\n";
+   std::cout << "   R: replicate credentials as the primary, with followers connecting on repl_port\n";
+   std::cout << "   F: replicate credentials as a follower of the primary at primary_ip:repl_port. Each\n";
+   std::cout << "      server keeps its changes in order in " << repllogfilename << "\n";
+   std::cout << "   S: partition users over a cluster of servers by username. This one answers the\n";
+   std::cout << "      others on node_ip:rpc_port; its passwd file only needs the users it owns\n";
+   std::cout << "   N: the other servers in the cluster, by their -S address. Every server must be\n";
+   std::cout << "      given the same set\n";
+   std::cout << "   C: calibrate the Argon2 profile to hash in at most target_ms on this machine,\n";
+   std::cout << "      save it for new and upgraded password hashes, then exit\n";
+   std::cout << "   M: memory budget per hash in MiB for calibration (default 64)\n";
 
 }
 
 // global default values
 const unsigned short default_port = 9999;
 const char default_IP[] = "127.0.0.1";
+const unsigned long default_calib_mem = 64;
+
+/****************************************************************************************
+ * calibrateProfile - times Argon2 on this machine, picks the strongest profile meeting the
+ *                    target latency and memory budget and saves it to the profile file
+ *
+ ****************************************************************************************/
+
+int calibrateProfile(double target_ms, unsigned long mem_mib) {
+   cout << "Calibrating Argon2 for " << target_ms << " ms per hash within " << mem_mib << " MiB\n";
+
+   Argon2Profile profile = Argon2Profile::calibrate(target_ms, (uint32_t) (mem_mib * 1024), true);
+
+   try {
+      profile.save(profilefilename);
+   } catch (pwfile_error &e) {
+      cerr << "Error saving the profile: " << e.what() << endl;
+      return -1;
+   }
+
+   cout << "Selected " << profile.toString() << ", saved to " << profilefilename << endl;
+   cout << "Existing passwords are rehashed with it as their users log in.\n";
+   return 0;
+}
 
 int main(int argc, char *argv[]) {
 
@@ -34,7 +102,29 @@ int main(int argc, char *argv[]) {
    // Get the command line arguments and set params appropriately
    int c = 0;
    long portval;
-   while ((c = getopt(argc, argv, "p:a:smw")) != -1) {
+   double calib_ms = 0.0;
+   unsigned long calib_mem = default_calib_mem;
+   unsigned int hash_threads = default_hash_threads;
+   unsigned long hash_mem = default_hash_mem_mib;
+   unsigned int hash_queue = default_hash_queue;
+   double conn_rate = default_conn_rate;
+   double login_fail_rate = default_login_fail_rate;
+   double drain_secs = default_drain_secs;
+   const char *handoff_path = NULL;
+   const char *content_dir = NULL;
+   const char *upload_dir = NULL;
+   uploadsync upload_sync = sync_end;
+   unsigned long upload_sync_mib = 0;
+   int compress_level = default_compress_level;
+   unsigned long max_conns = default_max_conns;
+   unsigned long log_mib = default_log_rotate_mib;
+   unsigned int log_secs = 0;
+   bool repl_primary = false;
+   std::string repl_ip;
+   unsigned short repl_port = 0;
+   std::string shard_self;
+   std::vector<std::string> shard_peers;
+   while ((c = getopt(argc, argv, "p:a:t:b:q:r:f:d:n:H:L:I:D:U:Y:Z:R:F:S:N:C:M:smw")) != -1) {
       switch (c) {
   
       // Set the max number to count up to	    
@@ -53,6 +143,169 @@ int main(int argc, char *argv[]) {
          ip_addr = optarg; 
          break;
 
+      // Password hashing limits
+      case 't':
+         hash_threads = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'b':
+         hash_mem = strtoul(optarg, NULL, 10);
+         if (hash_mem < 1) {
+            std::cout << "Invalid hash memory budget. Value must be at least 1 MiB\n";
+            exit(0);
+         }
+         break;
+
+      case 'q':
+         hash_queue = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      // Per-IP rate limits
+      case 'r':
+      case 'f': {
+         double rate = strtod(optarg, NULL);
+         if (rate <= 0.0) {
+            std::cout << "Invalid rate. Value must be a positive number\n";
+            exit(0);
+         }
+         if (c == 'r')
+            conn_rate = rate;
+         else
+            login_fail_rate = rate;
+         break;
+      }
+
+      case 'd':
+         drain_secs = strtod(optarg, NULL);
+         if (drain_secs < 0.0) {
+            std::cout << "Invalid drain time. Value must not be negative\n";
+            exit(0);
+         }
+         break;
+
+      case 'n':
+         max_conns = strtoul(optarg, NULL, 10);
+         if (max_conns < 1) {
+            std::cout << "Invalid connection limit. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'H':
+         handoff_path = optarg;
+         break;
+
+      // Event log rotation
+      case 'L':
+         log_mib = strtoul(optarg, NULL, 10);
+         break;
+
+      case 'I':
+         log_secs = (unsigned int) strtoul(optarg, NULL, 10);
+         break;
+
+      case 'D':
+         content_dir = optarg;
+         break;
+
+      // Uploads
+      case 'U':
+         upload_dir = optarg;
+         break;
+
+      case 'Y':
+         if (strcmp(optarg, "none") == 0) {
+            upload_sync = sync_none;
+         } else if (strcmp(optarg, "end") == 0) {
+            upload_sync = sync_end;
+         } else {
+            upload_sync_mib = strtoul(optarg, NULL, 10);
+            if (upload_sync_mib < 1) {
+               std::cout << "Invalid sync policy. Use none, end or a number of MiB\n";
+               exit(0);
+            }
+            upload_sync = sync_every;
+         }
+         break;
+
+      case 'Z': {
+         char *end = NULL;
+         compress_level = (int) strtol(optarg, &end, 10);
+         if ((*end != '\0') || (compress_level < 0) || (compress_level > 9)) {
+            std::cout << "Invalid compression level. Value must be between 0 and 9\n";
+            exit(0);
+         }
+         break;
+      }
+
+      // Credential replication
+      case 'R':
+      case 'F': {
+         const char *portstr = optarg;
+         if (c == 'F') {
+            const char *colon = strrchr(optarg, ':');
+            if (colon == NULL) {
+               std::cout << "Invalid primary. Format is <ip_addr>:<port>\n";
+               exit(0);
+            }
+            repl_ip.assign(optarg, colon - optarg);
+            portstr = colon + 1;
+         }
+
+         portval = strtol(portstr, NULL, 10);
+         if ((portval < 1) || (portval > 65535)) {
+            std::cout << "Invalid replication port. Value must be between 1 and 65535\n";
+            exit(0);
+         }
+         repl_port = (unsigned short) portval;
+         repl_primary = (c == 'R');
+         break;
+      }
+
+      // Partitioned users
+      case 'S':
+         if (strchr(optarg, ':') == NULL) {
+            std::cout << "Invalid shard node. Format is <ip_addr>:<port>\n";
+            exit(0);
+         }
+         shard_self = optarg;
+         break;
+
+      case 'N': {
+         std::string list(optarg);
+         size_t start = 0;
+         while (start <= list.size()) {
+            size_t comma = list.find(',', start);
+            if (comma == std::string::npos)
+               comma = list.size();
+            std::string peer = list.substr(start, comma - start);
+            if (peer.find(':') == std::string::npos) {
+               std::cout << "Invalid shard node " << peer << ". Format is <ip_addr>:<port>\n";
+               exit(0);
+            }
+            shard_peers.push_back(peer);
+            start = comma + 1;
+         }
+         break;
+      }
+
+      // Calibrate the Argon2 profile instead of serving
+      case 'C':
+         calib_ms = strtod(optarg, NULL);
+         if (calib_ms <= 0.0) {
+            std::cout << "Invalid calibration target. Value must be a positive number of ms\n";
+            exit(0);
+         }
+         break;
+
+      case 'M':
+         calib_mem = strtoul(optarg, NULL, 10);
+         if (calib_mem < 8) {
+            std::cout << "Invalid memory budget. Value must be at least 8 MiB\n";
+            exit(0);
+         }
+         break;
+
       case '?':
 	      displayHelp(argv[0]);
 	      break;
@@ -65,17 +318,51 @@ int main(int argc, char *argv[]) {
 
    }
 
+   if (calib_ms > 0.0)
+      return calibrateProfile(calib_ms, calib_mem);
+
+   // A client vanishing mid-reply should cost us that connection, not the whole server
+   signal(SIGPIPE, SIG_IGN);
+
    // Try to set up the server for listening
    TCPServer server;
+   server.setHashLimits(hash_threads, (uint32_t) hash_mem, hash_queue);
+   server.setRateLimits(conn_rate, login_fail_rate);
+   server.setDrainTimeout(drain_secs);
+   server.setMaxConns(max_conns);
+   server.setLogRotation(log_mib, log_secs);
+   if (handoff_path != NULL)
+      server.setHandoffPath(handoff_path);
+   if (content_dir != NULL)
+      server.setContentDir(content_dir);
+   if (upload_dir != NULL)
+      server.setUploadDir(upload_dir);
+   server.setUploadSync(upload_sync, (uint64_t) upload_sync_mib << 20);
+   server.setCompressLevel(compress_level);
+   if (repl_port != 0)
+      server.setReplication(repl_primary, repl_primary ? ip_addr.c_str() : repl_ip.c_str(), repl_port);
+   if (!shard_self.empty())
+      server.setSharding(shard_self, shard_peers);
+   else if (!shard_peers.empty()) {
+      std::cout << "-N needs this server's own address with -S\n";
+      exit(0);
+   }
    try {
-      cout << "Binding server to " << ip_addr << " port " << port << endl;
-      server.bindSvr(ip_addr.c_str(), port);
+      if ((handoff_path != NULL) && server.takeOver()) {
+         cout << "Took over from the server running on " << handoff_path << endl;
+      } else {
+         cout << "Binding server to " << ip_addr << " port " << port << endl;
+         server.bindSvr(ip_addr.c_str(), port);
+      }
 
    } catch (invalid_argument &e) 
    {
       cerr << "Server initialization failed: " << e.what() << endl;
       return -1;
-   }	   
+   } catch (socket_error &e) {
+      cerr << "Server initialization failed: " << e.what() << endl;
+      return -1;
+   }
 
    cout << "Server established.\n";
 
@@ -90,6 +377,10 @@ int main(int argc, char *argv[]) {
       cerr << "Unrecoverable socket error. Exiting.\n";
       cerr << "Error is: " << e.what() << endl;
       return -1;
+   } catch (logfile_error &e) {
+      cerr << "Error with the log file. Make sure " << logfilename << " can be created or written by the server.\n";
+      cerr << "Error is: " << e.what() << endl;
+      return -1;
    }
 
 
@@ -1,13 +1,13 @@
-#include <algorithm>
+#include <string.h>
 #include <termios.h>
 #include "strfuncts.h"
+#include "TextKernels.h"
 
 /*******************************************************************************************
- * clrNewlines - removes \r and \n from the string passed into buf
+ * clrNewlines - removes \r and \n from the string passed into buf, in one pass
  *******************************************************************************************/
 void clrNewlines(std::string &str) {
-   str.erase(std::remove(str.begin(), str.end(), '\r'), str.end());
-   str.erase(std::remove(str.begin(), str.end(), '\n'), str.end());
+   str.resize(textk::cleanLine(&str[0], str.size(), false));
 }
 
 /*******************************************************************************************
@@ -16,26 +16,33 @@ void clrNewlines(std::string &str) {
  *******************************************************************************************/
 
 bool split(std::string &orig, std::string &left, std::string &right, const char delimiter) {
-   int del_loc = orig.find(delimiter);
-   if (del_loc == std::string::npos)
+   const char *del = (const char *) memchr(orig.data(), delimiter, orig.size());
+   if (del == NULL)
       return false;
 
-   left = orig.substr(0, del_loc);
-   right = orig.substr(del_loc + 1, orig.size());
-   right.erase(std::remove(right.begin(), right.end(), '\n'), right.end());
-   right.erase(std::remove(right.begin(), right.end(), '\r'), right.end());
+   size_t del_loc = del - orig.data();
+   left.assign(orig, 0, del_loc);
+   right.assign(orig, del_loc + 1, std::string::npos);
+   clrNewlines(right);
    lower(left);
 
    return true;
 }
 
 /*******************************************************************************************
- * lower - simply converts the passed in string to lowercase
+ * lower - simply converts the passed in string to lowercase (ASCII letters only)
  *******************************************************************************************/
 
 void lower(std::string &str) {
-   std::transform(str.begin(), str.end(), str.begin(),
-         [](unsigned char c){ return std::tolower(c); });
+   textk::lowerASCII(&str[0], str.size());
+}
+
+/*******************************************************************************************
+ * clrNewlinesLower - clrNewlines and lower in a single pass over the string
+ *******************************************************************************************/
+
+void clrNewlinesLower(std::string &str) {
+   str.resize(textk::cleanLine(&str[0], str.size(), true));
 }
 
 /*******************************************************************************************